@@ -9,6 +9,7 @@
 typedef struct my_platform_instance_s {
     uni_gamepad_seat_t gamepad_seat;  // which "seat" is being used
 } my_platform_instance_t;
+_Static_assert(sizeof(my_platform_instance_t) <= HID_DEVICE_MAX_PLATFORM_DATA, "My platform instance too big");
 
 // Declarations
 static void trigger_event_on_gamepad(uni_hid_device_t* d);
@@ -185,7 +186,7 @@ static void my_platform_on_oob_event(uni_platform_oob_event_t event, void* data)
 // Helpers
 //
 static my_platform_instance_t* get_my_platform_instance(uni_hid_device_t* d) {
-    return (my_platform_instance_t*)&d->platform_data[0];
+    return (my_platform_instance_t*)&d->cold->platform_data[0];
 }
 
 static void trigger_event_on_gamepad(uni_hid_device_t* d) {
@@ -3,6 +3,8 @@
 //
 #define CONFIG_BLUEPAD32_MAX_DEVICES 4
 #define CONFIG_BLUEPAD32_MAX_ALLOWLIST 4
+#define CONFIG_BLUEPAD32_OUTGOING_BUFFER_SIZE 1024
+#define CONFIG_BLUEPAD32_HID_DESCRIPTOR_POOL_SIZE 2048
 #define CONFIG_BLUEPAD32_GAP_SECURITY 1
 #define CONFIG_BLUEPAD32_ENABLE_BLE_BY_DEFAULT 1
 // #define CONFIG_BLUEPAD32_ENABLE_VIRTUAL_DEVICE_BY_DEFAULT 1
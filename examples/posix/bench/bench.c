@@ -0,0 +1,272 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "bench.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include <btstack_memory.h>
+#include <btstack_run_loop.h>
+#include <btstack_run_loop_posix.h>
+
+#define DEFAULT_ITERATIONS 500000
+
+volatile uint32_t bench_sink;
+
+static bench_options_t g_options = {
+    .iterations = DEFAULT_ITERATIONS,
+};
+static int g_failed_checks;
+static uint32_t g_rand_state = 1;
+// Hardware counter for cache misses. -1 if not available.
+static int g_perf_fd = -1;
+
+//
+// Cache misses
+//
+static void perf_init(void) {
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.size = sizeof(attr);
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    // This process, any CPU, no group.
+    g_perf_fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (g_perf_fd < 0)
+        fprintf(stderr, "Cache misses not available: perf_event_open() failed: %s. See perf_event_paranoid.\n",
+                strerror(errno));
+}
+
+static void perf_start(void) {
+    if (g_perf_fd < 0)
+        return;
+    ioctl(g_perf_fd, PERF_EVENT_IOC_RESET, 0);
+    ioctl(g_perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+}
+
+// Returns false if the counter is not available.
+static bool perf_stop(uint64_t* count) {
+    if (g_perf_fd < 0)
+        return false;
+    ioctl(g_perf_fd, PERF_EVENT_IOC_DISABLE, 0);
+    return read(g_perf_fd, count, sizeof(*count)) == sizeof(*count);
+}
+
+static uint64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+//
+// Public
+//
+const bench_options_t* bench_get_options(void) {
+    return &g_options;
+}
+
+bool bench_should_run(const char* name) {
+    return g_options.filter == NULL || strstr(name, g_options.filter) != NULL;
+}
+
+void bench_run(const char* name, bench_fn_t fn, void* context, uint64_t iterations) {
+    uint64_t misses;
+
+    if (!bench_should_run(name))
+        return;
+    if (iterations == 0)
+        iterations = 1;
+
+    // Warm up: caches, branch predictors and lazy initializations.
+    fn(context, iterations / 10 + 1);
+
+    perf_start();
+    uint64_t start = get_time_ns();
+    fn(context, iterations);
+    uint64_t elapsed = get_time_ns() - start;
+    bool has_misses = perf_stop(&misses);
+
+    double ns = (double)elapsed / iterations;
+    printf("%-44s %10.1f %14.0f ", name, ns, ns > 0 ? 1e9 / ns : 0);
+    if (has_misses)
+        printf("%12.3f\n", (double)misses / iterations);
+    else
+        printf("%12s\n", "n/a");
+}
+
+void bench_print_value(const char* name, const char* fmt, ...) {
+    va_list args;
+
+    if (!bench_should_run(name))
+        return;
+
+    printf("%-44s ", name);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+}
+
+bool bench_check(bool ok, const char* expr, const char* file, int line) {
+    if (!ok) {
+        fprintf(stderr, "%s:%d: check failed: %s\n", file, line, expr);
+        g_failed_checks++;
+    }
+    return ok;
+}
+
+int bench_get_failed_checks(void) {
+    return g_failed_checks;
+}
+
+void bench_srand(uint32_t seed) {
+    g_rand_state = seed ? seed : 1;
+}
+
+uint32_t bench_rand(void) {
+    uint32_t x = g_rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    g_rand_state = x;
+    return x;
+}
+
+//
+// Platform
+//
+static void bench_platform_init(int argc, const char** argv) {
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+}
+
+static void bench_platform_on_init_complete(void) {}
+
+static uni_error_t bench_platform_on_device_discovered(bd_addr_t addr, const char* name, uint16_t cod, uint8_t rssi) {
+    // Not used: devices are created by the bench, not discovered.
+    return UNI_ERROR_SUCCESS;
+}
+
+static void bench_platform_on_device_connected(uni_hid_device_t* d) {
+    ARG_UNUSED(d);
+}
+
+static void bench_platform_on_device_disconnected(uni_hid_device_t* d) {
+    ARG_UNUSED(d);
+}
+
+static uni_error_t bench_platform_on_device_ready(uni_hid_device_t* d) {
+    ARG_UNUSED(d);
+    return UNI_ERROR_SUCCESS;
+}
+
+static void bench_platform_on_controller_data(uni_hid_device_t* d, uni_controller_t* ctl) {
+    ARG_UNUSED(d);
+    ARG_UNUSED(ctl);
+}
+
+static const uni_property_t* bench_platform_get_property(uni_property_idx_t idx) {
+    ARG_UNUSED(idx);
+    return NULL;
+}
+
+static void bench_platform_on_oob_event(uni_platform_oob_event_t event, void* data) {
+    ARG_UNUSED(event);
+    ARG_UNUSED(data);
+}
+
+static struct uni_platform g_platform = {
+    .name = "Bench",
+    .init = bench_platform_init,
+    .on_init_complete = bench_platform_on_init_complete,
+    .on_device_discovered = bench_platform_on_device_discovered,
+    .on_device_connected = bench_platform_on_device_connected,
+    .on_device_disconnected = bench_platform_on_device_disconnected,
+    .on_device_ready = bench_platform_on_device_ready,
+    .on_controller_data = bench_platform_on_controller_data,
+    .get_property = bench_platform_get_property,
+    .on_oob_event = bench_platform_on_oob_event,
+};
+
+//
+// Main
+//
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [options] [filter]\n", name);
+    fprintf(stderr, "Runs the cases whose name contain \"filter\". All of them by default.\n");
+    fprintf(stderr, "Options:\n");
+    fprintf(stderr, "  -n, --iterations NUM   operations per case. Default: %d\n", DEFAULT_ITERATIONS);
+    fprintf(stderr, "  -v, --verbose          print the Bluepad32 logs\n");
+    fprintf(stderr, "  -h, --help             this help\n");
+}
+
+int main(int argc, const char* argv[]) {
+    static const struct option long_options[] = {
+        {"iterations", required_argument, NULL, 'n'},
+        {"verbose", no_argument, NULL, 'v'},
+        {"help", no_argument, NULL, 'h'},
+        {0, 0, 0, 0},
+    };
+
+    while (true) {
+        int c = getopt_long(argc, (char* const*)argv, "n:vh", long_options, NULL);
+        if (c == -1)
+            break;
+        switch (c) {
+            case 'n':
+                g_options.iterations = strtoull(optarg, NULL, 10);
+                break;
+            case 'v':
+                g_options.verbose = true;
+                break;
+            case 'h':
+            default:
+                usage(argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+    if (optind < argc)
+        g_options.filter = argv[optind];
+
+    btstack_memory_init();
+    btstack_run_loop_init(btstack_run_loop_posix_get_instance());
+
+    // Like uni_init(), but without Bluetooth.
+    uni_platform_set_custom(&g_platform);
+    uni_property_init();
+    uni_platform_init(argc, argv);
+    uni_hid_device_setup();
+
+    perf_init();
+
+    printf("%-44s %10s %14s %12s\n", "case", "ns/op", "ops/s", "misses/op");
+    bench_core();
+    bench_snapshot();
+    bench_nina();
+    bench_bredr();
+    bench_parsers();
+    bench_gamepad();
+
+    if (g_failed_checks) {
+        fprintf(stderr, "%d checks failed\n", g_failed_checks);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <uni.h>
+
+#include "virtual_controllers.h"
+
+// Host benchmarks and checks for Bluepad32. See README.md, "Benchmarks".
+//
+// Cases are named "group/name", and can be filtered by a substring of the name.
+// Each case prints the time per operation, operations per second, and the cache misses per
+// operation, when the hardware counters are available.
+
+typedef struct {
+    // Number of operations per case. Might be scaled by each case.
+    uint64_t iterations;
+    // Only the cases whose name contain this string are run. NULL means all.
+    const char* filter;
+    // Whether the Bluepad32 logs are printed.
+    bool verbose;
+} bench_options_t;
+
+// "fn" must do "iterations" operations.
+typedef void (*bench_fn_t)(void* context, uint64_t iterations);
+
+const bench_options_t* bench_get_options(void);
+bool bench_should_run(const char* name);
+// Runs "fn" once to warm up the caches, and once more measuring it.
+void bench_run(const char* name, bench_fn_t fn, void* context, uint64_t iterations);
+// Prints the name and a value, for the cases that are not measured in time. E.g: sizes.
+void bench_print_value(const char* name, const char* fmt, ...) __attribute__((format(printf, 2, 3)));
+
+// Checks. A failed check makes the bench exit with an error.
+bool bench_check(bool ok, const char* expr, const char* file, int line);
+#define BENCH_CHECK(expr) bench_check((expr), #expr, __FILE__, __LINE__)
+int bench_get_failed_checks(void);
+
+// Results are stored here, so that the compiler doesn't optimize away the measured code.
+extern volatile uint32_t bench_sink;
+
+// Deterministic pseudo-random numbers (xorshift32), so that runs are comparable.
+void bench_srand(uint32_t seed);
+uint32_t bench_rand(void);
+
+// Fake clock used by btstack_run_loop_get_time_ms(), so that the timers can be tested.
+// When "frozen" is false, the real clock is used.
+void bench_clock_freeze(bool frozen);
+void bench_clock_set_ms(uint32_t now);
+uint32_t bench_clock_get_ms(void);
+
+// Fake link key database, used by gap_get_link_key_for_bd_addr(). Every device is paired with "key",
+// that must have 16 bytes. NULL means that no device is paired.
+void bench_link_key_set(const uint8_t* key);
+
+// Fake L2CAP. Reports sent to a device that has a model are answered like the real controller
+// would do, so that the parsers can complete their setup. The rest are dropped.
+typedef struct {
+    uint32_t sent;
+    uint32_t busy;
+    uint32_t can_send_now_requests;
+} bench_l2cap_stats_t;
+
+// Creates a device with fake control / interrupt channels. "model" might be NULL.
+// The controller type is set explicitly, so that the VID/PID database is not needed.
+uni_hid_device_t* bench_device_create(const virtual_controller_model_t* model, uni_controller_type_t type);
+// Runs the parser setup, answering its requests. Returns false if the device didn't get ready.
+bool bench_device_setup(uni_hid_device_t* d);
+// Marks the device as ready without running the parser setup. For parsers whose setup needs BLE.
+bool bench_device_set_ready(uni_hid_device_t* d);
+void bench_device_delete(uni_hid_device_t* d);
+// Delivers the replies queued by the fake L2CAP.
+void bench_l2cap_pump(void);
+// When "busy", l2cap_can_send_packet_now() returns false, and l2cap_send() fails.
+void bench_l2cap_set_busy(bool busy);
+const bench_l2cap_stats_t* bench_l2cap_get_stats(void);
+void bench_l2cap_reset_stats(void);
+
+// Suites
+void bench_parsers(void);
+void bench_gamepad(void);
+void bench_core(void);
+void bench_snapshot(void);
+void bench_nina(void);
+void bench_bredr(void);
+
+#endif  // BENCH_H
@@ -0,0 +1,360 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// BR/EDR connection cache: what is learned the first time a controller connects is used when it reconnects.
+// It uses an in-memory TLV, so that the one of uni_property is not touched.
+// And the connection pipeline: devices that connect at the same time wait for their turn to do the SDP query.
+
+#include <string.h>
+
+#include <btstack.h>
+
+#include "bench.h"
+#include "bt/uni_bt_bredr_cache.h"
+#include "bt/uni_bt_pipeline.h"
+
+#define MEM_TLV_MAX_TAGS 16
+#define MEM_TLV_MAX_LEN 1024
+
+// More than the cache can hold.
+#define NUM_EVICTION_DEVICES 16
+
+typedef struct {
+    bool used;
+    uint32_t tag;
+    uint32_t len;
+    uint8_t data[MEM_TLV_MAX_LEN];
+} mem_tlv_tag_t;
+
+static mem_tlv_tag_t g_tags[MEM_TLV_MAX_TAGS];
+static uint32_t g_stores;
+
+static mem_tlv_tag_t* mem_tlv_find(uint32_t tag) {
+    for (int i = 0; i < MEM_TLV_MAX_TAGS; i++) {
+        if (g_tags[i].used && g_tags[i].tag == tag)
+            return &g_tags[i];
+    }
+    return NULL;
+}
+
+static int mem_tlv_get_tag(void* context, uint32_t tag, uint8_t* buffer, uint32_t buffer_size) {
+    ARG_UNUSED(context);
+    mem_tlv_tag_t* t = mem_tlv_find(tag);
+    if (t == NULL)
+        return 0;
+    uint32_t len = btstack_min(t->len, buffer_size);
+    memcpy(buffer, t->data, len);
+    return (int)len;
+}
+
+static int mem_tlv_store_tag(void* context, uint32_t tag, const uint8_t* data, uint32_t data_size) {
+    ARG_UNUSED(context);
+    mem_tlv_tag_t* t = mem_tlv_find(tag);
+
+    if (data_size > MEM_TLV_MAX_LEN)
+        return 1;
+    for (int i = 0; t == NULL && i < MEM_TLV_MAX_TAGS; i++) {
+        if (!g_tags[i].used)
+            t = &g_tags[i];
+    }
+    if (t == NULL)
+        return 1;
+
+    t->used = true;
+    t->tag = tag;
+    t->len = data_size;
+    memcpy(t->data, data, data_size);
+    g_stores++;
+    return 0;
+}
+
+static void mem_tlv_delete_tag(void* context, uint32_t tag) {
+    ARG_UNUSED(context);
+    mem_tlv_tag_t* t = mem_tlv_find(tag);
+    if (t)
+        t->used = false;
+}
+
+static const btstack_tlv_t g_mem_tlv = {
+    .get_tag = mem_tlv_get_tag,
+    .store_tag = mem_tlv_store_tag,
+    .delete_tag = mem_tlv_delete_tag,
+};
+
+static const uint8_t g_link_key[16] = {0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08,
+                                       0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f, 0x10};
+static const uint8_t g_new_link_key[16] = {0xa1, 0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8,
+                                           0xa9, 0xaa, 0xab, 0xac, 0xad, 0xae, 0xaf, 0xb0};
+
+static void make_addr(bd_addr_t addr, uint8_t n) {
+    bd_addr_t base = {0x00, 0x00, 0x00, 0x00, 0xca, 0x00};
+
+    bd_addr_copy(addr, base);
+    addr[5] = n;
+}
+
+// Like the first connection: everything was fetched with the name request and SDP.
+// The controller type is set explicitly, so that the VID/PID database is not needed.
+static uni_hid_device_t* create_device(const bd_addr_t addr, const virtual_controller_model_t* model) {
+    bd_addr_t a;
+
+    bd_addr_copy(a, addr);
+    uni_hid_device_t* d = uni_hid_device_create(a);
+    if (d == NULL)
+        return NULL;
+
+    uni_hid_device_set_name(d, model->name);
+    uni_hid_device_set_cod(d, model->cod);
+    uni_hid_device_set_vendor_id(d, model->vendor_id);
+    uni_hid_device_set_product_id(d, model->product_id);
+    if (model->hid_descriptor)
+        uni_hid_device_set_hid_descriptor(d, model->hid_descriptor, model->hid_descriptor_len);
+    uni_hid_device_set_controller_type(d, CONTROLLER_TYPE_PS4Controller);
+    return d;
+}
+
+// A reconnection: only the address is known.
+static bool load_device(const bd_addr_t addr, const virtual_controller_model_t* model) {
+    bd_addr_t a;
+
+    bd_addr_copy(a, addr);
+    uni_hid_device_t* d = uni_hid_device_create(a);
+    if (d == NULL)
+        return false;
+
+    bool hit = uni_bt_bredr_cache_load(d);
+    if (hit && model) {
+        BENCH_CHECK(strcmp(d->cold->name, model->name) == 0);
+        BENCH_CHECK(d->cod == model->cod);
+        BENCH_CHECK(d->vendor_id == model->vendor_id);
+        BENCH_CHECK(d->product_id == model->product_id);
+        uint16_t hid_descriptor_len;
+        const uint8_t* hid_descriptor = uni_hid_device_get_hid_descriptor(d, &hid_descriptor_len);
+        BENCH_CHECK(hid_descriptor_len == model->hid_descriptor_len);
+        BENCH_CHECK(memcmp(hid_descriptor, model->hid_descriptor, model->hid_descriptor_len) == 0);
+        BENCH_CHECK(uni_hid_device_has_hid_descriptor(d) == (model->hid_descriptor_len > 0));
+        BENCH_CHECK(d->controller_type == CONTROLLER_TYPE_PS4Controller);
+        BENCH_CHECK(d->report_parser.parse_input_report != NULL);
+        BENCH_CHECK(d->cold->sdp_query_type == SDP_QUERY_NOT_NEEDED);
+    }
+    uni_hid_device_delete(d);
+    return hit;
+}
+
+static void mem_tlv_reset(void) {
+    memset(g_tags, 0, sizeof(g_tags));
+    g_stores = 0;
+}
+
+static void check_bredr_cache(const virtual_controller_model_t* model) {
+    bd_addr_t addr;
+    uni_hid_device_t* d;
+
+    make_addr(addr, 0);
+    d = create_device(addr, model);
+    if (!BENCH_CHECK(d != NULL))
+        return;
+
+    // Not paired: nothing is stored.
+    bench_link_key_set(NULL);
+    uni_bt_bredr_cache_store(d);
+    BENCH_CHECK(g_stores == 0);
+
+    bench_link_key_set(g_link_key);
+    uni_bt_bredr_cache_store(d);
+    BENCH_CHECK(g_stores == 1);
+    // Same info: not written again.
+    uni_bt_bredr_cache_store(d);
+    BENCH_CHECK(g_stores == 1);
+    uni_hid_device_delete(d);
+
+    BENCH_CHECK(load_device(addr, model));
+
+    // Paired again: the entry is deleted, even if the old link key comes back.
+    bench_link_key_set(g_new_link_key);
+    BENCH_CHECK(!load_device(addr, model));
+    bench_link_key_set(g_link_key);
+    BENCH_CHECK(!load_device(addr, model));
+
+    // Like DualShock 4 1st gen: the SDP query before connecting is not skipped.
+    d = create_device(addr, model);
+    if (!BENCH_CHECK(d != NULL))
+        return;
+    d->cold->sdp_query_type = SDP_QUERY_BEFORE_CONNECT;
+    uni_bt_bredr_cache_store(d);
+    uni_hid_device_delete(d);
+    d = uni_hid_device_create(addr);
+    if (!BENCH_CHECK(d != NULL))
+        return;
+    BENCH_CHECK(uni_bt_bredr_cache_load(d));
+    BENCH_CHECK(d->cold->sdp_query_type == SDP_QUERY_BEFORE_CONNECT);
+    uni_hid_device_delete(d);
+
+    // Full: the oldest ones are replaced.
+    int hits = 0;
+    for (int i = 0; i < NUM_EVICTION_DEVICES; i++) {
+        make_addr(addr, (uint8_t)i);
+        d = create_device(addr, model);
+        if (!BENCH_CHECK(d != NULL))
+            return;
+        uni_bt_bredr_cache_store(d);
+        uni_hid_device_delete(d);
+    }
+    for (int i = 0; i < NUM_EVICTION_DEVICES; i++) {
+        make_addr(addr, (uint8_t)i);
+        if (load_device(addr, NULL))
+            hits++;
+    }
+    BENCH_CHECK(hits > 0 && hits < NUM_EVICTION_DEVICES);
+    make_addr(addr, 0);
+    BENCH_CHECK(!load_device(addr, NULL));
+    make_addr(addr, NUM_EVICTION_DEVICES - 1);
+    BENCH_CHECK(load_device(addr, model));
+    bench_print_value("bredr/cache entries", "%10d", hits);
+
+    uni_bt_bredr_cache_delete_all();
+    BENCH_CHECK(!load_device(addr, NULL));
+}
+
+#define NUM_PIPELINE_DEVICES 4
+
+static uni_hid_device_t* g_pipeline_started[NUM_PIPELINE_DEVICES * 2];
+static int g_pipeline_num_started;
+
+static void pipeline_start(uni_hid_device_t* d) {
+    if (g_pipeline_num_started < (int)ARRAY_SIZE(g_pipeline_started))
+        g_pipeline_started[g_pipeline_num_started] = d;
+    g_pipeline_num_started++;
+}
+
+static void check_pipeline(void) {
+    const uni_bt_pipeline_stats_t* stats = uni_bt_pipeline_get_stats();
+    uni_hid_device_t* devices[NUM_PIPELINE_DEVICES] = {0};
+    bd_addr_t addr;
+
+    bench_clock_freeze(true);
+    bench_clock_set_ms(1000);
+    uni_bt_pipeline_reset_stats();
+    g_pipeline_num_started = 0;
+
+    for (int i = 0; i < NUM_PIPELINE_DEVICES; i++) {
+        make_addr(addr, (uint8_t)i);
+        devices[i] = uni_hid_device_create(addr);
+        if (!BENCH_CHECK(devices[i] != NULL))
+            goto out;
+        uni_bt_pipeline_set_stage(devices[i], UNI_BT_PIPELINE_STAGE_L2CAP);
+    }
+
+    // All of them want the SDP client at the same time: only the first one gets it, and the rest wait in order.
+    bench_clock_set_ms(1100);
+    for (int i = 0; i < NUM_PIPELINE_DEVICES; i++)
+        uni_bt_pipeline_acquire(devices[i], UNI_BT_PIPELINE_RESOURCE_SDP, pipeline_start);
+    // Asking again doesn't lose the place in the queue.
+    uni_bt_pipeline_acquire(devices[1], UNI_BT_PIPELINE_RESOURCE_SDP, pipeline_start);
+    BENCH_CHECK(g_pipeline_num_started == 1 && g_pipeline_started[0] == devices[0]);
+    BENCH_CHECK(devices[1]->cold->pipeline.stage == UNI_BT_PIPELINE_STAGE_SDP_QUEUED);
+
+    // A deleted device leaves the queue.
+    uni_hid_device_delete(devices[2]);
+    devices[2] = NULL;
+
+    bench_clock_set_ms(1300);
+    uni_bt_pipeline_release(UNI_BT_PIPELINE_RESOURCE_SDP);
+    BENCH_CHECK(g_pipeline_num_started == 2 && g_pipeline_started[1] == devices[1]);
+    uni_bt_pipeline_release(UNI_BT_PIPELINE_RESOURCE_SDP);
+    BENCH_CHECK(g_pipeline_num_started == 3 && g_pipeline_started[2] == devices[3]);
+    uni_bt_pipeline_release(UNI_BT_PIPELINE_RESOURCE_SDP);
+    BENCH_CHECK(g_pipeline_num_started == 3 && !uni_bt_pipeline_is_busy(UNI_BT_PIPELINE_RESOURCE_SDP));
+
+    // The other resources are not affected.
+    uni_bt_pipeline_acquire(devices[0], UNI_BT_PIPELINE_RESOURCE_NAME, pipeline_start);
+    BENCH_CHECK(g_pipeline_num_started == 4);
+    uni_bt_pipeline_release(UNI_BT_PIPELINE_RESOURCE_NAME);
+
+    // Time to ready: from the first stage (L2CAP) until the setup is done.
+    bench_clock_set_ms(1500);
+    uni_bt_pipeline_set_stage(devices[1], UNI_BT_PIPELINE_STAGE_SETUP);
+    bench_clock_set_ms(1750);
+    uni_bt_pipeline_on_ready(devices[1]);
+    BENCH_CHECK(devices[1]->cold->pipeline.stage == UNI_BT_PIPELINE_STAGE_NONE);
+    BENCH_CHECK(stats->ready.count == 1 && stats->ready.max == 750);
+    BENCH_CHECK(stats->stages[UNI_BT_PIPELINE_STAGE_L2CAP].count == NUM_PIPELINE_DEVICES);
+    BENCH_CHECK(stats->stages[UNI_BT_PIPELINE_STAGE_SDP_QUEUED].max == 200);
+    BENCH_CHECK(stats->stages[UNI_BT_PIPELINE_STAGE_SETUP].max == 250);
+
+    uni_bt_pipeline_on_timeout(devices[3]);
+    BENCH_CHECK(stats->timeouts[UNI_BT_PIPELINE_STAGE_SDP] == 1);
+    bench_print_value("bredr/pipeline sizeof(uni_bt_pipeline_device_t)", "%10zu", sizeof(uni_bt_pipeline_device_t));
+
+    // Stages of more than 262ms, like a slow SDP query or setup, still have meaningful percentiles.
+    static const uint32_t setup_ms[] = {300, 320, 350, 5000};
+    uint32_t now_ms = 2000;
+    uni_bt_pipeline_reset_stats();
+    for (size_t i = 0; i < ARRAY_SIZE(setup_ms); i++) {
+        bench_clock_set_ms(now_ms);
+        uni_bt_pipeline_set_stage(devices[1], UNI_BT_PIPELINE_STAGE_SETUP);
+        now_ms += setup_ms[i];
+        bench_clock_set_ms(now_ms);
+        uni_bt_pipeline_on_ready(devices[1]);
+    }
+    const uni_latency_histogram_t* setup = &stats->stages[UNI_BT_PIPELINE_STAGE_SETUP];
+    BENCH_CHECK(setup->count == ARRAY_SIZE(setup_ms) && setup->max == 5000);
+    BENCH_CHECK(uni_latency_histogram_get_percentile(setup, 50) == 512);
+    BENCH_CHECK(uni_latency_histogram_get_percentile(setup, 50) < setup->max);
+
+out:
+    for (int i = 0; i < NUM_PIPELINE_DEVICES; i++) {
+        if (devices[i])
+            uni_hid_device_delete(devices[i]);
+    }
+    uni_bt_pipeline_reset_stats();
+    bench_clock_freeze(false);
+}
+
+static void run_cache_load(void* context, uint64_t iterations) {
+    const uint8_t* n = context;
+    bd_addr_t addr;
+    uint32_t acc = 0;
+
+    make_addr(addr, *n);
+    for (uint64_t i = 0; i < iterations; i++)
+        acc += load_device(addr, NULL);
+    bench_sink = acc;
+}
+
+void bench_bredr(void) {
+    const virtual_controller_model_t* model = virtual_controller_find_model("ds4");
+    const btstack_tlv_t* prev_tlv;
+    void* prev_context;
+    bd_addr_t addr;
+
+    btstack_tlv_get_instance(&prev_tlv, &prev_context);
+    btstack_tlv_set_instance(&g_mem_tlv, g_tags);
+    mem_tlv_reset();
+
+    if (bench_should_run("bredr/check"))
+        check_bredr_cache(model);
+    if (bench_should_run("bredr/pipeline"))
+        check_pipeline();
+
+    // One entry, like a paired DS4.
+    uni_bt_bredr_cache_delete_all();
+    bench_link_key_set(g_link_key);
+    make_addr(addr, 0);
+    uni_hid_device_t* d = create_device(addr, model);
+    if (d) {
+        uni_bt_bredr_cache_store(d);
+        uni_hid_device_delete(d);
+    }
+
+    uint8_t hit = 0;
+    uint8_t miss = 1;
+    uint64_t iterations = bench_get_options()->iterations / 10 + 1;
+    bench_run("bredr/cache load (hit)", run_cache_load, &hit, iterations);
+    bench_run("bredr/cache load (miss)", run_cache_load, &miss, iterations);
+
+    uni_bt_bredr_cache_delete_all();
+    bench_link_key_set(NULL);
+    btstack_tlv_set_instance(prev_tlv, prev_context);
+}
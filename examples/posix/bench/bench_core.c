@@ -0,0 +1,775 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// Core: the helpers used by all the parsers. CRC32, the outgoing queue, the axis normalization,
+// the haptics engine, the latency histograms and the device pool. Each group checks that the optimized code returns
+// the same values as the reference one before measuring it.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+
+//
+// CRC32
+//
+#define CRC_BUFFER_SIZE 512
+// Size of the biggest report that is CRC'ed: DualSense output report.
+#define CRC_REPORT_SIZE 78
+
+static uint8_t g_crc_buffer[CRC_BUFFER_SIZE];
+
+static void run_crc32(void* context, uint64_t iterations) {
+    const uni_crc32_le_fn_t* fn = context;
+    uint32_t crc = 0;
+
+    for (uint64_t i = 0; i < iterations; i++)
+        crc = (*fn)(crc, &g_crc_buffer[i % 64], CRC_REPORT_SIZE);
+    bench_sink = crc;
+}
+
+static void bench_crc32(void) {
+    bench_srand(0xc0c0);
+    for (int i = 0; i < CRC_BUFFER_SIZE; i++)
+        g_crc_buffer[i] = bench_rand();
+
+    if (bench_should_run("core/crc32")) {
+        // Every alignment and length, including the ones shorter than a slice.
+        for (int i = 0; i < 2000; i++) {
+            int offset = bench_rand() % 16;
+            int len = bench_rand() % (CRC_BUFFER_SIZE - offset);
+            uint32_t seed = (i % 2) ? bench_rand() : 0;
+            if (uni_crc32_le(seed, &g_crc_buffer[offset], len) !=
+                uni_crc32_le_bitwise(seed, &g_crc_buffer[offset], len)) {
+                bench_check(false, "uni_crc32_le() == uni_crc32_le_bitwise()", __FILE__, __LINE__);
+                fprintf(stderr, "offset=%d, len=%d, seed=0x%08x\n", offset, len, seed);
+                break;
+            }
+        }
+        // Well-known value: CRC32 of "123456789", with the usual pre/post inversion.
+        BENCH_CHECK(~uni_crc32_le(~0u, (const uint8_t*)"123456789", 9) == 0xcbf43926);
+    }
+
+    static const uni_crc32_le_fn_t slice_by_8 = uni_crc32_le;
+    static const uni_crc32_le_fn_t bitwise = uni_crc32_le_bitwise;
+    uint64_t iterations = bench_get_options()->iterations;
+    bench_run("core/crc32 (slice-by-8, 78 bytes)", run_crc32, (void*)&slice_by_8, iterations);
+    bench_run("core/crc32 (bitwise, 78 bytes)", run_crc32, (void*)&bitwise, iterations / 8);
+}
+
+//
+// Outgoing queue
+//
+// Enough for a full buffer of 1-byte packets.
+#define REF_FIFO_SIZE (UNI_CIRCULAR_BUFFER_SIZE / 4)
+
+// Reference FIFO, used to check the circular buffer.
+typedef struct {
+    int16_t cid;
+    int len;
+    uint8_t data[UNI_CIRCULAR_BUFFER_DATA_SIZE];
+} ref_packet_t;
+
+static uni_circular_buffer_t g_ring;
+
+static void check_ring(void) {
+    static ref_packet_t fifo[REF_FIFO_SIZE];
+    int head = 0;
+    int count = 0;
+    uint8_t data[UNI_CIRCULAR_BUFFER_DATA_SIZE];
+
+    uni_circular_buffer_reset(&g_ring);
+    bench_srand(0xb0f0);
+
+    for (int i = 0; i < 100000; i++) {
+        if (bench_rand() % 2) {
+            int len = 1 + bench_rand() % (UNI_CIRCULAR_BUFFER_DATA_SIZE - 1);
+            int16_t cid = 0x40 + bench_rand() % 2;
+            for (int j = 0; j < len; j++)
+                data[j] = bench_rand();
+
+            bool was_empty = uni_circular_buffer_is_empty(&g_ring);
+            uint8_t err = uni_circular_buffer_put(&g_ring, cid, data, len);
+            if (err == UNI_CIRCULAR_BUFFER_ERROR_OK) {
+                if (!BENCH_CHECK(count < REF_FIFO_SIZE))
+                    return;
+                ref_packet_t* p = &fifo[(head + count) % REF_FIFO_SIZE];
+                p->cid = cid;
+                p->len = len;
+                memcpy(p->data, data, len);
+                count++;
+            } else if (!BENCH_CHECK(!was_empty && err == UNI_CIRCULAR_BUFFER_ERROR_BUFFER_FULL)) {
+                // An empty buffer must accept any packet of a valid size.
+                return;
+            }
+        } else {
+            int16_t cid;
+            void* out;
+            int len;
+            uint8_t err = uni_circular_buffer_get(&g_ring, &cid, &out, &len);
+            if (count == 0) {
+                if (!BENCH_CHECK(err == UNI_CIRCULAR_BUFFER_ERROR_BUFFER_EMPTY))
+                    return;
+                continue;
+            }
+            const ref_packet_t* p = &fifo[head];
+            if (!BENCH_CHECK(err == UNI_CIRCULAR_BUFFER_ERROR_OK && cid == p->cid && len == p->len &&
+                             memcmp(out, p->data, len) == 0))
+                return;
+            head = (head + 1) % REF_FIFO_SIZE;
+            count--;
+        }
+    }
+}
+
+static void run_ring(void* context, uint64_t iterations) {
+    static const uint8_t report[50] = {0xa2, 0x11};
+    uint32_t acc = 0;
+    int16_t cid;
+    void* data;
+    int len;
+    ARG_UNUSED(context);
+
+    uni_circular_buffer_reset(&g_ring);
+    for (uint64_t i = 0; i < iterations; i++) {
+        // Two packets queued, like a rumble and a LED report.
+        uni_circular_buffer_put(&g_ring, 0x41, report, sizeof(report));
+        uni_circular_buffer_put(&g_ring, 0x41, report, sizeof(report) / 2);
+        uni_circular_buffer_get(&g_ring, &cid, &data, &len);
+        acc += len;
+        uni_circular_buffer_get(&g_ring, &cid, &data, &len);
+        acc += len;
+    }
+    bench_sink = acc;
+}
+
+#define DRAIN_REPORTS 16
+
+static void send_and_drain(uni_hid_device_t* d) {
+    static const uint8_t report[48] = {0xa2, 0x31};
+
+    bench_l2cap_set_busy(true);
+    for (int i = 0; i < DRAIN_REPORTS; i++)
+        uni_hid_device_send_intr_report(d, report, sizeof(report));
+    bench_l2cap_set_busy(false);
+    // Same as the L2CAP_EVENT_CAN_SEND_NOW handler.
+    uni_hid_device_send_queued_reports(d);
+}
+
+static void run_drain(void* context, uint64_t iterations) {
+    uni_hid_device_t* d = context;
+
+    for (uint64_t i = 0; i < iterations; i++)
+        send_and_drain(d);
+    bench_sink = bench_l2cap_get_stats()->sent;
+}
+
+static void bench_queue(void) {
+    bench_print_value("core/queue sizeof(uni_circular_buffer_t)", "%10zu", sizeof(uni_circular_buffer_t));
+    bench_print_value("core/queue sizeof(uni_hid_device_t)", "%10zu", sizeof(uni_hid_device_t));
+    bench_print_value("core/queue sizeof(uni_hid_device_cold_t)", "%10zu", sizeof(uni_hid_device_cold_t));
+    bench_print_value("core/queue UNI_CIRCULAR_BUFFER_SIZE", "%10d", UNI_CIRCULAR_BUFFER_SIZE);
+
+    if (bench_should_run("core/queue ring"))
+        check_ring();
+    bench_run("core/queue ring (put+get)", run_ring, NULL, bench_get_options()->iterations);
+
+    if (!bench_should_run("core/queue drain"))
+        return;
+
+    uni_hid_device_t* d = bench_device_create(NULL, CONTROLLER_TYPE_GenericController);
+    if (!BENCH_CHECK(d != NULL))
+        return;
+
+    // All the queued reports must be sent in one can-send-now event, without asking for another one.
+    bench_l2cap_set_busy(true);
+    for (int i = 0; i < DRAIN_REPORTS; i++) {
+        uint8_t report[] = {0xa2, 0x31, i};
+        uni_hid_device_send_intr_report(d, report, sizeof(report));
+    }
+    bench_l2cap_set_busy(false);
+    bench_l2cap_reset_stats();
+    uni_hid_device_send_queued_reports(d);
+    const bench_l2cap_stats_t* stats = bench_l2cap_get_stats();
+    BENCH_CHECK(uni_circular_buffer_is_empty(&d->cold->outgoing_buffer));
+    BENCH_CHECK(stats->sent == DRAIN_REPORTS);
+    BENCH_CHECK(stats->can_send_now_requests == 0);
+
+    // Coalesced reports replace the queued one with the same Report ID: only the latest of each is sent.
+    uint32_t merged = d->cold->outgoing_buffer.merged_count;
+    bench_l2cap_set_busy(true);
+    for (int i = 0; i < DRAIN_REPORTS; i++) {
+        uint8_t report[] = {0xa2, 0x11 + (i % 2), i};
+        uni_hid_device_send_intr_report_coalesced(d, report, sizeof(report));
+    }
+    bench_l2cap_set_busy(false);
+    bench_l2cap_reset_stats();
+    uni_hid_device_send_queued_reports(d);
+    BENCH_CHECK(stats->sent == 2);
+    BENCH_CHECK(d->cold->outgoing_buffer.merged_count - merged == DRAIN_REPORTS - 2);
+
+    bench_run("core/queue drain (16 reports)", run_drain, d, bench_get_options()->iterations / DRAIN_REPORTS);
+    bench_device_delete(d);
+}
+
+//
+// Normalization
+//
+typedef struct {
+    const char* name;
+    int32_t logical_minimum;
+    int32_t logical_maximum;
+    uint8_t report_size;
+} norm_case_t;
+
+// The ranges found in the descriptors of the supported controllers.
+static const norm_case_t norm_cases[] = {
+    {"0..255", 0, 255, 8},
+    {"-128..127", -128, 127, 8},
+    {"-127..127", -127, 127, 8},
+    {"0..1023", 0, 1023, 10},
+    {"-512..511", -512, 511, 10},
+    {"0..4095", 0, 4095, 12},
+    {"-2048..2047", -2048, 2047, 12},
+    {"0..65535", 0, 65535, 16},
+    {"-32768..32767", -32768, 32767, 16},
+    {"-32767..32767", -32767, 32767, 16},
+    {"0..100", 0, 100, 8},
+    {"1..8", 1, 8, 4},
+    {"0..1", 0, 1, 1},
+    // Amazon Fire TV: logical maximum reported as -1. See get_logical_maximum().
+    {"0..-1 (8-bit)", 0, -1, 8},
+    {"0..-1 (10-bit)", 0, -1, 10},
+    {"0..-1 (16-bit)", 0, -1, 16},
+    // Wide fields. Too many values to try them all: see check_normalization().
+    {"0..16777215", 0, 16777215, 24},
+    {"-8388608..8388607", -8388608, 8388607, 24},
+    {"0..-1 (24-bit)", 0, -1, 24},
+    {"0..65535 (32-bit)", 0, 65535, 32},
+    {"-32768..32767 (32-bit)", -32768, 32767, 32},
+    {"0..2147483647", 0, INT32_MAX, 32},
+};
+
+static void init_globals(hid_globals_t* g, const norm_case_t* c, bool precomputed) {
+    memset(g, 0, sizeof(*g));
+    g->logical_minimum = c->logical_minimum;
+    g->logical_maximum = c->logical_maximum;
+    g->report_size = c->report_size;
+    g->report_count = 1;
+    if (precomputed)
+        uni_hid_parser_init_normalization(g);
+}
+
+// uni_hid_parser_process_axis() and uni_hid_parser_process_pedal() as they were before the
+// precomputed coefficients. Both the precomputed and the division paths must match them.
+// The range and the centered value are computed in 64 bits: same results, but they don't overflow with the
+// wide fields.
+static int32_t reference_process_axis(const norm_case_t* c, uint32_t value) {
+    int64_t max = c->logical_maximum;
+    int64_t min = c->logical_minimum;
+
+    if (max == -1)
+        max = (1 << c->report_size) - 1;
+
+    int64_t range = (max - min) + 1;
+    int64_t centered = (int64_t)(int32_t)value - range / 2 - min;
+    return (int32_t)(centered * AXIS_NORMALIZE_RANGE / range);
+}
+
+static int32_t reference_process_pedal(const norm_case_t* c, uint32_t value) {
+    int64_t max = c->logical_maximum;
+    int64_t min = c->logical_minimum;
+
+    if (max == -1)
+        max = (1 << c->report_size) - 1;
+
+    uint32_t range = (max - min) + 1;
+    return value * AXIS_NORMALIZE_RANGE / range;
+}
+
+// Returns false if "v" is not normalized like the reference.
+static bool check_normalization_value(const norm_case_t* c, hid_globals_t* fast, hid_globals_t* slow, int64_t v) {
+    uint32_t value = (uint32_t)(int32_t)v;
+    int32_t axis = reference_process_axis(c, value);
+    int32_t pedal = reference_process_pedal(c, value);
+    if (uni_hid_parser_process_axis(fast, value) == axis && uni_hid_parser_process_axis(slow, value) == axis &&
+        uni_hid_parser_process_pedal(fast, value) == pedal && uni_hid_parser_process_pedal(slow, value) == pedal)
+        return true;
+
+    bench_check(false, "normalization == reference", __FILE__, __LINE__);
+    fprintf(stderr, "range %s, value %lld\n", c->name, (long long)v);
+    return false;
+}
+
+static void check_normalization(void) {
+    hid_globals_t fast, slow;
+
+    bench_srand(0x1024);
+    for (size_t i = 0; i < ARRAY_SIZE(norm_cases); i++) {
+        const norm_case_t* c = &norm_cases[i];
+        init_globals(&fast, c, true);
+        init_globals(&slow, c, false);
+
+        // The values the field can hold, including the ones out of the logical range.
+        // Fields with a negative logical minimum are sign-extended.
+        int64_t min = 0;
+        int64_t max = (1LL << c->report_size) - 1;
+        if (c->logical_minimum < 0) {
+            min = -(1LL << (c->report_size - 1));
+            max = (1LL << (c->report_size - 1)) - 1;
+        }
+
+        if (c->report_size <= 16) {
+            for (int64_t v = min; v <= max; v++) {
+                if (!check_normalization_value(c, &fast, &slow, v))
+                    break;
+            }
+            continue;
+        }
+
+        // Wide fields: the edges of the field and of the logical range, the values around the limit of the
+        // precomputed coefficients, the ones that would wrap into it in 32 bits, and random ones.
+        int64_t logical_max = (c->logical_maximum == -1) ? max : c->logical_maximum;
+        int64_t center = (logical_max - c->logical_minimum + 1) / 2 + c->logical_minimum;
+        int64_t wrap = (1LL << 32) / AXIS_NORMALIZE_RANGE;
+        int64_t edges[] = {
+            min,
+            max,
+            c->logical_minimum,
+            logical_max,
+            center,
+            center + (1 << 20),
+            center - (1 << 20),
+            center + wrap,
+            center - wrap,
+            center + wrap * 3,
+            center - wrap * 3,
+        };
+        bool ok = true;
+        for (size_t j = 0; j < ARRAY_SIZE(edges) && ok; j++) {
+            for (int64_t v = edges[j] - 2; v <= edges[j] + 2 && ok; v++) {
+                if (v >= min && v <= max)
+                    ok = check_normalization_value(c, &fast, &slow, v);
+            }
+        }
+        for (int j = 0; j < 100000 && ok; j++) {
+            int64_t v = min + (int64_t)(bench_rand() & (uint32_t)(max - min));
+            ok = check_normalization_value(c, &fast, &slow, v);
+        }
+    }
+}
+
+typedef struct {
+    hid_globals_t globals;
+    bool pedal;
+} norm_run_t;
+
+static void run_normalization(void* context, uint64_t iterations) {
+    norm_run_t* run = context;
+    int32_t acc = 0;
+
+    if (run->pedal) {
+        for (uint64_t i = 0; i < iterations; i++)
+            acc += uni_hid_parser_process_pedal(&run->globals, i & 0x3ff);
+    } else {
+        for (uint64_t i = 0; i < iterations; i++)
+            acc += uni_hid_parser_process_axis(&run->globals, i & 0x3ff);
+    }
+    bench_sink = acc;
+}
+
+static void bench_normalization(void) {
+    // Most common: 10-bit triggers, 8/16-bit sticks. 10-bit is used for both.
+    static const norm_case_t c = {"0..1023", 0, 1023, 10};
+    norm_run_t run;
+    uint64_t iterations = bench_get_options()->iterations * 4;
+
+    if (bench_should_run("core/normalization"))
+        check_normalization();
+
+    init_globals(&run.globals, &c, true);
+    run.pedal = false;
+    bench_run("core/normalization axis (precomputed)", run_normalization, &run, iterations);
+    run.pedal = true;
+    bench_run("core/normalization pedal (precomputed)", run_normalization, &run, iterations);
+
+    init_globals(&run.globals, &c, false);
+    run.pedal = false;
+    bench_run("core/normalization axis (division)", run_normalization, &run, iterations);
+    run.pedal = true;
+    bench_run("core/normalization pedal (division)", run_normalization, &run, iterations);
+}
+
+//
+// Haptics
+//
+typedef struct {
+    int calls;
+    // Number of RETRY results before OK.
+    int retries;
+    uint8_t last_weak;
+    uint8_t last_strong;
+} haptics_stats_t;
+
+static haptics_stats_t g_haptics_stats;
+
+static uni_haptics_result_t fake_set_rumble(uni_hid_device_t* d, const uni_haptics_motors_t* motors) {
+    ARG_UNUSED(d);
+
+    if (g_haptics_stats.retries > 0) {
+        g_haptics_stats.retries--;
+        return UNI_HAPTICS_RESULT_RETRY;
+    }
+    g_haptics_stats.calls++;
+    g_haptics_stats.last_weak = motors->weak_magnitude;
+    g_haptics_stats.last_strong = motors->strong_magnitude;
+    return UNI_HAPTICS_RESULT_OK;
+}
+
+// Moves the fake clock forward one millisecond at a time, like a run loop with a precise timer.
+static void haptics_advance(uint32_t to) {
+    for (uint32_t now = bench_clock_get_ms() + 1; now <= to; now++) {
+        bench_clock_set_ms(now);
+        uni_haptics_process(now);
+    }
+}
+
+static uni_hid_device_t* haptics_create_device(void) {
+    uni_hid_device_t* d = bench_device_create(NULL, CONTROLLER_TYPE_GenericController);
+    if (d)
+        d->report_parser.set_rumble = fake_set_rumble;
+    return d;
+}
+
+static void check_haptics(void) {
+    haptics_stats_t* s = &g_haptics_stats;
+
+    uni_hid_device_t* d = haptics_create_device();
+    uni_hid_device_t* d2 = haptics_create_device();
+    if (!BENCH_CHECK(d != NULL && d2 != NULL))
+        goto out;
+
+    memset(s, 0, sizeof(*s));
+
+    // Basic: on now, off after the duration.
+    uni_haptics_play_dual_rumble(d, 0, 100, 10, 20);
+    BENCH_CHECK(s->calls == 1 && s->last_weak == 10 && uni_haptics_is_playing(d));
+    haptics_advance(99);
+    BENCH_CHECK(s->calls == 1);
+    haptics_advance(100);
+    BENCH_CHECK(s->calls == 2 && s->last_weak == 0 && !uni_haptics_is_playing(d));
+
+    // Delayed start, and the first two attempts fail.
+    s->retries = 2;
+    uni_haptics_play_dual_rumble(d, 50, 100, 5, 6);
+    haptics_advance(149);
+    BENCH_CHECK(s->calls == 2);
+    haptics_advance(150 + UNI_HAPTICS_RETRY_MS);
+    BENCH_CHECK(s->calls == 2);
+    haptics_advance(150 + UNI_HAPTICS_RETRY_MS * 2);
+    BENCH_CHECK(s->calls == 3 && s->last_strong == 6);
+    haptics_advance(1000);
+    BENCH_CHECK(s->calls == 4 && s->last_weak == 0);
+
+    // Queued effects are played one after the other, honoring their delay.
+    const uni_haptics_effect_t e1 = {0, 100, {1, 1}};
+    const uni_haptics_effect_t e2 = {0, 100, {2, 2}};
+    const uni_haptics_effect_t e3 = {30, 100, {3, 3}};
+    uni_haptics_play(d, &e1);
+    BENCH_CHECK(uni_haptics_queue(d, &e2));
+    BENCH_CHECK(uni_haptics_queue(d, &e3));
+    int calls = s->calls;
+    haptics_advance(bench_clock_get_ms() + 100);
+    BENCH_CHECK(s->calls == calls + 1 && s->last_weak == 2);
+    haptics_advance(bench_clock_get_ms() + 100);
+    BENCH_CHECK(s->calls == calls + 2 && s->last_weak == 0);
+    haptics_advance(bench_clock_get_ms() + 30);
+    BENCH_CHECK(s->calls == calls + 3 && s->last_weak == 3);
+    haptics_advance(bench_clock_get_ms() + 100);
+    BENCH_CHECK(s->calls == calls + 4 && s->last_weak == 0 && !uni_haptics_is_playing(d));
+
+    // Cancel doesn't send anything.
+    uni_haptics_play_dual_rumble(d, 0, 100, 9, 9);
+    calls = s->calls;
+    uni_haptics_cancel(d);
+    haptics_advance(bench_clock_get_ms() + 200);
+    BENCH_CHECK(s->calls == calls && !uni_haptics_is_playing(d));
+
+    // Two devices, with different durations.
+    calls = s->calls;
+    uni_haptics_play_dual_rumble(d, 0, 300, 1, 1);
+    uni_haptics_play_dual_rumble(d2, 0, 100, 1, 1);
+    haptics_advance(bench_clock_get_ms() + 100);
+    BENCH_CHECK(s->calls == calls + 3 && uni_haptics_is_playing(d) && !uni_haptics_is_playing(d2));
+    haptics_advance(bench_clock_get_ms() + 200);
+    BENCH_CHECK(s->calls == calls + 4 && !uni_haptics_is_playing(d));
+
+out:
+    if (d)
+        bench_device_delete(d);
+    if (d2)
+        bench_device_delete(d2);
+}
+
+static void run_haptics(void* context, uint64_t iterations) {
+    uni_hid_device_t* d = context;
+    uint32_t now = bench_clock_get_ms();
+
+    // One effect per iteration: start, and stop when it finishes.
+    for (uint64_t i = 0; i < iterations; i++) {
+        uni_haptics_play_dual_rumble(d, 0, 10, 0x80, 0x40);
+        now += 10;
+        uni_haptics_process(now);
+    }
+    bench_clock_set_ms(now);
+    bench_sink = g_haptics_stats.calls;
+}
+
+static void bench_haptics(void) {
+    bench_clock_freeze(true);
+    bench_clock_set_ms(0);
+
+    if (bench_should_run("core/haptics"))
+        check_haptics();
+
+    if (bench_should_run("core/haptics effect")) {
+        uni_hid_device_t* d = haptics_create_device();
+        if (BENCH_CHECK(d != NULL)) {
+            bench_run("core/haptics effect (play+process)", run_haptics, d, bench_get_options()->iterations);
+            bench_device_delete(d);
+        }
+    }
+
+    bench_clock_freeze(false);
+}
+
+//
+// Latency
+//
+static void run_latency(void* context, uint64_t iterations) {
+    uni_latency_t* l = context;
+    uint64_t last = 0;
+    uint64_t now = 1;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        // ~4ms between reports, like most gamepads.
+        now += 4000 + (i & 0xff);
+        uni_latency_on_input_report(l, last, now);
+        last = now;
+        uni_latency_histogram_add(&l->parse, i & 0x3f);
+    }
+    bench_sink = l->inter_arrival.count;
+}
+
+static void check_latency(void) {
+    uni_latency_histogram_t h;
+    uni_latency_t l;
+
+    memset(&h, 0, sizeof(h));
+    BENCH_CHECK(uni_latency_histogram_get_percentile(&h, 50) == 0);
+    BENCH_CHECK(uni_latency_histogram_get_mean(&h) == 0);
+
+    // Bucket 0 is 0us, bucket N is [2^(N-1), 2^N).
+    uni_latency_histogram_add(&h, 0);
+    uni_latency_histogram_add(&h, 1);
+    uni_latency_histogram_add(&h, 3);
+    uni_latency_histogram_add(&h, 4);
+    BENCH_CHECK(h.buckets[0] == 1 && h.buckets[1] == 1 && h.buckets[2] == 1 && h.buckets[3] == 1);
+    BENCH_CHECK(h.count == 4 && h.min == 0 && h.max == 4 && h.total == 8);
+    BENCH_CHECK(uni_latency_histogram_get_mean(&h) == 2);
+    BENCH_CHECK(uni_latency_histogram_get_percentile(&h, 0) == 1);
+    BENCH_CHECK(uni_latency_histogram_get_percentile(&h, 50) == 2);
+    BENCH_CHECK(uni_latency_histogram_get_percentile(&h, 51) == 4);
+    // The bucket of the max goes up to 8, but no sample is above 4.
+    BENCH_CHECK(uni_latency_histogram_get_percentile(&h, 100) == 4);
+
+    // The last bucket has no upper bound: the max is used instead.
+    uni_latency_histogram_add(&h, 10000000);
+    BENCH_CHECK(h.buckets[UNI_LATENCY_HISTOGRAM_BUCKETS - 1] == 1);
+    BENCH_CHECK(uni_latency_histogram_get_percentile(&h, 100) == 10000000);
+
+    // All the samples in the same bucket: the percentiles are the max, not the bucket's upper bound.
+    memset(&h, 0, sizeof(h));
+    for (int i = 0; i < 10; i++)
+        uni_latency_histogram_add(&h, 5);
+    BENCH_CHECK(uni_latency_histogram_get_percentile(&h, 50) == 5 && uni_latency_histogram_get_percentile(&h, 99) == 5);
+
+    // Inter-arrival starts with the second report.
+    memset(&l, 0, sizeof(l));
+    uni_latency_on_input_report(&l, 0, 1000);
+    BENCH_CHECK(l.inter_arrival.count == 0);
+    uni_latency_on_input_report(&l, 1000, 5000);
+    uni_latency_on_input_report(&l, 5000, 13000);
+    BENCH_CHECK(l.inter_arrival.count == 2 && l.inter_arrival.min == 4000 && l.inter_arrival.max == 8000);
+}
+
+static void bench_latency(void) {
+    uni_latency_t l;
+
+    if (bench_should_run("core/latency"))
+        check_latency();
+
+    memset(&l, 0, sizeof(l));
+    bench_print_value("core/latency sizeof(uni_latency_t)", "%10zu", sizeof(uni_latency_t));
+    bench_run("core/latency report+parse", run_latency, &l, bench_get_options()->iterations * 4);
+}
+
+//
+// Device pool
+//
+#define POOL_DEVICES 16
+
+static uni_hid_device_t* g_pool_devices[POOL_DEVICES];
+static uint8_t g_pool_descriptor[HID_MAX_DESCRIPTOR_LEN];
+
+// A different descriptor for each "idx": a real one, followed by a unit with "idx" as data.
+// If "padded", it is as big as possible, padded with units.
+static uint16_t make_pool_descriptor(const virtual_controller_model_t* model, int idx, bool padded) {
+    uint16_t len = padded ? sizeof(g_pool_descriptor) : model->hid_descriptor_len + 2;
+
+    // Unit, with no data.
+    memset(g_pool_descriptor, 0x64, sizeof(g_pool_descriptor));
+    memcpy(g_pool_descriptor, model->hid_descriptor, model->hid_descriptor_len);
+    // Unit, with "idx" as data.
+    g_pool_descriptor[len - 2] = 0x65;
+    g_pool_descriptor[len - 1] = idx;
+    return len;
+}
+
+static void run_pool_lookup(void* context, uint64_t iterations) {
+    ARG_UNUSED(context);
+    uintptr_t acc = 0;
+
+    // Same lookups as the incoming packets: by cid, and by connection handle.
+    for (uint64_t i = 0; i < iterations; i++) {
+        const uni_hid_device_t* d = g_pool_devices[i % POOL_DEVICES];
+        acc += (uintptr_t)uni_hid_device_get_instance_for_cid(d->conn.interrupt_cid);
+        acc += (uintptr_t)uni_hid_device_get_instance_for_connection_handle(d->conn.handle);
+    }
+    bench_sink = acc;
+}
+
+static void bench_pool(void) {
+    size_t size = uni_hid_device_get_pool_size(POOL_DEVICES);
+
+    bench_print_value("core/pool uni_hid_device_get_pool_size(16)", "%10zu", size);
+    if (!bench_should_run("core/pool"))
+        return;
+
+    BENCH_CHECK(uni_hid_device_get_pool_size(0) == 0);
+    BENCH_CHECK(uni_hid_device_get_pool_size(UNI_HID_DEVICE_POOL_MAX_DEVICES + 1) == 0);
+
+    // malloc() returns memory aligned to at least 8 bytes.
+    void* arena = malloc(size);
+    if (!BENCH_CHECK(arena != NULL))
+        return;
+    BENCH_CHECK(!uni_hid_device_set_pool(arena, size - 1, POOL_DEVICES));
+    if (!BENCH_CHECK(uni_hid_device_set_pool(arena, size, POOL_DEVICES))) {
+        free(arena);
+        return;
+    }
+    BENCH_CHECK(uni_hid_device_get_max_devices() == POOL_DEVICES);
+
+    for (int i = 0; i < POOL_DEVICES; i++) {
+        g_pool_devices[i] = bench_device_create(NULL, CONTROLLER_TYPE_GenericController);
+        if (!BENCH_CHECK(g_pool_devices[i] != NULL))
+            break;
+        uni_hid_device_set_connection_handle(g_pool_devices[i], 0x100 + i);
+        g_pool_devices[i]->cold->name[0] = 'a' + i;
+    }
+    // Full.
+    bd_addr_t addr = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
+    BENCH_CHECK(uni_hid_device_create(addr) == NULL);
+
+    bool found = true;
+    for (int i = 0; i < POOL_DEVICES && g_pool_devices[i] != NULL; i++) {
+        uni_hid_device_t* d = g_pool_devices[i];
+        found &= uni_hid_device_get_idx_for_instance(d) == i;
+        found &= uni_hid_device_get_instance_for_cid(d->conn.control_cid) == d;
+        found &= uni_hid_device_get_instance_for_cid(d->conn.interrupt_cid) == d;
+        found &= uni_hid_device_get_instance_for_connection_handle(0x100 + i) == d;
+        found &= uni_hid_device_get_instance_for_address(d->conn.btaddr) == d;
+        // Each device has its own cold part.
+        found &= d->cold->name[0] == 'a' + i;
+    }
+    BENCH_CHECK(found);
+    // The pool can't change while it has devices.
+    BENCH_CHECK(!uni_hid_device_set_pool(NULL, 0, 0));
+
+    if (g_pool_devices[POOL_DEVICES - 1] != NULL)
+        bench_run("core/pool lookup (16 devices)", run_pool_lookup, NULL, bench_get_options()->iterations);
+
+    // Mixed models: each device has a different descriptor. The HID descriptor store of the pool has the same
+    // budget per device as the static one.
+    const virtual_controller_model_t* model = virtual_controller_find_model("generic");
+    if (BENCH_CHECK(model != NULL && model->hid_descriptor != NULL && g_pool_devices[POOL_DEVICES - 1] != NULL)) {
+        uni_hid_descriptor_store_stats_t stats;
+        bool stored = true;
+        uint16_t len;
+
+        for (int i = 0; i < POOL_DEVICES; i++) {
+            len = make_pool_descriptor(model, i, false);
+            stored &= uni_hid_device_set_hid_descriptor(g_pool_devices[i], g_pool_descriptor, len);
+            stored &= uni_hid_descriptor_store_get_plan(g_pool_devices[i]->hid_descriptor) != NULL;
+        }
+        BENCH_CHECK(stored);
+        uni_hid_descriptor_store_get_stats(&stats);
+        BENCH_CHECK(stats.entries == POOL_DEVICES && stats.refs == POOL_DEVICES);
+        BENCH_CHECK(stats.pool_size ==
+                    CONFIG_BLUEPAD32_HID_DESCRIPTOR_POOL_SIZE / CONFIG_BLUEPAD32_MAX_DEVICES * POOL_DEVICES);
+        bench_print_value("core/pool descriptor store (16 different descriptors)", "%10d bytes", stats.pool_used);
+        bench_print_value("core/pool descriptor store size", "%10d bytes", stats.pool_size);
+
+        // A device can replace its descriptor.
+        len = make_pool_descriptor(model, POOL_DEVICES, false);
+        BENCH_CHECK(uni_hid_device_set_hid_descriptor(g_pool_devices[0], g_pool_descriptor, len));
+        uni_hid_descriptor_store_get_stats(&stats);
+        BENCH_CHECK(stats.entries == POOL_DEVICES && stats.refs == POOL_DEVICES);
+
+        // There is no room for the largest descriptor on every device. Descriptors have priority over plans:
+        // the plans in the way are dropped, so the descriptors fill the whole pool. The ones that don't fit
+        // fail cleanly: the device has no descriptor, and the other ones keep theirs.
+        int big = 0;
+        bool clean = true;
+        for (int i = 0; i < POOL_DEVICES; i++) {
+            len = make_pool_descriptor(model, i, true);
+            if (uni_hid_device_set_hid_descriptor(g_pool_devices[i], g_pool_descriptor, len))
+                big++;
+            else
+                clean &= !uni_hid_device_has_hid_descriptor(g_pool_devices[i]);
+        }
+        uni_hid_descriptor_store_get_stats(&stats);
+        BENCH_CHECK(big == stats.pool_size / HID_MAX_DESCRIPTOR_LEN && clean);
+        BENCH_CHECK(stats.entries == big && stats.refs == big && stats.pool_used <= stats.pool_size);
+        bench_print_value("core/pool descriptor store (1024-byte descriptors that fit)", "%10d", big);
+
+        // One more descriptor doesn't fit either.
+        len = make_pool_descriptor(model, POOL_DEVICES, true);
+        BENCH_CHECK(uni_hid_descriptor_store_acquire(g_pool_descriptor, len) == UNI_HID_DESCRIPTOR_HANDLE_INVALID);
+        uni_hid_descriptor_store_get_stats(&stats);
+        BENCH_CHECK(stats.entries == big && stats.refs == big);
+    }
+
+    for (int i = 0; i < POOL_DEVICES; i++) {
+        if (g_pool_devices[i] != NULL)
+            bench_device_delete(g_pool_devices[i]);
+        g_pool_devices[i] = NULL;
+    }
+    BENCH_CHECK(uni_hid_device_set_pool(NULL, 0, 0));
+    BENCH_CHECK(uni_hid_device_get_max_devices() == CONFIG_BLUEPAD32_MAX_DEVICES);
+    uni_hid_descriptor_store_stats_t stats;
+    uni_hid_descriptor_store_get_stats(&stats);
+    BENCH_CHECK(stats.entries == 0 && stats.pool_size == CONFIG_BLUEPAD32_HID_DESCRIPTOR_POOL_SIZE);
+    free(arena);
+}
+
+void bench_core(void) {
+    bench_crc32();
+    bench_queue();
+    bench_normalization();
+    bench_haptics();
+    bench_latency();
+    bench_pool();
+}
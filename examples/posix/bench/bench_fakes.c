@@ -0,0 +1,297 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// Fakes for the BTstack functions that need a running Bluetooth stack.
+// The bench is linked with "--wrap=<function>", so the calls that Bluepad32 does to <function>
+// end up in __wrap_<function>. See CMakeLists.txt.
+
+#include <stdarg.h>
+#include <string.h>
+
+#include <btstack.h>
+
+#include "bench.h"
+
+// HID transaction header
+#define HID_GET_REPORT_FEATURE 0x43
+#define HID_DATA_INPUT 0xa1
+#define HID_DATA_OUTPUT 0xa2
+#define HID_DATA_FEATURE 0xa3
+
+// Fake channels. Each device has two: control (even) and interrupt (odd).
+#define BENCH_CID_BASE 0x0040
+
+#define MAX_QUEUED_REPLIES 16
+
+uint8_t __wrap_l2cap_send(uint16_t local_cid, const uint8_t* data, uint16_t len);
+bool __wrap_l2cap_can_send_packet_now(uint16_t local_cid);
+uint8_t __wrap_l2cap_request_can_send_now_event(uint16_t local_cid);
+gap_connection_type_t __wrap_gap_get_connection_type(hci_con_handle_t handle);
+uint32_t __wrap_btstack_run_loop_get_time_ms(void);
+uint32_t __real_btstack_run_loop_get_time_ms(void);
+void __wrap_uni_log(const char* fmt, ...);
+void __wrap_uni_logv(const char* fmt, va_list args);
+void __real_uni_logv(const char* fmt, va_list args);
+void __wrap_printf_hexdump(const void* data, int size);
+void __real_printf_hexdump(const void* data, int size);
+// Same return type as the BTstack declaration.
+__typeof__(gap_get_link_key_for_bd_addr(NULL, NULL, NULL))
+    __wrap_gap_get_link_key_for_bd_addr(bd_addr_t addr, link_key_t link_key, link_key_type_t* type);
+
+typedef struct {
+    // NULL if the slot is not in use.
+    uni_hid_device_t* d;
+    // Its model is NULL if the device doesn't answer.
+    virtual_controller_t vc;
+} link_t;
+
+typedef struct {
+    uint8_t idx;
+    // HID_DATA_INPUT or HID_DATA_FEATURE
+    uint8_t type;
+    uint16_t len;
+    uint8_t data[VIRTUAL_CONTROLLER_MAX_REPORT_SIZE];
+} reply_t;
+
+// Indexed by device index. Sized for the biggest pool, since "core/pool" uses one.
+static link_t g_links[UNI_HID_DEVICE_POOL_MAX_DEVICES];
+static reply_t g_replies[MAX_QUEUED_REPLIES];
+static int g_replies_head;
+static int g_replies_count;
+static bool g_busy;
+static bench_l2cap_stats_t g_stats;
+static uint8_t g_next_addr;
+
+static bool g_clock_frozen;
+static uint32_t g_clock_ms;
+
+// Every device is paired with this link key. NULL: none is paired.
+static const uint8_t* g_link_key;
+
+static link_t* link_for_cid(uint16_t cid, bool* is_control) {
+    if (cid < BENCH_CID_BASE)
+        return NULL;
+    int idx = (cid - BENCH_CID_BASE) / 2;
+    if (idx >= UNI_HID_DEVICE_POOL_MAX_DEVICES || g_links[idx].d == NULL)
+        return NULL;
+    *is_control = ((cid - BENCH_CID_BASE) % 2) == 0;
+    return &g_links[idx];
+}
+
+static void queue_reply(int idx, uint8_t type, const uint8_t* data, uint16_t len) {
+    if (g_replies_count == MAX_QUEUED_REPLIES) {
+        loge("Bench: too many queued replies, dropping one\n");
+        return;
+    }
+    reply_t* r = &g_replies[(g_replies_head + g_replies_count) % MAX_QUEUED_REPLIES];
+    r->idx = idx;
+    r->type = type;
+    r->len = len;
+    memcpy(r->data, data, len);
+    g_replies_count++;
+}
+
+//
+// Wrapped functions
+//
+uint8_t __wrap_l2cap_send(uint16_t local_cid, const uint8_t* data, uint16_t len) {
+    uint8_t reply[VIRTUAL_CONTROLLER_MAX_REPORT_SIZE];
+    uint16_t reply_len = 0;
+    uint8_t type = HID_DATA_INPUT;
+    bool is_control = false;
+
+    if (g_busy) {
+        g_stats.busy++;
+        return BTSTACK_ACL_BUFFERS_FULL;
+    }
+    g_stats.sent++;
+
+    link_t* link = link_for_cid(local_cid, &is_control);
+    if (link == NULL || link->vc.model == NULL || len < 2)
+        return ERROR_CODE_SUCCESS;
+
+    const virtual_controller_model_t* model = link->vc.model;
+    if (is_control && data[0] == HID_GET_REPORT_FEATURE && model->get_feature_report) {
+        reply_len = model->get_feature_report(&link->vc, data[1], reply);
+        type = HID_DATA_FEATURE;
+    } else if (!is_control && data[0] == HID_DATA_OUTPUT && model->on_output_report) {
+        reply_len = model->on_output_report(&link->vc, &data[1], len - 1, reply);
+    }
+
+    // Delivered later, like the real controller would do.
+    if (reply_len > 0)
+        queue_reply(link - g_links, type, reply, reply_len);
+    return ERROR_CODE_SUCCESS;
+}
+
+bool __wrap_l2cap_can_send_packet_now(uint16_t local_cid) {
+    ARG_UNUSED(local_cid);
+    return !g_busy;
+}
+
+uint8_t __wrap_l2cap_request_can_send_now_event(uint16_t local_cid) {
+    ARG_UNUSED(local_cid);
+    g_stats.can_send_now_requests++;
+    return ERROR_CODE_SUCCESS;
+}
+
+gap_connection_type_t __wrap_gap_get_connection_type(hci_con_handle_t handle) {
+    ARG_UNUSED(handle);
+    // All bench devices are BR/EDR.
+    return GAP_CONNECTION_ACL;
+}
+
+uint32_t __wrap_btstack_run_loop_get_time_ms(void) {
+    if (g_clock_frozen)
+        return g_clock_ms;
+    return __real_btstack_run_loop_get_time_ms();
+}
+
+// uni_log() calls uni_logv() from its own object file, where "--wrap" doesn't apply. Both are wrapped.
+void __wrap_uni_log(const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    __wrap_uni_logv(fmt, args);
+    va_end(args);
+}
+
+void __wrap_uni_logv(const char* fmt, va_list args) {
+    if (bench_get_options()->verbose)
+        __real_uni_logv(fmt, args);
+}
+
+void __wrap_printf_hexdump(const void* data, int size) {
+    if (bench_get_options()->verbose)
+        __real_printf_hexdump(data, size);
+}
+
+__typeof__(gap_get_link_key_for_bd_addr(NULL, NULL, NULL))
+    __wrap_gap_get_link_key_for_bd_addr(bd_addr_t addr, link_key_t link_key, link_key_type_t* type) {
+    if (g_link_key == NULL)
+        return 0;
+    memcpy(link_key, g_link_key, sizeof(link_key_t));
+    *type = AUTHENTICATED_COMBINATION_KEY_GENERATED_FROM_P256;
+    return 1;
+}
+
+//
+// Clock
+//
+void bench_clock_freeze(bool frozen) {
+    g_clock_frozen = frozen;
+}
+
+void bench_clock_set_ms(uint32_t now) {
+    g_clock_ms = now;
+}
+
+uint32_t bench_clock_get_ms(void) {
+    return g_clock_ms;
+}
+
+//
+// Link keys
+//
+void bench_link_key_set(const uint8_t* key) {
+    g_link_key = key;
+}
+
+//
+// L2CAP
+//
+void bench_l2cap_pump(void) {
+    while (g_replies_count > 0) {
+        // Copy it, since processing it might queue more replies.
+        reply_t r = g_replies[g_replies_head];
+        g_replies_head = (g_replies_head + 1) % MAX_QUEUED_REPLIES;
+        g_replies_count--;
+
+        uni_hid_device_t* d = g_links[r.idx].d;
+        if (d == NULL)
+            continue;
+
+        // Same as uni_bt_bredr does.
+        if (r.type == HID_DATA_FEATURE) {
+            if (d->report_parser.parse_feature_report)
+                d->report_parser.parse_feature_report(d, r.data, r.len);
+        } else {
+            uni_hid_parse_input_report(d, r.data, r.len);
+            uni_hid_device_process_controller(d);
+        }
+    }
+}
+
+void bench_l2cap_set_busy(bool busy) {
+    g_busy = busy;
+}
+
+const bench_l2cap_stats_t* bench_l2cap_get_stats(void) {
+    return &g_stats;
+}
+
+void bench_l2cap_reset_stats(void) {
+    memset(&g_stats, 0, sizeof(g_stats));
+}
+
+//
+// Devices
+//
+uni_hid_device_t* bench_device_create(const virtual_controller_model_t* model, uni_controller_type_t type) {
+    bd_addr_t addr = {0x00, 0x00, 0x00, 0x00, 0xbe, 0x00};
+
+    addr[5] = g_next_addr++;
+    uni_hid_device_t* d = uni_hid_device_create(addr);
+    if (d == NULL) {
+        loge("Bench: cannot create device\n");
+        return NULL;
+    }
+
+    int idx = uni_hid_device_get_idx_for_instance(d);
+    link_t* link = &g_links[idx];
+    memset(link, 0, sizeof(*link));
+    link->d = d;
+
+    if (model) {
+        virtual_controller_init(&link->vc, model, idx);
+        uni_hid_device_set_name(d, model->name);
+        uni_hid_device_set_cod(d, model->cod);
+        uni_hid_device_set_vendor_id(d, model->vendor_id);
+        uni_hid_device_set_product_id(d, model->product_id);
+        if (model->hid_descriptor)
+            uni_hid_device_set_hid_descriptor(d, model->hid_descriptor, model->hid_descriptor_len);
+    }
+    uni_hid_device_set_controller_type(d, type);
+    uni_hid_device_set_control_cid(d, BENCH_CID_BASE + idx * 2);
+    uni_hid_device_set_interrupt_cid(d, BENCH_CID_BASE + idx * 2 + 1);
+    uni_hid_device_connect(d);
+    return d;
+}
+
+bool bench_device_setup(uni_hid_device_t* d) {
+    int idx = uni_hid_device_get_idx_for_instance(d);
+
+    uni_hid_device_set_ready(d);
+    bench_l2cap_pump();
+
+    // The platform might have deleted it.
+    return g_links[idx].d == d && uni_bt_conn_get_state(&d->conn) == UNI_BT_CONN_STATE_DEVICE_READY;
+}
+
+bool bench_device_set_ready(uni_hid_device_t* d) {
+    uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_DEVICE_PENDING_READY);
+    return uni_hid_device_set_ready_complete(d);
+}
+
+void bench_device_delete(uni_hid_device_t* d) {
+    int idx = uni_hid_device_get_idx_for_instance(d);
+
+    // Pending replies for it are dropped by the pump.
+    g_links[idx].d = NULL;
+
+    // Like uni_hid_device_disconnect(), but without the Bluetooth part.
+    uni_bt_conn_disconnect(&d->conn);
+    uni_hid_device_on_connected(d, false);
+    uni_hid_device_delete(d);
+}
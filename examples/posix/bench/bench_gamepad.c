@@ -0,0 +1,324 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// Gamepad: the mappings, the changes delivered to the platforms, and the conversions to joystick done by the
+// Unijoysticle platform.
+
+#include <string.h>
+
+#include "bench.h"
+
+// Same as the pre-generated reports: the inputs repeat every 256 operations.
+#define NUM_INPUTS 256
+
+typedef struct {
+    uni_gamepad_t gamepads[NUM_INPUTS];
+    uni_keyboard_t keyboards[NUM_INPUTS];
+    uni_balance_board_t boards[NUM_INPUTS];
+} gamepad_inputs_t;
+
+static gamepad_inputs_t g_inputs;
+
+static void init_inputs(void) {
+    bench_srand(0x1234);
+    for (int i = 0; i < NUM_INPUTS; i++) {
+        uni_gamepad_t* gp = &g_inputs.gamepads[i];
+        memset(gp, 0, sizeof(*gp));
+        gp->dpad = bench_rand() & 0x0f;
+        gp->buttons = bench_rand() & 0x3ff;
+        gp->misc_buttons = bench_rand() & 0x0f;
+        gp->axis_x = (int32_t)(bench_rand() % 1024) - 512;
+        gp->axis_y = (int32_t)(bench_rand() % 1024) - 512;
+        gp->axis_rx = (int32_t)(bench_rand() % 1024) - 512;
+        gp->axis_ry = (int32_t)(bench_rand() % 1024) - 512;
+        gp->brake = bench_rand() % 1024;
+        gp->throttle = bench_rand() % 1024;
+        gp->accel[0] = (int32_t)(bench_rand() % 1024) - 512;
+        gp->accel[1] = (int32_t)(bench_rand() % 1024) - 512;
+        gp->accel[2] = (int32_t)(bench_rand() % 1024) - 512;
+
+        uni_keyboard_t* kb = &g_inputs.keyboards[i];
+        memset(kb, 0, sizeof(*kb));
+        kb->modifiers = bench_rand() & 0xff;
+        // Cursor keys, WASD, space and enter are the ones mapped to the joysticks.
+        static const uint8_t keys[] = {0x04, 0x07, 0x16, 0x1a, 0x28, 0x2c, 0x4f, 0x50, 0x51, 0x52};
+        for (int k = 0; k < 3; k++)
+            kb->pressed_keys[k] = keys[bench_rand() % ARRAY_SIZE(keys)];
+
+        uni_balance_board_t* bb = &g_inputs.boards[i];
+        bb->tl = bench_rand() % 4096;
+        bb->tr = bench_rand() % 4096;
+        bb->bl = bench_rand() % 4096;
+        bb->br = bench_rand() % 4096;
+        bb->temperature = 25;
+    }
+}
+
+//
+// Mappings
+//
+static void run_remap(void* context, uint64_t iterations) {
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uni_gamepad_t gp = uni_gamepad_remap(&g_inputs.gamepads[i % NUM_INPUTS]);
+        acc += gp.buttons + gp.axis_x;
+    }
+    bench_sink = acc;
+}
+
+static void check_remap(void) {
+    const uni_gamepad_t in = {.buttons = BUTTON_A | BUTTON_X | BUTTON_SHOULDER_L, .axis_x = 100, .axis_ry = -50};
+    uni_gamepad_t out;
+
+    uni_gamepad_set_mappings_type(UNI_GAMEPAD_MAPPINGS_TYPE_XBOX);
+    out = uni_gamepad_remap(&in);
+    BENCH_CHECK(memcmp(&out, &in, sizeof(in)) == 0);
+
+    uni_gamepad_set_mappings_type(UNI_GAMEPAD_MAPPINGS_TYPE_SWITCH);
+    out = uni_gamepad_remap(&in);
+    BENCH_CHECK(out.buttons == (BUTTON_B | BUTTON_Y | BUTTON_SHOULDER_L));
+    BENCH_CHECK(out.axis_x == in.axis_x && out.axis_ry == in.axis_ry);
+
+    // Same as the commented out mappings in my_platform.c: A/B swapped.
+    uni_gamepad_mappings_t mappings = GAMEPAD_DEFAULT_MAPPINGS;
+    mappings.button_a = UNI_GAMEPAD_MAPPINGS_BUTTON_B;
+    mappings.button_b = UNI_GAMEPAD_MAPPINGS_BUTTON_A;
+    uni_gamepad_set_mappings(&mappings);
+    out = uni_gamepad_remap(&in);
+    BENCH_CHECK(out.buttons == (BUTTON_B | BUTTON_X | BUTTON_SHOULDER_L));
+    BENCH_CHECK(out.axis_x == in.axis_x && out.axis_ry == in.axis_ry);
+}
+
+static void bench_remap(void) {
+    static const struct {
+        const char* name;
+        uni_gamepad_mappings_type_t type;
+    } types[] = {
+        {"gamepad/remap (xbox)", UNI_GAMEPAD_MAPPINGS_TYPE_XBOX},
+        {"gamepad/remap (switch)", UNI_GAMEPAD_MAPPINGS_TYPE_SWITCH},
+        {"gamepad/remap (custom)", UNI_GAMEPAD_MAPPINGS_TYPE_CUSTOM},
+    };
+    uint64_t iterations = bench_get_options()->iterations * 4;
+
+    if (bench_should_run("gamepad/remap"))
+        check_remap();
+
+    for (size_t i = 0; i < ARRAY_SIZE(types); i++) {
+        if (types[i].type == UNI_GAMEPAD_MAPPINGS_TYPE_CUSTOM) {
+            // Axes swapped, with RY inverted. Exercises all the paths.
+            uni_gamepad_mappings_t mappings = GAMEPAD_DEFAULT_MAPPINGS;
+            mappings.axis_x = UNI_GAMEPAD_MAPPINGS_AXIS_RX;
+            mappings.axis_y = UNI_GAMEPAD_MAPPINGS_AXIS_RY;
+            mappings.axis_ry_inverted = true;
+            mappings.axis_rx = UNI_GAMEPAD_MAPPINGS_AXIS_X;
+            mappings.axis_ry = UNI_GAMEPAD_MAPPINGS_AXIS_Y;
+            uni_gamepad_set_mappings(&mappings);
+        } else {
+            uni_gamepad_set_mappings_type(types[i].type);
+        }
+        bench_run(types[i].name, run_remap, NULL, iterations);
+    }
+
+    // Restore the default, like my_platform.c does.
+    uni_gamepad_set_mappings_type(UNI_GAMEPAD_MAPPINGS_TYPE_XBOX);
+}
+
+//
+// Changes
+//
+static void run_changes(void* context, uint64_t iterations) {
+    const uni_controller_change_filter_t* filter = context;
+    uni_controller_t prev = {.klass = UNI_CONTROLLER_CLASS_GAMEPAD};
+    uni_controller_t ctl = {.klass = UNI_CONTROLLER_CLASS_GAMEPAD};
+    uint32_t acc = 0;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        ctl.gamepad = g_inputs.gamepads[i % NUM_INPUTS];
+        uint32_t changes = uni_controller_get_changes(&prev, &ctl, filter);
+        if (changes != 0)
+            prev = ctl;
+        acc += changes;
+    }
+    bench_sink = acc;
+}
+
+static void check_changes(void) {
+    const uni_controller_change_filter_t filter = {.only_on_change = true, .axis_x = 10, .gyro = 32};
+    uni_controller_t prev = {0};
+    uni_controller_t ctl = {.klass = UNI_CONTROLLER_CLASS_GAMEPAD, .battery = 100};
+
+    // New class: everything changed.
+    BENCH_CHECK(uni_controller_get_changes(&prev, &ctl, NULL) == UNI_CONTROLLER_CHANGE_ALL);
+
+    prev = ctl;
+    BENCH_CHECK(uni_controller_get_changes(&prev, &ctl, NULL) == 0);
+
+    ctl.gamepad.buttons = BUTTON_A;
+    ctl.gamepad.axis_y = -1;
+    ctl.battery = 99;
+    BENCH_CHECK(uni_controller_get_changes(&prev, &ctl, NULL) ==
+                (UNI_CONTROLLER_CHANGE_BUTTONS | UNI_CONTROLLER_CHANGE_AXIS_Y | UNI_CONTROLLER_CHANGE_BATTERY));
+
+    // Below or at the thresholds: not a change.
+    prev = ctl;
+    ctl.gamepad.axis_x = -10;
+    ctl.gamepad.gyro[2] = 32;
+    BENCH_CHECK(uni_controller_get_changes(&prev, &ctl, &filter) == 0);
+    BENCH_CHECK(uni_controller_get_changes(&prev, &ctl, NULL) ==
+                (UNI_CONTROLLER_CHANGE_AXIS_X | UNI_CONTROLLER_CHANGE_GYRO));
+    ctl.gamepad.axis_x = 11;
+    ctl.gamepad.gyro[2] = -33;
+    ctl.gamepad.throttle = 1;
+    BENCH_CHECK(uni_controller_get_changes(&prev, &ctl, &filter) ==
+                (UNI_CONTROLLER_CHANGE_AXIS_X | UNI_CONTROLLER_CHANGE_GYRO | UNI_CONTROLLER_CHANGE_THROTTLE));
+
+    // Mouse deltas are relative: the same movement twice is a change, and so is stopping.
+    uni_controller_t prev_ms = {.klass = UNI_CONTROLLER_CLASS_MOUSE, .mouse = {.delta_x = 5}};
+    uni_controller_t ms = prev_ms;
+    BENCH_CHECK(uni_controller_get_changes(&prev_ms, &ms, NULL) == UNI_CONTROLLER_CHANGE_AXIS_X);
+    ms.mouse.delta_x = 0;
+    BENCH_CHECK(uni_controller_get_changes(&prev_ms, &ms, NULL) == UNI_CONTROLLER_CHANGE_AXIS_X);
+    prev_ms = ms;
+    BENCH_CHECK(uni_controller_get_changes(&prev_ms, &ms, NULL) == 0);
+
+    uni_controller_t prev_kb = {.klass = UNI_CONTROLLER_CLASS_KEYBOARD};
+    uni_controller_t kb = prev_kb;
+    kb.keyboard.pressed_keys[0] = 0x04;
+    BENCH_CHECK(uni_controller_get_changes(&prev_kb, &kb, NULL) == UNI_CONTROLLER_CHANGE_KEYS);
+}
+
+static void bench_changes(void) {
+    // Noisy gyro/accel, like DualShock4 and DualSense.
+    static const uni_controller_change_filter_t filter = {.only_on_change = true, .gyro = 32, .accel = 32};
+    uint64_t iterations = bench_get_options()->iterations * 4;
+
+    if (bench_should_run("gamepad/changes"))
+        check_changes();
+
+    bench_run("gamepad/changes", run_changes, NULL, iterations);
+    bench_run("gamepad/changes (thresholds)", run_changes, (void*)&filter, iterations);
+}
+
+//
+// Joystick
+//
+static void run_joy_single(void* context, uint64_t iterations) {
+    uni_joystick_t joy;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        memset(&joy, 0, sizeof(joy));
+        uni_joy_to_single_joy_from_gamepad(&g_inputs.gamepads[i % NUM_INPUTS], &joy, i & 1);
+        acc += joy.up + joy.fire + joy.button2;
+    }
+    bench_sink = acc;
+}
+
+static void run_joy_twinstick(void* context, uint64_t iterations) {
+    uni_joystick_t joy1, joy2;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        memset(&joy1, 0, sizeof(joy1));
+        memset(&joy2, 0, sizeof(joy2));
+        uni_joy_to_twinstick_from_gamepad(&g_inputs.gamepads[i % NUM_INPUTS], &joy1, &joy2);
+        acc += joy1.left + joy2.right;
+    }
+    bench_sink = acc;
+}
+
+static void run_joy_wii_accel(void* context, uint64_t iterations) {
+    uni_joystick_t joy;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        memset(&joy, 0, sizeof(joy));
+        uni_joy_to_single_from_wii_accel(&g_inputs.gamepads[i % NUM_INPUTS], &joy);
+        acc += joy.up + joy.left;
+    }
+    bench_sink = acc;
+}
+
+static void run_joy_keyboard(void* context, uint64_t iterations) {
+    uni_joystick_t joy;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        memset(&joy, 0, sizeof(joy));
+        uni_joy_to_single_joy_from_keyboard(&g_inputs.keyboards[i % NUM_INPUTS], &joy);
+        acc += joy.up + joy.fire;
+    }
+    bench_sink = acc;
+}
+
+static void run_joy_keyboard_twinstick(void* context, uint64_t iterations) {
+    uni_joystick_t joy1, joy2;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        memset(&joy1, 0, sizeof(joy1));
+        memset(&joy2, 0, sizeof(joy2));
+        uni_joy_to_twinstick_from_keyboard(&g_inputs.keyboards[i % NUM_INPUTS], &joy1, &joy2);
+        acc += joy1.down + joy2.fire;
+    }
+    bench_sink = acc;
+}
+
+static void run_joy_balance_board(void* context, uint64_t iterations) {
+    uni_balance_board_state_t state = {0};
+    uni_joystick_t joy;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        memset(&joy, 0, sizeof(joy));
+        uni_joy_to_single_joy_from_balance_board(&g_inputs.boards[i % NUM_INPUTS], &state, &joy);
+        acc += joy.up + joy.fire;
+    }
+    bench_sink = acc;
+}
+
+static void check_joy(void) {
+    uni_joystick_t joy;
+
+    uni_gamepad_t gp = {.dpad = DPAD_UP | DPAD_LEFT, .buttons = BUTTON_A};
+    memset(&joy, 0, sizeof(joy));
+    uni_joy_to_single_joy_from_gamepad(&gp, &joy, false);
+    BENCH_CHECK(joy.up && joy.left && !joy.down && !joy.right);
+    BENCH_CHECK(joy.fire);
+
+    // Idle gamepad, idle joystick.
+    memset(&gp, 0, sizeof(gp));
+    memset(&joy, 0, sizeof(joy));
+    uni_joy_to_single_joy_from_gamepad(&gp, &joy, false);
+    BENCH_CHECK(!joy.up && !joy.down && !joy.left && !joy.right && !joy.fire);
+}
+
+static void bench_joy(void) {
+    uint64_t iterations = bench_get_options()->iterations * 4;
+
+    if (bench_should_run("gamepad/joy"))
+        check_joy();
+
+    bench_run("gamepad/joy single (gamepad)", run_joy_single, NULL, iterations);
+    bench_run("gamepad/joy twinstick (gamepad)", run_joy_twinstick, NULL, iterations);
+    bench_run("gamepad/joy single (wii accel)", run_joy_wii_accel, NULL, iterations);
+    bench_run("gamepad/joy single (keyboard)", run_joy_keyboard, NULL, iterations);
+    bench_run("gamepad/joy twinstick (keyboard)", run_joy_keyboard_twinstick, NULL, iterations);
+    bench_run("gamepad/joy single (balance board)", run_joy_balance_board, NULL, iterations);
+}
+
+void bench_gamepad(void) {
+    init_inputs();
+    bench_remap();
+    bench_changes();
+    bench_joy();
+}
@@ -0,0 +1,930 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// NINA: the SPI protocol spoken with the Arduino / CircuitPython hosts, without the ESP32.
+// The bench plays the SPI master: it sends framed commands to uni_nina_protocol_process_request(), like the
+// host libraries do, and decodes the responses. The Bluetooth side is fed with simulated controllers.
+// v2 "controllers changes" is checked against v1 "controllers data", that is the ground truth.
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+#include "platform/uni_nina_protocol.h"
+
+#define NUM_CONTROLLERS CONFIG_BLUEPAD32_MAX_DEVICES
+#define MAX_FAKE_REQUESTS 16
+
+// What goes over the wire, in either direction.
+typedef struct {
+    uint8_t data[UNI_NINA_PROTOCOL_BUFFER_LEN];
+    int len;
+} nina_buffer_t;
+
+// What the host knows, decoded from the v2 responses.
+typedef struct {
+    uint16_t seq;
+    uint8_t seats;
+    uni_nina_controller_t controllers[NUM_CONTROLLERS];
+} nina_host_t;
+
+// The Bluetooth side: devices and their latest data.
+typedef struct {
+    uni_hid_device_t* devices[NUM_CONTROLLERS];
+    uni_controller_t controllers[NUM_CONTROLLERS];
+    uint8_t seats;
+} nina_sim_t;
+
+// Callbacks. What would be sent to the BTstack task.
+typedef struct {
+    uni_nina_request_t requests[MAX_FAKE_REQUESTS];
+    int total_requests;
+    int forget_keys;
+    bool connections_enabled;
+} nina_fake_bt_t;
+
+typedef struct {
+    nina_sim_t* sim;
+    bool stop;
+    uint64_t updates;
+} nina_producer_t;
+
+static nina_fake_bt_t g_fake_bt;
+static nina_sim_t g_sim;
+
+//
+// Fake Bluetooth task
+//
+static void fake_queue_request(const uni_nina_request_t* request) {
+    if (g_fake_bt.total_requests < MAX_FAKE_REQUESTS)
+        g_fake_bt.requests[g_fake_bt.total_requests] = *request;
+    g_fake_bt.total_requests++;
+}
+
+static void fake_forget_bluetooth_keys(void) {
+    g_fake_bt.forget_keys++;
+}
+
+static void fake_enable_bluetooth_connections(bool enabled) {
+    g_fake_bt.connections_enabled = enabled;
+}
+
+static void protocol_init(void) {
+    static const uni_nina_protocol_callbacks_t callbacks = {
+        .queue_request = fake_queue_request,
+        .forget_bluetooth_keys = fake_forget_bluetooth_keys,
+        .enable_bluetooth_connections = fake_enable_bluetooth_connections,
+        // No NINA-fw commands: they need the ESP32.
+    };
+
+    memset(&g_fake_bt, 0, sizeof(g_fake_bt));
+    uni_nina_protocol_init(&callbacks);
+}
+
+//
+// Host side: commands and responses
+//
+static void command_begin(nina_buffer_t* b, uint8_t cmd) {
+    // Zero padded, like the SPI buffer.
+    memset(b->data, 0, sizeof(b->data));
+    b->data[0] = UNI_NINA_CMD_START;
+    b->data[1] = cmd;
+    b->data[2] = 0;  // Number of parameters
+    b->len = 3;
+}
+
+static void command_add_param(nina_buffer_t* b, const void* param, int len) {
+    b->data[2]++;
+    b->data[b->len] = len;
+    memcpy(&b->data[b->len + 1], param, len);
+    b->len += len + 1;
+}
+
+static void command_add_u8(nina_buffer_t* b, uint8_t value) {
+    command_add_param(b, &value, 1);
+}
+
+static void command_end(nina_buffer_t* b) {
+    b->data[b->len++] = UNI_NINA_CMD_END;
+}
+
+// One SPI transaction: the command goes in, the response comes out.
+static int transfer(const nina_buffer_t* command, nina_buffer_t* response) {
+    memset(response->data, 0, sizeof(response->data));
+    response->len = uni_nina_protocol_process_request(command->data, command->len, response->data);
+    return response->len;
+}
+
+static bool response_is_valid(const nina_buffer_t* r, uint8_t cmd) {
+    return r->len >= 4 && r->data[0] == UNI_NINA_CMD_START && r->data[1] == (cmd | UNI_NINA_CMD_REPLY_FLAG) &&
+           r->data[r->len - 1] == UNI_NINA_CMD_END;
+}
+
+// Returns parameter "n", or NULL if it doesn't exist.
+static const uint8_t* response_get_param(const nina_buffer_t* r, int n, int* len) {
+    int offset = 3;
+
+    if (n >= r->data[2])
+        return NULL;
+    for (int i = 0; i < n; i++)
+        offset += r->data[offset] + 1;
+    if (offset >= r->len - 1)
+        return NULL;
+    *len = r->data[offset];
+    return &r->data[offset + 1];
+}
+
+// Most commands: the controller idx, and the arguments as a single parameter.
+static void build_controller_command(nina_buffer_t* b, uint8_t cmd, uint8_t idx, const uint8_t args[], int len) {
+    command_begin(b, cmd);
+    command_add_u8(b, idx);
+    if (len > 0)
+        command_add_param(b, args, len);
+    command_end(b);
+}
+
+// For the commands that answer with a status.
+static uint8_t send_command(const nina_buffer_t* command) {
+    nina_buffer_t response;
+    int len;
+
+    transfer(command, &response);
+    if (!response_is_valid(&response, command->data[1]))
+        return UNI_NINA_RESPONSE_ERROR;
+    const uint8_t* status = response_get_param(&response, 0, &len);
+    if (status == NULL || len != 1)
+        return UNI_NINA_RESPONSE_ERROR;
+    return status[0];
+}
+
+// Returns the major version.
+static int negotiate_protocol(uint8_t wanted_version) {
+    nina_buffer_t command;
+    nina_buffer_t response;
+    int len;
+
+    command_begin(&command, UNI_NINA_CMD_PROTOCOL_VERSION);
+    if (wanted_version != 0)
+        command_add_u8(&command, wanted_version);
+    command_end(&command);
+    transfer(&command, &response);
+
+    if (!response_is_valid(&response, UNI_NINA_CMD_PROTOCOL_VERSION))
+        return -1;
+    const uint8_t* version = response_get_param(&response, 0, &len);
+    if (version == NULL || len != 2)
+        return -1;
+    return version[0];
+}
+
+//
+// Host side: controllers
+//
+// v2 fields, in bitmap order. Written from the protocol description, not shared with the implementation.
+typedef struct {
+    size_t offset;
+    size_t len;
+} nina_field_t;
+
+#define FIELD(_field) {offsetof(uni_nina_controller_t, _field), sizeof(((uni_nina_controller_t*)0)->_field)}
+static const nina_field_t gamepad_fields[] = {
+    FIELD(gamepad.dpad),
+    FIELD(gamepad.axis_x),
+    FIELD(gamepad.axis_y),
+    FIELD(gamepad.axis_rx),
+    FIELD(gamepad.axis_ry),
+    FIELD(gamepad.brake),
+    FIELD(gamepad.throttle),
+    FIELD(gamepad.buttons),
+    FIELD(gamepad.misc_buttons),
+    FIELD(gamepad.gyro),
+    FIELD(gamepad.accel),
+};
+static const nina_field_t mouse_fields[] = {
+    FIELD(mouse.delta_x),
+    FIELD(mouse.delta_y),
+    FIELD(mouse.buttons),
+    FIELD(mouse.misc_buttons),
+    FIELD(mouse.scroll_wheel),
+};
+static const nina_field_t balance_fields[] = {
+    FIELD(balance.tr),
+    FIELD(balance.br),
+    FIELD(balance.tl),
+    FIELD(balance.bl),
+    FIELD(balance.temperature),
+};
+#undef FIELD
+
+static const nina_field_t* get_fields(uint8_t klass, int* count) {
+    switch (klass) {
+        case UNI_NINA_CONTROLLER_CLASS_GAMEPAD:
+            *count = ARRAY_SIZE(gamepad_fields);
+            return gamepad_fields;
+        case UNI_NINA_CONTROLLER_CLASS_MOUSE:
+            *count = ARRAY_SIZE(mouse_fields);
+            return mouse_fields;
+        case UNI_NINA_CONTROLLER_CLASS_BALANCE_BOARD:
+            *count = ARRAY_SIZE(balance_fields);
+            return balance_fields;
+        default:
+            *count = 0;
+            return NULL;
+    }
+}
+
+// Only what is sent: the bytes of the union that don't belong to the class are ignored.
+static bool controllers_equal(const uni_nina_controller_t* a, const uni_nina_controller_t* b) {
+    int count;
+
+    if (a->idx != b->idx || a->klass != b->klass || a->battery != b->battery)
+        return false;
+    const nina_field_t* fields = get_fields(a->klass, &count);
+    for (int i = 0; i < count; i++) {
+        if (memcmp((const uint8_t*)a + fields[i].offset, (const uint8_t*)b + fields[i].offset, fields[i].len) != 0)
+            return false;
+    }
+    return true;
+}
+
+// Decodes a v1 "controllers data" response. Returns the seats, or -1 if it is malformed.
+static int decode_controllers_data(const nina_buffer_t* r, uni_nina_controller_t out[]) {
+    int seats = 0;
+    int len;
+
+    if (!response_is_valid(r, UNI_NINA_CMD_CONTROLLERS_DATA))
+        return -1;
+    for (int i = 0; i < r->data[2]; i++) {
+        const uint8_t* param = response_get_param(r, i, &len);
+        if (param == NULL || len != sizeof(uni_nina_controller_t))
+            return -1;
+        int idx = (int8_t)param[0];
+        if (idx < 0 || idx >= NUM_CONTROLLERS)
+            return -1;
+        memcpy(&out[idx], param, sizeof(out[0]));
+        seats |= BIT(idx);
+    }
+    return seats;
+}
+
+// Applies a v2 "controllers changes" response. Returns false if it is malformed.
+static bool host_apply_changes(nina_host_t* host, const nina_buffer_t* r) {
+    int len;
+
+    if (!response_is_valid(r, UNI_NINA_CMD_CONTROLLERS_CHANGES))
+        return false;
+    const uint8_t* header = response_get_param(r, 0, &len);
+    if (header == NULL || len != 4)
+        return false;
+    host->seq = little_endian_read_16(header, 0);
+    host->seats = header[2];
+
+    for (int i = 1; i < r->data[2]; i++) {
+        const uint8_t* record = response_get_param(r, i, &len);
+        if (record == NULL || len < 3)
+            return false;
+        int idx = record[0];
+        if (idx >= NUM_CONTROLLERS || (host->seats & BIT(idx)) == 0)
+            return false;
+
+        uni_nina_controller_t* ctl = &host->controllers[idx];
+        uint16_t changes = little_endian_read_16(record, 1);
+        int offset = 3;
+        int count;
+
+        ctl->idx = idx;
+        if (changes & UNI_NINA_V2_CHANGE_CLASS)
+            ctl->klass = record[offset++];
+        const nina_field_t* fields = get_fields(ctl->klass, &count);
+        for (int f = 0; f < count; f++) {
+            if (changes & BIT(f)) {
+                memcpy((uint8_t*)ctl + fields[f].offset, &record[offset], fields[f].len);
+                offset += fields[f].len;
+            }
+        }
+        if (changes & UNI_NINA_V2_CHANGE_BATTERY)
+            ctl->battery = record[offset++];
+        if (offset != len)
+            return false;
+    }
+    return true;
+}
+
+static void host_build_changes_command(const nina_host_t* host, nina_buffer_t* command) {
+    uint8_t seq[2];
+
+    little_endian_store_16(seq, 0, host->seq);
+    command_begin(command, UNI_NINA_CMD_CONTROLLERS_CHANGES);
+    command_add_param(command, seq, sizeof(seq));
+    command_end(command);
+}
+
+static void build_controllers_data_command(nina_buffer_t* command) {
+    command_begin(command, UNI_NINA_CMD_CONTROLLERS_DATA);
+    command_end(command);
+}
+
+//
+// Bluetooth side
+//
+static void sim_init(nina_sim_t* sim) {
+    // Three gamepads and a mouse.
+    static const uni_controller_type_t types[] = {
+        CONTROLLER_TYPE_XBoxOneController,
+        CONTROLLER_TYPE_PS4Controller,
+        CONTROLLER_TYPE_XBoxOneController,
+        CONTROLLER_TYPE_GenericMouse,
+    };
+
+    memset(sim, 0, sizeof(*sim));
+    for (int i = 0; i < NUM_CONTROLLERS; i++) {
+        sim->devices[i] = bench_device_create(NULL, types[i % ARRAY_SIZE(types)]);
+        uni_controller_t* ctl = &sim->controllers[i];
+        ctl->klass = (i % ARRAY_SIZE(types) == 3) ? UNI_CONTROLLER_CLASS_MOUSE : UNI_CONTROLLER_CLASS_GAMEPAD;
+        // The properties tell mice apart by their Class of Device.
+        if (sim->devices[i] != NULL && ctl->klass == UNI_CONTROLLER_CLASS_MOUSE)
+            uni_hid_device_set_cod(sim->devices[i], UNI_BT_COD_MAJOR_PERIPHERAL | UNI_BT_COD_MINOR_MICE);
+        ctl->battery = 200;
+    }
+}
+
+static void sim_deinit(nina_sim_t* sim) {
+    for (int i = 0; i < NUM_CONTROLLERS; i++) {
+        if (sim->devices[i] != NULL)
+            bench_device_delete(sim->devices[i]);
+    }
+    memset(sim, 0, sizeof(*sim));
+}
+
+static bool sim_connect(nina_sim_t* sim, int i) {
+    if (sim->devices[i] == NULL)
+        return false;
+    int idx = uni_nina_protocol_add_controller(sim->devices[i]);
+    if (idx == UNI_NINA_CONTROLLER_INVALID)
+        return false;
+    // The first free seat. Seats are given in order in this bench.
+    if (!BENCH_CHECK(idx == i))
+        return false;
+    sim->seats |= BIT(i);
+    uni_nina_protocol_set_controller_data(i, &sim->controllers[i]);
+    return true;
+}
+
+static void sim_disconnect(nina_sim_t* sim, int i) {
+    uni_nina_protocol_remove_controller(i);
+    sim->seats &= ~BIT(i);
+}
+
+// Like a person playing: most reports change a button or an axis, the rest stay the same.
+static void sim_update(nina_sim_t* sim, int i) {
+    uni_controller_t* ctl = &sim->controllers[i];
+    uint32_t r = bench_rand();
+
+    if (ctl->klass == UNI_CONTROLLER_CLASS_MOUSE) {
+        ctl->mouse.delta_x = (int32_t)(r % 16) - 8;
+        ctl->mouse.delta_y = (int32_t)((r >> 4) % 16) - 8;
+        if ((r & 0x300) == 0)
+            ctl->mouse.buttons ^= BIT(0);
+    } else {
+        if ((r & 0x3) == 0)
+            ctl->gamepad.buttons ^= BIT((r >> 2) % 10);
+        if ((r & 0x30) == 0)
+            ctl->gamepad.dpad = (r >> 6) & 0x0f;
+        if ((r & 0x100) == 0)
+            ctl->gamepad.axis_x = (int32_t)((r >> 9) % 1024) - 512;
+        if ((r & 0x600) == 0)
+            ctl->gamepad.throttle = (r >> 11) % 1024;
+    }
+    if ((r >> 24) == 0)
+        ctl->battery--;
+    uni_nina_protocol_set_controller_data(i, ctl);
+}
+
+// Returns the seats according to v1.
+static int read_ground_truth(uni_nina_controller_t out[]) {
+    nina_buffer_t command;
+    nina_buffer_t response;
+
+    build_controllers_data_command(&command);
+    transfer(&command, &response);
+    return decode_controllers_data(&response, out);
+}
+
+//
+// Checks
+//
+static void check_nina_v1(void) {
+    uni_nina_controller_t controllers[NUM_CONTROLLERS];
+    nina_buffer_t command;
+    nina_buffer_t response;
+    int len;
+
+    protocol_init();
+    sim_init(&g_sim);
+
+    // Hosts that don't know about v2 keep getting v1.
+    BENCH_CHECK(negotiate_protocol(0) == UNI_NINA_PROTOCOL_VERSION_HI);
+    BENCH_CHECK(read_ground_truth(controllers) == 0);
+
+    for (int i = 0; i < NUM_CONTROLLERS; i++)
+        BENCH_CHECK(sim_connect(&g_sim, i));
+    // No more seats.
+    BENCH_CHECK(uni_nina_protocol_add_controller(g_sim.devices[0]) == UNI_NINA_CONTROLLER_INVALID);
+
+    g_sim.controllers[1].gamepad.axis_x = -100;
+    g_sim.controllers[1].gamepad.buttons = 0x81;
+    g_sim.controllers[1].gamepad.gyro[2] = 1234;
+    uni_nina_protocol_set_controller_data(1, &g_sim.controllers[1]);
+    g_sim.controllers[3].mouse.delta_y = 7;
+    g_sim.controllers[3].mouse.scroll_wheel = -1;
+    uni_nina_protocol_set_controller_data(3, &g_sim.controllers[3]);
+    sim_disconnect(&g_sim, 2);
+
+    BENCH_CHECK(read_ground_truth(controllers) == (BIT(0) | BIT(1) | BIT(3)));
+    BENCH_CHECK(controllers[1].idx == 1);
+    BENCH_CHECK(controllers[1].klass == UNI_NINA_CONTROLLER_CLASS_GAMEPAD);
+    BENCH_CHECK(controllers[1].gamepad.axis_x == -100);
+    BENCH_CHECK(controllers[1].gamepad.buttons == 0x81);
+    BENCH_CHECK(controllers[1].gamepad.gyro[2] == 1234);
+    BENCH_CHECK(controllers[1].battery == 200);
+    BENCH_CHECK(controllers[3].klass == UNI_NINA_CONTROLLER_CLASS_MOUSE);
+    BENCH_CHECK(controllers[3].mouse.delta_y == 7);
+    BENCH_CHECK(controllers[3].mouse.scroll_wheel == -1);
+
+    // The prebuilt frame that the SPI driver sends is the same as the response.
+    build_controllers_data_command(&command);
+    transfer(&command, &response);
+    const uint8_t* frame = uni_nina_protocol_get_controllers_frame(&len);
+    BENCH_CHECK(len == response.len && memcmp(frame, response.data, len) == 0);
+
+    // Properties
+    command_begin(&command, UNI_NINA_CMD_GET_PROPERTIES);
+    command_add_u8(&command, 3);
+    command_end(&command);
+    transfer(&command, &response);
+    const uint8_t* param = response_get_param(&response, 1, &len);
+    if (BENCH_CHECK(param != NULL && len == sizeof(uni_nina_controller_properties_t))) {
+        uni_nina_controller_properties_t properties;
+        memcpy(&properties, param, sizeof(properties));
+        BENCH_CHECK(properties.idx == 3);
+        BENCH_CHECK(properties.flags & UNI_NINA_PROPERTY_FLAG_MOUSE);
+        BENCH_CHECK(memcmp(properties.btaddr, g_sim.devices[3]->conn.btaddr, sizeof(properties.btaddr)) == 0);
+    }
+
+    // Invalid commands get CMD_ERR: Bluepad32 ones without a handler, NINA-fw ones, and v2 ones.
+    static const uint8_t invalid_commands[] = {0x0c, 0x37, UNI_NINA_CMD_CONTROLLERS_CHANGES, UNI_NINA_CMD_BATCH};
+    for (size_t i = 0; i < ARRAY_SIZE(invalid_commands); i++) {
+        command_begin(&command, invalid_commands[i]);
+        command_end(&command);
+        BENCH_CHECK(transfer(&command, &response) == 3 && response.data[0] == UNI_NINA_CMD_ERR);
+    }
+
+    sim_deinit(&g_sim);
+}
+
+static void check_nina_requests(void) {
+    const uint8_t leds[] = {0x05};
+    const uint8_t color[] = {0xff, 0x80, 0x00};
+    const uint8_t rumble[] = {0x80, 0x20};
+    nina_buffer_t command;
+
+    protocol_init();
+
+    build_controller_command(&command, UNI_NINA_CMD_SET_PLAYER_LEDS, 1, leds, sizeof(leds));
+    BENCH_CHECK(send_command(&command) == UNI_NINA_RESPONSE_OK);
+    build_controller_command(&command, UNI_NINA_CMD_SET_COLOR_LED, 0, color, sizeof(color));
+    BENCH_CHECK(send_command(&command) == UNI_NINA_RESPONSE_OK);
+    build_controller_command(&command, UNI_NINA_CMD_SET_RUMBLE, 2, rumble, sizeof(rumble));
+    BENCH_CHECK(send_command(&command) == UNI_NINA_RESPONSE_OK);
+    build_controller_command(&command, UNI_NINA_CMD_DISCONNECT, 3, NULL, 0);
+    BENCH_CHECK(send_command(&command) == UNI_NINA_RESPONSE_OK);
+    // Rejected: never reaches the Bluetooth task.
+    build_controller_command(&command, UNI_NINA_CMD_SET_PLAYER_LEDS, NUM_CONTROLLERS, leds, sizeof(leds));
+    BENCH_CHECK(send_command(&command) == UNI_NINA_RESPONSE_ERROR);
+
+    if (BENCH_CHECK(g_fake_bt.total_requests == 4)) {
+        const uni_nina_request_t* r = g_fake_bt.requests;
+        BENCH_CHECK(r[0].cmd == UNI_NINA_REQUEST_CMD_PLAYER_LEDS && r[0].controller_idx == 1 && r[0].args[0] == 0x05);
+        BENCH_CHECK(r[1].cmd == UNI_NINA_REQUEST_CMD_LIGHTBAR_COLOR && r[1].controller_idx == 0 &&
+                    r[1].args[0] == 0xff && r[1].args[1] == 0x80 && r[1].args[2] == 0x00);
+        BENCH_CHECK(r[2].cmd == UNI_NINA_REQUEST_CMD_RUMBLE && r[2].controller_idx == 2 && r[2].args[0] == 0x80 &&
+                    r[2].args[1] == 0x20);
+        BENCH_CHECK(r[3].cmd == UNI_NINA_REQUEST_CMD_DISCONNECT && r[3].controller_idx == 3);
+    }
+
+    // No idx: the parameter is "enabled".
+    g_fake_bt.connections_enabled = true;
+    build_controller_command(&command, UNI_NINA_CMD_ENABLE_BT_CONNECTIONS, false, NULL, 0);
+    BENCH_CHECK(send_command(&command) == UNI_NINA_RESPONSE_OK);
+    BENCH_CHECK(!g_fake_bt.connections_enabled);
+
+    command_begin(&command, UNI_NINA_CMD_FORGET_BT_KEYS);
+    command_end(&command);
+    BENCH_CHECK(send_command(&command) == UNI_NINA_RESPONSE_OK);
+    BENCH_CHECK(g_fake_bt.forget_keys == 1);
+}
+
+// Random updates, connections and lost responses. After each poll, what the host decoded must match v1.
+static void check_nina_v2(int polls) {
+    uni_nina_controller_t truth[NUM_CONTROLLERS];
+    nina_host_t host;
+    nina_buffer_t command;
+    nina_buffer_t response;
+    int mismatches = 0;
+    int full_responses = 0;
+
+    protocol_init();
+    sim_init(&g_sim);
+    bench_srand(0x2222);
+    memset(&host, 0, sizeof(host));
+
+    BENCH_CHECK(negotiate_protocol(UNI_NINA_PROTOCOL_V2_VERSION_HI) == UNI_NINA_PROTOCOL_V2_VERSION_HI);
+    for (int i = 0; i < NUM_CONTROLLERS - 1; i++)
+        sim_connect(&g_sim, i);
+
+    for (int poll = 0; poll < polls; poll++) {
+        uint32_t r = bench_rand();
+        int i = r % NUM_CONTROLLERS;
+
+        if ((r & 0xff00) == 0) {
+            // Controllers come and go. New ones take the first free seat.
+            if (g_sim.seats & BIT(i)) {
+                sim_disconnect(&g_sim, i);
+            } else {
+                int free_seat = 0;
+                while (g_sim.seats & BIT(free_seat))
+                    free_seat++;
+                sim_connect(&g_sim, free_seat);
+            }
+        } else if (g_sim.seats & BIT(i)) {
+            sim_update(&g_sim, i);
+        }
+
+        host_build_changes_command(&host, &command);
+        transfer(&command, &response);
+
+        // Lost response: the host keeps what it had, and the next one must be a full one.
+        if ((r & 0xff0000) == 0)
+            continue;
+
+        if (!BENCH_CHECK(host_apply_changes(&host, &response)))
+            break;
+        if (response.data[7] & UNI_NINA_V2_FLAG_FULL)
+            full_responses++;
+
+        int seats = read_ground_truth(truth);
+        if (seats != host.seats) {
+            mismatches++;
+            continue;
+        }
+        for (int c = 0; c < NUM_CONTROLLERS; c++) {
+            if ((seats & BIT(c)) && !controllers_equal(&truth[c], &host.controllers[c]))
+                mismatches++;
+        }
+    }
+
+    BENCH_CHECK(mismatches == 0);
+    // One per lost response.
+    BENCH_CHECK(full_responses > 0);
+
+    // Going back to v1 is always possible.
+    BENCH_CHECK(negotiate_protocol(0) == UNI_NINA_PROTOCOL_VERSION_HI);
+    host_build_changes_command(&host, &command);
+    BENCH_CHECK(transfer(&command, &response) == 3 && response.data[0] == UNI_NINA_CMD_ERR);
+
+    sim_deinit(&g_sim);
+}
+
+static void check_nina_batch(void) {
+    nina_buffer_t command;
+    nina_buffer_t response;
+    nina_host_t host;
+    int len = 0;
+
+    // Sub-commands: command, number of parameters, and parameters.
+    const uint8_t leds[] = {UNI_NINA_CMD_SET_PLAYER_LEDS, 2, 1, 0, 1, 0x0f};
+    const uint8_t rumble[] = {UNI_NINA_CMD_SET_RUMBLE, 2, 1, 1, 2, 0x40, 0x10};
+    const uint8_t changes[] = {UNI_NINA_CMD_CONTROLLERS_CHANGES, 1, 2, 0x00, 0x00};
+    const uint8_t nested[] = {UNI_NINA_CMD_BATCH, 0};
+
+    protocol_init();
+    sim_init(&g_sim);
+    memset(&host, 0, sizeof(host));
+    BENCH_CHECK(negotiate_protocol(UNI_NINA_PROTOCOL_V2_VERSION_HI) == UNI_NINA_PROTOCOL_V2_VERSION_HI);
+    sim_connect(&g_sim, 0);
+    sim_connect(&g_sim, 1);
+
+    command_begin(&command, UNI_NINA_CMD_BATCH);
+    command_add_param(&command, leds, sizeof(leds));
+    command_add_param(&command, rumble, sizeof(rumble));
+    command_add_param(&command, changes, sizeof(changes));
+    command_add_param(&command, nested, sizeof(nested));
+    command_end(&command);
+    transfer(&command, &response);
+
+    if (!BENCH_CHECK(response_is_valid(&response, UNI_NINA_CMD_BATCH) && response.data[2] == 4)) {
+        sim_deinit(&g_sim);
+        return;
+    }
+
+    const uint8_t* reply = response_get_param(&response, 0, &len);
+    BENCH_CHECK(reply != NULL && len == 4 && reply[0] == (UNI_NINA_CMD_SET_PLAYER_LEDS | UNI_NINA_CMD_REPLY_FLAG) &&
+                reply[3] == UNI_NINA_RESPONSE_OK);
+    reply = response_get_param(&response, 1, &len);
+    BENCH_CHECK(reply != NULL && len == 4 && reply[0] == (UNI_NINA_CMD_SET_RUMBLE | UNI_NINA_CMD_REPLY_FLAG) &&
+                reply[3] == UNI_NINA_RESPONSE_OK);
+    BENCH_CHECK(g_fake_bt.total_requests == 2);
+    BENCH_CHECK(g_fake_bt.requests[0].cmd == UNI_NINA_REQUEST_CMD_PLAYER_LEDS);
+    BENCH_CHECK(g_fake_bt.requests[1].cmd == UNI_NINA_REQUEST_CMD_RUMBLE && g_fake_bt.requests[1].args[0] == 0x40);
+
+    // The reply of "controllers changes" is a response on its own: decoded like one.
+    reply = response_get_param(&response, 2, &len);
+    if (BENCH_CHECK(reply != NULL && reply[0] == (UNI_NINA_CMD_CONTROLLERS_CHANGES | UNI_NINA_CMD_REPLY_FLAG))) {
+        nina_buffer_t sub;
+        memset(&sub, 0, sizeof(sub));
+        sub.data[0] = UNI_NINA_CMD_START;
+        memcpy(&sub.data[1], reply, len);
+        sub.data[len + 1] = UNI_NINA_CMD_END;
+        sub.len = len + 2;
+        BENCH_CHECK(host_apply_changes(&host, &sub));
+        BENCH_CHECK(host.seats == (BIT(0) | BIT(1)));
+    }
+
+    // Batches can't be nested.
+    reply = response_get_param(&response, 3, &len);
+    BENCH_CHECK(reply != NULL && len == 1 && reply[0] == UNI_NINA_CMD_ERR);
+
+    sim_deinit(&g_sim);
+}
+
+// More commands than what fits in the response: the ones that don't fit are not executed, and run only once
+// when the host sends them again.
+static void check_nina_batch_overflow(void) {
+    nina_buffer_t command;
+    nina_buffer_t response;
+    int len = 0;
+
+    const uint8_t data[] = {UNI_NINA_CMD_CONTROLLERS_DATA, 0};
+    const uint8_t rumble[] = {UNI_NINA_CMD_SET_RUMBLE, 2, 1, 0, 2, 0x40, 0x10};
+    // As many as fit in the command.
+    const int total_rumbles = (UNI_NINA_PROTOCOL_BUFFER_LEN - 4 - (1 + sizeof(data))) / (1 + sizeof(rumble));
+
+    protocol_init();
+    sim_init(&g_sim);
+    BENCH_CHECK(negotiate_protocol(UNI_NINA_PROTOCOL_V2_VERSION_HI) == UNI_NINA_PROTOCOL_V2_VERSION_HI);
+    sim_connect(&g_sim, 0);
+    sim_connect(&g_sim, 1);
+
+    command_begin(&command, UNI_NINA_CMD_BATCH);
+    command_add_param(&command, data, sizeof(data));
+    for (int i = 0; i < total_rumbles; i++)
+        command_add_param(&command, rumble, sizeof(rumble));
+    command_end(&command);
+    transfer(&command, &response);
+
+    if (!BENCH_CHECK(response_is_valid(&response, UNI_NINA_CMD_BATCH))) {
+        sim_deinit(&g_sim);
+        return;
+    }
+    int executed = response.data[2];
+    BENCH_CHECK(executed > 1 && executed < 1 + total_rumbles);
+    // Executed ones succeeded, and only them reached the Bluetooth side.
+    BENCH_CHECK(g_fake_bt.total_requests == executed - 1);
+    for (int i = 1; i < executed; i++) {
+        const uint8_t* reply = response_get_param(&response, i, &len);
+        BENCH_CHECK(reply != NULL && len == 4 && reply[0] == (UNI_NINA_CMD_SET_RUMBLE | UNI_NINA_CMD_REPLY_FLAG) &&
+                    reply[3] == UNI_NINA_RESPONSE_OK);
+    }
+
+    // The host sends the rest again.
+    int pending = total_rumbles - (executed - 1);
+    command_begin(&command, UNI_NINA_CMD_BATCH);
+    for (int i = 0; i < pending; i++)
+        command_add_param(&command, rumble, sizeof(rumble));
+    command_end(&command);
+    transfer(&command, &response);
+    BENCH_CHECK(response_is_valid(&response, UNI_NINA_CMD_BATCH) && response.data[2] == pending);
+    BENCH_CHECK(g_fake_bt.total_requests == total_rumbles);
+
+    sim_deinit(&g_sim);
+}
+
+//
+// Benchmarks
+//
+// Bytes per poll of a 4 controllers game: each poll sees one report of each controller.
+static void measure_bytes_per_poll(int polls) {
+    nina_host_t host;
+    nina_buffer_t command;
+    nina_buffer_t response;
+    uint64_t v1_bytes = 0;
+    uint64_t v2_bytes = 0;
+    uint64_t v2_idle_bytes = 0;
+
+    protocol_init();
+    sim_init(&g_sim);
+    bench_srand(0x3333);
+    memset(&host, 0, sizeof(host));
+    BENCH_CHECK(negotiate_protocol(UNI_NINA_PROTOCOL_V2_VERSION_HI) == UNI_NINA_PROTOCOL_V2_VERSION_HI);
+    for (int i = 0; i < NUM_CONTROLLERS; i++)
+        sim_connect(&g_sim, i);
+
+    for (int poll = 0; poll < polls; poll++) {
+        for (int i = 0; i < NUM_CONTROLLERS; i++)
+            sim_update(&g_sim, i);
+
+        // Both responses are for the same data. v1 can be sent with no changes to v2 state.
+        build_controllers_data_command(&command);
+        v1_bytes += command.len + transfer(&command, &response);
+
+        host_build_changes_command(&host, &command);
+        v2_bytes += command.len + transfer(&command, &response);
+        host_apply_changes(&host, &response);
+
+        // Nothing changed since the previous poll.
+        host_build_changes_command(&host, &command);
+        v2_idle_bytes += command.len + transfer(&command, &response);
+        host_apply_changes(&host, &response);
+    }
+
+    // Command + response.
+    bench_print_value("nina/bytes per poll v1", "%10.1f", (double)v1_bytes / polls);
+    bench_print_value("nina/bytes per poll v2", "%10.1f", (double)v2_bytes / polls);
+    bench_print_value("nina/bytes per poll v2 (idle)", "%10.1f", (double)v2_idle_bytes / polls);
+
+    sim_deinit(&g_sim);
+}
+
+static void run_nina_set_controller_data(void* context, uint64_t iterations) {
+    nina_sim_t* sim = context;
+
+    for (uint64_t i = 0; i < iterations; i++)
+        sim_update(sim, i % NUM_CONTROLLERS);
+    bench_sink = sim->controllers[0].gamepad.buttons;
+}
+
+static void run_nina_controllers_data(void* context, uint64_t iterations) {
+    nina_buffer_t command;
+    nina_buffer_t response;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    build_controllers_data_command(&command);
+    for (uint64_t i = 0; i < iterations; i++)
+        acc += transfer(&command, &response);
+    bench_sink = acc;
+}
+
+// What the SPI driver does: no handler, no copy.
+static void run_nina_controllers_frame(void* context, uint64_t iterations) {
+    uint32_t acc = 0;
+    int len;
+    ARG_UNUSED(context);
+
+    for (uint64_t i = 0; i < iterations; i++)
+        acc += uni_nina_protocol_get_controllers_frame(&len)[len - 2];
+    bench_sink = acc;
+}
+
+// One controller changes between polls.
+static void run_nina_controllers_changes(void* context, uint64_t iterations) {
+    nina_sim_t* sim = context;
+    nina_host_t host;
+    nina_buffer_t command;
+    nina_buffer_t response;
+
+    memset(&host, 0, sizeof(host));
+    for (uint64_t i = 0; i < iterations; i++) {
+        sim_update(sim, i % NUM_CONTROLLERS);
+        host_build_changes_command(&host, &command);
+        transfer(&command, &response);
+        host_apply_changes(&host, &response);
+    }
+    bench_sink = host.seq;
+}
+
+// LEDs, rumble and the changes in one transaction.
+static void run_nina_batch(void* context, uint64_t iterations) {
+    const uint8_t leds[] = {UNI_NINA_CMD_SET_PLAYER_LEDS, 2, 1, 0, 1, 0x0f};
+    const uint8_t rumble[] = {UNI_NINA_CMD_SET_RUMBLE, 2, 1, 1, 2, 0x40, 0x10};
+    const uint8_t changes[] = {UNI_NINA_CMD_CONTROLLERS_CHANGES, 1, 2, 0x00, 0x00};
+    nina_buffer_t command;
+    nina_buffer_t response;
+    uint32_t acc = 0;
+    ARG_UNUSED(context);
+
+    command_begin(&command, UNI_NINA_CMD_BATCH);
+    command_add_param(&command, leds, sizeof(leds));
+    command_add_param(&command, rumble, sizeof(rumble));
+    command_add_param(&command, changes, sizeof(changes));
+    command_end(&command);
+    for (uint64_t i = 0; i < iterations; i++) {
+        // The fake queue is never full.
+        g_fake_bt.total_requests = 0;
+        acc += transfer(&command, &response);
+    }
+    bench_sink = acc;
+}
+
+//
+// Worst case latency: the Bluetooth side publishes as fast as it can from another thread, like CPU0 does,
+// while the SPI side polls. Each poll is measured on its own.
+//
+static uint64_t get_time_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void* producer_thread(void* arg) {
+    nina_producer_t* p = arg;
+
+    while (!__atomic_load_n(&p->stop, __ATOMIC_RELAXED)) {
+        sim_update(p->sim, p->updates % NUM_CONTROLLERS);
+        p->updates++;
+    }
+    return NULL;
+}
+
+static void measure_latency(const char* name, bool v2, int polls) {
+    nina_producer_t producer = {.sim = &g_sim};
+    nina_host_t host;
+    nina_buffer_t command;
+    nina_buffer_t response;
+    pthread_t thread;
+    uint64_t total_ns = 0;
+    uint64_t max_ns = 0;
+    int errors = 0;
+
+    if (!bench_should_run(name))
+        return;
+
+    memset(&host, 0, sizeof(host));
+    BENCH_CHECK(negotiate_protocol(v2 ? UNI_NINA_PROTOCOL_V2_VERSION_HI : 0) > 0);
+    if (!BENCH_CHECK(pthread_create(&thread, NULL, producer_thread, &producer) == 0))
+        return;
+
+    for (int i = 0; i < polls; i++) {
+        if (v2)
+            host_build_changes_command(&host, &command);
+        else
+            build_controllers_data_command(&command);
+
+        uint64_t start = get_time_ns();
+        transfer(&command, &response);
+        uint64_t elapsed = get_time_ns() - start;
+
+        total_ns += elapsed;
+        if (elapsed > max_ns)
+            max_ns = elapsed;
+        if (v2 && !host_apply_changes(&host, &response))
+            errors++;
+        else if (!v2 && response.data[0] != UNI_NINA_CMD_START)
+            errors++;
+    }
+
+    __atomic_store_n(&producer.stop, true, __ATOMIC_RELAXED);
+    pthread_join(thread, NULL);
+
+    BENCH_CHECK(errors == 0);
+    bench_print_value(name, "%10.1f ns mean, %10llu ns max, %llu updates", (double)total_ns / polls,
+                      (unsigned long long)max_ns, (unsigned long long)producer.updates);
+}
+
+void bench_nina(void) {
+    uint64_t iterations = bench_get_options()->iterations;
+
+    if (bench_should_run("nina/check")) {
+        check_nina_v1();
+        check_nina_requests();
+        check_nina_v2(iterations / 10 + 1000);
+        check_nina_batch();
+        check_nina_batch_overflow();
+    }
+
+    measure_bytes_per_poll(10000);
+
+    protocol_init();
+    sim_init(&g_sim);
+    bench_srand(0x4444);
+    for (int i = 0; i < NUM_CONTROLLERS; i++)
+        sim_connect(&g_sim, i);
+
+    // Bluetooth side
+    bench_run("nina/set controller data", run_nina_set_controller_data, &g_sim, iterations);
+
+    // SPI side
+    bench_run("nina/controllers data v1", run_nina_controllers_data, NULL, iterations);
+    bench_run("nina/controllers frame v1", run_nina_controllers_frame, NULL, iterations);
+    negotiate_protocol(UNI_NINA_PROTOCOL_V2_VERSION_HI);
+    bench_run("nina/controllers changes v2", run_nina_controllers_changes, &g_sim, iterations);
+    bench_run("nina/batch v2", run_nina_batch, NULL, iterations);
+
+    measure_latency("nina/latency v1 (contended)", false, iterations / 10 + 1);
+    measure_latency("nina/latency v2 (contended)", true, iterations / 10 + 1);
+
+    sim_deinit(&g_sim);
+}
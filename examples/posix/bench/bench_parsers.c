@@ -0,0 +1,887 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// Parsers: cost of uni_hid_parse_input_report() for each parser, with representative reports.
+// Devices go through the real parser setup, answered by the models, so the parsers are in the
+// same state as with the real controllers.
+
+#include <stdio.h>
+#include <string.h>
+
+#include <btstack_util.h>
+
+#include "bench.h"
+
+// Class of Device: Peripheral + Gamepad / Keyboard / Mouse
+#define COD_GAMEPAD 0x002508
+#define COD_KEYBOARD 0x002540
+#define COD_MOUSE 0x002580
+
+// Reports are generated once, and then parsed in a loop.
+// 256 frames, since the models repeat their pattern every 256 frames.
+#define NUM_FRAMES 256
+
+// Triangle wave: 0 -> 254 -> 0 in 256 frames.
+static uint8_t wave(uint32_t frame) {
+    uint8_t t = frame & 0xff;
+    return (t < 128) ? t * 2 : (255 - t) * 2;
+}
+
+//
+// Models not emulated by the virtual HCI transport
+//
+
+// DualShock 3
+#define DS3_INPUT_REPORT_SIZE 49
+
+static uint16_t ds3_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    ARG_UNUSED(vc);
+
+    memset(report, 0, DS3_INPUT_REPORT_SIZE);
+    report[0] = 0x01;
+    // Buttons: d-pad, and cross
+    report[2] = 0x10 << ((frame / 32) % 4);
+    report[3] = (frame & 0x10) ? 0x40 : 0;
+    // Sticks
+    report[6] = wave(frame);
+    report[7] = wave(frame + 64);
+    report[8] = 0x80;
+    report[9] = 0x80;
+    // L2 / R2
+    report[18] = wave(frame + 128);
+    report[19] = wave(frame + 192);
+    // Charge, battery: full
+    report[29] = 0x03;
+    report[30] = 0x05;
+    return DS3_INPUT_REPORT_SIZE;
+}
+
+// Wii U Pro Controller: a Wii Remote (2nd gen) with the "Pro Controller" extension.
+#define WII_OUTPUT_REQ_STATUS 0x15
+#define WII_OUTPUT_WRITE_MEM 0x16
+#define WII_OUTPUT_READ_MEM 0x17
+#define WII_INPUT_STATUS 0x20
+#define WII_INPUT_READ_MEM 0x21
+#define WII_INPUT_ACK 0x22
+#define WII_INPUT_DRM_KEE 0x34
+#define WII_INPUT_REPORT_SIZE 22
+
+static void wii_store_stick(uint8_t* out, uint8_t v) {
+    // 12-bit, centered at 2048
+    little_endian_store_16(out, 0, 2048 - 1024 + v * 8);
+}
+
+static uint16_t wii_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    ARG_UNUSED(vc);
+
+    memset(report, 0, WII_INPUT_REPORT_SIZE);
+    report[0] = WII_INPUT_DRM_KEE;
+    // Extension: LX, RX, LY, RY, and the buttons, low-active.
+    uint8_t* e = &report[3];
+    wii_store_stick(&e[0], wave(frame));
+    wii_store_stick(&e[2], 0x80);
+    wii_store_stick(&e[4], wave(frame + 64));
+    wii_store_stick(&e[6], 0x80);
+    e[8] = 0xff;
+    e[9] = (frame & 0x10) ? 0xef : 0xff;
+    e[10] = 0xcf;
+    return WII_INPUT_REPORT_SIZE;
+}
+
+static uint16_t wii_on_output_report(virtual_controller_t* vc, const uint8_t* data, uint16_t len, uint8_t* reply) {
+    ARG_UNUSED(vc);
+
+    switch (data[0]) {
+        case WII_OUTPUT_REQ_STATUS:
+            // Extension connected, battery high.
+            memset(reply, 0, 7);
+            reply[0] = WII_INPUT_STATUS;
+            reply[3] = 0x02;
+            reply[6] = 0xc0;
+            return 7;
+        case WII_OUTPUT_WRITE_MEM:
+            memset(reply, 0, 5);
+            reply[0] = WII_INPUT_ACK;
+            reply[3] = WII_OUTPUT_WRITE_MEM;
+            return 5;
+        case WII_OUTPUT_READ_MEM:
+            if (len < 7)
+                return 0;
+            // Only the extension id is read: 0xa400fa, 6 bytes.
+            memset(reply, 0, WII_INPUT_REPORT_SIZE);
+            reply[0] = WII_INPUT_READ_MEM;
+            reply[3] = ((data[6] - 1) << 4);
+            reply[4] = data[3];
+            reply[5] = data[4];
+            memcpy(&reply[6], (const uint8_t[]){0x00, 0x00, 0xa4, 0x20, 0x01, 0x20}, 6);
+            return WII_INPUT_REPORT_SIZE;
+        default:
+            // LEDs, report mode, rumble. Nothing to reply.
+            return 0;
+    }
+}
+
+// Steam Controller
+#define STEAM_INPUT_REPORT_SIZE 20
+
+static uint16_t steam_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    ARG_UNUSED(vc);
+
+    memset(report, 0, STEAM_INPUT_REPORT_SIZE);
+    report[0] = 0x03;
+    report[1] = 0xc0;
+    // Input report, with buttons, triggers, thumbstick and right pad.
+    report[2] = 0xb4;
+    report[3] = 0x02;
+    report[4] = (frame & 0x10) ? 0x80 : 0;
+    report[7] = wave(frame);
+    report[8] = wave(frame + 64);
+    little_endian_store_16(report, 12, (wave(frame) - 128) * 256);
+    little_endian_store_16(report, 14, (wave(frame + 64) - 128) * 256);
+    return STEAM_INPUT_REPORT_SIZE;
+}
+
+// PS Move (ZCM1)
+#define PSMOVE_INPUT_REPORT_SIZE 49
+
+static uint16_t psmove_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    ARG_UNUSED(vc);
+
+    memset(report, 0, PSMOVE_INPUT_REPORT_SIZE);
+    report[0] = 0x01;
+    // Buttons: triangle, circle, cross, square
+    report[2] = 0x10 << ((frame / 32) % 4);
+    // Trigger, two frames
+    report[5] = wave(frame);
+    report[6] = wave(frame);
+    // Battery: full
+    report[12] = 0x05;
+    // Accelerometer, two frames
+    for (int i = 0; i < 6; i++)
+        little_endian_store_16(report, 13 + i * 2, 0x8000 + wave(frame + i * 32) * 16);
+    return PSMOVE_INPUT_REPORT_SIZE;
+}
+
+// Keyboard. Report ID 1: modifiers, reserved, 6 keys.
+static const uint8_t keyboard_descriptor[] = {
+    0x05, 0x01,  // Usage Page (Generic Desktop)
+    0x09, 0x06,  // Usage (Keyboard)
+    0xa1, 0x01,  // Collection (Application)
+    0x85, 0x01,  //   Report ID (1)
+    0x05, 0x07,  //   Usage Page (Keyboard)
+    0x19, 0xe0,  //   Usage Minimum (Left Control)
+    0x29, 0xe7,  //   Usage Maximum (Right GUI)
+    0x15, 0x00,  //   Logical Minimum (0)
+    0x25, 0x01,  //   Logical Maximum (1)
+    0x75, 0x01,  //   Report Size (1)
+    0x95, 0x08,  //   Report Count (8)
+    0x81, 0x02,  //   Input (Data,Var,Abs)
+    0x95, 0x01,  //   Report Count (1)
+    0x75, 0x08,  //   Report Size (8)
+    0x81, 0x01,  //   Input (Const)
+    0x05, 0x08,  //   Usage Page (LEDs)
+    0x19, 0x01,  //   Usage Minimum (Num Lock)
+    0x29, 0x05,  //   Usage Maximum (Kana)
+    0x95, 0x05,  //   Report Count (5)
+    0x75, 0x01,  //   Report Size (1)
+    0x91, 0x02,  //   Output (Data,Var,Abs)
+    0x95, 0x01,  //   Report Count (1)
+    0x75, 0x03,  //   Report Size (3)
+    0x91, 0x01,  //   Output (Const)
+    0x05, 0x07,  //   Usage Page (Keyboard)
+    0x19, 0x00,  //   Usage Minimum (0)
+    0x29, 0x65,  //   Usage Maximum (101)
+    0x15, 0x00,  //   Logical Minimum (0)
+    0x25, 0x65,  //   Logical Maximum (101)
+    0x95, 0x06,  //   Report Count (6)
+    0x75, 0x08,  //   Report Size (8)
+    0x81, 0x00,  //   Input (Data,Array,Abs)
+    0xc0,        // End Collection
+};
+
+#define KEYBOARD_INPUT_REPORT_SIZE 9
+
+static uint16_t keyboard_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    // W, A, S, D
+    static const uint8_t keys[] = {0x1a, 0x04, 0x16, 0x07};
+    ARG_UNUSED(vc);
+
+    memset(report, 0, KEYBOARD_INPUT_REPORT_SIZE);
+    report[0] = 0x01;
+    // Left shift
+    report[1] = (frame & 0x40) ? 0x02 : 0;
+    report[3] = keys[(frame / 16) % 4];
+    // Space
+    report[4] = (frame & 0x08) ? 0x2c : 0;
+    return KEYBOARD_INPUT_REPORT_SIZE;
+}
+
+// Mouse. Report ID 1: 3 buttons, X, Y (16-bit, relative), wheel.
+static const uint8_t mouse_descriptor[] = {
+    0x05, 0x01,        // Usage Page (Generic Desktop)
+    0x09, 0x02,        // Usage (Mouse)
+    0xa1, 0x01,        // Collection (Application)
+    0x85, 0x01,        //   Report ID (1)
+    0x09, 0x01,        //   Usage (Pointer)
+    0xa1, 0x00,        //   Collection (Physical)
+    0x05, 0x09,        //     Usage Page (Button)
+    0x19, 0x01,        //     Usage Minimum (1)
+    0x29, 0x03,        //     Usage Maximum (3)
+    0x15, 0x00,        //     Logical Minimum (0)
+    0x25, 0x01,        //     Logical Maximum (1)
+    0x95, 0x03,        //     Report Count (3)
+    0x75, 0x01,        //     Report Size (1)
+    0x81, 0x02,        //     Input (Data,Var,Abs)
+    0x95, 0x01,        //     Report Count (1)
+    0x75, 0x05,        //     Report Size (5)
+    0x81, 0x03,        //     Input (Const)
+    0x05, 0x01,        //     Usage Page (Generic Desktop)
+    0x09, 0x30,        //     Usage (X)
+    0x09, 0x31,        //     Usage (Y)
+    0x16, 0x01, 0x80,  //     Logical Minimum (-32767)
+    0x26, 0xff, 0x7f,  //     Logical Maximum (32767)
+    0x75, 0x10,        //     Report Size (16)
+    0x95, 0x02,        //     Report Count (2)
+    0x81, 0x06,        //     Input (Data,Var,Rel)
+    0x09, 0x38,        //     Usage (Wheel)
+    0x15, 0x81,        //     Logical Minimum (-127)
+    0x25, 0x7f,        //     Logical Maximum (127)
+    0x75, 0x08,        //     Report Size (8)
+    0x95, 0x01,        //     Report Count (1)
+    0x81, 0x06,        //     Input (Data,Var,Rel)
+    0xc0,              //   End Collection
+    0xc0,              // End Collection
+};
+
+#define MOUSE_INPUT_REPORT_SIZE 7
+
+static uint16_t mouse_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    ARG_UNUSED(vc);
+
+    memset(report, 0, MOUSE_INPUT_REPORT_SIZE);
+    report[0] = 0x01;
+    report[1] = (frame & 0x20) ? 0x01 : 0;
+    little_endian_store_16(report, 2, (uint16_t)(wave(frame) - 127));
+    little_endian_store_16(report, 4, (uint16_t)(wave(frame + 64) - 127));
+    report[6] = (frame % 64 == 0) ? 0x01 : 0;
+    return MOUSE_INPUT_REPORT_SIZE;
+}
+
+static const virtual_controller_model_t ds3_model = {
+    .id = "ds3",
+    .name = "PLAYSTATION(R)3 Controller",
+    .cod = COD_GAMEPAD,
+    .vendor_id = 0x054c,
+    .product_id = 0x0268,
+    .get_input_report = ds3_get_input_report,
+};
+
+static const virtual_controller_model_t wii_model = {
+    .id = "wii",
+    .name = "Nintendo RVL-CNT-01-UC",
+    .cod = COD_GAMEPAD,
+    .vendor_id = 0x057e,
+    .product_id = 0x0330,
+    .get_input_report = wii_get_input_report,
+    .on_output_report = wii_on_output_report,
+};
+
+static const virtual_controller_model_t steam_model = {
+    .id = "steam",
+    .name = "SteamController",
+    .cod = COD_GAMEPAD,
+    .vendor_id = 0x28de,
+    .product_id = 0x1106,
+    .get_input_report = steam_get_input_report,
+};
+
+static const virtual_controller_model_t psmove_model = {
+    .id = "psmove",
+    .name = "Motion Controller",
+    .cod = COD_GAMEPAD,
+    .vendor_id = 0x054c,
+    .product_id = 0x03d5,
+    .get_input_report = psmove_get_input_report,
+};
+
+static const virtual_controller_model_t keyboard_model = {
+    .id = "keyboard",
+    .name = "Bluepad32 Virtual Keyboard",
+    .cod = COD_KEYBOARD,
+    .vendor_id = 0x1209,
+    .product_id = 0xb933,
+    .hid_descriptor = keyboard_descriptor,
+    .hid_descriptor_len = sizeof(keyboard_descriptor),
+    .get_input_report = keyboard_get_input_report,
+};
+
+static const virtual_controller_model_t mouse_model = {
+    .id = "mouse",
+    .name = "Bluepad32 Virtual Mouse",
+    .cod = COD_MOUSE,
+    .vendor_id = 0x1209,
+    .product_id = 0xb934,
+    .hid_descriptor = mouse_descriptor,
+    .hid_descriptor_len = sizeof(mouse_descriptor),
+    .get_input_report = mouse_get_input_report,
+};
+
+//
+// Cases
+//
+typedef struct {
+    const char* name;
+    // Either the id of a model of virtual_controllers.c, or a model defined here.
+    const char* virtual_model;
+    const virtual_controller_model_t* model;
+    uni_controller_type_t type;
+    uni_controller_class_t klass;
+    // The Steam setup needs GATT. Its devices are set as ready without it.
+    bool skip_setup;
+} parser_case_t;
+
+static const parser_case_t cases[] = {
+    {"ds3", NULL, &ds3_model, CONTROLLER_TYPE_PS3Controller, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"ds4", "ds4", NULL, CONTROLLER_TYPE_PS4Controller, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"ds5", "ds5", NULL, CONTROLLER_TYPE_PS5Controller, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"switch", "switch", NULL, CONTROLLER_TYPE_SwitchProController, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"wii", NULL, &wii_model, CONTROLLER_TYPE_WiiController, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"xboxone", "xbox", NULL, CONTROLLER_TYPE_XBoxOneController, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"steam", NULL, &steam_model, CONTROLLER_TYPE_SteamController, UNI_CONTROLLER_CLASS_GAMEPAD, true},
+    {"psmove", NULL, &psmove_model, CONTROLLER_TYPE_PSMoveController, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"android", "generic", NULL, CONTROLLER_TYPE_AndroidController, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"generic", "generic", NULL, CONTROLLER_TYPE_GenericController, UNI_CONTROLLER_CLASS_GAMEPAD, false},
+    {"keyboard", NULL, &keyboard_model, CONTROLLER_TYPE_GenericKeyboard, UNI_CONTROLLER_CLASS_KEYBOARD, false},
+    {"mouse", NULL, &mouse_model, CONTROLLER_TYPE_GenericMouse, UNI_CONTROLLER_CLASS_MOUSE, false},
+};
+
+typedef struct {
+    uni_hid_device_t* d;
+    uint16_t lens[NUM_FRAMES];
+    uint8_t reports[NUM_FRAMES][VIRTUAL_CONTROLLER_MAX_REPORT_SIZE];
+} parser_run_t;
+
+static parser_run_t g_run;
+
+//
+// Compiled HID descriptors: same fields as btstack_hid_parser
+//
+
+// A field, as received by parse_usage().
+typedef struct {
+    uint16_t usage_page;
+    uint16_t usage;
+    int32_t value;
+    int32_t logical_minimum;
+    int32_t logical_maximum;
+    uint8_t report_size;
+} decoded_field_t;
+
+#define MAX_DECODED_FIELDS 512
+
+typedef struct {
+    int count;
+    decoded_field_t fields[MAX_DECODED_FIELDS];
+} decoded_report_t;
+
+static decoded_report_t g_expected;
+static decoded_report_t g_decoded;
+static decoded_report_t* g_decoding;
+// Number of reports compared. Printed at the end.
+static int g_compared_reports;
+
+static void decode_usage(struct uni_hid_device_s* d,
+                         hid_globals_t* globals,
+                         uint16_t usage_page,
+                         uint16_t usage,
+                         int32_t value) {
+    ARG_UNUSED(d);
+    if (g_decoding->count >= MAX_DECODED_FIELDS)
+        return;
+    decoded_field_t* f = &g_decoding->fields[g_decoding->count++];
+    // Zeroed, including the padding, so that the fields can be compared with memcmp().
+    memset(f, 0, sizeof(*f));
+    f->usage_page = usage_page;
+    f->usage = usage;
+    f->value = value;
+    f->logical_minimum = globals->logical_minimum;
+    f->logical_maximum = globals->logical_maximum;
+    f->report_size = globals->report_size;
+}
+
+// Same as the slow path of uni_hid_parse_input_report().
+static void decode_with_btstack(const uint8_t* descriptor,
+                                uint16_t descriptor_len,
+                                const uint8_t* report,
+                                uint16_t len,
+                                decoded_report_t* out) {
+    btstack_hid_parser_t parser;
+
+    out->count = 0;
+    g_decoding = out;
+    btstack_hid_parser_init(&parser, descriptor, descriptor_len, HID_REPORT_TYPE_INPUT, report, len);
+    while (btstack_hid_parser_has_more(&parser)) {
+        uint16_t usage_page;
+        uint16_t usage;
+        int32_t value;
+        hid_globals_t globals;
+
+        memset(&globals, 0, sizeof(globals));
+        globals.logical_minimum = parser.global_logical_minimum;
+        globals.logical_maximum = parser.global_logical_maximum;
+        globals.report_size = parser.global_report_size;
+        btstack_hid_parser_get_field(&parser, &usage_page, &usage, &value);
+        decode_usage(NULL, &globals, usage_page, usage, value);
+    }
+}
+
+static void decode_with_plan(const uni_hid_plan_t* plan, const uint8_t* report, uint16_t len, decoded_report_t* out) {
+    out->count = 0;
+    g_decoding = out;
+    uni_hid_plan_parse_report(plan, NULL, decode_usage, report, len);
+}
+
+// The report, and all its shorter versions, must give the same fields with the plan and with btstack_hid_parser.
+static bool is_same_decoding(const uni_hid_plan_t* plan,
+                             const uint8_t* descriptor,
+                             uint16_t descriptor_len,
+                             const uint8_t* report,
+                             uint16_t len) {
+    for (int l = len; l > 0; l--) {
+        decode_with_btstack(descriptor, descriptor_len, report, l, &g_expected);
+        decode_with_plan(plan, report, l, &g_decoded);
+        g_compared_reports++;
+        if (g_expected.count != g_decoded.count ||
+            memcmp(g_expected.fields, g_decoded.fields, g_decoded.count * sizeof(g_decoded.fields[0])) != 0) {
+            fprintf(stderr, "%d-byte report: %d fields, btstack_hid_parser: %d fields\n", l, g_decoded.count,
+                    g_expected.count);
+            return false;
+        }
+    }
+    return true;
+}
+
+static void run_parse(void* context, uint64_t iterations) {
+    parser_run_t* run = context;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uint32_t f = i % NUM_FRAMES;
+        uni_hid_parse_input_report(run->d, run->reports[f], run->lens[f]);
+    }
+    bench_sink = run->d->controller.gamepad.buttons;
+}
+
+// Whether the parser decoded anything. All the models move something in the first frames.
+static bool has_input(const uni_controller_t* ctl) {
+    switch (ctl->klass) {
+        case UNI_CONTROLLER_CLASS_GAMEPAD:
+            return ctl->gamepad.axis_x || ctl->gamepad.axis_y || ctl->gamepad.dpad || ctl->gamepad.buttons ||
+                   ctl->gamepad.throttle;
+        case UNI_CONTROLLER_CLASS_MOUSE:
+            return ctl->mouse.delta_x || ctl->mouse.delta_y || ctl->mouse.buttons;
+        case UNI_CONTROLLER_CLASS_KEYBOARD:
+            return ctl->keyboard.modifiers || ctl->keyboard.pressed_keys[0];
+        default:
+            return false;
+    }
+}
+
+static void run_case(const parser_case_t* c) {
+    char name[64];
+    virtual_controller_t vc;
+
+    snprintf(name, sizeof(name), "parser/%s", c->name);
+    if (!bench_should_run(name))
+        return;
+
+    const virtual_controller_model_t* model = c->model;
+    if (c->virtual_model)
+        model = virtual_controller_find_model(c->virtual_model);
+    if (!BENCH_CHECK(model != NULL))
+        return;
+
+    memset(&g_run, 0, sizeof(g_run));
+    g_run.d = bench_device_create(model, c->type);
+    if (!BENCH_CHECK(g_run.d != NULL))
+        return;
+
+    uni_hid_device_t* d = g_run.d;
+    bool ready;
+    if (c->skip_setup) {
+        ready = bench_device_set_ready(d);
+        d->controller.klass = c->klass;
+    } else {
+        ready = bench_device_setup(d);
+    }
+    if (!bench_check(ready, "device ready", __FILE__, __LINE__)) {
+        fprintf(stderr, "%s: setup did not complete\n", name);
+        bench_device_delete(d);
+        return;
+    }
+
+    // Reports are generated by another instance of the model, already streaming.
+    virtual_controller_init(&vc, model, 0);
+    vc.report_mode = 0x30;
+    for (int i = 0; i < NUM_FRAMES; i++)
+        g_run.lens[i] = model->get_input_report(&vc, i, g_run.reports[i]);
+
+    bool decoded = false;
+    for (int i = 0; i < NUM_FRAMES; i++) {
+        uni_hid_parse_input_report(d, g_run.reports[i], g_run.lens[i]);
+        decoded |= has_input(&d->controller);
+    }
+    BENCH_CHECK(d->controller.klass == c->klass);
+    if (!bench_check(decoded, "decoded", __FILE__, __LINE__))
+        fprintf(stderr, "%s: reports were not decoded\n", name);
+
+    // The compiled HID descriptor must decode each report like btstack_hid_parser does:
+    // the same fields, and the same state once the parser processed them.
+    const uni_hid_plan_t* plan = uni_hid_descriptor_store_get_plan(d->hid_descriptor);
+    bool has_plan = d->report_parser.parse_usage && plan;
+    if (has_plan) {
+        uint16_t descriptor_len;
+        const uint8_t* descriptor = uni_hid_device_get_hid_descriptor(d, &descriptor_len);
+        for (int i = 0; i < NUM_FRAMES; i++) {
+            if (!bench_check(is_same_decoding(plan, descriptor, descriptor_len, g_run.reports[i], g_run.lens[i]),
+                             "same fields as btstack_hid_parser", __FILE__, __LINE__)) {
+                fprintf(stderr, "%s: frame %d decoded differently\n", name, i);
+                break;
+            }
+        }
+        for (int i = 0; i < NUM_FRAMES; i++) {
+            uni_controller_t expected;
+
+            uni_hid_descriptor_store_set_plans_enabled(false);
+            uni_hid_parse_input_report(d, g_run.reports[i], g_run.lens[i]);
+            memcpy(&expected, &d->controller, sizeof(expected));
+            uni_hid_descriptor_store_set_plans_enabled(true);
+            uni_hid_parse_input_report(d, g_run.reports[i], g_run.lens[i]);
+            if (!bench_check(memcmp(&expected, &d->controller, sizeof(expected)) == 0, "same as btstack_hid_parser",
+                             __FILE__, __LINE__)) {
+                fprintf(stderr, "%s: frame %d decoded differently\n", name, i);
+                break;
+            }
+        }
+    }
+
+    uint64_t iterations = bench_get_options()->iterations;
+    bench_run(name, run_parse, &g_run, iterations);
+
+    // Same reports, using btstack_hid_parser instead of the compiled HID descriptor.
+    if (has_plan) {
+        snprintf(name, sizeof(name), "parser/%s (btstack_hid_parser)", c->name);
+        uni_hid_descriptor_store_set_plans_enabled(false);
+        bench_run(name, run_parse, &g_run, iterations / 4);
+        uni_hid_descriptor_store_set_plans_enabled(true);
+    }
+
+    bench_device_delete(d);
+    bench_l2cap_pump();
+}
+
+//
+// Corner cases of the HID descriptors. Both the plan and btstack_hid_parser must decode them like this.
+//
+
+// Constant items with usages, a usage range smaller than the Report Count, and more fields than usages.
+static const uint8_t corner_items_descriptor[] = {
+    0x05, 0x01,        // Usage Page (Generic Desktop)
+    0x09, 0x30,        // Usage (X)
+    0x15, 0x00,        // Logical Minimum (0)
+    0x26, 0xff, 0x00,  // Logical Maximum (255)
+    0x75, 0x08,        // Report Size (8)
+    0x95, 0x01,        // Report Count (1)
+    0x81, 0x03,        // Input (Const,Var,Abs): skipped, even if it has a usage
+    0x09, 0x31,        // Usage (Y)
+    0x81, 0x02,        // Input (Data,Var,Abs)
+    0x05, 0x09,        // Usage Page (Button)
+    0x19, 0x01,        // Usage Minimum (0x01)
+    0x29, 0x04,        // Usage Maximum (0x04)
+    0x25, 0x01,        // Logical Maximum (1)
+    0x75, 0x01,        // Report Size (1)
+    0x95, 0x08,        // Report Count (8)
+    0x81, 0x02,        // Input (Data,Var,Abs): the last 4 fields have no usage, and are ignored
+    0x05, 0x01,        // Usage Page (Generic Desktop)
+    0x09, 0x32,        // Usage (Z)
+    0x09, 0x35,        // Usage (Rz)
+    0x26, 0xff, 0x00,  // Logical Maximum (255)
+    0x75, 0x08,        // Report Size (8)
+    0x95, 0x03,        // Report Count (3)
+    0x81, 0x02,        // Input (Data,Var,Abs): the 3rd field has no usage: the parsing stops
+    0x09, 0x33,        // Usage (Rx)
+    0x95, 0x01,        // Report Count (1)
+    0x81, 0x02,        // Input (Data,Var,Abs): not reported
+};
+
+// Usage pages, arrays, Push / Pop, and an item without usages.
+static const uint8_t corner_usages_descriptor[] = {
+    0x05, 0x01,                    // Usage Page (Generic Desktop)
+    0x09, 0x30,                    // Usage (X): Generic Desktop, the page when it is declared
+    0x05, 0x09,                    // Usage Page (Button)
+    0x09, 0x01,                    // Usage (0x01)
+    0x15, 0x00,                    // Logical Minimum (0)
+    0x25, 0x01,                    // Logical Maximum (1)
+    0x75, 0x01,                    // Report Size (1)
+    0x95, 0x02,                    // Report Count (2)
+    0x81, 0x02,                    // Input (Data,Var,Abs)
+    0x95, 0x06,                    // Report Count (6)
+    0x81, 0x01,                    // Input (Const,Array,Abs)
+    0x0b, 0x35, 0x00, 0x01, 0x00,  // Usage (Generic Desktop: Rz), 4-byte usage
+    0x15, 0x81,                    // Logical Minimum (-127)
+    0x25, 0x7f,                    // Logical Maximum (127)
+    0x75, 0x08,                    // Report Size (8)
+    0x95, 0x01,                    // Report Count (1)
+    0x81, 0x02,                    // Input (Data,Var,Abs)
+    0x05, 0x07,                    // Usage Page (Keyboard)
+    0x19, 0x00,                    // Usage Minimum (0x00)
+    0x29, 0x65,                    // Usage Maximum (0x65)
+    0x15, 0x00,                    // Logical Minimum (0)
+    0x25, 0x65,                    // Logical Maximum (101)
+    0x95, 0x02,                    // Report Count (2)
+    0x81, 0x00,                    // Input (Data,Array,Abs)
+    0x05, 0x01,                    // Usage Page (Generic Desktop)
+    0xa4,                          // Push: ignored by btstack_hid_parser
+    0x05, 0x09,                    // Usage Page (Button)
+    0xb4,                          // Pop: ignored by btstack_hid_parser
+    0x09, 0x02,                    // Usage (0x02): Button page
+    0x25, 0x01,                    // Logical Maximum (1)
+    0x75, 0x08,                    // Report Size (8)
+    0x95, 0x01,                    // Report Count (1)
+    0x81, 0x02,                    // Input (Data,Var,Abs)
+    0x81, 0x02,                    // Input (Data,Var,Abs): no usages, the parsing stops
+    0x09, 0x03,                    // Usage (0x03)
+    0x81, 0x02,                    // Input (Data,Var,Abs): not reported
+};
+
+// Two reports. The Report ID is not part of the fields.
+static const uint8_t corner_reports_descriptor[] = {
+    0x85, 0x01,        // Report ID (1)
+    0x05, 0x01,        // Usage Page (Generic Desktop)
+    0x09, 0x30,        // Usage (X)
+    0x09, 0x31,        // Usage (Y)
+    0x15, 0x81,        // Logical Minimum (-127)
+    0x25, 0x7f,        // Logical Maximum (127)
+    0x75, 0x08,        // Report Size (8)
+    0x95, 0x02,        // Report Count (2)
+    0x81, 0x02,        // Input (Data,Var,Abs)
+    0x85, 0x02,        // Report ID (2)
+    0x05, 0x09,        // Usage Page (Button)
+    0x19, 0x01,        // Usage Minimum (0x01)
+    0x29, 0x0c,        // Usage Maximum (0x0c)
+    0x15, 0x00,        // Logical Minimum (0)
+    0x25, 0x01,        // Logical Maximum (1)
+    0x75, 0x01,        // Report Size (1)
+    0x95, 0x0c,        // Report Count (12)
+    0x81, 0x02,        // Input (Data,Var,Abs)
+    0x95, 0x04,        // Report Count (4)
+    0x81, 0x03,        // Input (Const,Var,Abs)
+};
+
+typedef struct {
+    const char* name;
+    const uint8_t* descriptor;
+    uint16_t descriptor_len;
+} corner_case_t;
+
+static const corner_case_t corner_cases[] = {
+    {"items", corner_items_descriptor, sizeof(corner_items_descriptor)},
+    {"usages", corner_usages_descriptor, sizeof(corner_usages_descriptor)},
+    {"reports", corner_reports_descriptor, sizeof(corner_reports_descriptor)},
+};
+
+#define CORNER_CASE_RANDOM_REPORTS 1000
+#define CORNER_CASE_MAX_REPORT_LEN 12
+
+// Room for the tables of any plan: not limited by the HID descriptor store.
+static uint8_t g_plan_buffer[2048] __attribute__((aligned(4)));
+
+static bool is_field(const decoded_field_t* f, uint16_t usage_page, uint16_t usage, int32_t value) {
+    return f->usage_page == usage_page && f->usage == usage && f->value == value;
+}
+
+static void check_corner_cases(void) {
+    static const uint8_t items_report[] = {0x11, 0x22, 0xff, 0x33, 0x44, 0x55, 0x66};
+    static const uint8_t usages_report[] = {0x03, 0xfe, 0x04, 0x05, 0x01, 0x02, 0x03};
+    static const uint8_t reports_report[] = {0x02, 0x01, 0x08};
+    uni_hid_plan_t plan;
+    const decoded_field_t* f = g_decoded.fields;
+
+    // Constant items are skipped, the buttons without usage are ignored, and Rz is the last one.
+    if (BENCH_CHECK(uni_hid_plan_compile(&plan, g_plan_buffer, sizeof(g_plan_buffer), corner_items_descriptor, sizeof(corner_items_descriptor)))) {
+        decode_with_plan(&plan, items_report, sizeof(items_report), &g_decoded);
+        BENCH_CHECK(g_decoded.count == 7);
+        BENCH_CHECK(is_field(&f[0], 0x01, 0x31, 0x22));
+        BENCH_CHECK(is_field(&f[1], 0x09, 0x01, 1) && is_field(&f[4], 0x09, 0x04, 1));
+        BENCH_CHECK(is_field(&f[5], 0x01, 0x32, 0x33) && is_field(&f[6], 0x01, 0x35, 0x44));
+
+        // Short report: the missing fields are still reported, as 0.
+        decode_with_plan(&plan, items_report, 2, &g_decoded);
+        BENCH_CHECK(g_decoded.count == 7);
+        BENCH_CHECK(is_field(&f[0], 0x01, 0x31, 0x22) && is_field(&f[1], 0x09, 0x01, 0));
+        BENCH_CHECK(is_field(&f[6], 0x01, 0x35, 0));
+
+        // The tables take only the bytes they need, and fail cleanly if they don't fit.
+        uint16_t tables_size = uni_hid_plan_get_tables_size(&plan);
+        BENCH_CHECK(uni_hid_plan_compile(&plan, g_plan_buffer, tables_size, corner_items_descriptor,
+                                         sizeof(corner_items_descriptor)));
+        BENCH_CHECK(!uni_hid_plan_compile(&plan, g_plan_buffer, tables_size - 1, corner_items_descriptor,
+                                          sizeof(corner_items_descriptor)));
+        BENCH_CHECK(!plan.valid);
+    }
+
+    // Usage page of the declaration, signed values, arrays, and Push / Pop ignored.
+    if (BENCH_CHECK(
+            uni_hid_plan_compile(&plan, g_plan_buffer, sizeof(g_plan_buffer), corner_usages_descriptor, sizeof(corner_usages_descriptor)))) {
+        decode_with_plan(&plan, usages_report, sizeof(usages_report), &g_decoded);
+        BENCH_CHECK(g_decoded.count == 6);
+        BENCH_CHECK(is_field(&f[0], 0x01, 0x30, 1) && is_field(&f[1], 0x09, 0x01, 1));
+        BENCH_CHECK(is_field(&f[2], 0x01, 0x35, -2));
+        BENCH_CHECK(is_field(&f[3], 0x07, 0x04, 1) && is_field(&f[4], 0x07, 0x05, 1));
+        BENCH_CHECK(is_field(&f[5], 0x09, 0x02, 1));
+    }
+
+    // Only the fields of the report.
+    if (BENCH_CHECK(
+            uni_hid_plan_compile(&plan, g_plan_buffer, sizeof(g_plan_buffer), corner_reports_descriptor, sizeof(corner_reports_descriptor)))) {
+        decode_with_plan(&plan, reports_report, sizeof(reports_report), &g_decoded);
+        BENCH_CHECK(g_decoded.count == 12);
+        BENCH_CHECK(is_field(&f[0], 0x09, 0x01, 1) && is_field(&f[1], 0x09, 0x02, 0));
+        BENCH_CHECK(is_field(&f[11], 0x09, 0x0c, 1));
+    }
+
+    // Random reports, of random lengths.
+    for (size_t i = 0; i < ARRAY_SIZE(corner_cases); i++) {
+        const corner_case_t* c = &corner_cases[i];
+        uint8_t report[CORNER_CASE_MAX_REPORT_LEN];
+
+        if (!BENCH_CHECK(uni_hid_plan_compile(&plan, g_plan_buffer, sizeof(g_plan_buffer), c->descriptor, c->descriptor_len)))
+            continue;
+        for (int r = 0; r < CORNER_CASE_RANDOM_REPORTS; r++) {
+            for (size_t j = 0; j < sizeof(report); j++)
+                report[j] = bench_rand();
+            // Valid Report IDs, most of the time.
+            if (plan.has_report_ids && (report[0] & 0x80) == 0)
+                report[0] = 1 + (report[0] & 0x01);
+            if (!bench_check(is_same_decoding(&plan, c->descriptor, c->descriptor_len, report, sizeof(report)),
+                             "same fields as btstack_hid_parser", __FILE__, __LINE__)) {
+                fprintf(stderr, "parser/corner cases: %s decoded differently\n", c->name);
+                break;
+            }
+        }
+    }
+}
+
+//
+// HID descriptor store
+//
+
+// Whether the plan of the store is the same as compiling the descriptor again.
+static bool is_same_plan(uni_hid_descriptor_handle_t handle) {
+    uni_hid_plan_t expected;
+    uint16_t len;
+
+    const uint8_t* data = uni_hid_descriptor_store_get_data(handle, &len);
+    const uni_hid_plan_t* plan = uni_hid_descriptor_store_get_plan(handle);
+    if (data == NULL || plan == NULL || !uni_hid_plan_compile(&expected, g_plan_buffer, sizeof(g_plan_buffer), data, len))
+        return false;
+    return plan->num_items == expected.num_items && plan->num_fields == expected.num_fields &&
+           plan->num_reports == expected.num_reports &&
+           memcmp(plan->items, expected.items, expected.num_items * sizeof(expected.items[0])) == 0 &&
+           memcmp(plan->fields, expected.fields, expected.num_fields * sizeof(expected.fields[0])) == 0 &&
+           memcmp(plan->reports, expected.reports, expected.num_reports * sizeof(expected.reports[0])) == 0;
+}
+
+static void check_descriptor_store(void) {
+    const virtual_controller_model_t* gamepad = virtual_controller_find_model("generic");
+    uni_hid_descriptor_store_stats_t base;
+    uni_hid_descriptor_store_stats_t stats;
+    uni_hid_descriptor_handle_t handles[4];
+    uint16_t len;
+
+    if (!BENCH_CHECK(gamepad != NULL && gamepad->hid_descriptor != NULL))
+        return;
+
+    // Devices of other benchmarks might still be connected.
+    uni_hid_descriptor_store_get_stats(&base);
+
+    // Same descriptor: stored and compiled once.
+    for (size_t i = 0; i < ARRAY_SIZE(handles); i++)
+        handles[i] = uni_hid_descriptor_store_acquire(gamepad->hid_descriptor, gamepad->hid_descriptor_len);
+    for (size_t i = 0; i < ARRAY_SIZE(handles); i++)
+        BENCH_CHECK(handles[i] != UNI_HID_DESCRIPTOR_HANDLE_INVALID && handles[i] == handles[0]);
+    uni_hid_descriptor_store_get_stats(&stats);
+    BENCH_CHECK(stats.entries == base.entries + 1 && stats.refs == base.refs + ARRAY_SIZE(handles));
+    uint16_t gamepad_size = stats.pool_used - base.pool_used;
+
+    uni_hid_descriptor_handle_t keyboard =
+        uni_hid_descriptor_store_acquire(keyboard_descriptor, sizeof(keyboard_descriptor));
+    uni_hid_descriptor_handle_t mouse = uni_hid_descriptor_store_acquire(mouse_descriptor, sizeof(mouse_descriptor));
+    BENCH_CHECK(keyboard != UNI_HID_DESCRIPTOR_HANDLE_INVALID && mouse != UNI_HID_DESCRIPTOR_HANDLE_INVALID);
+    BENCH_CHECK(keyboard != mouse && keyboard != handles[0]);
+    uni_hid_descriptor_store_get_stats(&stats);
+    BENCH_CHECK(stats.entries == base.entries + 3);
+    bench_print_value("parser/descriptor store (3 descriptors)", "%10d bytes", stats.pool_used - base.pool_used);
+
+    // The first one is released: the others are moved, and their plans must still work.
+    for (size_t i = 0; i < ARRAY_SIZE(handles); i++)
+        uni_hid_descriptor_store_release(handles[i]);
+    BENCH_CHECK(uni_hid_descriptor_store_get_plan(handles[0]) == NULL);
+    uni_hid_descriptor_store_get_stats(&stats);
+    uint16_t pool_used = stats.pool_used;
+    BENCH_CHECK(stats.entries == base.entries + 2 && stats.refs == base.refs + 2);
+
+    const uint8_t* data = uni_hid_descriptor_store_get_data(keyboard, &len);
+    BENCH_CHECK(len == sizeof(keyboard_descriptor) && memcmp(data, keyboard_descriptor, len) == 0);
+    data = uni_hid_descriptor_store_get_data(mouse, &len);
+    BENCH_CHECK(len == sizeof(mouse_descriptor) && memcmp(data, mouse_descriptor, len) == 0);
+    BENCH_CHECK(is_same_plan(keyboard));
+    BENCH_CHECK(is_same_plan(mouse));
+
+    // Takes the same room as before.
+    handles[0] = uni_hid_descriptor_store_acquire(gamepad->hid_descriptor, gamepad->hid_descriptor_len);
+    BENCH_CHECK(is_same_plan(handles[0]));
+    uni_hid_descriptor_store_get_stats(&stats);
+    BENCH_CHECK(stats.pool_used == pool_used + gamepad_size);
+
+    uni_hid_descriptor_store_release(handles[0]);
+    uni_hid_descriptor_store_release(keyboard);
+    uni_hid_descriptor_store_release(mouse);
+    uni_hid_descriptor_store_get_stats(&stats);
+    BENCH_CHECK(stats.entries == base.entries && stats.pool_used == base.pool_used);
+}
+
+// Like a second gamepad of the same model: the descriptor is already in the store.
+static void run_descriptor_store_acquire(void* context, uint64_t iterations) {
+    const virtual_controller_model_t* model = context;
+    uint32_t acc = 0;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uni_hid_descriptor_handle_t handle =
+            uni_hid_descriptor_store_acquire(model->hid_descriptor, model->hid_descriptor_len);
+        acc += handle;
+        uni_hid_descriptor_store_release(handle);
+    }
+    bench_sink = acc;
+}
+
+void bench_parsers(void) {
+    for (size_t i = 0; i < ARRAY_SIZE(cases); i++)
+        run_case(&cases[i]);
+
+    if (bench_should_run("parser/corner cases"))
+        check_corner_cases();
+    bench_print_value("parser/reports decoded like btstack_hid_parser", "%10d", g_compared_reports);
+
+    if (bench_should_run("parser/descriptor store"))
+        check_descriptor_store();
+
+    const virtual_controller_model_t* model = virtual_controller_find_model("generic");
+    if (model && bench_should_run("parser/descriptor store acquire (shared)")) {
+        uni_hid_descriptor_handle_t handle =
+            uni_hid_descriptor_store_acquire(model->hid_descriptor, model->hid_descriptor_len);
+        bench_run("parser/descriptor store acquire (shared)", run_descriptor_store_acquire, (void*)model,
+                  bench_get_options()->iterations);
+        uni_hid_descriptor_store_release(handle);
+    }
+}
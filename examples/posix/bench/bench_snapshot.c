@@ -0,0 +1,185 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// Snapshot: the lock-free sharing between the Bluetooth task and the other tasks.
+// The check is a stress test with real threads: one producer and several consumers, like NINA,
+// where the SPI task runs on the other CPU.
+
+#include <pthread.h>
+#include <string.h>
+
+#include "bench.h"
+
+#define NUM_READERS 3
+
+// Same size as the NINA controllers, rounded up.
+typedef struct {
+    uint32_t words[14];
+} snapshot_data_t;
+
+typedef struct {
+    uni_snapshot_t snapshot;
+    snapshot_data_t shared;
+    // Set by the producer when it finishes.
+    bool done;
+    // Set to stop the producer before "writes".
+    bool stop;
+    uint64_t writes;
+} snapshot_test_t;
+
+typedef struct {
+    snapshot_test_t* test;
+    uint64_t reads;
+    uint64_t torn;
+    uint64_t out_of_order;
+    uint64_t failed_try_reads;
+} snapshot_reader_t;
+
+static snapshot_test_t g_test;
+
+// Written field by field, like NINA does, so that a torn read is likely to be caught.
+static void write_value(snapshot_test_t* t, uint32_t value) {
+    uni_snapshot_write_begin(&t->snapshot);
+    for (size_t i = 0; i < ARRAY_SIZE(t->shared.words); i++)
+        t->shared.words[i] = value;
+    uni_snapshot_write_end(&t->snapshot);
+}
+
+static void* producer_thread(void* arg) {
+    snapshot_test_t* t = arg;
+
+    for (uint64_t i = 1; i <= t->writes && !__atomic_load_n(&t->stop, __ATOMIC_RELAXED); i++)
+        write_value(t, (uint32_t)i);
+
+    __atomic_store_n(&t->done, true, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void* reader_thread(void* arg) {
+    snapshot_reader_t* r = arg;
+    snapshot_test_t* t = r->test;
+    snapshot_data_t copy;
+    uint32_t prev_value = 0;
+    uint32_t prev_seq = 0;
+
+    while (!__atomic_load_n(&t->done, __ATOMIC_ACQUIRE)) {
+        uint32_t seq = uni_snapshot_read(&t->snapshot, &copy, &t->shared, sizeof(copy));
+        r->reads++;
+
+        for (size_t i = 1; i < ARRAY_SIZE(copy.words); i++) {
+            if (copy.words[i] != copy.words[0]) {
+                r->torn++;
+                break;
+            }
+        }
+        // Values and sequences only go forward.
+        if (copy.words[0] < prev_value || seq < prev_seq)
+            r->out_of_order++;
+        prev_value = copy.words[0];
+        prev_seq = seq;
+
+        if (!uni_snapshot_try_read(&t->snapshot, &copy, &t->shared, sizeof(copy)))
+            r->failed_try_reads++;
+    }
+    return NULL;
+}
+
+static void check_snapshot_stress(uint64_t writes) {
+    pthread_t producer;
+    pthread_t readers[NUM_READERS];
+    snapshot_reader_t reader_args[NUM_READERS];
+    uint64_t reads = 0;
+    uint64_t failed_try_reads = 0;
+
+    memset(&g_test, 0, sizeof(g_test));
+    uni_snapshot_init(&g_test.snapshot);
+    g_test.writes = writes;
+
+    for (int i = 0; i < NUM_READERS; i++) {
+        memset(&reader_args[i], 0, sizeof(reader_args[i]));
+        reader_args[i].test = &g_test;
+        if (!BENCH_CHECK(pthread_create(&readers[i], NULL, reader_thread, &reader_args[i]) == 0))
+            return;
+    }
+    if (!BENCH_CHECK(pthread_create(&producer, NULL, producer_thread, &g_test) == 0)) {
+        // Stop the readers.
+        __atomic_store_n(&g_test.done, true, __ATOMIC_RELEASE);
+        for (int i = 0; i < NUM_READERS; i++)
+            pthread_join(readers[i], NULL);
+        return;
+    }
+
+    pthread_join(producer, NULL);
+    for (int i = 0; i < NUM_READERS; i++) {
+        pthread_join(readers[i], NULL);
+        BENCH_CHECK(reader_args[i].torn == 0);
+        BENCH_CHECK(reader_args[i].out_of_order == 0);
+        reads += reader_args[i].reads;
+        failed_try_reads += reader_args[i].failed_try_reads;
+    }
+
+    // The last value is the one that is read once the producer is done.
+    snapshot_data_t copy;
+    uint32_t seq = uni_snapshot_read(&g_test.snapshot, &copy, &g_test.shared, sizeof(copy));
+    BENCH_CHECK(copy.words[0] == (uint32_t)writes);
+    BENCH_CHECK(seq == (uint32_t)writes);
+
+    bench_print_value("core/snapshot stress reads", "%10llu", (unsigned long long)reads);
+    bench_print_value("core/snapshot stress failed try_reads", "%10llu", (unsigned long long)failed_try_reads);
+}
+
+static void run_snapshot_publish(void* context, uint64_t iterations) {
+    snapshot_test_t* t = context;
+    snapshot_data_t data;
+
+    memset(&data, 0, sizeof(data));
+    for (uint64_t i = 0; i < iterations; i++) {
+        data.words[0] = (uint32_t)i;
+        uni_snapshot_publish(&t->snapshot, &t->shared, &data, sizeof(data));
+    }
+    bench_sink = t->shared.words[0];
+}
+
+static void run_snapshot_read(void* context, uint64_t iterations) {
+    snapshot_test_t* t = context;
+    snapshot_data_t copy;
+    uint32_t acc = 0;
+
+    for (uint64_t i = 0; i < iterations; i++) {
+        uni_snapshot_read(&t->snapshot, &copy, &t->shared, sizeof(copy));
+        acc += copy.words[0];
+    }
+    bench_sink = acc;
+}
+
+// Producer running on another thread during the reads.
+static void run_snapshot_read_contended(void* context, uint64_t iterations) {
+    snapshot_test_t* t = context;
+    pthread_t producer;
+
+    t->done = false;
+    t->stop = false;
+    // Stopped once the measurement is done.
+    t->writes = UINT64_MAX;
+    if (pthread_create(&producer, NULL, producer_thread, t) != 0)
+        return;
+
+    run_snapshot_read(t, iterations);
+
+    __atomic_store_n(&t->stop, true, __ATOMIC_RELAXED);
+    pthread_join(producer, NULL);
+}
+
+void bench_snapshot(void) {
+    uint64_t iterations = bench_get_options()->iterations * 4;
+
+    if (bench_should_run("core/snapshot stress"))
+        check_snapshot_stress(iterations);
+
+    memset(&g_test, 0, sizeof(g_test));
+    uni_snapshot_init(&g_test.snapshot);
+    bench_run("core/snapshot publish", run_snapshot_publish, &g_test, iterations);
+    bench_run("core/snapshot read", run_snapshot_read, &g_test, iterations);
+    bench_run("core/snapshot read (contended)", run_snapshot_read_contended, &g_test, iterations);
+}
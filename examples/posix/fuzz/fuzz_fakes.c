@@ -0,0 +1,39 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// Fakes for the BTstack functions that need a running Bluetooth stack.
+// Same as the bench: linked with "--wrap=<function>". See CMakeLists.txt.
+// Replayed devices don't have L2CAP channels, so the reports sent by the parsers never reach L2CAP.
+
+#include <stdarg.h>
+#include <stdio.h>
+
+#include <btstack.h>
+
+#include "uni_common.h"
+
+gap_connection_type_t __wrap_gap_get_connection_type(hci_con_handle_t handle);
+void __wrap_uni_log(const char* fmt, ...);
+void __wrap_uni_logv(const char* fmt, va_list args);
+
+gap_connection_type_t __wrap_gap_get_connection_type(hci_con_handle_t handle) {
+    ARG_UNUSED(handle);
+    // HCI is not initialized. All the fuzzed devices are BR/EDR.
+    return GAP_CONNECTION_ACL;
+}
+
+// uni_log() calls uni_logv() from its own object file, where "--wrap" doesn't apply. Both are wrapped.
+void __wrap_uni_log(const char* fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    __wrap_uni_logv(fmt, args);
+    va_end(args);
+}
+
+void __wrap_uni_logv(const char* fmt, va_list args) {
+    // Formatted but not printed: bad format arguments are still caught, without slowing down the fuzzer.
+    char buf[256];
+    vsnprintf(buf, sizeof(buf), fmt, args);
+}
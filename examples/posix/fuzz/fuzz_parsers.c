@@ -0,0 +1,188 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// libFuzzer target for the report parsers. See README.md, "Fuzzing".
+//
+// The input is a capture (see uni_capture.h), replayed with uni_capture_replay_buffer(): DEVICE records
+// create a device with an arbitrary HID descriptor and run its parser setup, and the INPUT_REPORT /
+// FEATURE_REPORT records are fed to the parser. Real captures are valid inputs, and are used as the
+// seed corpus.
+//
+// When FUZZ_PARSER is defined, the controller type of the DEVICE records is replaced with the one
+// of that parser, so that the fuzzer only explores one parser. Otherwise the type of the capture is used.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <btstack_memory.h>
+#include <btstack_run_loop.h>
+#include <btstack_run_loop_posix.h>
+
+#include <uni.h>
+
+#include "parser/uni_hid_parser_stadia.h"
+
+typedef struct {
+    const char* name;
+    uni_controller_type_t type;
+    // Only for the parsers that are selected by VID/PID as well. 0 means "use the one of the capture".
+    uint16_t vendor_id;
+    uint16_t product_id;
+} fuzz_parser_t;
+
+#ifdef FUZZ_PARSER
+// One entry per parser in uni_hid_device_set_controller_type().
+static const fuzz_parser_t parsers[] = {
+    {"8bitdo", CONTROLLER_TYPE_8BitdoController, 0, 0},
+    {"android", CONTROLLER_TYPE_AndroidController, 0, 0},
+    {"atari", CONTROLLER_TYPE_AtariJoystick, 0, 0},
+    {"ds3", CONTROLLER_TYPE_PS3Controller, 0, 0},
+    {"ds4", CONTROLLER_TYPE_PS4Controller, 0, 0},
+    {"ds5", CONTROLLER_TYPE_PS5Controller, 0, 0},
+    {"generic", CONTROLLER_TYPE_GenericController, 0, 0},
+    {"icade", CONTROLLER_TYPE_iCadeController, 0, 0},
+    {"keyboard", CONTROLLER_TYPE_GenericKeyboard, 0, 0},
+    {"mouse", CONTROLLER_TYPE_GenericMouse, 0, 0},
+    {"nimbus", CONTROLLER_TYPE_NimbusController, 0, 0},
+    {"ouya", CONTROLLER_TYPE_OUYAController, 0, 0},
+    {"psmove", CONTROLLER_TYPE_PSMoveController, 0, 0},
+    {"smarttvremote", CONTROLLER_TYPE_SmartTVRemoteController, 0, 0},
+    {"stadia", CONTROLLER_TYPE_AndroidController, UNI_HID_PARSER_STADIA_VID, UNI_HID_PARSER_STADIA_PID},
+    {"steam", CONTROLLER_TYPE_SteamController, 0, 0},
+    {"switch", CONTROLLER_TYPE_SwitchProController, 0, 0},
+    {"wii", CONTROLLER_TYPE_WiiController, 0, 0},
+    {"xboxone", CONTROLLER_TYPE_XBoxOneController, 0, 0},
+};
+#endif  // FUZZ_PARSER
+
+// NULL if the type of the capture is used.
+static const fuzz_parser_t* g_parser;
+
+int LLVMFuzzerInitialize(int* argc, char*** argv);
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size);
+
+//
+// Platform
+//
+static void fuzz_platform_init(int argc, const char** argv) {
+    ARG_UNUSED(argc);
+    ARG_UNUSED(argv);
+}
+
+static void fuzz_platform_on_init_complete(void) {}
+
+static uni_error_t fuzz_platform_on_device_discovered(bd_addr_t addr, const char* name, uint16_t cod, uint8_t rssi) {
+    // Not used: devices are created by the replay, not discovered.
+    return UNI_ERROR_SUCCESS;
+}
+
+static void fuzz_platform_on_device_connected(uni_hid_device_t* d) {
+    ARG_UNUSED(d);
+}
+
+static void fuzz_platform_on_device_disconnected(uni_hid_device_t* d) {
+    ARG_UNUSED(d);
+}
+
+static uni_error_t fuzz_platform_on_device_ready(uni_hid_device_t* d) {
+    ARG_UNUSED(d);
+    return UNI_ERROR_SUCCESS;
+}
+
+static void fuzz_platform_on_controller_data(uni_hid_device_t* d, uni_controller_t* ctl) {
+    ARG_UNUSED(d);
+    ARG_UNUSED(ctl);
+}
+
+static const uni_property_t* fuzz_platform_get_property(uni_property_idx_t idx) {
+    ARG_UNUSED(idx);
+    return NULL;
+}
+
+static void fuzz_platform_on_oob_event(uni_platform_oob_event_t event, void* data) {
+    ARG_UNUSED(event);
+    ARG_UNUSED(data);
+}
+
+static struct uni_platform g_platform = {
+    .name = "Fuzz",
+    .init = fuzz_platform_init,
+    .on_init_complete = fuzz_platform_on_init_complete,
+    .on_device_discovered = fuzz_platform_on_device_discovered,
+    .on_device_connected = fuzz_platform_on_device_connected,
+    .on_device_disconnected = fuzz_platform_on_device_disconnected,
+    .on_device_ready = fuzz_platform_on_device_ready,
+    .on_controller_data = fuzz_platform_on_controller_data,
+    .get_property = fuzz_platform_get_property,
+    .on_oob_event = fuzz_platform_on_oob_event,
+};
+
+//
+// Fuzzer
+//
+
+// Replaces the controller type (and VID/PID, if needed) of the DEVICE records.
+static void force_parser(uint8_t* data, size_t size) {
+    size_t offset = UNI_CAPTURE_FILE_HEADER_SIZE;
+
+    while (offset + UNI_CAPTURE_RECORD_HEADER_SIZE <= size) {
+        uint8_t* header = &data[offset];
+        uint16_t len = little_endian_read_16(header, 2);
+        offset += UNI_CAPTURE_RECORD_HEADER_SIZE;
+        if (len > size - offset)
+            break;
+
+        uint8_t* payload = &data[offset];
+        if (header[0] == UNI_CAPTURE_RECORD_DEVICE && len >= UNI_CAPTURE_DEVICE_PAYLOAD_SIZE) {
+            if (g_parser->vendor_id != 0) {
+                little_endian_store_16(payload, 0, g_parser->vendor_id);
+                little_endian_store_16(payload, 2, g_parser->product_id);
+            }
+            little_endian_store_16(payload, 4, g_parser->type);
+        }
+        offset += len;
+    }
+}
+
+int LLVMFuzzerInitialize(int* argc, char*** argv) {
+    btstack_memory_init();
+    btstack_run_loop_init(btstack_run_loop_posix_get_instance());
+
+    // Like uni_init(), but without Bluetooth.
+    uni_platform_set_custom(&g_platform);
+    uni_property_init();
+    uni_platform_init(*argc, (const char**)*argv);
+    uni_hid_device_setup();
+
+#ifdef FUZZ_PARSER
+    for (size_t i = 0; i < ARRAY_SIZE(parsers); i++) {
+        if (strcmp(parsers[i].name, FUZZ_PARSER) == 0)
+            g_parser = &parsers[i];
+    }
+    if (g_parser == NULL) {
+        // Logs are not printed by the fuzzer.
+        fprintf(stderr, "Fuzz: unknown parser: %s\n", FUZZ_PARSER);
+        abort();
+    }
+#endif
+    return 0;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size) {
+    if (g_parser == NULL) {
+        uni_capture_replay_buffer(data, size);
+        return 0;
+    }
+
+    // The input must not be modified.
+    uint8_t* copy = malloc(size);
+    if (copy == NULL)
+        return 0;
+    memcpy(copy, data, size);
+    force_parser(copy, size);
+    uni_capture_replay_buffer(copy, size);
+    free(copy);
+    return 0;
+}
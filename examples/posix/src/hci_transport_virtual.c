@@ -0,0 +1,1466 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#define BTSTACK_FILE__ "hci_transport_virtual.c"
+
+// Emulates a BR/EDR controller, at the HCI level:
+// - HCI commands are answered with the events that a real controller would generate.
+// - Only legacy pairing (PIN code) is supported. No SSP, no LE.
+// - For each virtual controller, it emulates the remote device as well: L2CAP signaling,
+//   a minimal SDP server (PnP and HID records), and the HID control and interrupt channels.
+//
+// Packets are never delivered to the host from send_packet(). Instead they are queued,
+// and delivered from the run loop, like a real transport does.
+
+#include "hci_transport_virtual.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "btstack_config.h"
+
+#include "bluetooth.h"
+#include "bluetooth_company_id.h"
+#include "btstack_debug.h"
+#include "btstack_defines.h"
+#include "btstack_run_loop.h"
+#include "btstack_util.h"
+
+#include "virtual_controllers.h"
+
+#ifndef HCI_INCOMING_PRE_BUFFER_SIZE
+#define HCI_INCOMING_PRE_BUFFER_SIZE 0
+#endif
+
+#define MAX_CONTROLLERS 16
+// HID control, HID interrupt and SDP.
+#define MAX_CHANNELS 3
+
+#define ACL_BUFFER_SIZE 1021
+#define ACL_BUFFER_NUM 8
+// ACL header + ACL payload. Bigger than any event.
+#define MAX_PACKET_SIZE (4 + ACL_BUFFER_SIZE)
+#define MAX_L2CAP_PAYLOAD_SIZE (ACL_BUFFER_SIZE - 4)
+#define QUEUE_SIZE 64
+
+#define CONNECTION_HANDLE_BASE 0x0040
+#define LOCAL_CID_BASE 0x0040
+
+// Polling interval used to start a new connection, or to report a new inquiry result.
+#define CONNECT_POLL_MS 100
+// A controller starts streaming after the host stops sending requests to it for this long.
+#define SETUP_QUIET_MS 300
+
+#define OPCODE(ogf, ocf) ((uint16_t)((ocf) | ((ogf) << 10)))
+
+enum {
+    OPCODE_INQUIRY = OPCODE(0x01, 0x0001),
+    OPCODE_INQUIRY_CANCEL = OPCODE(0x01, 0x0002),
+    OPCODE_PERIODIC_INQUIRY_MODE = OPCODE(0x01, 0x0003),
+    OPCODE_EXIT_PERIODIC_INQUIRY_MODE = OPCODE(0x01, 0x0004),
+    OPCODE_CREATE_CONNECTION = OPCODE(0x01, 0x0005),
+    OPCODE_DISCONNECT = OPCODE(0x01, 0x0006),
+    OPCODE_CREATE_CONNECTION_CANCEL = OPCODE(0x01, 0x0008),
+    OPCODE_ACCEPT_CONNECTION_REQUEST = OPCODE(0x01, 0x0009),
+    OPCODE_REJECT_CONNECTION_REQUEST = OPCODE(0x01, 0x000a),
+    OPCODE_LINK_KEY_REQUEST_REPLY = OPCODE(0x01, 0x000b),
+    OPCODE_LINK_KEY_REQUEST_NEGATIVE_REPLY = OPCODE(0x01, 0x000c),
+    OPCODE_PIN_CODE_REQUEST_REPLY = OPCODE(0x01, 0x000d),
+    OPCODE_PIN_CODE_REQUEST_NEGATIVE_REPLY = OPCODE(0x01, 0x000e),
+    OPCODE_AUTHENTICATION_REQUESTED = OPCODE(0x01, 0x0011),
+    OPCODE_SET_CONNECTION_ENCRYPTION = OPCODE(0x01, 0x0013),
+    OPCODE_REMOTE_NAME_REQUEST = OPCODE(0x01, 0x0019),
+    OPCODE_REMOTE_NAME_REQUEST_CANCEL = OPCODE(0x01, 0x001a),
+    OPCODE_READ_REMOTE_SUPPORTED_FEATURES = OPCODE(0x01, 0x001b),
+    OPCODE_READ_REMOTE_VERSION_INFORMATION = OPCODE(0x01, 0x001d),
+    OPCODE_RESET = OPCODE(0x03, 0x0003),
+    OPCODE_READ_LOCAL_NAME = OPCODE(0x03, 0x0014),
+    OPCODE_WRITE_SCAN_ENABLE = OPCODE(0x03, 0x001a),
+    OPCODE_READ_LOCAL_VERSION_INFORMATION = OPCODE(0x04, 0x0001),
+    OPCODE_READ_BUFFER_SIZE = OPCODE(0x04, 0x0005),
+    OPCODE_READ_BD_ADDR = OPCODE(0x04, 0x0009),
+    OPCODE_READ_ENCRYPTION_KEY_SIZE = OPCODE(0x05, 0x0008),
+};
+
+// L2CAP signaling commands
+enum {
+    SIG_COMMAND_REJECT = 0x01,
+    SIG_CONNECTION_REQUEST = 0x02,
+    SIG_CONNECTION_RESPONSE = 0x03,
+    SIG_CONFIGURE_REQUEST = 0x04,
+    SIG_CONFIGURE_RESPONSE = 0x05,
+    SIG_DISCONNECTION_REQUEST = 0x06,
+    SIG_DISCONNECTION_RESPONSE = 0x07,
+    SIG_ECHO_REQUEST = 0x08,
+    SIG_ECHO_RESPONSE = 0x09,
+    SIG_INFORMATION_REQUEST = 0x0a,
+    SIG_INFORMATION_RESPONSE = 0x0b,
+};
+
+#define L2CAP_SIGNALING_CID 0x0001
+#define L2CAP_CONNECTION_RESULT_SUCCESS 0x0000
+#define L2CAP_CONNECTION_RESULT_PENDING 0x0001
+#define L2CAP_CONNECTION_RESULT_PSM_NOT_SUPPORTED 0x0002
+#define L2CAP_CONNECTION_RESULT_NO_RESOURCES 0x0004
+
+#define SDP_ERROR_RESPONSE 0x01
+#define SDP_SERVICE_SEARCH_ATTRIBUTE_REQUEST 0x06
+#define SDP_SERVICE_SEARCH_ATTRIBUTE_RESPONSE 0x07
+
+// HID transaction header
+#define HID_GET_REPORT_FEATURE 0x43
+#define HID_DATA_INPUT 0xa1
+#define HID_DATA_OUTPUT 0xa2
+#define HID_DATA_FEATURE 0xa3
+
+typedef struct {
+    // 0 if the channel is not in use.
+    uint16_t psm;
+    // Controller side
+    uint16_t local_cid;
+    // Host side
+    uint16_t remote_cid;
+    // Whether the host accepted our configuration
+    bool local_config_done;
+    // Whether we accepted the host configuration
+    bool remote_config_done;
+    bool open;
+} channel_t;
+
+typedef enum {
+    // Waiting for its turn to connect, or to be discovered.
+    DEVICE_STATE_IDLE,
+    // Inquiry result sent, waiting for the host to connect.
+    DEVICE_STATE_DISCOVERED,
+    // Connection request sent, waiting for the host to accept it.
+    DEVICE_STATE_CONNECTING,
+    // ACL connection established. The host is setting up the controller.
+    DEVICE_STATE_CONNECTED,
+    DEVICE_STATE_STREAMING,
+    // Disconnected. It won't connect again.
+    DEVICE_STATE_DONE,
+} device_state_t;
+
+typedef struct {
+    virtual_controller_t vc;
+    device_state_t state;
+    uint16_t handle;
+    // Whether the controller initiated the connection.
+    bool incoming;
+    channel_t channels[MAX_CHANNELS];
+    uint16_t next_local_cid;
+    uint8_t next_signaling_id;
+    // Fires when the host stops sending requests.
+    btstack_timer_source_t setup_timer;
+    uint32_t frame;
+
+    // Host to controller ACL reassembly
+    uint8_t acl_buffer[MAX_PACKET_SIZE];
+    uint16_t acl_len;
+
+    // Stats
+    uint32_t reports_sent;
+    uint32_t output_reports;
+    bool streamed;
+} device_t;
+
+typedef struct {
+    uint8_t packet_type;
+    // Whether it is an input report. Used for stats.
+    bool input_report;
+    uint16_t len;
+    uint8_t buffer[HCI_INCOMING_PRE_BUFFER_SIZE + MAX_PACKET_SIZE];
+} queued_packet_t;
+
+static const hci_transport_virtual_config_t* config;
+static void (*host_packet_handler)(uint8_t packet_type, uint8_t* packet, uint16_t size);
+static bool is_open;
+
+static const bd_addr_t local_addr = {0x00, 0x1b, 0xdc, 0xb9, 0x32, 0xff};
+static device_t devices[MAX_CONTROLLERS];
+static int num_devices;
+
+static queued_packet_t queue[QUEUE_SIZE];
+static int queue_head;
+static int queue_len;
+static btstack_context_callback_registration_t deliver_registration;
+static bool deliver_scheduled;
+
+static btstack_timer_source_t connect_timer;
+static btstack_timer_source_t stream_timer;
+static bool stream_timer_active;
+static bool page_scan_enabled;
+static bool inquiry_active;
+static bool done_notified;
+
+static struct {
+    uint32_t reports;
+    uint64_t first_report_ns;
+    uint64_t last_report_ns;
+    uint64_t latency_total_ns;
+    uint64_t latency_min_ns;
+    uint64_t latency_max_ns;
+} stats;
+
+static void on_channel_opened(device_t* d, channel_t* ch);
+static void start_streaming(device_t* d);
+static void stream_tick(void);
+static void check_done(void);
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//
+// Host delivery
+//
+static void deliver_packets(void* context) {
+    UNUSED(context);
+    deliver_scheduled = false;
+
+    // Packets queued by the host while delivering are delivered in the next iteration.
+    int n = queue_len;
+    while (n-- > 0 && is_open) {
+        queued_packet_t* p = &queue[queue_head];
+        uint8_t* packet = &p->buffer[HCI_INCOMING_PRE_BUFFER_SIZE];
+
+        if (p->input_report) {
+            uint64_t start = now_ns();
+            host_packet_handler(p->packet_type, packet, p->len);
+            uint64_t end = now_ns();
+            uint64_t latency = end - start;
+
+            if (stats.reports == 0) {
+                stats.first_report_ns = start;
+                stats.latency_min_ns = latency;
+            }
+            stats.reports++;
+            stats.last_report_ns = end;
+            stats.latency_total_ns += latency;
+            if (latency < stats.latency_min_ns)
+                stats.latency_min_ns = latency;
+            if (latency > stats.latency_max_ns)
+                stats.latency_max_ns = latency;
+        } else {
+            host_packet_handler(p->packet_type, packet, p->len);
+        }
+
+        // Slot is released after the handler returns, so that packets queued
+        // by the handler can't overwrite it.
+        queue_head = (queue_head + 1) % QUEUE_SIZE;
+        queue_len--;
+    }
+
+    if (!is_open)
+        return;
+
+    if (queue_len == 0) {
+        // As fast as possible: generate the next round once the previous one was consumed.
+        if (config->report_interval_ms == 0)
+            stream_tick();
+        check_done();
+    }
+
+    if (queue_len > 0 && !deliver_scheduled) {
+        deliver_scheduled = true;
+        btstack_run_loop_execute_on_main_thread(&deliver_registration);
+    }
+}
+
+static void queue_packet(uint8_t packet_type, const uint8_t* packet, uint16_t len, bool input_report) {
+    if (queue_len == QUEUE_SIZE) {
+        log_error("Virtual HCI: queue full, dropping packet type %u", packet_type);
+        return;
+    }
+    if (len > MAX_PACKET_SIZE) {
+        log_error("Virtual HCI: packet too big (%u), dropping it", len);
+        return;
+    }
+
+    queued_packet_t* p = &queue[(queue_head + queue_len) % QUEUE_SIZE];
+    p->packet_type = packet_type;
+    p->input_report = input_report;
+    p->len = len;
+    memcpy(&p->buffer[HCI_INCOMING_PRE_BUFFER_SIZE], packet, len);
+    queue_len++;
+
+    if (!deliver_scheduled) {
+        deliver_scheduled = true;
+        btstack_run_loop_execute_on_main_thread(&deliver_registration);
+    }
+}
+
+//
+// HCI events
+//
+static void send_event(uint8_t event_code, const uint8_t* params, uint8_t params_len) {
+    uint8_t event[2 + 255];
+    event[0] = event_code;
+    event[1] = params_len;
+    memcpy(&event[2], params, params_len);
+    queue_packet(HCI_EVENT_PACKET, event, params_len + 2, false);
+}
+
+// "params" are the return parameters, including the status.
+static void send_command_complete(uint16_t opcode, const uint8_t* params, uint8_t params_len) {
+    uint8_t event[3 + 252];
+    event[0] = 1;  // Num HCI command packets
+    little_endian_store_16(event, 1, opcode);
+    memcpy(&event[3], params, params_len);
+    send_event(HCI_EVENT_COMMAND_COMPLETE, event, params_len + 3);
+}
+
+static void send_command_complete_status(uint16_t opcode, uint8_t status) {
+    send_command_complete(opcode, &status, 1);
+}
+
+// Return parameters: status + bd_addr
+static void send_command_complete_addr(uint16_t opcode, const bd_addr_t addr) {
+    uint8_t params[7];
+    params[0] = ERROR_CODE_SUCCESS;
+    reverse_bd_addr(addr, &params[1]);
+    send_command_complete(opcode, params, sizeof(params));
+}
+
+static void send_command_status(uint16_t opcode, uint8_t status) {
+    uint8_t event[4];
+    event[0] = status;
+    event[1] = 1;  // Num HCI command packets
+    little_endian_store_16(event, 2, opcode);
+    send_event(HCI_EVENT_COMMAND_STATUS, event, sizeof(event));
+}
+
+// For events whose parameters are just a bd_addr.
+static void send_event_addr(uint8_t event_code, const bd_addr_t addr) {
+    uint8_t event[6];
+    reverse_bd_addr(addr, event);
+    send_event(event_code, event, sizeof(event));
+}
+
+// For events whose parameters are status + handle.
+static void send_event_status_handle(uint8_t event_code, uint8_t status, uint16_t handle) {
+    uint8_t event[3];
+    event[0] = status;
+    little_endian_store_16(event, 1, handle);
+    send_event(event_code, event, sizeof(event));
+}
+
+static void send_connection_complete(uint8_t status, uint16_t handle, const bd_addr_t addr) {
+    uint8_t event[11];
+    event[0] = status;
+    little_endian_store_16(event, 1, handle);
+    reverse_bd_addr(addr, &event[3]);
+    event[9] = 0x01;  // ACL
+    event[10] = 0x00;  // Encryption disabled
+    send_event(HCI_EVENT_CONNECTION_COMPLETE, event, sizeof(event));
+}
+
+static void send_inquiry_result(const device_t* d) {
+    uint8_t event[15];
+    event[0] = 1;  // Num responses
+    reverse_bd_addr(d->vc.addr, &event[1]);
+    event[7] = 0x01;  // Page scan repetition mode: R1
+    event[8] = 0x00;  // Reserved
+    little_endian_store_24(event, 9, d->vc.model->cod);
+    little_endian_store_16(event, 12, 0x1234);  // Clock offset
+    event[14] = (uint8_t)-40;                   // RSSI
+    send_event(HCI_EVENT_INQUIRY_RESULT_WITH_RSSI, event, sizeof(event));
+}
+
+//
+// Devices
+//
+static device_t* device_for_addr(const uint8_t* addr) {
+    for (int i = 0; i < num_devices; i++) {
+        if (bd_addr_cmp(devices[i].vc.addr, addr) == 0)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+// "params" contains the address in HCI (little-endian) order.
+static device_t* device_for_hci_addr(const uint8_t* params) {
+    bd_addr_t addr;
+    reverse_bd_addr(params, addr);
+    return device_for_addr(addr);
+}
+
+static device_t* device_for_handle(uint16_t handle) {
+    for (int i = 0; i < num_devices; i++) {
+        if (devices[i].handle == handle && devices[i].state >= DEVICE_STATE_CONNECTED &&
+            devices[i].state != DEVICE_STATE_DONE)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+static bool device_is_busy(const device_t* d) {
+    return d->state == DEVICE_STATE_DISCOVERED || d->state == DEVICE_STATE_CONNECTING ||
+           d->state == DEVICE_STATE_CONNECTED;
+}
+
+static device_t* next_idle_device(void) {
+    for (int i = 0; i < num_devices && !config->together; i++) {
+        // One at a time, unless they power on together.
+        if (device_is_busy(&devices[i]))
+            return NULL;
+    }
+    for (int i = 0; i < num_devices; i++) {
+        if (devices[i].state == DEVICE_STATE_IDLE)
+            return &devices[i];
+    }
+    return NULL;
+}
+
+static void device_connected(device_t* d) {
+    d->state = DEVICE_STATE_CONNECTED;
+    d->acl_len = 0;
+    memset(d->channels, 0, sizeof(d->channels));
+    printf("Virtual: %s (%s) connected\n", d->vc.model->id, bd_addr_to_str(d->vc.addr));
+}
+
+static void device_disconnected(device_t* d) {
+    btstack_run_loop_remove_timer(&d->setup_timer);
+    d->state = DEVICE_STATE_DONE;
+    memset(d->channels, 0, sizeof(d->channels));
+    printf("Virtual: %s (%s) disconnected\n", d->vc.model->id, bd_addr_to_str(d->vc.addr));
+    check_done();
+}
+
+static void setup_timeout(btstack_timer_source_t* ts) {
+    device_t* d = btstack_run_loop_get_timer_context(ts);
+    if (d->state == DEVICE_STATE_CONNECTED)
+        start_streaming(d);
+}
+
+// Called every time the host sends something to the device.
+// Streaming starts once the host is done with the setup.
+static void device_restart_setup_timer(device_t* d) {
+    if (d->state != DEVICE_STATE_CONNECTED)
+        return;
+    btstack_run_loop_remove_timer(&d->setup_timer);
+    btstack_run_loop_set_timer_handler(&d->setup_timer, setup_timeout);
+    btstack_run_loop_set_timer_context(&d->setup_timer, d);
+    btstack_run_loop_set_timer(&d->setup_timer, SETUP_QUIET_MS);
+    btstack_run_loop_add_timer(&d->setup_timer);
+}
+
+//
+// L2CAP
+//
+static void send_l2cap(device_t* d, uint16_t cid, const uint8_t* data, uint16_t len, bool input_report) {
+    uint8_t packet[MAX_PACKET_SIZE];
+
+    if (len > MAX_L2CAP_PAYLOAD_SIZE) {
+        log_error("Virtual HCI: L2CAP payload too big: %u", len);
+        return;
+    }
+    // Packet boundary: first automatically flushable packet
+    little_endian_store_16(packet, 0, d->handle | (0x02 << 12));
+    little_endian_store_16(packet, 2, len + 4);
+    little_endian_store_16(packet, 4, len);
+    little_endian_store_16(packet, 6, cid);
+    memcpy(&packet[8], data, len);
+    queue_packet(HCI_ACL_DATA_PACKET, packet, len + 8, input_report);
+}
+
+static void send_signaling(device_t* d, uint8_t code, uint8_t identifier, const uint8_t* data, uint16_t len) {
+    uint8_t cmd[4 + 16];
+    cmd[0] = code;
+    cmd[1] = identifier;
+    little_endian_store_16(cmd, 2, len);
+    memcpy(&cmd[4], data, len);
+    send_l2cap(d, L2CAP_SIGNALING_CID, cmd, len + 4, false);
+}
+
+static uint8_t next_signaling_id(device_t* d) {
+    if (d->next_signaling_id == 0)
+        d->next_signaling_id = 1;
+    return d->next_signaling_id++;
+}
+
+static channel_t* channel_alloc(device_t* d, uint16_t psm) {
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        channel_t* ch = &d->channels[i];
+        if (ch->psm != 0)
+            continue;
+        memset(ch, 0, sizeof(*ch));
+        ch->psm = psm;
+        ch->local_cid = LOCAL_CID_BASE + d->next_local_cid++;
+        return ch;
+    }
+    return NULL;
+}
+
+static channel_t* channel_for_local_cid(device_t* d, uint16_t cid) {
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        if (d->channels[i].psm != 0 && d->channels[i].local_cid == cid)
+            return &d->channels[i];
+    }
+    return NULL;
+}
+
+static channel_t* channel_for_psm(device_t* d, uint16_t psm) {
+    for (int i = 0; i < MAX_CHANNELS; i++) {
+        if (d->channels[i].psm == psm)
+            return &d->channels[i];
+    }
+    return NULL;
+}
+
+static void send_configure_request(device_t* d, channel_t* ch) {
+    // No options: default MTU, basic mode.
+    uint8_t data[4];
+    little_endian_store_16(data, 0, ch->remote_cid);
+    little_endian_store_16(data, 2, 0);  // Flags
+    send_signaling(d, SIG_CONFIGURE_REQUEST, next_signaling_id(d), data, sizeof(data));
+}
+
+static void channel_check_open(device_t* d, channel_t* ch) {
+    if (ch->open || !ch->local_config_done || !ch->remote_config_done)
+        return;
+    ch->open = true;
+    on_channel_opened(d, ch);
+}
+
+// Controller initiated channel.
+static void open_channel(device_t* d, uint16_t psm) {
+    channel_t* ch = channel_alloc(d, psm);
+    if (ch == NULL) {
+        log_error("Virtual HCI: no free channels for PSM 0x%04x", psm);
+        return;
+    }
+    uint8_t data[4];
+    little_endian_store_16(data, 0, psm);
+    little_endian_store_16(data, 2, ch->local_cid);
+    send_signaling(d, SIG_CONNECTION_REQUEST, next_signaling_id(d), data, sizeof(data));
+}
+
+static void on_channel_opened(device_t* d, channel_t* ch) {
+    switch (ch->psm) {
+        case BLUETOOTH_PSM_HID_CONTROL:
+            // Same order as a real controller: control first, then interrupt.
+            if (d->incoming)
+                open_channel(d, BLUETOOTH_PSM_HID_INTERRUPT);
+            break;
+        case BLUETOOTH_PSM_HID_INTERRUPT:
+            device_restart_setup_timer(d);
+            break;
+        default:
+            break;
+    }
+}
+
+static void handle_signaling_command(device_t* d, uint8_t code, uint8_t identifier, const uint8_t* p, uint16_t len) {
+    uint8_t rsp[12];
+    channel_t* ch;
+
+    switch (code) {
+        case SIG_CONNECTION_REQUEST: {
+            if (len < 4)
+                break;
+            uint16_t psm = little_endian_read_16(p, 0);
+            uint16_t result = L2CAP_CONNECTION_RESULT_SUCCESS;
+            ch = NULL;
+            if (psm != BLUETOOTH_PSM_SDP && psm != BLUETOOTH_PSM_HID_CONTROL && psm != BLUETOOTH_PSM_HID_INTERRUPT) {
+                result = L2CAP_CONNECTION_RESULT_PSM_NOT_SUPPORTED;
+            } else {
+                ch = channel_alloc(d, psm);
+                if (ch == NULL)
+                    result = L2CAP_CONNECTION_RESULT_NO_RESOURCES;
+            }
+            little_endian_store_16(rsp, 0, ch ? ch->local_cid : 0);
+            little_endian_store_16(rsp, 2, little_endian_read_16(p, 2));
+            little_endian_store_16(rsp, 4, result);
+            little_endian_store_16(rsp, 6, 0);  // Status
+            send_signaling(d, SIG_CONNECTION_RESPONSE, identifier, rsp, 8);
+            if (ch == NULL)
+                break;
+            ch->remote_cid = little_endian_read_16(p, 2);
+            send_configure_request(d, ch);
+            break;
+        }
+        case SIG_CONNECTION_RESPONSE: {
+            if (len < 8)
+                break;
+            ch = channel_for_local_cid(d, little_endian_read_16(p, 2));
+            if (ch == NULL)
+                break;
+            uint16_t result = little_endian_read_16(p, 4);
+            if (result == L2CAP_CONNECTION_RESULT_PENDING)
+                break;
+            if (result != L2CAP_CONNECTION_RESULT_SUCCESS) {
+                log_error("Virtual HCI: connection for PSM 0x%04x refused: 0x%04x", ch->psm, result);
+                memset(ch, 0, sizeof(*ch));
+                break;
+            }
+            ch->remote_cid = little_endian_read_16(p, 0);
+            send_configure_request(d, ch);
+            break;
+        }
+        case SIG_CONFIGURE_REQUEST:
+            if (len < 4)
+                break;
+            ch = channel_for_local_cid(d, little_endian_read_16(p, 0));
+            if (ch == NULL)
+                break;
+            // Accept any option.
+            little_endian_store_16(rsp, 0, ch->remote_cid);
+            little_endian_store_16(rsp, 2, 0);  // Flags
+            little_endian_store_16(rsp, 4, 0);  // Result: success
+            send_signaling(d, SIG_CONFIGURE_RESPONSE, identifier, rsp, 6);
+            ch->remote_config_done = true;
+            channel_check_open(d, ch);
+            break;
+        case SIG_CONFIGURE_RESPONSE:
+            if (len < 6)
+                break;
+            ch = channel_for_local_cid(d, little_endian_read_16(p, 0));
+            if (ch == NULL)
+                break;
+            if (little_endian_read_16(p, 4) != 0) {
+                log_error("Virtual HCI: configuration for PSM 0x%04x rejected", ch->psm);
+                break;
+            }
+            ch->local_config_done = true;
+            channel_check_open(d, ch);
+            break;
+        case SIG_DISCONNECTION_REQUEST:
+            if (len < 4)
+                break;
+            ch = channel_for_local_cid(d, little_endian_read_16(p, 0));
+            send_signaling(d, SIG_DISCONNECTION_RESPONSE, identifier, p, 4);
+            if (ch != NULL)
+                memset(ch, 0, sizeof(*ch));
+            break;
+        case SIG_ECHO_REQUEST:
+            send_signaling(d, SIG_ECHO_RESPONSE, identifier, NULL, 0);
+            break;
+        case SIG_INFORMATION_REQUEST: {
+            if (len < 2)
+                break;
+            uint16_t info_type = little_endian_read_16(p, 0);
+            memset(rsp, 0, sizeof(rsp));
+            little_endian_store_16(rsp, 0, info_type);
+            if (info_type == 0x0002) {
+                // Extended features: none. Only basic mode.
+                send_signaling(d, SIG_INFORMATION_RESPONSE, identifier, rsp, 8);
+            } else if (info_type == 0x0003) {
+                // Fixed channels: only signaling.
+                rsp[4] = 0x02;
+                send_signaling(d, SIG_INFORMATION_RESPONSE, identifier, rsp, 12);
+            } else {
+                little_endian_store_16(rsp, 2, 0x0001);  // Not supported
+                send_signaling(d, SIG_INFORMATION_RESPONSE, identifier, rsp, 4);
+            }
+            break;
+        }
+        case SIG_DISCONNECTION_RESPONSE:
+        case SIG_ECHO_RESPONSE:
+        case SIG_INFORMATION_RESPONSE:
+        case SIG_COMMAND_REJECT:
+            break;
+        default:
+            // Command not understood
+            memset(rsp, 0, 2);
+            send_signaling(d, SIG_COMMAND_REJECT, identifier, rsp, 2);
+            break;
+    }
+}
+
+static void handle_signaling(device_t* d, const uint8_t* data, uint16_t len) {
+    // A signaling packet might contain more than one command.
+    uint16_t offset = 0;
+    while (offset + 4 <= len) {
+        uint16_t cmd_len = little_endian_read_16(data, offset + 2);
+        if (offset + 4 + cmd_len > len)
+            break;
+        handle_signaling_command(d, data[offset], data[offset + 1], &data[offset + 4], cmd_len);
+        offset += 4 + cmd_len;
+    }
+}
+
+//
+// SDP server
+//
+typedef struct {
+    uint8_t* buf;
+    uint16_t len;
+} de_writer_t;
+
+static void de_put_u8(de_writer_t* w, uint8_t v) {
+    w->buf[w->len++] = 0x08;
+    w->buf[w->len++] = v;
+}
+
+static void de_put_u16(de_writer_t* w, uint16_t v) {
+    w->buf[w->len++] = 0x09;
+    big_endian_store_16(w->buf, w->len, v);
+    w->len += 2;
+}
+
+static void de_put_u32(de_writer_t* w, uint32_t v) {
+    w->buf[w->len++] = 0x0a;
+    big_endian_store_32(w->buf, w->len, v);
+    w->len += 4;
+}
+
+static void de_put_bool(de_writer_t* w, bool v) {
+    w->buf[w->len++] = 0x28;
+    w->buf[w->len++] = v;
+}
+
+static void de_put_uuid16(de_writer_t* w, uint16_t v) {
+    w->buf[w->len++] = 0x19;
+    big_endian_store_16(w->buf, w->len, v);
+    w->len += 2;
+}
+
+static void de_put_string(de_writer_t* w, const uint8_t* data, uint16_t len) {
+    w->buf[w->len++] = 0x26;
+    big_endian_store_16(w->buf, w->len, len);
+    w->len += 2;
+    memcpy(&w->buf[w->len], data, len);
+    w->len += len;
+}
+
+// Sequences always use a 16-bit length, patched by de_end_sequence().
+static uint16_t de_begin_sequence(de_writer_t* w) {
+    uint16_t pos = w->len;
+    w->buf[w->len++] = 0x36;
+    w->len += 2;
+    return pos;
+}
+
+static void de_end_sequence(de_writer_t* w, uint16_t pos) {
+    big_endian_store_16(w->buf, pos + 1, w->len - pos - 3);
+}
+
+static void de_put_service_class(de_writer_t* w, uint16_t uuid) {
+    de_put_u16(w, 0x0001);  // ServiceClassIDList
+    uint16_t seq = de_begin_sequence(w);
+    de_put_uuid16(w, uuid);
+    de_end_sequence(w, seq);
+}
+
+static void sdp_put_pnp_record(de_writer_t* w, const virtual_controller_model_t* model) {
+    uint16_t record = de_begin_sequence(w);
+    de_put_u16(w, 0x0000);  // ServiceRecordHandle
+    de_put_u32(w, 0x00010001);
+    de_put_service_class(w, BLUETOOTH_SERVICE_CLASS_PNP_INFORMATION);
+    de_put_u16(w, 0x0200);  // SpecificationID
+    de_put_u16(w, 0x0103);
+    de_put_u16(w, 0x0201);  // VendorID
+    de_put_u16(w, model->vendor_id);
+    de_put_u16(w, 0x0202);  // ProductID
+    de_put_u16(w, model->product_id);
+    de_put_u16(w, 0x0203);  // Version
+    de_put_u16(w, 0x0100);
+    de_put_u16(w, 0x0204);  // PrimaryRecord
+    de_put_bool(w, true);
+    de_put_u16(w, 0x0205);  // VendorIDSource: USB
+    de_put_u16(w, 0x0002);
+    de_end_sequence(w, record);
+}
+
+static void sdp_put_hid_record(de_writer_t* w, const virtual_controller_model_t* model) {
+    uint16_t seq;
+    uint16_t record = de_begin_sequence(w);
+    de_put_u16(w, 0x0000);  // ServiceRecordHandle
+    de_put_u32(w, 0x00010000);
+    de_put_service_class(w, BLUETOOTH_SERVICE_CLASS_HUMAN_INTERFACE_DEVICE_SERVICE);
+
+    de_put_u16(w, 0x0004);  // ProtocolDescriptorList
+    uint16_t protocols = de_begin_sequence(w);
+    seq = de_begin_sequence(w);
+    de_put_uuid16(w, 0x0100);  // L2CAP
+    de_put_u16(w, BLUETOOTH_PSM_HID_CONTROL);
+    de_end_sequence(w, seq);
+    seq = de_begin_sequence(w);
+    de_put_uuid16(w, 0x0011);  // HIDP
+    de_end_sequence(w, seq);
+    de_end_sequence(w, protocols);
+
+    if (model->hid_descriptor != NULL) {
+        de_put_u16(w, 0x0206);  // HIDDescriptorList
+        uint16_t list = de_begin_sequence(w);
+        seq = de_begin_sequence(w);
+        de_put_u8(w, 0x22);  // Report descriptor
+        de_put_string(w, model->hid_descriptor, model->hid_descriptor_len);
+        de_end_sequence(w, seq);
+        de_end_sequence(w, list);
+    }
+    de_end_sequence(w, record);
+}
+
+// Returns the first UUID of the ServiceSearchPattern, or 0 if it is not valid.
+static uint16_t sdp_get_search_uuid16(const uint8_t* pattern, uint16_t len) {
+    // Skip the sequence header
+    uint16_t offset;
+    switch (pattern[0]) {
+        case 0x35:
+            offset = 2;
+            break;
+        case 0x36:
+            offset = 3;
+            break;
+        case 0x37:
+            offset = 5;
+            break;
+        default:
+            return 0;
+    }
+    if (offset + 5 > len)
+        return 0;
+
+    switch (pattern[offset]) {
+        case 0x19:  // UUID16
+            return big_endian_read_16(pattern, offset + 1);
+        case 0x1a:  // UUID32
+        case 0x1c:  // UUID128, based on the Bluetooth Base UUID
+            return big_endian_read_16(pattern, offset + 3);
+        default:
+            return 0;
+    }
+}
+
+static void handle_sdp_request(device_t* d, channel_t* ch, const uint8_t* data, uint16_t len) {
+    uint8_t rsp[MAX_L2CAP_PAYLOAD_SIZE];
+
+    if (len < 5)
+        return;
+    uint16_t transaction_id = big_endian_read_16(data, 1);
+
+    rsp[0] = SDP_SERVICE_SEARCH_ATTRIBUTE_RESPONSE;
+    big_endian_store_16(rsp, 1, transaction_id);
+
+    if (data[0] != SDP_SERVICE_SEARCH_ATTRIBUTE_REQUEST) {
+        rsp[0] = SDP_ERROR_RESPONSE;
+        big_endian_store_16(rsp, 3, 2);
+        big_endian_store_16(rsp, 5, 0x0003);  // Invalid request syntax
+        send_l2cap(d, ch->remote_cid, rsp, 7, false);
+        return;
+    }
+
+    // 1 byte PDU ID, 2 bytes transaction ID, 2 bytes parameter length, 2 bytes attribute list byte count.
+    de_writer_t w = {.buf = rsp, .len = 7};
+    uint16_t lists = de_begin_sequence(&w);
+    switch (sdp_get_search_uuid16(&data[5], len - 5)) {
+        case BLUETOOTH_SERVICE_CLASS_PNP_INFORMATION:
+            sdp_put_pnp_record(&w, d->vc.model);
+            break;
+        case BLUETOOTH_SERVICE_CLASS_HUMAN_INTERFACE_DEVICE_SERVICE:
+            sdp_put_hid_record(&w, d->vc.model);
+            break;
+        default:
+            break;
+    }
+    de_end_sequence(&w, lists);
+    big_endian_store_16(rsp, 5, w.len - 7);
+    // No continuation state
+    rsp[w.len++] = 0;
+    big_endian_store_16(rsp, 3, w.len - 5);
+    send_l2cap(d, ch->remote_cid, rsp, w.len, false);
+}
+
+//
+// HID
+//
+static void handle_hid_control(device_t* d, channel_t* ch, const uint8_t* data, uint16_t len) {
+    uint8_t rsp[1 + VIRTUAL_CONTROLLER_MAX_REPORT_SIZE];
+
+    device_restart_setup_timer(d);
+
+    if (len < 2 || data[0] != HID_GET_REPORT_FEATURE || d->vc.model->get_feature_report == NULL)
+        return;
+
+    uint16_t rsp_len = d->vc.model->get_feature_report(&d->vc, data[1], &rsp[1]);
+    if (rsp_len == 0)
+        return;
+    rsp[0] = HID_DATA_FEATURE;
+    send_l2cap(d, ch->remote_cid, rsp, rsp_len + 1, false);
+}
+
+static void handle_hid_interrupt(device_t* d, channel_t* ch, const uint8_t* data, uint16_t len) {
+    uint8_t rsp[1 + VIRTUAL_CONTROLLER_MAX_REPORT_SIZE];
+
+    device_restart_setup_timer(d);
+
+    if (len < 2 || data[0] != HID_DATA_OUTPUT)
+        return;
+
+    d->output_reports++;
+    if (d->vc.model->on_output_report == NULL)
+        return;
+    uint16_t rsp_len = d->vc.model->on_output_report(&d->vc, &data[1], len - 1, &rsp[1]);
+    if (rsp_len == 0)
+        return;
+    rsp[0] = HID_DATA_INPUT;
+    send_l2cap(d, ch->remote_cid, rsp, rsp_len + 1, false);
+}
+
+static void handle_l2cap(device_t* d, uint16_t cid, const uint8_t* data, uint16_t len) {
+    if (cid == L2CAP_SIGNALING_CID) {
+        handle_signaling(d, data, len);
+        return;
+    }
+
+    channel_t* ch = channel_for_local_cid(d, cid);
+    if (ch == NULL || !ch->open) {
+        log_error("Virtual HCI: data for invalid cid 0x%04x", cid);
+        return;
+    }
+
+    switch (ch->psm) {
+        case BLUETOOTH_PSM_SDP:
+            handle_sdp_request(d, ch, data, len);
+            break;
+        case BLUETOOTH_PSM_HID_CONTROL:
+            handle_hid_control(d, ch, data, len);
+            break;
+        case BLUETOOTH_PSM_HID_INTERRUPT:
+            handle_hid_interrupt(d, ch, data, len);
+            break;
+        default:
+            break;
+    }
+}
+
+static void handle_acl(const uint8_t* packet, uint16_t size) {
+    if (size < 4)
+        return;
+
+    uint16_t handle = little_endian_read_16(packet, 0) & 0x0fff;
+    uint8_t packet_boundary = (little_endian_read_16(packet, 0) >> 12) & 0x03;
+    uint16_t len = btstack_min(little_endian_read_16(packet, 2), size - 4);
+
+    // Tell the host that the buffer is free again.
+    uint8_t event[5];
+    event[0] = 1;  // Num handles
+    little_endian_store_16(event, 1, handle);
+    little_endian_store_16(event, 3, 1);
+    send_event(HCI_EVENT_NUMBER_OF_COMPLETED_PACKETS, event, sizeof(event));
+
+    device_t* d = device_for_handle(handle);
+    if (d == NULL)
+        return;
+
+    // Continuation fragment
+    if (packet_boundary != 0x01)
+        d->acl_len = 0;
+    if (d->acl_len + len > sizeof(d->acl_buffer)) {
+        log_error("Virtual HCI: ACL packet too big, dropping it");
+        d->acl_len = 0;
+        return;
+    }
+    memcpy(&d->acl_buffer[d->acl_len], &packet[4], len);
+    d->acl_len += len;
+
+    if (d->acl_len < 4)
+        return;
+    uint16_t l2cap_len = little_endian_read_16(d->acl_buffer, 0);
+    if (d->acl_len < l2cap_len + 4)
+        return;
+    d->acl_len = 0;
+    handle_l2cap(d, little_endian_read_16(d->acl_buffer, 2), &d->acl_buffer[4], l2cap_len);
+}
+
+//
+// Connections
+//
+static void connect_timeout(btstack_timer_source_t* ts) {
+    UNUSED(ts);
+    bool discovered = false;
+
+    // All the idle ones when they power on together: same inquiry, or connection requests back-to-back.
+    for (device_t* d = next_idle_device(); d != NULL; d = next_idle_device()) {
+        if (config->discover) {
+            if (!inquiry_active)
+                break;
+            d->state = DEVICE_STATE_DISCOVERED;
+            send_inquiry_result(d);
+            discovered = true;
+        } else if (page_scan_enabled) {
+            uint8_t event[10];
+            d->state = DEVICE_STATE_CONNECTING;
+            d->incoming = true;
+            reverse_bd_addr(d->vc.addr, event);
+            little_endian_store_24(event, 6, d->vc.model->cod);
+            event[9] = 0x01;  // ACL
+            send_event(HCI_EVENT_CONNECTION_REQUEST, event, sizeof(event));
+        } else {
+            break;
+        }
+        if (!config->together)
+            break;
+    }
+    if (discovered) {
+        uint8_t status = ERROR_CODE_SUCCESS;
+        send_event(HCI_EVENT_INQUIRY_COMPLETE, &status, 1);
+    }
+
+    btstack_run_loop_set_timer(&connect_timer, CONNECT_POLL_MS);
+    btstack_run_loop_add_timer(&connect_timer);
+}
+
+static void handle_create_connection(uint16_t opcode, const uint8_t* params) {
+    device_t* d = device_for_hci_addr(params);
+    send_command_status(opcode, ERROR_CODE_SUCCESS);
+
+    if (d == NULL || d->state == DEVICE_STATE_DONE) {
+        bd_addr_t addr;
+        reverse_bd_addr(params, addr);
+        send_connection_complete(ERROR_CODE_PAGE_TIMEOUT, 0, addr);
+        return;
+    }
+    // Already connected. E.g: the SDP query reuses the connection.
+    if (d->state == DEVICE_STATE_CONNECTED || d->state == DEVICE_STATE_STREAMING) {
+        send_connection_complete(ERROR_CODE_ACL_CONNECTION_ALREADY_EXISTS, d->handle, d->vc.addr);
+        return;
+    }
+    d->incoming = false;
+    device_connected(d);
+    send_connection_complete(ERROR_CODE_SUCCESS, d->handle, d->vc.addr);
+}
+
+static void handle_accept_connection(uint16_t opcode, const uint8_t* params, bool accept) {
+    device_t* d = device_for_hci_addr(params);
+    send_command_status(opcode, ERROR_CODE_SUCCESS);
+
+    if (d == NULL || d->state != DEVICE_STATE_CONNECTING)
+        return;
+
+    if (!accept) {
+        // Reject: params[6] has the reason.
+        send_connection_complete(params[6], 0, d->vc.addr);
+        device_disconnected(d);
+        return;
+    }
+    device_connected(d);
+    send_connection_complete(ERROR_CODE_SUCCESS, d->handle, d->vc.addr);
+    open_channel(d, BLUETOOTH_PSM_HID_CONTROL);
+}
+
+static void handle_disconnect(uint16_t opcode, const uint8_t* params) {
+    uint16_t handle = little_endian_read_16(params, 0) & 0x0fff;
+    device_t* d = device_for_handle(handle);
+    if (d == NULL) {
+        send_command_status(opcode, ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+        return;
+    }
+    send_command_status(opcode, ERROR_CODE_SUCCESS);
+
+    uint8_t event[4];
+    event[0] = ERROR_CODE_SUCCESS;
+    little_endian_store_16(event, 1, handle);
+    event[3] = ERROR_CODE_CONNECTION_TERMINATED_BY_LOCAL_HOST;
+    send_event(HCI_EVENT_DISCONNECTION_COMPLETE, event, sizeof(event));
+    device_disconnected(d);
+}
+
+static void handle_remote_name_request(uint16_t opcode, const uint8_t* params) {
+    // Status + bd_addr + name
+    uint8_t event[1 + 6 + 248] = {0};
+    device_t* d = device_for_hci_addr(params);
+
+    send_command_status(opcode, ERROR_CODE_SUCCESS);
+
+    event[0] = (d != NULL) ? ERROR_CODE_SUCCESS : ERROR_CODE_PAGE_TIMEOUT;
+    memcpy(&event[1], params, 6);
+    if (d != NULL)
+        strncpy((char*)&event[7], d->vc.model->name, 247);
+    send_event(HCI_EVENT_REMOTE_NAME_REQUEST_COMPLETE, event, sizeof(event));
+}
+
+static void handle_link_key_reply(uint16_t opcode, const uint8_t* params, bool has_key) {
+    bd_addr_t addr;
+    reverse_bd_addr(params, addr);
+    device_t* d = device_for_addr(addr);
+
+    send_command_complete_addr(opcode, addr);
+    if (d == NULL)
+        return;
+    if (has_key) {
+        // Any key is valid.
+        send_event_status_handle(HCI_EVENT_AUTHENTICATION_COMPLETE_EVENT, ERROR_CODE_SUCCESS, d->handle);
+        return;
+    }
+    // No key: legacy pairing.
+    send_event_addr(HCI_EVENT_PIN_CODE_REQUEST, addr);
+}
+
+static void handle_pin_code_reply(uint16_t opcode, const uint8_t* params, bool has_pin) {
+    bd_addr_t addr;
+    reverse_bd_addr(params, addr);
+    device_t* d = device_for_addr(addr);
+
+    send_command_complete_addr(opcode, addr);
+    if (d == NULL)
+        return;
+    if (!has_pin) {
+        send_event_status_handle(HCI_EVENT_AUTHENTICATION_COMPLETE_EVENT, ERROR_CODE_AUTHENTICATION_FAILURE,
+                                 d->handle);
+        return;
+    }
+
+    // Any PIN is valid.
+    uint8_t event[6 + 16 + 1];
+    memcpy(event, params, 6);
+    memset(&event[6], 0x5a ^ d->vc.addr[5], 16);
+    event[22] = 0x00;  // Combination key
+    send_event(HCI_EVENT_LINK_KEY_NOTIFICATION, event, sizeof(event));
+    send_event_status_handle(HCI_EVENT_AUTHENTICATION_COMPLETE_EVENT, ERROR_CODE_SUCCESS, d->handle);
+}
+
+//
+// HCI commands
+//
+static void handle_command(const uint8_t* packet, uint16_t size) {
+    if (size < 3)
+        return;
+
+    uint16_t opcode = little_endian_read_16(packet, 0);
+    const uint8_t* params = &packet[3];
+    uint8_t params_len = btstack_min(packet[2], size - 3);
+    // Enough for any return parameters used by BTstack. Filled with zeros by default.
+    uint8_t rsp[1 + 248] = {0};
+    device_t* d;
+
+    switch (opcode) {
+        case OPCODE_RESET:
+            page_scan_enabled = false;
+            inquiry_active = false;
+            send_command_complete_status(opcode, ERROR_CODE_SUCCESS);
+            break;
+        case OPCODE_READ_LOCAL_VERSION_INFORMATION:
+            rsp[1] = 0x09;  // HCI version: 5.0
+            little_endian_store_16(rsp, 2, 0);
+            rsp[4] = 0x09;  // LMP version: 5.0
+            little_endian_store_16(rsp, 5, BLUETOOTH_COMPANY_ID_BLUEKITCHEN_GMBH);
+            little_endian_store_16(rsp, 7, 0);
+            send_command_complete(opcode, rsp, 9);
+            break;
+        case OPCODE_READ_BD_ADDR:
+            send_command_complete_addr(opcode, local_addr);
+            break;
+        case OPCODE_READ_BUFFER_SIZE:
+            little_endian_store_16(rsp, 1, ACL_BUFFER_SIZE);
+            rsp[3] = 0;  // SCO packet length
+            little_endian_store_16(rsp, 4, ACL_BUFFER_NUM);
+            little_endian_store_16(rsp, 6, 0);  // SCO packets
+            send_command_complete(opcode, rsp, 8);
+            break;
+        case OPCODE_READ_LOCAL_NAME:
+            send_command_complete(opcode, rsp, sizeof(rsp));
+            break;
+        case OPCODE_READ_ENCRYPTION_KEY_SIZE:
+            memcpy(&rsp[1], params, 2);
+            rsp[3] = 16;
+            send_command_complete(opcode, rsp, 4);
+            break;
+        case OPCODE_WRITE_SCAN_ENABLE:
+            page_scan_enabled = (params_len > 0) && (params[0] & 0x02);
+            send_command_complete_status(opcode, ERROR_CODE_SUCCESS);
+            break;
+        case OPCODE_INQUIRY:
+            inquiry_active = true;
+            send_command_status(opcode, ERROR_CODE_SUCCESS);
+            break;
+        case OPCODE_PERIODIC_INQUIRY_MODE:
+            inquiry_active = true;
+            send_command_complete_status(opcode, ERROR_CODE_SUCCESS);
+            break;
+        case OPCODE_INQUIRY_CANCEL:
+        case OPCODE_EXIT_PERIODIC_INQUIRY_MODE:
+            inquiry_active = false;
+            send_command_complete_status(opcode, ERROR_CODE_SUCCESS);
+            break;
+        case OPCODE_CREATE_CONNECTION:
+            handle_create_connection(opcode, params);
+            break;
+        case OPCODE_CREATE_CONNECTION_CANCEL:
+        case OPCODE_REMOTE_NAME_REQUEST_CANCEL:
+            send_command_complete_addr(opcode, local_addr);
+            break;
+        case OPCODE_ACCEPT_CONNECTION_REQUEST:
+            handle_accept_connection(opcode, params, true);
+            break;
+        case OPCODE_REJECT_CONNECTION_REQUEST:
+            handle_accept_connection(opcode, params, false);
+            break;
+        case OPCODE_DISCONNECT:
+            handle_disconnect(opcode, params);
+            break;
+        case OPCODE_REMOTE_NAME_REQUEST:
+            handle_remote_name_request(opcode, params);
+            break;
+        case OPCODE_LINK_KEY_REQUEST_REPLY:
+            handle_link_key_reply(opcode, params, true);
+            break;
+        case OPCODE_LINK_KEY_REQUEST_NEGATIVE_REPLY:
+            handle_link_key_reply(opcode, params, false);
+            break;
+        case OPCODE_PIN_CODE_REQUEST_REPLY:
+            handle_pin_code_reply(opcode, params, true);
+            break;
+        case OPCODE_PIN_CODE_REQUEST_NEGATIVE_REPLY:
+            handle_pin_code_reply(opcode, params, false);
+            break;
+        case OPCODE_AUTHENTICATION_REQUESTED:
+            d = device_for_handle(little_endian_read_16(params, 0));
+            send_command_status(opcode, d ? ERROR_CODE_SUCCESS : ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            if (d != NULL)
+                send_event_addr(HCI_EVENT_LINK_KEY_REQUEST, d->vc.addr);
+            break;
+        case OPCODE_SET_CONNECTION_ENCRYPTION:
+            d = device_for_handle(little_endian_read_16(params, 0));
+            send_command_status(opcode, d ? ERROR_CODE_SUCCESS : ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            if (d != NULL) {
+                uint8_t event[4];
+                event[0] = ERROR_CODE_SUCCESS;
+                little_endian_store_16(event, 1, d->handle);
+                event[3] = params[2];
+                send_event(HCI_EVENT_ENCRYPTION_CHANGE, event, sizeof(event));
+            }
+            break;
+        case OPCODE_READ_REMOTE_SUPPORTED_FEATURES:
+            d = device_for_handle(little_endian_read_16(params, 0));
+            send_command_status(opcode, d ? ERROR_CODE_SUCCESS : ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            if (d != NULL) {
+                // No features: no SSP, no extended features.
+                uint8_t event[3 + 8] = {0};
+                little_endian_store_16(event, 1, d->handle);
+                send_event(HCI_EVENT_READ_REMOTE_SUPPORTED_FEATURES_COMPLETE, event, sizeof(event));
+            }
+            break;
+        case OPCODE_READ_REMOTE_VERSION_INFORMATION:
+            d = device_for_handle(little_endian_read_16(params, 0));
+            send_command_status(opcode, d ? ERROR_CODE_SUCCESS : ERROR_CODE_UNKNOWN_CONNECTION_IDENTIFIER);
+            if (d != NULL) {
+                uint8_t event[8] = {0};
+                little_endian_store_16(event, 1, d->handle);
+                event[3] = 0x06;  // Version 4.0
+                little_endian_store_16(event, 4, BLUETOOTH_COMPANY_ID_BROADCOM_CORPORATION);
+                send_event(HCI_EVENT_READ_REMOTE_VERSION_INFORMATION_COMPLETE, event, sizeof(event));
+            }
+            break;
+        default:
+            switch (opcode >> 10) {
+                case 0x01:
+                    send_command_status(opcode, ERROR_CODE_UNKNOWN_HCI_COMMAND);
+                    break;
+                case 0x02:
+                    // Link policy commands generate events that are not emulated. E.g: sniff mode, role switch.
+                    send_command_status(opcode, ERROR_CODE_COMMAND_DISALLOWED);
+                    break;
+                default:
+                    // Status success + zeroed return parameters.
+                    send_command_complete(opcode, rsp, 65);
+                    break;
+            }
+            break;
+    }
+}
+
+//
+// Streaming
+//
+static void stream_tick(void) {
+    uint8_t report[1 + VIRTUAL_CONTROLLER_MAX_REPORT_SIZE];
+
+    for (int i = 0; i < num_devices; i++) {
+        device_t* d = &devices[i];
+        if (d->state != DEVICE_STATE_STREAMING)
+            continue;
+        if (config->num_reports != 0 && d->reports_sent >= config->num_reports)
+            continue;
+        channel_t* ch = channel_for_psm(d, BLUETOOTH_PSM_HID_INTERRUPT);
+        if (ch == NULL || !ch->open)
+            continue;
+
+        uint16_t len = d->vc.model->get_input_report(&d->vc, d->frame, &report[1]);
+        if (len == 0)
+            continue;
+        report[0] = HID_DATA_INPUT;
+        d->frame++;
+        d->reports_sent++;
+        send_l2cap(d, ch->remote_cid, report, len + 1, true);
+    }
+}
+
+static void stream_timeout(btstack_timer_source_t* ts) {
+    stream_tick();
+    btstack_run_loop_set_timer(ts, config->report_interval_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+static void start_streaming(device_t* d) {
+    d->state = DEVICE_STATE_STREAMING;
+    d->streamed = true;
+    printf("Virtual: %s (%s) streaming\n", d->vc.model->id, bd_addr_to_str(d->vc.addr));
+
+    if (config->report_interval_ms == 0) {
+        stream_tick();
+        return;
+    }
+    if (stream_timer_active)
+        return;
+    stream_timer_active = true;
+    btstack_run_loop_set_timer_handler(&stream_timer, stream_timeout);
+    btstack_run_loop_set_timer(&stream_timer, config->report_interval_ms);
+    btstack_run_loop_add_timer(&stream_timer);
+}
+
+static void check_done(void) {
+    if (done_notified || num_devices == 0)
+        return;
+
+    for (int i = 0; i < num_devices; i++) {
+        const device_t* d = &devices[i];
+        if (d->state == DEVICE_STATE_DONE)
+            continue;
+        if (d->state == DEVICE_STATE_STREAMING && config->num_reports != 0 && d->reports_sent >= config->num_reports)
+            continue;
+        return;
+    }
+    // Only when all the reports were delivered.
+    if (queue_len > 0)
+        return;
+
+    done_notified = true;
+    if (config->on_done != NULL)
+        config->on_done();
+}
+
+//
+// Transport
+//
+static void transport_init(const void* transport_config) {
+    static const hci_transport_virtual_config_t default_config = {
+        .controllers = "ds4",
+    };
+    char buf[128];
+
+    config = transport_config ? transport_config : &default_config;
+    num_devices = 0;
+
+    btstack_strcpy(buf, sizeof(buf), config->controllers);
+    for (char* id = strtok(buf, ","); id != NULL; id = strtok(NULL, ",")) {
+        const virtual_controller_model_t* model = virtual_controller_find_model(id);
+        if (model == NULL) {
+            printf("Virtual: unknown controller '%s'. Valid ones: %s\n", id, virtual_controller_get_model_ids());
+            continue;
+        }
+        if (num_devices == MAX_CONTROLLERS) {
+            printf("Virtual: too many controllers, max is %d\n", MAX_CONTROLLERS);
+            break;
+        }
+        device_t* d = &devices[num_devices];
+        memset(d, 0, sizeof(*d));
+        virtual_controller_init(&d->vc, model, num_devices);
+        d->handle = CONNECTION_HANDLE_BASE + num_devices;
+        num_devices++;
+    }
+}
+
+static int transport_open(void) {
+    is_open = true;
+    queue_head = 0;
+    queue_len = 0;
+    deliver_scheduled = false;
+    page_scan_enabled = false;
+    inquiry_active = false;
+    stream_timer_active = false;
+    done_notified = false;
+    memset(&stats, 0, sizeof(stats));
+
+    deliver_registration.callback = deliver_packets;
+
+    btstack_run_loop_set_timer_handler(&connect_timer, connect_timeout);
+    btstack_run_loop_set_timer(&connect_timer, CONNECT_POLL_MS);
+    btstack_run_loop_add_timer(&connect_timer);
+    return 0;
+}
+
+static int transport_close(void) {
+    is_open = false;
+    queue_len = 0;
+    btstack_run_loop_remove_timer(&connect_timer);
+    btstack_run_loop_remove_timer(&stream_timer);
+    stream_timer_active = false;
+    for (int i = 0; i < num_devices; i++)
+        btstack_run_loop_remove_timer(&devices[i].setup_timer);
+    return 0;
+}
+
+static void transport_register_packet_handler(void (*handler)(uint8_t packet_type, uint8_t* packet, uint16_t size)) {
+    host_packet_handler = handler;
+}
+
+static int transport_send_packet(uint8_t packet_type, uint8_t* packet, int size) {
+    if (!is_open)
+        return -1;
+
+    switch (packet_type) {
+        case HCI_COMMAND_DATA_PACKET:
+            handle_command(packet, size);
+            break;
+        case HCI_ACL_DATA_PACKET:
+            handle_acl(packet, size);
+            break;
+        default:
+            // SCO is not supported.
+            break;
+    }
+    return 0;
+}
+
+const hci_transport_t* hci_transport_virtual_instance(void) {
+    static const hci_transport_t transport = {
+        .name = "Virtual",
+        .init = transport_init,
+        .open = transport_open,
+        .close = transport_close,
+        .register_packet_handler = transport_register_packet_handler,
+        // NULL: packets can always be sent, like a synchronous transport.
+        .can_send_packet_now = NULL,
+        .send_packet = transport_send_packet,
+    };
+    return &transport;
+}
+
+bool hci_transport_virtual_all_streamed(void) {
+    for (int i = 0; i < num_devices; i++) {
+        if (!devices[i].streamed)
+            return false;
+    }
+    return true;
+}
+
+void hci_transport_virtual_dump_stats(void) {
+    fprintf(stderr, "Virtual controllers:\n");
+    for (int i = 0; i < num_devices; i++) {
+        const device_t* d = &devices[i];
+        fprintf(stderr, "  %-8s %s: input reports=%u, output reports=%u%s\n", d->vc.model->id,
+                bd_addr_to_str(d->vc.addr), d->reports_sent, d->output_reports,
+                d->streamed ? "" : " (never streamed)");
+    }
+
+    if (stats.reports == 0) {
+        fprintf(stderr, "No input reports were delivered\n");
+        return;
+    }
+
+    double elapsed_s = (stats.last_report_ns - stats.first_report_ns) / 1e9;
+    fprintf(stderr, "Input reports: %u in %.3f s", stats.reports, elapsed_s);
+    if (elapsed_s > 0)
+        fprintf(stderr, " (%.1f reports/s)", stats.reports / elapsed_s);
+    fprintf(stderr, "\n");
+    // Time spent by the host on each input report: from the HCI transport up to the platform callback.
+    fprintf(stderr, "Host latency per input report (us): min=%.2f, avg=%.2f, max=%.2f\n", stats.latency_min_ns / 1e3,
+            stats.latency_total_ns / 1e3 / stats.reports, stats.latency_max_ns / 1e3);
+}
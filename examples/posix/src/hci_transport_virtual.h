@@ -0,0 +1,46 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef HCI_TRANSPORT_VIRTUAL_H
+#define HCI_TRANSPORT_VIRTUAL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hci_transport.h"
+
+// Virtual HCI transport: emulates a BR/EDR Bluetooth controller, and a set of synthetic HID
+// controllers connected to it (see virtual_controllers.h).
+// Useful to run the whole stack (BTstack + Bluepad32 + platform) without a Bluetooth dongle,
+// and to measure its throughput and latency.
+//
+// By default the controllers connect one at a time. With "together", all of them power on at the same time,
+// like when several players turn on their gamepads at once, and the host sees them page (or be discovered)
+// in parallel. Once the host finishes setting up a controller, the controller starts streaming input reports.
+
+typedef struct {
+    // Controllers to emulate, separated by commas. E.g: "ds4,ds5,switch,xbox,generic".
+    const char* controllers;
+    // Interval between input reports. 0 means as fast as possible.
+    uint32_t report_interval_ms;
+    // Number of input reports that each controller sends. 0 means forever.
+    uint32_t num_reports;
+    // If true, the controllers wait to be discovered with an inquiry, like when pairing them.
+    // Otherwise, they connect to the host, like when reconnecting an already paired controller.
+    bool discover;
+    // If true, all the controllers connect (or are discovered) at the same time, instead of one at a time.
+    bool together;
+    // Called once all the controllers sent "num_reports" reports, or got disconnected.
+    void (*on_done)(void);
+} hci_transport_virtual_config_t;
+
+// Config must be passed to hci_init(). Must be valid while the transport is in use.
+const hci_transport_t* hci_transport_virtual_instance(void);
+
+// Prints the number of reports, throughput and latency.
+void hci_transport_virtual_dump_stats(void);
+// Whether all the controllers got to stream their input reports.
+bool hci_transport_virtual_all_streamed(void);
+
+#endif  // HCI_TRANSPORT_VIRTUAL_H
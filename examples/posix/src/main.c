@@ -74,6 +74,7 @@
 #include "hci_dump_posix_fs.h"
 #include "hci_transport.h"
 #include "hci_transport_usb.h"
+#include "hci_transport_virtual.h"
 
 // Bluepad32 related
 #include <uni.h>
@@ -104,6 +105,18 @@ static btstack_packet_callback_registration_t hci_event_callback_registration;
 // shutdown
 static bool shutdown_triggered;
 
+// Virtual HCI transport, used instead of the USB dongle. See hci_transport_virtual.h
+static bool use_virtual_transport;
+static hci_transport_virtual_config_t virtual_config;
+
+// Capture / replay of the controller reports. See uni_capture.h
+static const char* capture_file_path;
+static const char* replay_file_path;
+static bool replay_fast;
+
+// Size of the device pool. 0: the default one. See uni_hid_device_set_pool()
+static int max_devices;
+
 static void create_instance_tlv(void) {
     tlv_impl = btstack_tlv_posix_init_instance(&tlv_context, tlv_db_path);
     btstack_tlv_set_instance(tlv_impl, &tlv_context);
@@ -210,10 +223,13 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
                     btstack_tlv_posix_deinit(&tlv_context);
                     if (!shutdown_triggered)
                         break;
+                    // Flush the capture file
+                    uni_capture_stop();
                     // reset stdin
                     btstack_stdin_reset();
                     log_info("Good bye, see you.\n");
-                    exit(0);
+                    // A virtual run fails if a controller couldn't connect.
+                    exit((use_virtual_transport && !hci_transport_virtual_all_streamed()) ? EXIT_FAILURE : 0);
                     break;
                 default:
                     break;
@@ -246,6 +262,21 @@ static void packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
 static void trigger_shutdown(void) {
     printf("CTRL-C - SIGINT received, shutting down..\n");
     log_info("sigint_handler: shutting down");
+    if (use_virtual_transport)
+        hci_transport_virtual_dump_stats();
+    shutdown_triggered = true;
+    hci_power_control(HCI_POWER_OFF);
+}
+
+static void replay_done(void) {
+    printf("Replay done, shutting down..\n");
+    shutdown_triggered = true;
+    hci_power_control(HCI_POWER_OFF);
+}
+
+static void virtual_transport_done(void) {
+    printf("Virtual controllers done, shutting down..\n");
+    hci_transport_virtual_dump_stats();
     shutdown_triggered = true;
     hci_power_control(HCI_POWER_OFF);
 }
@@ -257,12 +288,21 @@ void hal_led_toggle(void) {
     printf("LED State %u\n", led_state);
 }
 
-static char short_options[] = "hu:l:r";
+static char short_options[] = "hu:l:rv:n:i:DTc:p:Fm:";
 
 static struct option long_options[] = {{"help", no_argument, NULL, 'h'},
                                        {"logfile", required_argument, NULL, 'l'},
                                        {"reset-tlv", no_argument, NULL, 'r'},
                                        {"usbpath", required_argument, NULL, 'u'},
+                                       {"virtual", required_argument, NULL, 'v'},
+                                       {"virtual-reports", required_argument, NULL, 'n'},
+                                       {"virtual-interval", required_argument, NULL, 'i'},
+                                       {"virtual-discover", no_argument, NULL, 'D'},
+                                       {"virtual-together", no_argument, NULL, 'T'},
+                                       {"capture", required_argument, NULL, 'c'},
+                                       {"replay", required_argument, NULL, 'p'},
+                                       {"replay-fast", no_argument, NULL, 'F'},
+                                       {"max-devices", required_argument, NULL, 'm'},
                                        {0, 0, 0, 0}};
 
 static char* help_options[] = {
@@ -270,6 +310,15 @@ static char* help_options[] = {
     "set file to store debug output and HCI trace.",
     "reset bonding information stored in TLV.",
     "set USB path to Bluetooth Controller.",
+    "use virtual controllers instead of a dongle. E.g: ds4,ds5,switch,xbox,generic.",
+    "input reports per virtual controller before exiting. 0: forever.",
+    "milliseconds between virtual input reports. 0: as fast as possible.",
+    "virtual controllers wait to be discovered, instead of connecting.",
+    "virtual controllers power on at the same time, instead of one at a time.",
+    "save the reports received from the controllers to a file.",
+    "replay the reports of a capture file, and exit.",
+    "replay as fast as possible, instead of using the original pace.",
+    "max number of devices, up to 32. The default is CONFIG_BLUEPAD32_MAX_DEVICES.",
 };
 
 static char* option_arg_name[] = {
@@ -277,6 +326,15 @@ static char* option_arg_name[] = {
     "LOGFILE",
     "",
     "USBPATH",
+    "CONTROLLERS",
+    "NUM",
+    "MS",
+    "",
+    "",
+    "FILE",
+    "FILE",
+    "",
+    "NUM",
 };
 
 static void usage(const char* name) {
@@ -315,6 +373,34 @@ int main(int argc, const char* argv[]) {
             case 'r':
                 tlv_reset = true;
                 break;
+            case 'v':
+                use_virtual_transport = true;
+                virtual_config.controllers = optarg;
+                break;
+            case 'n':
+                virtual_config.num_reports = strtoul(optarg, NULL, 10);
+                break;
+            case 'i':
+                virtual_config.report_interval_ms = strtoul(optarg, NULL, 10);
+                break;
+            case 'D':
+                virtual_config.discover = true;
+                break;
+            case 'T':
+                virtual_config.together = true;
+                break;
+            case 'c':
+                capture_file_path = optarg;
+                break;
+            case 'p':
+                replay_file_path = optarg;
+                break;
+            case 'F':
+                replay_fast = true;
+                break;
+            case 'm':
+                max_devices = strtoul(optarg, NULL, 10);
+                break;
             case 'h':
             default:
                 usage(argv[0]);
@@ -340,6 +426,12 @@ int main(int argc, const char* argv[]) {
         printf("\n");
     }
 
+    // Replay doesn't need a Bluetooth controller. Use a virtual one without devices.
+    if (replay_file_path != NULL && !use_virtual_transport) {
+        use_virtual_transport = true;
+        virtual_config.controllers = "";
+    }
+
     /// GET STARTED with BTstack ///
     btstack_memory_init();
     btstack_run_loop_init(btstack_run_loop_posix_get_instance());
@@ -350,7 +442,8 @@ int main(int argc, const char* argv[]) {
 
     // log into file using HCI_DUMP_PACKETLOGGER format
     char pklg_path[100];
-    if (log_file_path == NULL) {
+    // Virtual: don't slow down the benchmark with the packet log, unless requested.
+    if (log_file_path == NULL && !use_virtual_transport) {
         btstack_strcpy(pklg_path, sizeof(pklg_path), "/tmp/hci_dump");
         if (usb_path_len) {
             btstack_strcat(pklg_path, sizeof(pklg_path), "_");
@@ -360,13 +453,20 @@ int main(int argc, const char* argv[]) {
         log_file_path = pklg_path;
     }
 
-    hci_dump_posix_fs_open(log_file_path, HCI_DUMP_PACKETLOGGER);
-    const hci_dump_t* hci_dump_impl = hci_dump_posix_fs_get_instance();
-    hci_dump_init(hci_dump_impl);
-    printf("Packet Log: %s\n", log_file_path);
+    if (log_file_path != NULL) {
+        hci_dump_posix_fs_open(log_file_path, HCI_DUMP_PACKETLOGGER);
+        const hci_dump_t* hci_dump_impl = hci_dump_posix_fs_get_instance();
+        hci_dump_init(hci_dump_impl);
+        printf("Packet Log: %s\n", log_file_path);
+    }
 
     // init HCI
-    hci_init(hci_transport_usb_instance(), NULL);
+    if (use_virtual_transport) {
+        virtual_config.on_done = virtual_transport_done;
+        hci_init(hci_transport_virtual_instance(), &virtual_config);
+    } else {
+        hci_init(hci_transport_usb_instance(), NULL);
+    }
 
 #ifdef HAVE_PORTAUDIO
     btstack_audio_sink_set_instance(btstack_audio_portaudio_sink_get_instance());
@@ -383,7 +483,7 @@ int main(int argc, const char* argv[]) {
     // register known Realtek USB Controllers
     uint16_t realtek_num_controllers = btstack_chipset_realtek_get_num_usb_controllers();
     uint16_t i;
-    for (i = 0; i < realtek_num_controllers; i++) {
+    for (i = 0; i < realtek_num_controllers && !use_virtual_transport; i++) {
         uint16_t vendor_id;
         uint16_t product_id;
         btstack_chipset_realtek_get_vendor_product_id(i, &vendor_id, &product_id);
@@ -392,8 +492,22 @@ int main(int argc, const char* argv[]) {
 
     // Must be called before uni_init()
     uni_platform_set_custom(get_my_platform());
+    if (max_devices > 0) {
+        // Lives until the process exits.
+        size_t pool_size = uni_hid_device_get_pool_size(max_devices);
+        void* pool = pool_size > 0 ? malloc(pool_size) : NULL;
+        if (pool == NULL || !uni_hid_device_set_pool(pool, pool_size, max_devices)) {
+            printf("Invalid max devices: %d\n", max_devices);
+            return EXIT_FAILURE;
+        }
+    }
     uni_init(argc, argv);
 
+    if (capture_file_path != NULL && !uni_capture_start_file(capture_file_path))
+        return EXIT_FAILURE;
+    if (replay_file_path != NULL && !uni_capture_replay_file(replay_file_path, replay_fast, replay_done))
+        return EXIT_FAILURE;
+
     // go: does not return
     btstack_run_loop_execute();
 
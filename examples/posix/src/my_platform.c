@@ -25,6 +25,7 @@ enum {
 typedef struct posix_instance_s {
     uni_gamepad_seat_t gamepad_seat;  // which "seat" is being used
 } posix_instance_t;
+_Static_assert(sizeof(posix_instance_t) <= HID_DEVICE_MAX_PLATFORM_DATA, "Posix instance too big");
 
 // Declarations
 static void trigger_event_on_gamepad(uni_hid_device_t* d);
@@ -90,6 +91,14 @@ static void posix_init(int argc, const char** argv) {
     uni_gamepad_set_mappings(&mappings);
 #endif
     uni_gamepad_set_mappings_type(UNI_GAMEPAD_MAPPINGS_TYPE_XBOX);
+
+    // Don't dump idle reports, nor the gyro/accel noise of DualShock4/DualSense.
+    uni_controller_change_filter_t filter = {
+        .only_on_change = true,
+        .gyro = 32,
+        .accel = 32,
+    };
+    uni_controller_set_change_filter(&filter);
     //    uni_bt_service_set_enabled(true);
 }
 
@@ -130,6 +139,9 @@ static void posix_on_device_connected(uni_hid_device_t* d) {
 
 static void posix_on_device_disconnected(uni_hid_device_t* d) {
     logi("posix: device disconnected: %p\n", d);
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+    uni_latency_dump(&d->cold->latency);
+#endif
 }
 
 static uni_error_t posix_on_device_ready(uni_hid_device_t* d) {
@@ -141,21 +153,17 @@ static uni_error_t posix_on_device_ready(uni_hid_device_t* d) {
     return UNI_ERROR_SUCCESS;
 }
 
-static void posix_on_controller_data(uni_hid_device_t* d, uni_controller_t* ctl) {
+static void posix_on_controller_data_changed(uni_hid_device_t* d, uni_controller_t* ctl, uint32_t changes) {
     static uint8_t leds = 0;
     static uint8_t enabled = true;
-    static uni_controller_t prev = {0};
     static ds5_adaptive_trigger_effect_t trigger_effect;
     static int trigger_effect_index_left = 0, trigger_effect_index_right = 0;
     static bool trigger_left_in_progress = false, trigger_right_in_progress = false;
     uni_gamepad_t* gp;
 
-    if (memcmp(&prev, ctl, sizeof(*ctl)) == 0) {
-        return;
-    }
-    prev = *ctl;
+    // Only called when something changed. See posix_init().
     // Print device Id before dumping gamepad.
-    logi("(%p) ", d);
+    logi("(%p) changes=0x%04x ", d, changes);
     uni_controller_dump(ctl);
 
     switch (ctl->klass) {
@@ -295,7 +303,7 @@ static void posix_on_oob_event(uni_platform_oob_event_t event, void* data) {
 // Helpers
 //
 static posix_instance_t* get_posix_instance(uni_hid_device_t* d) {
-    return (posix_instance_t*)&d->platform_data[0];
+    return (posix_instance_t*)&d->cold->platform_data[0];
 }
 
 static void trigger_event_on_gamepad(uni_hid_device_t* d) {
@@ -332,7 +340,7 @@ struct uni_platform* get_my_platform(void) {
         .on_device_disconnected = posix_on_device_disconnected,
         .on_device_ready = posix_on_device_ready,
         .on_oob_event = posix_on_oob_event,
-        .on_controller_data = posix_on_controller_data,
+        .on_controller_data_changed = posix_on_controller_data_changed,
         .get_property = posix_get_property,
     };
 
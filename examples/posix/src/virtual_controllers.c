@@ -0,0 +1,477 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "virtual_controllers.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "btstack_util.h"
+
+// Class of Device: Peripheral, Gamepad
+#define COD_GAMEPAD 0x002508
+
+#define HAT_CENTERED 8
+
+//
+// Helpers
+//
+
+// Triangle wave: 0 -> 254 -> 0 in 256 frames.
+static uint8_t wave(uint32_t frame) {
+    uint8_t t = frame & 0xff;
+    return (t < 128) ? t * 2 : (255 - t) * 2;
+}
+
+// Rotates the d-pad every 32 frames, with a "centered" step in between.
+static uint8_t hat(uint32_t frame) {
+    return (frame / 32) % 9;
+}
+
+// L3 is pressed for 16 frames, released for 16 frames.
+static bool thumb_left(uint32_t frame) {
+    return (frame / 16) & 1;
+}
+
+//
+// DualShock 4 / DualSense: common
+//
+
+// Calibration used by both DS4 (feature 0x02) and DS5 (feature 0x05).
+// Gyro "plus" and "minus" share the same value, since DS4 and DS5 store them in different order.
+static void ps_fill_calibration(uint8_t* report, uint8_t report_id) {
+    report[0] = report_id;
+    int offset = 1;
+    // Gyro bias: pitch, yaw, roll
+    for (int i = 0; i < 3; i++, offset += 2)
+        little_endian_store_16(report, offset, 0);
+    // Gyro plus / minus
+    for (int i = 0; i < 6; i++, offset += 2)
+        little_endian_store_16(report, offset, 8000);
+    // Gyro speed plus / minus
+    for (int i = 0; i < 2; i++, offset += 2)
+        little_endian_store_16(report, offset, 540);
+    // Accel plus / minus: x, y, z
+    for (int i = 0; i < 3; i++, offset += 4) {
+        little_endian_store_16(report, offset, 8192);
+        little_endian_store_16(report, offset + 2, (uint16_t)-8192);
+    }
+}
+
+//
+// DualShock 4
+//
+#define DS4_INPUT_REPORT_SIZE 78
+#define DS4_FEATURE_CALIBRATION 0x02
+#define DS4_FEATURE_CALIBRATION_SIZE 37
+#define DS4_FEATURE_FIRMWARE_VERSION 0xa3
+#define DS4_FEATURE_FIRMWARE_VERSION_SIZE 49
+
+static uint16_t ds4_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    UNUSED(vc);
+
+    memset(report, 0, DS4_INPUT_REPORT_SIZE);
+    report[0] = 0x11;
+    report[1] = 0xc0;
+    // report[3]: start of the "stream" data
+    report[3] = wave(frame);
+    report[4] = wave(frame + 64);
+    report[5] = 0x80;
+    report[6] = 0x80;
+    report[7] = hat(frame);
+    report[8] = thumb_left(frame) ? 0x40 : 0;
+    report[10] = wave(frame + 128);
+    report[11] = wave(frame + 192);
+    return DS4_INPUT_REPORT_SIZE;
+}
+
+static uint16_t ds4_get_feature_report(virtual_controller_t* vc, uint8_t report_id, uint8_t* report) {
+    UNUSED(vc);
+
+    switch (report_id) {
+        case DS4_FEATURE_CALIBRATION:
+            memset(report, 0, DS4_FEATURE_CALIBRATION_SIZE);
+            ps_fill_calibration(report, report_id);
+            return DS4_FEATURE_CALIBRATION_SIZE;
+        case DS4_FEATURE_FIRMWARE_VERSION:
+            memset(report, 0, DS4_FEATURE_FIRMWARE_VERSION_SIZE);
+            report[0] = report_id;
+            memcpy(&report[1], "Sep 21 2023", 11);
+            memcpy(&report[17], "10:20:30", 8);
+            return DS4_FEATURE_FIRMWARE_VERSION_SIZE;
+        default:
+            return 0;
+    }
+}
+
+static uint16_t ds4_on_output_report(virtual_controller_t* vc, const uint8_t* data, uint16_t len, uint8_t* reply) {
+    UNUSED(vc);
+    UNUSED(data);
+    UNUSED(len);
+    UNUSED(reply);
+    // Lightbar and rumble. Nothing to reply.
+    return 0;
+}
+
+//
+// DualSense
+//
+#define DS5_INPUT_REPORT_SIZE 78
+#define DS5_FEATURE_CALIBRATION 0x05
+#define DS5_FEATURE_CALIBRATION_SIZE 41
+#define DS5_FEATURE_PAIRING_INFO 0x09
+#define DS5_FEATURE_PAIRING_INFO_SIZE 20
+#define DS5_FEATURE_FIRMWARE_VERSION 0x20
+#define DS5_FEATURE_FIRMWARE_VERSION_SIZE 64
+
+static uint16_t ds5_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    UNUSED(vc);
+
+    memset(report, 0, DS5_INPUT_REPORT_SIZE);
+    report[0] = 0x31;
+    // report[2]: start of the input report data
+    report[2] = wave(frame);
+    report[3] = wave(frame + 64);
+    report[4] = 0x80;
+    report[5] = 0x80;
+    report[6] = wave(frame + 128);
+    report[7] = wave(frame + 192);
+    report[8] = frame & 0xff;
+    report[9] = hat(frame);
+    report[10] = thumb_left(frame) ? 0x40 : 0;
+    return DS5_INPUT_REPORT_SIZE;
+}
+
+static uint16_t ds5_get_feature_report(virtual_controller_t* vc, uint8_t report_id, uint8_t* report) {
+    switch (report_id) {
+        case DS5_FEATURE_PAIRING_INFO:
+            memset(report, 0, DS5_FEATURE_PAIRING_INFO_SIZE);
+            report[0] = report_id;
+            // Controller address, in reverse order
+            reverse_bd_addr(vc->addr, &report[1]);
+            return DS5_FEATURE_PAIRING_INFO_SIZE;
+        case DS5_FEATURE_FIRMWARE_VERSION:
+            memset(report, 0, DS5_FEATURE_FIRMWARE_VERSION_SIZE);
+            report[0] = report_id;
+            memcpy(&report[1], "Sep 21 2023", 11);
+            memcpy(&report[12], "10:20:30", 8);
+            // Update version: 2.36. Supports "vibration2".
+            little_endian_store_16(report, 44, 0x0224);
+            return DS5_FEATURE_FIRMWARE_VERSION_SIZE;
+        case DS5_FEATURE_CALIBRATION:
+            memset(report, 0, DS5_FEATURE_CALIBRATION_SIZE);
+            ps_fill_calibration(report, report_id);
+            return DS5_FEATURE_CALIBRATION_SIZE;
+        default:
+            return 0;
+    }
+}
+
+static uint16_t ds5_on_output_report(virtual_controller_t* vc, const uint8_t* data, uint16_t len, uint8_t* reply) {
+    UNUSED(vc);
+    UNUSED(data);
+    UNUSED(len);
+    UNUSED(reply);
+    // Lightbar, player LEDs, rumble and adaptive triggers. Nothing to reply.
+    return 0;
+}
+
+//
+// Nintendo Switch Pro
+//
+#define SWITCH_INPUT_REPORT_SIZE 49
+#define SWITCH_OUTPUT_SUBCMD 0x01
+#define SWITCH_OUTPUT_RUMBLE_ONLY 0x10
+#define SWITCH_SUBCMD_REQ_DEV_INFO 0x02
+#define SWITCH_SUBCMD_SET_REPORT_MODE 0x03
+#define SWITCH_SUBCMD_SPI_FLASH_READ 0x10
+#define SWITCH_STICK_CENTER 2048
+#define SWITCH_STICK_RANGE 1400
+
+typedef struct {
+    uint32_t addr;
+    const uint8_t* data;
+    uint8_t len;
+} switch_spi_region_t;
+
+// Left stick: max, center, min. Right stick: center, min, max.
+// 12-bit values: range=1400, center=2048.
+static const uint8_t switch_spi_stick_cal[] = {
+    0x78, 0x85, 0x57, 0x00, 0x08, 0x80, 0x78, 0x85, 0x57,  // Left
+    0x00, 0x08, 0x80, 0x78, 0x85, 0x57, 0x78, 0x85, 0x57,  // Right
+};
+
+// Accel offset, accel scale (16384), gyro offset, gyro scale (13371).
+static const uint8_t switch_spi_imu_cal[] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x40, 0x00, 0x40, 0x00, 0x40,
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x3b, 0x34, 0x3b, 0x34, 0x3b, 0x34,
+};
+
+static const switch_spi_region_t switch_spi_regions[] = {
+    {0x603d, switch_spi_stick_cal, sizeof(switch_spi_stick_cal)},
+    {0x6020, switch_spi_imu_cal, sizeof(switch_spi_imu_cal)},
+};
+
+// Erased flash reads as 0xff. Only the regions used by the parser are populated.
+static void switch_spi_read(uint32_t addr, uint8_t len, uint8_t* out) {
+    memset(out, 0xff, len);
+    for (size_t i = 0; i < sizeof(switch_spi_regions) / sizeof(switch_spi_regions[0]); i++) {
+        const switch_spi_region_t* r = &switch_spi_regions[i];
+        for (uint8_t j = 0; j < len; j++) {
+            if (addr + j >= r->addr && addr + j < r->addr + r->len)
+                out[j] = r->data[addr + j - r->addr];
+        }
+    }
+}
+
+static void switch_store_stick(uint8_t* out, uint16_t x, uint16_t y) {
+    out[0] = x & 0xff;
+    out[1] = ((x >> 8) & 0x0f) | ((y & 0x0f) << 4);
+    out[2] = y >> 4;
+}
+
+static uint16_t switch_stick(uint8_t v) {
+    return SWITCH_STICK_CENTER + ((v - 128) * SWITCH_STICK_RANGE) / 128;
+}
+
+// Fills the fields shared by all the input reports: timer, battery and buttons.
+static void switch_fill_header(virtual_controller_t* vc, uint8_t report_id, uint8_t* report) {
+    memset(report, 0, SWITCH_INPUT_REPORT_SIZE);
+    report[0] = report_id;
+    report[1] = vc->timer++;
+    // Battery full, charging grip
+    report[2] = 0x8e;
+    switch_store_stick(&report[6], SWITCH_STICK_CENTER, SWITCH_STICK_CENTER);
+    switch_store_stick(&report[9], SWITCH_STICK_CENTER, SWITCH_STICK_CENTER);
+}
+
+static uint16_t switch_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    static const uint8_t dpad[] = {
+        0x02,  // Up
+        0x06,  // Up-Right
+        0x04,  // Right
+        0x05,  // Down-Right
+        0x01,  // Down
+        0x09,  // Down-Left
+        0x08,  // Left
+        0x0a,  // Up-Left
+        0x00,  // Centered
+    };
+
+    // Until the host requests the "standard full" mode, the controller doesn't stream reports.
+    if (vc->report_mode != 0x30)
+        return 0;
+
+    switch_fill_header(vc, 0x30, report);
+    report[4] = thumb_left(frame) ? 0x08 : 0;
+    report[5] = dpad[hat(frame)];
+    switch_store_stick(&report[6], switch_stick(wave(frame)), switch_stick(wave(frame + 64)));
+    return SWITCH_INPUT_REPORT_SIZE;
+}
+
+static uint16_t switch_on_output_report(virtual_controller_t* vc, const uint8_t* data, uint16_t len, uint8_t* reply) {
+    // data[0]: report id, data[1]: packet number, data[2-9]: rumble, data[10]: sub-command, data[11]: args
+    if (len < 11 || data[0] != SWITCH_OUTPUT_SUBCMD)
+        return 0;
+
+    uint8_t subcmd = data[10];
+    const uint8_t* args = &data[11];
+    int args_len = len - 11;
+
+    switch_fill_header(vc, 0x21, reply);
+    reply[12] = 0x80;
+    reply[13] = 0x80;  // ACK
+    reply[14] = subcmd;
+    uint8_t* out = &reply[15];
+
+    switch (subcmd) {
+        case SWITCH_SUBCMD_REQ_DEV_INFO:
+            reply[13] = 0x82;
+            out[0] = 0x04;  // Firmware 4.33
+            out[1] = 0x21;
+            out[2] = 0x03;  // Pro Controller
+            out[3] = 0x02;
+            memcpy(&out[4], vc->addr, 6);
+            out[10] = 0x01;
+            out[11] = 0x01;
+            break;
+        case SWITCH_SUBCMD_SET_REPORT_MODE:
+            if (args_len >= 1)
+                vc->report_mode = args[0];
+            break;
+        case SWITCH_SUBCMD_SPI_FLASH_READ: {
+            if (args_len < 5)
+                break;
+            uint32_t addr = little_endian_read_32(args, 0);
+            // 15 bytes of header, 5 bytes of address + size.
+            uint8_t size = btstack_min(args[4], SWITCH_INPUT_REPORT_SIZE - 15 - 5);
+            reply[13] = 0x90;
+            little_endian_store_32(out, 0, addr);
+            out[4] = size;
+            switch_spi_read(addr, size, &out[5]);
+            break;
+        }
+        default:
+            // Player LEDs, enable IMU, etc: just ACK it.
+            break;
+    }
+    return SWITCH_INPUT_REPORT_SIZE;
+}
+
+//
+// Xbox One (firmware v3.1) and generic HID gamepad
+//
+
+// Report ID 1: X, Y, Rx, Ry (16-bit), Z, Rz (10-bit), hat, 16 buttons.
+// Valid for both the Xbox (firmware v3.1) parser and the generic one.
+static const uint8_t hid_gamepad_descriptor[] = {
+    0x05, 0x01,                    // Usage Page (Generic Desktop)
+    0x09, 0x05,                    // Usage (Game Pad)
+    0xa1, 0x01,                    // Collection (Application)
+    0x85, 0x01,                    //   Report ID (1)
+    0x09, 0x30,                    //   Usage (X)
+    0x09, 0x31,                    //   Usage (Y)
+    0x09, 0x33,                    //   Usage (Rx)
+    0x09, 0x34,                    //   Usage (Ry)
+    0x15, 0x00,                    //   Logical Minimum (0)
+    0x27, 0xff, 0xff, 0x00, 0x00,  //   Logical Maximum (65535)
+    0x75, 0x10,                    //   Report Size (16)
+    0x95, 0x04,                    //   Report Count (4)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x09, 0x32,                    //   Usage (Z)
+    0x09, 0x35,                    //   Usage (Rz)
+    0x26, 0xff, 0x03,              //   Logical Maximum (1023)
+    0x95, 0x02,                    //   Report Count (2)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0x09, 0x39,                    //   Usage (Hat switch)
+    0x15, 0x01,                    //   Logical Minimum (1)
+    0x25, 0x08,                    //   Logical Maximum (8)
+    0x35, 0x00,                    //   Physical Minimum (0)
+    0x46, 0x3b, 0x01,              //   Physical Maximum (315)
+    0x66, 0x14, 0x00,              //   Unit (Degrees)
+    0x75, 0x04,                    //   Report Size (4)
+    0x95, 0x01,                    //   Report Count (1)
+    0x81, 0x42,                    //   Input (Data,Var,Abs,Null)
+    0x65, 0x00,                    //   Unit (None)
+    0x45, 0x00,                    //   Physical Maximum (0)
+    0x81, 0x03,                    //   Input (Const): 4-bit padding
+    0x05, 0x09,                    //   Usage Page (Button)
+    0x19, 0x01,                    //   Usage Minimum (1)
+    0x29, 0x10,                    //   Usage Maximum (16)
+    0x15, 0x00,                    //   Logical Minimum (0)
+    0x25, 0x01,                    //   Logical Maximum (1)
+    0x75, 0x01,                    //   Report Size (1)
+    0x95, 0x10,                    //   Report Count (16)
+    0x81, 0x02,                    //   Input (Data,Var,Abs)
+    0xc0,                          // End Collection
+};
+
+#define HID_GAMEPAD_REPORT_SIZE 16
+
+static uint16_t hid_gamepad_get_input_report(virtual_controller_t* vc, uint32_t frame, uint8_t* report) {
+    UNUSED(vc);
+
+    memset(report, 0, HID_GAMEPAD_REPORT_SIZE);
+    report[0] = 0x01;
+    little_endian_store_16(report, 1, wave(frame) * 257);
+    little_endian_store_16(report, 3, wave(frame + 64) * 257);
+    little_endian_store_16(report, 5, 0x8000);
+    little_endian_store_16(report, 7, 0x8000);
+    little_endian_store_16(report, 9, wave(frame + 128) * 4);
+    little_endian_store_16(report, 11, wave(frame + 192) * 4);
+    // Hat: 1-8. 0 (out of range) means centered.
+    uint8_t h = hat(frame);
+    report[13] = (h == HAT_CENTERED) ? 0 : h + 1;
+    // Button 9: Thumb left
+    report[15] = thumb_left(frame) ? 0x01 : 0;
+    return HID_GAMEPAD_REPORT_SIZE;
+}
+
+static uint16_t hid_gamepad_on_output_report(virtual_controller_t* vc,
+                                             const uint8_t* data,
+                                             uint16_t len,
+                                             uint8_t* reply) {
+    UNUSED(vc);
+    UNUSED(data);
+    UNUSED(len);
+    UNUSED(reply);
+    // Rumble. Nothing to reply.
+    return 0;
+}
+
+static const virtual_controller_model_t models[] = {
+    {
+        .id = "ds4",
+        .name = "Wireless Controller",
+        .cod = COD_GAMEPAD,
+        .vendor_id = 0x054c,
+        .product_id = 0x09cc,
+        .get_input_report = ds4_get_input_report,
+        .get_feature_report = ds4_get_feature_report,
+        .on_output_report = ds4_on_output_report,
+    },
+    {
+        .id = "ds5",
+        .name = "DualSense Wireless Controller",
+        .cod = COD_GAMEPAD,
+        .vendor_id = 0x054c,
+        .product_id = 0x0ce6,
+        .get_input_report = ds5_get_input_report,
+        .get_feature_report = ds5_get_feature_report,
+        .on_output_report = ds5_on_output_report,
+    },
+    {
+        .id = "switch",
+        .name = "Pro Controller",
+        .cod = COD_GAMEPAD,
+        .vendor_id = 0x057e,
+        .product_id = 0x2009,
+        .get_input_report = switch_get_input_report,
+        .on_output_report = switch_on_output_report,
+    },
+    {
+        .id = "xbox",
+        .name = "Xbox Wireless Controller",
+        .cod = COD_GAMEPAD,
+        .vendor_id = 0x045e,
+        .product_id = 0x02e0,
+        .hid_descriptor = hid_gamepad_descriptor,
+        .hid_descriptor_len = sizeof(hid_gamepad_descriptor),
+        .get_input_report = hid_gamepad_get_input_report,
+        .on_output_report = hid_gamepad_on_output_report,
+    },
+    {
+        // Not in the controller database: uses the generic (Android) parser.
+        .id = "generic",
+        .name = "Bluepad32 Virtual Gamepad",
+        .cod = COD_GAMEPAD,
+        .vendor_id = 0x1209,
+        .product_id = 0xb932,
+        .hid_descriptor = hid_gamepad_descriptor,
+        .hid_descriptor_len = sizeof(hid_gamepad_descriptor),
+        .get_input_report = hid_gamepad_get_input_report,
+        .on_output_report = hid_gamepad_on_output_report,
+    },
+};
+
+const virtual_controller_model_t* virtual_controller_find_model(const char* id) {
+    for (size_t i = 0; i < sizeof(models) / sizeof(models[0]); i++) {
+        if (strcmp(models[i].id, id) == 0)
+            return &models[i];
+    }
+    return NULL;
+}
+
+const char* virtual_controller_get_model_ids(void) {
+    return "ds4,ds5,switch,xbox,generic";
+}
+
+void virtual_controller_init(virtual_controller_t* vc, const virtual_controller_model_t* model, int idx) {
+    static const uint8_t base_addr[6] = {0x00, 0x1b, 0xdc, 0xb9, 0x32, 0x00};
+
+    memset(vc, 0, sizeof(*vc));
+    vc->model = model;
+    memcpy(vc->addr, base_addr, sizeof(vc->addr));
+    vc->addr[5] = idx + 1;
+}
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef VIRTUAL_CONTROLLERS_H
+#define VIRTUAL_CONTROLLERS_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Synthetic controllers used by the virtual HCI transport.
+// They only emulate the HID part: the reports, and the replies to the requests that the
+// Bluepad32 parsers send during setup. Bluetooth is emulated in hci_transport_virtual.c.
+
+// Max size of an input, output or feature report, without the HID header.
+#define VIRTUAL_CONTROLLER_MAX_REPORT_SIZE 100
+
+typedef struct virtual_controller_s virtual_controller_t;
+
+typedef struct {
+    // As used in the command line. E.g: "ds4".
+    const char* id;
+    // Bluetooth name, returned by the Remote Name Request.
+    const char* name;
+    uint32_t cod;
+    // Returned in the SDP PnP record.
+    uint16_t vendor_id;
+    uint16_t product_id;
+    // Returned in the SDP HID record. Might be NULL.
+    const uint8_t* hid_descriptor;
+    uint16_t hid_descriptor_len;
+
+    // Fills the input report for the given frame, without the HID header (0xa1).
+    // Returns its length, or 0 if the controller is not ready to stream reports yet.
+    uint16_t (*get_input_report)(virtual_controller_t* vc, uint32_t frame, uint8_t* report);
+    // Fills the feature report requested with a GET_REPORT, without the HID header (0xa3).
+    // Returns its length, or 0 if not supported.
+    uint16_t (*get_feature_report)(virtual_controller_t* vc, uint8_t report_id, uint8_t* report);
+    // Called for each output report received in the interrupt channel, without the HID header (0xa2).
+    // Might fill an input report as reply. Returns its length, or 0 if there is no reply.
+    uint16_t (*on_output_report)(virtual_controller_t* vc, const uint8_t* data, uint16_t len, uint8_t* reply);
+} virtual_controller_model_t;
+
+struct virtual_controller_s {
+    const virtual_controller_model_t* model;
+    uint8_t addr[6];
+    // Switch: input report mode requested by the host.
+    uint8_t report_mode;
+    // Switch: timer that is included in every report.
+    uint8_t timer;
+};
+
+// Returns NULL if there is no model with that id.
+const virtual_controller_model_t* virtual_controller_find_model(const char* id);
+// Ids of all the models, separated with commas.
+const char* virtual_controller_get_model_ids(void);
+// "idx" is used to generate a unique Bluetooth address.
+void virtual_controller_init(virtual_controller_t* vc, const virtual_controller_model_t* model, int idx);
+
+#endif  // VIRTUAL_CONTROLLERS_H
@@ -81,6 +81,11 @@ static struct {
     struct arg_end* end;
 } getprop_args;
 
+static struct {
+    struct arg_lit* reset;
+    struct arg_end* end;
+} latency_args;
+
 static int list_devices(int argc, char** argv) {
     // FIXME: Should not belong to "bluetooth"
     uni_bt_dump_devices_safe();
@@ -210,6 +215,26 @@ static int list_bluetooth_keys(int argc, char** argv) {
     return 0;
 }
 
+static int latency(int argc, char** argv) {
+    int nerrors = arg_parse(argc, argv, (void**)&latency_args);
+    if (nerrors != 0) {
+        arg_print_errors(stderr, latency_args.end, argv[0]);
+        return 1;
+    }
+
+    if (latency_args.reset->count > 0) {
+        uni_bt_reset_latency_safe();
+        logi("Done\n");
+        return 0;
+    }
+
+    uni_bt_dump_latency_safe();
+    // This function prints to console. print bp32> after a delay
+    TickType_t ticks = pdMS_TO_TICKS(250);
+    vTaskDelay(ticks);
+    return 0;
+}
+
 static int del_bluetooth_keys(int argc, char** argv) {
     ARG_UNUSED(argc);
     ARG_UNUSED(argv);
@@ -230,7 +255,7 @@ static int disconnect_device(int argc, char** argv) {
     }
 
     idx = disconnect_device_args.idx->ival[0];
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES)
+    if (idx < 0 || idx >= uni_hid_device_get_max_devices())
         return 1;
 
     uni_bt_disconnect_device_safe(idx);
@@ -352,7 +377,7 @@ static void register_bluepad32() {
     ble_enable_args.enabled = arg_int1(NULL, NULL, "<0 | 1>", "Whether to enable Bluetooth Low Energy (BLE)");
     ble_enable_args.end = arg_end(2);
 
-    snprintf(buf_disconnect, sizeof(buf_disconnect) - 1, "<0 - %d>", CONFIG_BLUEPAD32_MAX_DEVICES - 1);
+    snprintf(buf_disconnect, sizeof(buf_disconnect) - 1, "<0 - %d>", uni_hid_device_get_max_devices() - 1);
     disconnect_device_args.idx = arg_int1(NULL, NULL, buf_disconnect, "Device index to disconnect");
     disconnect_device_args.end = arg_end(2);
 
@@ -367,6 +392,9 @@ static void register_bluepad32() {
     getprop_args.prop = arg_str1(NULL, NULL, "<property_name>", "Return property value");
     getprop_args.end = arg_end(2);
 
+    latency_args.reset = arg_lit0("r", "reset", "Reset the statistics");
+    latency_args.end = arg_end(2);
+
     const esp_console_cmd_t cmd_list_devices = {
         .command = "list_devices",
         .help = "List info about connected devices",
@@ -491,6 +519,21 @@ static void register_bluepad32() {
         .argtable = &getprop_args,
     };
 
+    const esp_console_cmd_t cmd_latency = {
+        .command = "latency",
+        .help =
+            "Show the latency statistics of the connected devices, in microseconds,\n"
+            "when CONFIG_BLUEPAD32_LATENCY_STATS is enabled:\n"
+            "  inter-arrival: time between input reports\n"
+            "  parse: from the reception of the report until it is parsed\n"
+            "  callback: time spent in the platform callback\n"
+            "  total: from the reception of the report until the platform callback returns\n"
+            "And the time, in milliseconds, that BR/EDR devices spend in each connection stage",
+        .hint = NULL,
+        .func = &latency,
+        .argtable = &latency_args,
+    };
+
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_list_devices));
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_disconnect_device));
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_gap_security_level));
@@ -506,6 +549,7 @@ static void register_bluepad32() {
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_mouse_scale));
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_virtual_device_enable));
     ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_getprop));
+    ESP_ERROR_CHECK(esp_console_cmd_register(&cmd_latency));
 }
 #endif  // CONFIG_BLUEPAD32_USB_CONSOLE_ENABLE
 
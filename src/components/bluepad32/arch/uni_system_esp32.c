@@ -2,8 +2,15 @@
 // Copyright 2024 Ricardo Quesada
 // http://retro.moe/unijoysticle2
 
+#include "uni_system.h"
+
 #include <esp_system.h>
+#include <esp_timer.h>
 
 void uni_system_reboot(void) {
     esp_restart();
+}
+
+uint64_t uni_system_get_time_us(void) {
+    return esp_timer_get_time();
 }
\ No newline at end of file
@@ -64,6 +64,7 @@
 #include "bt/uni_bt_bredr.h"
 #include "bt/uni_bt_hci_cmd.h"
 #include "bt/uni_bt_le.h"
+#include "bt/uni_bt_pipeline.h"
 #include "bt/uni_bt_service.h"
 #include "bt/uni_bt_setup.h"
 #include "platform/uni_platform.h"
@@ -93,6 +94,8 @@ enum {
     CMD_DISCONNECT_DEVICE,
     CMD_BLE_SERVICE_ENABLE,
     CMD_BLE_SERVICE_DISABLE,
+    CMD_DUMP_LATENCY,
+    CMD_RESET_LATENCY,
 };
 
 static void bluetooth_del_keys(void) {
@@ -214,6 +217,14 @@ static void cmd_callback(void* context) {
         case CMD_BLE_SERVICE_DISABLE:
             uni_bt_service_set_enabled(false);
             break;
+        case CMD_DUMP_LATENCY:
+            uni_hid_device_dump_latency_all();
+            uni_bt_pipeline_dump_stats();
+            break;
+        case CMD_RESET_LATENCY:
+            uni_hid_device_reset_latency_all();
+            uni_bt_pipeline_reset_stats();
+            break;
         default:
             loge("Unknown command: %#x\n", cmd);
             break;
@@ -264,6 +275,18 @@ void uni_bt_dump_devices_safe(void) {
     btstack_run_loop_execute_on_main_thread(&cmd_callback_registration);
 }
 
+void uni_bt_dump_latency_safe(void) {
+    cmd_callback_registration.callback = &cmd_callback;
+    cmd_callback_registration.context = (void*)CMD_DUMP_LATENCY;
+    btstack_run_loop_execute_on_main_thread(&cmd_callback_registration);
+}
+
+void uni_bt_reset_latency_safe(void) {
+    cmd_callback_registration.callback = &cmd_callback;
+    cmd_callback_registration.context = (void*)CMD_RESET_LATENCY;
+    btstack_run_loop_execute_on_main_thread(&cmd_callback_registration);
+}
+
 void uni_bt_disconnect_device_safe(int device_idx) {
     unsigned long idx = (unsigned long)device_idx;
     cmd_callback_registration.callback = &cmd_callback;
@@ -399,6 +422,11 @@ void uni_bt_packet_handler(uint8_t packet_type, uint16_t channel, uint8_t* packe
                 case HCI_EVENT_LINK_KEY_REQUEST:
                     logi("--> HCI_EVENT_LINK_KEY_REQUEST:\n");
                     break;
+                case HCI_EVENT_LINK_KEY_NOTIFICATION:
+                    logi("--> HCI_EVENT_LINK_KEY_NOTIFICATION\n");
+                    if (IS_ENABLED(UNI_ENABLE_BREDR))
+                        uni_bt_bredr_on_hci_link_key_notification(channel, packet, size);
+                    break;
                 case HCI_EVENT_ROLE_CHANGE:
                     logi("--> HCI_EVENT_ROLE_CHANGE\n");
                     break;
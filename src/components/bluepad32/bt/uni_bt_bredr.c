@@ -13,12 +13,16 @@
 
 #include "bt/uni_bt.h"
 #include "bt/uni_bt_allowlist.h"
+#include "bt/uni_bt_bredr_cache.h"
 #include "bt/uni_bt_defines.h"
+#include "bt/uni_bt_pipeline.h"
 #include "bt/uni_bt_sdp.h"
 #include "platform/uni_platform.h"
+#include "uni_capture.h"
 #include "uni_common.h"
 #include "uni_config.h"
 #include "uni_log.h"
+#include "uni_system.h"
 
 // These are the only two supported platforms with BR/EDR support.
 #if !(defined(CONFIG_IDF_TARGET_ESP32) || defined(CONFIG_TARGET_POSIX) || defined(CONFIG_TARGET_PICO_W))
@@ -26,7 +30,7 @@
 #endif
 
 #define INQUIRY_REMOTE_NAME_TIMEOUT_MS 4500
-_Static_assert(INQUIRY_REMOTE_NAME_TIMEOUT_MS < HID_DEVICE_CONNECTION_TIMEOUT_MS, "Timeout too big");
+_Static_assert(INQUIRY_REMOTE_NAME_TIMEOUT_MS < UNI_BT_PIPELINE_NAME_TIMEOUT_MS, "Timeout too big");
 
 static bool bt_bredr_enabled = true;
 
@@ -38,6 +42,7 @@ static void l2cap_create_control_connection(uni_hid_device_t* d) {
         loge("\nConnecting or Auth to HID Control failed: 0x%02x", status);
     } else {
         uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_L2CAP_CONTROL_CONNECTION_REQUESTED);
+        uni_bt_pipeline_set_stage(d, UNI_BT_PIPELINE_STAGE_L2CAP);
     }
 }
 
@@ -61,6 +66,30 @@ static void inquiry_remote_name_timeout_callback(btstack_timer_source_t* ts) {
     uni_bt_bredr_process_fsm(d);
 }
 
+// Called by the pipeline when it is the turn of the device: BTstack can only do one name request at the time.
+static void remote_name_request_start(uni_hid_device_t* d) {
+    uint8_t status;
+
+    if (d->conn.clock_offset & UNI_BT_CLOCK_OFFSET_VALID)
+        status = gap_remote_name_request(d->conn.btaddr, d->conn.page_scan_repetition_mode, d->conn.clock_offset);
+    else
+        status = gap_remote_name_request(d->conn.btaddr, 0x02, 0x0000);
+
+    uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_REMOTE_NAME_INQUIRED);
+
+    // Some devices might not respond to the name request
+    btstack_run_loop_set_timer(&d->cold->inquiry_remote_name_timer, INQUIRY_REMOTE_NAME_TIMEOUT_MS);
+    btstack_run_loop_set_timer_context(&d->cold->inquiry_remote_name_timer, d);
+    btstack_run_loop_set_timer_handler(&d->cold->inquiry_remote_name_timer, &inquiry_remote_name_timeout_callback);
+    btstack_run_loop_add_timer(&d->cold->inquiry_remote_name_timer);
+
+    if (status) {
+        // There won't be a "remote name request complete" event. The timer fakes the name.
+        loge("Failed to request name for %s, error=0x%02x\n", bd_addr_to_str(d->conn.btaddr), status);
+        uni_bt_pipeline_release(UNI_BT_PIPELINE_RESOURCE_NAME);
+    }
+}
+
 void uni_bt_bredr_scan_start(void) {
     uint8_t status;
 
@@ -85,19 +114,19 @@ void uni_bt_bredr_scan_stop(void) {
 void uni_bt_bredr_disconnect(uni_hid_device_t* d) {
     if (gap_get_connection_type(d->conn.handle) != GAP_CONNECTION_INVALID) {
         gap_disconnect(d->conn.handle);
-        d->conn.handle = UNI_BT_CONN_HANDLE_INVALID;
+        uni_hid_device_set_connection_handle(d, UNI_BT_CONN_HANDLE_INVALID);
     } else {
         // After calling gap_disconnect() we should not call l2cap_disonnect(),
         // since gap_disconnect() will take care of it.
         // But if the handle is not present, then call it manually.
         if (d->conn.control_cid) {
             l2cap_disconnect(d->conn.control_cid);
-            d->conn.control_cid = 0;
+            uni_hid_device_set_control_cid(d, 0);
         }
 
         if (d->conn.interrupt_cid) {
             l2cap_disconnect(d->conn.interrupt_cid);
-            d->conn.interrupt_cid = 0;
+            uni_hid_device_set_interrupt_cid(d, 0);
         }
     }
 }
@@ -124,6 +153,9 @@ void uni_bt_bredr_delete_bonded_keys(void) {
 
     logi(".\n");
     gap_link_key_iterator_done(&it);
+
+    // Entries are useless without their link keys.
+    uni_bt_bredr_cache_delete_all();
 }
 
 void uni_bt_bredr_list_bonded_keys(void) {
@@ -190,6 +222,50 @@ bool uni_bt_bredr_is_enabled(void) {
     return bt_bredr_enabled;
 }
 
+// Everything needed was fetched. Stored in the cache, so that the next connection doesn't need to fetch it again.
+static void device_ready(uni_hid_device_t* d) {
+    uni_bt_bredr_cache_store(d);
+    uni_bt_pipeline_set_stage(d, UNI_BT_PIPELINE_STAGE_SETUP);
+    uni_hid_device_set_ready(d);
+}
+
+// Known controller: name, VID/PID and HID descriptor are taken from the cache.
+// Outgoing connections skip the remote name request and go straight to L2CAP. Except the ones that need
+// an SDP query before connecting, that still do it.
+// Incoming connections are ready once their L2CAP channels are open.
+// Returns true if the cache was used.
+static bool process_fsm_from_cache(uni_hid_device_t* d, uni_bt_conn_state_t state) {
+    if (uni_hid_device_is_incoming(d)) {
+        if (state != UNI_BT_CONN_STATE_L2CAP_INTERRUPT_CONNECTED)
+            return false;
+    } else if (state != UNI_BT_CONN_STATE_DEVICE_DISCOVERED && state != UNI_BT_CONN_STATE_REMOTE_NAME_FETCHED) {
+        return false;
+    }
+
+    if (!uni_bt_bredr_cache_load(d))
+        return false;
+
+    if (!uni_hid_device_is_incoming(d) && d->cold->sdp_query_type == SDP_QUERY_BEFORE_CONNECT) {
+        logi("uni_bt_process_fsm: starting SDP query before connecting (cached)\n");
+        uni_bt_sdp_query_start(d);
+        /* 'd' might be invalid */
+        return true;
+    }
+
+    d->cold->sdp_query_type = SDP_QUERY_NOT_NEEDED;
+    uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_SDP_HID_DESCRIPTOR_FETCHED);
+
+    if (uni_hid_device_is_incoming(d)) {
+        logi("uni_bt_process_fsm: Device is ready (cached)\n");
+        uni_bt_pipeline_set_stage(d, UNI_BT_PIPELINE_STAGE_SETUP);
+        uni_hid_device_set_ready(d);
+    } else {
+        logi("uni_bt_process_fsm: Starting L2CAP connection (cached)\n");
+        l2cap_create_control_connection(d);
+    }
+    return true;
+}
+
 void uni_bt_bredr_process_fsm(uni_hid_device_t* d) {
     // TODO: Move to uni_bt_bredr.c
 
@@ -216,48 +292,40 @@ void uni_bt_bredr_process_fsm(uni_hid_device_t* d) {
     logi("uni_bt_process_fsm, bd addr:%s,  state: %d, incoming:%d\n", bd_addr_to_str(d->conn.btaddr), state,
          uni_hid_device_is_incoming(d));
 
+    if (process_fsm_from_cache(d, state))
+        return;
+
     // Does it have a name?
     // The name is fetched at the very beginning, when we initiate the connection,
     // Or at the very end, when it is an incoming connection.
     if (!uni_hid_device_has_name(d) &&
         ((state == UNI_BT_CONN_STATE_DEVICE_DISCOVERED) || state == UNI_BT_CONN_STATE_L2CAP_INTERRUPT_CONNECTED)) {
         logi("uni_bt_process_fsm: requesting name\n");
-
-        if (d->conn.clock_offset & UNI_BT_CLOCK_OFFSET_VALID)
-            gap_remote_name_request(d->conn.btaddr, d->conn.page_scan_repetition_mode, d->conn.clock_offset);
-        else
-            gap_remote_name_request(d->conn.btaddr, 0x02, 0x0000);
-
-        uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_REMOTE_NAME_INQUIRED);
-
-        // Some devices might not respond to the name request
-        btstack_run_loop_set_timer(&d->inquiry_remote_name_timer, INQUIRY_REMOTE_NAME_TIMEOUT_MS);
-        btstack_run_loop_set_timer_context(&d->inquiry_remote_name_timer, d);
-        btstack_run_loop_set_timer_handler(&d->inquiry_remote_name_timer, &inquiry_remote_name_timeout_callback);
-        btstack_run_loop_add_timer(&d->inquiry_remote_name_timer);
+        uni_bt_pipeline_acquire(d, UNI_BT_PIPELINE_RESOURCE_NAME, remote_name_request_start);
+        /* 'd' might be invalid */
         return;
     }
 
     if (state == UNI_BT_CONN_STATE_REMOTE_NAME_FETCHED) {
         // TODO: Move comparison to DS4 code
-        if (strcmp("Wireless Controller", d->name) == 0) {
+        if (strcmp("Wireless Controller", d->cold->name) == 0) {
             logi("uni_bt_process_fsm: gamepad is 'Wireless Controller', starting SDP query\n");
-            d->sdp_query_type = SDP_QUERY_BEFORE_CONNECT;
+            d->cold->sdp_query_type = SDP_QUERY_BEFORE_CONNECT;
             uni_bt_sdp_query_start(d);
             /* 'd' might be invalid */
             return;
         }
 
-        if (uni_hid_device_guess_controller_type_from_name(d, d->name)) {
+        if (uni_hid_device_guess_controller_type_from_name(d, d->cold->name)) {
             logi("uni_bt_process_fsm: Guess controller from name\n");
-            d->sdp_query_type = SDP_QUERY_NOT_NEEDED;
+            d->cold->sdp_query_type = SDP_QUERY_NOT_NEEDED;
             uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_SDP_HID_DESCRIPTOR_FETCHED);
         }
 
         if (uni_hid_device_is_incoming(d)) {
-            if (d->sdp_query_type == SDP_QUERY_NOT_NEEDED) {
+            if (d->cold->sdp_query_type == SDP_QUERY_NOT_NEEDED) {
                 logi("uni_bt_process_fsm: Device is ready\n");
-                uni_hid_device_set_ready(d);
+                device_ready(d);
             } else {
                 logi("uni_bt_process_fsm: starting SDP query\n");
                 uni_bt_sdp_query_start(d);
@@ -279,17 +347,17 @@ void uni_bt_bredr_process_fsm(uni_hid_device_t* d) {
 
     if (state == UNI_BT_CONN_STATE_SDP_HID_DESCRIPTOR_FETCHED) {
         if (uni_hid_device_is_incoming(d)) {
-            uni_hid_device_set_ready(d);
+            device_ready(d);
             return;
         }
 
         // Not incoming
-        if (d->sdp_query_type == SDP_QUERY_BEFORE_CONNECT) {
+        if (d->cold->sdp_query_type == SDP_QUERY_BEFORE_CONNECT) {
             logi("uni_bt_process_fsm: Starting L2CAP connection\n");
             l2cap_create_control_connection(d);
         } else {
             logi("uni_bt_process_fsm: Device is ready\n");
-            uni_hid_device_set_ready(d);
+            device_ready(d);
         }
         return;
     }
@@ -302,11 +370,11 @@ void uni_bt_bredr_process_fsm(uni_hid_device_t* d) {
         }
 
         if (state == UNI_BT_CONN_STATE_L2CAP_INTERRUPT_CONNECTED) {
-            switch (d->sdp_query_type) {
+            switch (d->cold->sdp_query_type) {
                 case SDP_QUERY_BEFORE_CONNECT:
                 case SDP_QUERY_NOT_NEEDED:
                     logi("uni_bt_process_fsm: Device is ready\n");
-                    uni_hid_device_set_ready(d);
+                    device_ready(d);
                     break;
                 case SDP_QUERY_AFTER_CONNECT:
                     logi("uni_bt_process_fsm: starting SDP query\n");
@@ -375,8 +443,9 @@ void uni_bt_bredr_on_l2cap_incoming_connection(uint16_t channel, const uint8_t*
             }
             l2cap_accept_connection(channel);
             uni_hid_device_set_connection_handle(device, handle);
-            device->conn.control_cid = channel;
+            uni_hid_device_set_control_cid(device, channel);
             uni_hid_device_set_incoming(device, true);
+            uni_bt_pipeline_set_stage(device, UNI_BT_PIPELINE_STAGE_L2CAP);
             break;
         case PSM_HID_INTERRUPT:
             if (device == NULL) {
@@ -384,7 +453,7 @@ void uni_bt_bredr_on_l2cap_incoming_connection(uint16_t channel, const uint8_t*
                 l2cap_decline_connection(channel);
                 break;
             }
-            device->conn.interrupt_cid = channel;
+            uni_hid_device_set_interrupt_cid(device, channel);
             l2cap_accept_connection(channel);
             break;
         default:
@@ -423,6 +492,7 @@ void uni_bt_bredr_on_l2cap_channel_opened(uint16_t channel, const uint8_t* packe
         }
         logi("Removing key for device: %s.\n", bd_addr_to_str(address));
         gap_drop_link_key_for_bd_addr(device->conn.btaddr);
+        uni_bt_bredr_cache_delete(device->conn.btaddr);
         uni_hid_device_disconnect(device);
         uni_hid_device_delete(device);
         /* 'device' is destroyed, don't use */
@@ -443,12 +513,12 @@ void uni_bt_bredr_on_l2cap_channel_opened(uint16_t channel, const uint8_t* packe
 
     switch (psm) {
         case PSM_HID_CONTROL:
-            device->conn.control_cid = l2cap_event_channel_opened_get_local_cid(packet);
+            uni_hid_device_set_control_cid(device, l2cap_event_channel_opened_get_local_cid(packet));
             logi("HID Control opened, cid 0x%02x\n", device->conn.control_cid);
             uni_bt_conn_set_state(&device->conn, UNI_BT_CONN_STATE_L2CAP_CONTROL_CONNECTED);
             break;
         case PSM_HID_INTERRUPT:
-            device->conn.interrupt_cid = l2cap_event_channel_opened_get_local_cid(packet);
+            uni_hid_device_set_interrupt_cid(device, l2cap_event_channel_opened_get_local_cid(packet));
             logi("HID Interrupt opened, cid 0x%02x\n", device->conn.interrupt_cid);
             uni_bt_conn_set_state(&device->conn, UNI_BT_CONN_STATE_L2CAP_INTERRUPT_CONNECTED);
 
@@ -483,6 +553,8 @@ void uni_bt_bredr_on_l2cap_channel_closed(uint16_t channel, const uint8_t* packe
 
 void uni_bt_bredr_on_l2cap_data_packet(uint16_t channel, const uint8_t* packet, uint16_t size) {
     uni_hid_device_t* d;
+    // Before anything else, so that the latency stats include the lookup and the checks.
+    uint64_t received_us = uni_system_get_time_us();
 
     d = uni_hid_device_get_instance_for_cid(channel);
     if (d == NULL) {
@@ -500,6 +572,7 @@ void uni_bt_bredr_on_l2cap_data_packet(uint16_t channel, const uint8_t* packet,
 
     if (channel == d->conn.control_cid) {
         // Feature report
+        uni_capture_on_feature_report(d, &packet[1], size - 1);
         if (d->report_parser.parse_feature_report)
             // Skip the first byte which must be 0xa3
             d->report_parser.parse_feature_report(d, &packet[1], size - 1);
@@ -520,7 +593,7 @@ void uni_bt_bredr_on_l2cap_data_packet(uint16_t channel, const uint8_t* packet,
     }
 
     // Skip the first byte, which is always 0xa1
-    uni_hid_parse_input_report(d, &packet[1], size - 1);
+    uni_hid_parse_input_report_at(d, &packet[1], size - 1, received_us);
     uni_hid_device_process_controller(d);
 }
 
@@ -710,6 +783,17 @@ void uni_bt_bredr_on_hci_pin_code_request(uint16_t channel, const uint8_t* packe
     }
 }
 
+void uni_bt_bredr_on_hci_link_key_notification(uint16_t channel, const uint8_t* packet, uint16_t size) {
+    bd_addr_t event_addr;
+
+    ARG_UNUSED(channel);
+    ARG_UNUSED(size);
+
+    // New pairing: what was cached was learned with the previous link key.
+    hci_event_link_key_notification_get_bd_addr(packet, event_addr);
+    uni_bt_bredr_cache_delete(event_addr);
+}
+
 void uni_bt_bredr_on_hci_remote_name_request_complete(uint16_t channel, const uint8_t* packet, uint16_t size) {
     uni_hid_device_t* d;
     uint8_t status;
@@ -743,6 +827,9 @@ void uni_bt_bredr_on_hci_remote_name_request_complete(uint16_t channel, const ui
         }
 
         // Remove timer
-        btstack_run_loop_remove_timer(&d->inquiry_remote_name_timer);
+        btstack_run_loop_remove_timer(&d->cold->inquiry_remote_name_timer);
     }
+
+    // Even if the device was deleted: the next one can request its name now.
+    uni_bt_pipeline_release(UNI_BT_PIPELINE_RESOURCE_NAME);
 }
@@ -0,0 +1,318 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "bt/uni_bt_bredr_cache.h"
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <btstack.h>
+
+#include "sdkconfig.h"
+
+#include "uni_common.h"
+#include "uni_hid_device.h"
+#include "uni_log.h"
+#include "uni_utils.h"
+
+// One TLV tag per slot.
+#ifdef CONFIG_TARGET_PICO_W
+// On Pico W the TLV is a 4KB flash bank, shared with the link keys. Fewer, and smaller, entries are kept, so that
+// the cache takes at most 2.5KB and never leaves the link keys without room. Devices with a bigger entry, like
+// the ones with a big HID descriptor, are not cached.
+#define CACHE_MAX_ENTRIES 4
+#define CACHE_MAX_ENTRY_SIZE 640
+#else
+#define CACHE_MAX_ENTRIES 8
+#define CACHE_MAX_ENTRY_SIZE sizeof(entry_buffer)
+#endif
+
+// Bump it when the entry format changes. Entries with another version are ignored.
+#define CACHE_VERSION 2
+
+enum {
+    // Outgoing connections must do an SDP query before the L2CAP connection. See SDP_QUERY_BEFORE_CONNECT.
+    CACHE_FLAG_SDP_BEFORE_CONNECT = BIT(0),
+};
+
+// Prevent possible clashes from user using TLV directly. 'B','P','3' is used by uni_property.
+static const char tag_0 = 'B';
+static const char tag_1 = 'P';
+static const char tag_2 = 'C';
+
+// Stored as is. Followed by the name (without the NUL) and the HID descriptor.
+// Only the used bytes are stored.
+typedef struct __attribute__((packed)) {
+    uint8_t version;
+    bd_addr_t addr;
+    // CRC32 of the link key. If the controller was paired again, the entry is stale.
+    uint32_t link_key_crc;
+    // Higher is newer. When the cache is full, the oldest entry is replaced.
+    uint32_t generation;
+    uint32_t cod;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t controller_type;
+    uint8_t controller_subtype;
+    uint8_t flags;
+    uint8_t name_len;
+    uint16_t hid_descriptor_len;
+} cache_entry_header_t;
+
+_Static_assert(HID_MAX_NAME_LEN <= UINT8_MAX + 1, "name_len too small");
+
+// RAM copy of what is stored in each slot, so that a miss doesn't read the TLV.
+typedef struct {
+    bool used;
+    bd_addr_t addr;
+    uint32_t generation;
+} cache_slot_t;
+
+static const btstack_tlv_t* tlv_impl;
+static void* tlv_context;
+static cache_slot_t slots[CACHE_MAX_ENTRIES];
+static uint32_t last_generation;
+
+// Static since it is too big for the stack.
+static uint8_t entry_buffer[sizeof(cache_entry_header_t) + HID_MAX_NAME_LEN + HID_MAX_DESCRIPTOR_LEN];
+
+static uint32_t get_tag_for_slot(int slot) {
+    return (tag_0 << 24) | (tag_1 << 16) | (tag_2 << 8) | slot;
+}
+
+// Reads the slot into entry_buffer. Returns false if it is empty, or if it is not a valid entry.
+static bool read_slot(int slot, cache_entry_header_t* header) {
+    int len = tlv_impl->get_tag(tlv_context, get_tag_for_slot(slot), entry_buffer, sizeof(entry_buffer));
+    if (len < (int)sizeof(*header))
+        return false;
+
+    memcpy(header, entry_buffer, sizeof(*header));
+    if (header->version != CACHE_VERSION || header->name_len >= HID_MAX_NAME_LEN ||
+        header->hid_descriptor_len > HID_MAX_DESCRIPTOR_LEN)
+        return false;
+    return len == (int)(sizeof(*header) + header->name_len + header->hid_descriptor_len);
+}
+
+static void delete_slot(int slot) {
+    tlv_impl->delete_tag(tlv_context, get_tag_for_slot(slot));
+    slots[slot].used = false;
+}
+
+static void load_slots(void) {
+    cache_entry_header_t header;
+
+    memset(slots, 0, sizeof(slots));
+    last_generation = 0;
+
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+        if (!read_slot(i, &header))
+            continue;
+        slots[i].used = true;
+        bd_addr_copy(slots[i].addr, header.addr);
+        slots[i].generation = header.generation;
+        last_generation = btstack_max(last_generation, header.generation);
+    }
+}
+
+// The TLV instance is set once the HCI is working, after uni_bt_bredr_setup(). Fetched when needed.
+static bool get_tlv(void) {
+    const btstack_tlv_t* impl;
+    void* context;
+
+    btstack_tlv_get_instance(&impl, &context);
+    if (impl == NULL)
+        return false;
+
+    if (impl != tlv_impl || context != tlv_context) {
+        tlv_impl = impl;
+        tlv_context = context;
+        load_slots();
+    }
+    return true;
+}
+
+static int find_slot(const bd_addr_t addr) {
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+        if (slots[i].used && bd_addr_cmp(slots[i].addr, addr) == 0)
+            return i;
+    }
+    return -1;
+}
+
+// A free slot, or the oldest one.
+static int find_slot_to_replace(void) {
+    int oldest = 0;
+
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+        if (!slots[i].used)
+            return i;
+        if (slots[i].generation < slots[oldest].generation)
+            oldest = i;
+    }
+    return oldest;
+}
+
+static bool get_link_key_crc(bd_addr_t addr, uint32_t* crc) {
+    link_key_t link_key;
+    link_key_type_t type;
+
+    if (!gap_get_link_key_for_bd_addr(addr, link_key, &type))
+        return false;
+    *crc = uni_crc32_le(0, link_key, sizeof(link_key));
+    return true;
+}
+
+bool uni_bt_bredr_cache_load(uni_hid_device_t* d) {
+    cache_entry_header_t header;
+    uint32_t crc;
+    char name[HID_MAX_NAME_LEN];
+
+    if (!get_tlv())
+        return false;
+
+    int slot = find_slot(d->conn.btaddr);
+    if (slot < 0)
+        return false;
+
+    if (!read_slot(slot, &header) || bd_addr_cmp(header.addr, d->conn.btaddr) != 0) {
+        loge("BR/EDR cache: invalid entry for %s, deleting it\n", bd_addr_to_str(d->conn.btaddr));
+        delete_slot(slot);
+        return false;
+    }
+
+    if (!get_link_key_crc(d->conn.btaddr, &crc) || crc != header.link_key_crc) {
+        logi("BR/EDR cache: link key changed for %s, deleting entry\n", bd_addr_to_str(d->conn.btaddr));
+        delete_slot(slot);
+        return false;
+    }
+
+    const uint8_t* payload = entry_buffer + sizeof(header);
+    memcpy(name, payload, header.name_len);
+    name[header.name_len] = 0;
+
+    // Same order as a connection without cache: the parser might depend on the VID/PID and name.
+    // Without room for it, the device goes through the regular connection, that will fail as well.
+    if (header.hid_descriptor_len > 0 &&
+        !uni_hid_device_set_hid_descriptor(d, payload + header.name_len, header.hid_descriptor_len))
+        return false;
+    uni_hid_device_set_vendor_id(d, header.vendor_id);
+    uni_hid_device_set_product_id(d, header.product_id);
+    uni_hid_device_set_name(d, name);
+    // Incoming connections already have the one from the connection request.
+    if (d->cod == 0)
+        uni_hid_device_set_cod(d, header.cod);
+    uni_hid_device_set_controller_type(d, header.controller_type);
+    d->controller_subtype = header.controller_subtype;
+    d->cold->sdp_query_type =
+        (header.flags & CACHE_FLAG_SDP_BEFORE_CONNECT) ? SDP_QUERY_BEFORE_CONNECT : SDP_QUERY_NOT_NEEDED;
+
+    logi("BR/EDR cache: %s is '%s', VID/PID: %04x:%04x, type: 0x%02x\n", bd_addr_to_str(d->conn.btaddr), d->cold->name,
+         d->vendor_id, d->product_id, d->controller_type);
+    return true;
+}
+
+static uint8_t get_flags(const uni_hid_device_t* d) {
+    return (d->cold->sdp_query_type == SDP_QUERY_BEFORE_CONNECT) ? CACHE_FLAG_SDP_BEFORE_CONNECT : 0;
+}
+
+// Whether entry_buffer, that has the stored entry, has the same info as "d".
+static bool entry_matches_device(const cache_entry_header_t* header, uni_hid_device_t* d, uint32_t crc) {
+    const uint8_t* payload = entry_buffer + sizeof(*header);
+    size_t name_len = strlen(d->cold->name);
+    uint16_t hid_descriptor_len;
+    const uint8_t* hid_descriptor = uni_hid_device_get_hid_descriptor(d, &hid_descriptor_len);
+
+    return header->link_key_crc == crc && header->cod == d->cod && header->vendor_id == d->vendor_id &&
+           header->product_id == d->product_id && header->controller_type == d->controller_type &&
+           header->controller_subtype == d->controller_subtype && header->flags == get_flags(d) &&
+           header->name_len == name_len &&
+           header->hid_descriptor_len == hid_descriptor_len && memcmp(payload, d->cold->name, name_len) == 0 &&
+           (hid_descriptor_len == 0 || memcmp(payload + name_len, hid_descriptor, hid_descriptor_len) == 0);
+}
+
+void uni_bt_bredr_cache_store(uni_hid_device_t* d) {
+    cache_entry_header_t header;
+    uint32_t crc;
+
+    if (!uni_hid_device_has_controller_type(d))
+        return;
+    if (!get_tlv())
+        return;
+    // Without a link key, there is no way to tell that it is the same controller the next time.
+    if (!get_link_key_crc(d->conn.btaddr, &crc))
+        return;
+
+    uint16_t hid_descriptor_len;
+    const uint8_t* hid_descriptor = uni_hid_device_get_hid_descriptor(d, &hid_descriptor_len);
+    uint32_t len = sizeof(header) + strlen(d->cold->name) + hid_descriptor_len;
+
+    int slot = find_slot(d->conn.btaddr);
+    if (len > CACHE_MAX_ENTRY_SIZE) {
+        logi("BR/EDR cache: entry for %s too big (%d bytes), not cached\n", bd_addr_to_str(d->conn.btaddr), (int)len);
+        // The one stored might be stale.
+        if (slot >= 0)
+            delete_slot(slot);
+        return;
+    }
+
+    if (slot >= 0) {
+        // Reconnections that used the cache end up here. Don't wear the flash writing the same entry.
+        if (read_slot(slot, &header) && entry_matches_device(&header, d, crc))
+            return;
+    } else {
+        slot = find_slot_to_replace();
+    }
+
+    memset(&header, 0, sizeof(header));
+    header.version = CACHE_VERSION;
+    bd_addr_copy(header.addr, d->conn.btaddr);
+    header.link_key_crc = crc;
+    header.generation = ++last_generation;
+    header.cod = d->cod;
+    header.vendor_id = d->vendor_id;
+    header.product_id = d->product_id;
+    header.controller_type = d->controller_type;
+    header.controller_subtype = d->controller_subtype;
+    header.flags = get_flags(d);
+    header.name_len = strlen(d->cold->name);
+    header.hid_descriptor_len = hid_descriptor_len;
+
+    uint8_t* payload = entry_buffer + sizeof(header);
+    memcpy(entry_buffer, &header, sizeof(header));
+    memcpy(payload, d->cold->name, header.name_len);
+    if (header.hid_descriptor_len > 0)
+        memcpy(payload + header.name_len, hid_descriptor, header.hid_descriptor_len);
+
+    if (tlv_impl->store_tag(tlv_context, get_tag_for_slot(slot), entry_buffer, len)) {
+        loge("BR/EDR cache: failed to store entry for %s\n", bd_addr_to_str(d->conn.btaddr));
+        // Whatever was there before might be gone.
+        delete_slot(slot);
+        return;
+    }
+
+    slots[slot].used = true;
+    bd_addr_copy(slots[slot].addr, d->conn.btaddr);
+    slots[slot].generation = header.generation;
+    logi("BR/EDR cache: stored %s (%d bytes)\n", bd_addr_to_str(d->conn.btaddr), (int)len);
+}
+
+void uni_bt_bredr_cache_delete(bd_addr_t addr) {
+    if (!get_tlv())
+        return;
+
+    int slot = find_slot(addr);
+    if (slot >= 0)
+        delete_slot(slot);
+}
+
+void uni_bt_bredr_cache_delete_all(void) {
+    if (!get_tlv())
+        return;
+
+    for (int i = 0; i < CACHE_MAX_ENTRIES; i++) {
+        if (slots[i].used)
+            delete_slot(i);
+    }
+}
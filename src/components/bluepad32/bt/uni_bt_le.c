@@ -70,6 +70,7 @@
 #include "uni_hid_device.h"
 #include "uni_log.h"
 #include "uni_property.h"
+#include "uni_system.h"
 
 static bool is_scanning;
 static bool ble_enabled;
@@ -212,6 +213,8 @@ static void parse_report(uint8_t* packet, uint16_t size) {
     uint16_t descriptor_len;
     const uint8_t* report_data;
     uint16_t report_len;
+    // Before anything else, so that the latency stats include the lookup and the checks.
+    uint64_t received_us = uni_system_get_time_us();
 
     ARG_UNUSED(size);
 
@@ -227,16 +230,20 @@ static void parse_report(uint8_t* packet, uint16_t size) {
     // FIXME: Copying the HID descriptor should be done at setup time since some device, like Xbox requires it
     // to set the correct parser.
     // But not clear how to get the "service_index" from setup
-    if (device->hid_descriptor_len == 0) {
+    if (!uni_hid_device_has_hid_descriptor(device)) {
         descriptor_data = hids_client_descriptor_storage_get_descriptor_data(hids_cid, service_index);
         descriptor_len = hids_client_descriptor_storage_get_descriptor_len(hids_cid, service_index);
 
-        uni_hid_device_set_hid_descriptor(device, descriptor_data, descriptor_len);
+        if (!uni_hid_device_set_hid_descriptor(device, descriptor_data, descriptor_len)) {
+            // Its reports can't be parsed.
+            uni_hid_device_disconnect(device);
+            return;
+        }
     }
     report_data = gattservice_subevent_hid_report_get_report(packet);
     report_len = gattservice_subevent_hid_report_get_report_len(packet);
 
-    uni_hid_parse_input_report(device, report_data, report_len);
+    uni_hid_parse_input_report_at(device, report_data, report_len, received_us);
     uni_hid_device_process_controller(device);
 }
 
@@ -402,7 +409,7 @@ static void device_information_packet_handler(uint8_t packet_type, uint16_t chan
                         break;
                     }
                     logi("Using hids_cid=%d\n", hids_cid);
-                    device->hids_cid = hids_cid;
+                    uni_hid_device_set_hids_cid(device, hids_cid);
                     break;
                 default:
                     logi("Device Information service client connection failed, error=%#x.\n", status);
@@ -0,0 +1,187 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "bt/uni_bt_pipeline.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include <btstack.h>
+
+#include "uni_hid_device.h"
+#include "uni_log.h"
+
+// A resource is busy until BTstack tells that it is done with it, even if the connection is lost.
+// It can't be taken back before that: BTstack only runs one name request / SDP query at the time.
+typedef struct {
+    bool busy;
+    uni_bt_pipeline_start_fn_t start;
+} resource_t;
+
+static resource_t g_resources[UNI_BT_PIPELINE_RESOURCE_COUNT];
+static uint32_t g_queue_seq;
+static uni_bt_pipeline_stats_t g_stats;
+
+// Queued stages have no timeout (0): the device that has the resource has its own, and the resource
+// is always released once BTstack is done with it. The timeout of the next stage starts when it runs.
+static const uint32_t g_stage_timeouts_ms[UNI_BT_PIPELINE_STAGE_COUNT] = {
+    [UNI_BT_PIPELINE_STAGE_NONE] = HID_DEVICE_CONNECTION_TIMEOUT_MS,
+    [UNI_BT_PIPELINE_STAGE_NAME_QUEUED] = 0,
+    [UNI_BT_PIPELINE_STAGE_NAME] = UNI_BT_PIPELINE_NAME_TIMEOUT_MS,
+    [UNI_BT_PIPELINE_STAGE_SDP_QUEUED] = 0,
+    [UNI_BT_PIPELINE_STAGE_SDP] = UNI_BT_PIPELINE_SDP_TIMEOUT_MS,
+    [UNI_BT_PIPELINE_STAGE_L2CAP] = UNI_BT_PIPELINE_L2CAP_TIMEOUT_MS,
+    [UNI_BT_PIPELINE_STAGE_SETUP] = UNI_BT_PIPELINE_SETUP_TIMEOUT_MS,
+};
+
+static const uint8_t g_queued_stages[UNI_BT_PIPELINE_RESOURCE_COUNT] = {
+    [UNI_BT_PIPELINE_RESOURCE_NAME] = UNI_BT_PIPELINE_STAGE_NAME_QUEUED,
+    [UNI_BT_PIPELINE_RESOURCE_SDP] = UNI_BT_PIPELINE_STAGE_SDP_QUEUED,
+};
+
+static const uint8_t g_running_stages[UNI_BT_PIPELINE_RESOURCE_COUNT] = {
+    [UNI_BT_PIPELINE_RESOURCE_NAME] = UNI_BT_PIPELINE_STAGE_NAME,
+    [UNI_BT_PIPELINE_RESOURCE_SDP] = UNI_BT_PIPELINE_STAGE_SDP,
+};
+
+static void start_resource(uni_hid_device_t* d, uni_bt_pipeline_resource_t resource) {
+    resource_t* r = &g_resources[resource];
+
+    r->busy = true;
+    d->cold->pipeline.waiting = 0;
+    uni_bt_pipeline_set_stage(d, g_running_stages[resource]);
+    r->start(d);
+    /* 'd' might be destroyed after this call, don't use it */
+}
+
+void uni_bt_pipeline_set_stage(uni_hid_device_t* d, uni_bt_pipeline_stage_t stage) {
+    uni_bt_pipeline_device_t* p = &d->cold->pipeline;
+    uint32_t now = btstack_run_loop_get_time_ms();
+
+    if (p->stage == UNI_BT_PIPELINE_STAGE_NONE)
+        p->start_ms = now;
+    else
+        uni_latency_histogram_add(&g_stats.stages[p->stage], now - p->stage_start_ms);
+
+    logd("Pipeline: %s: %s -> %s\n", bd_addr_to_str(d->conn.btaddr), uni_bt_pipeline_stage_to_str(p->stage),
+         uni_bt_pipeline_stage_to_str(stage));
+    p->stage = stage;
+    p->stage_start_ms = now;
+    uni_hid_device_set_connection_timeout(d, g_stage_timeouts_ms[stage]);
+}
+
+void uni_bt_pipeline_acquire(uni_hid_device_t* d,
+                             uni_bt_pipeline_resource_t resource,
+                             uni_bt_pipeline_start_fn_t start) {
+    resource_t* r = &g_resources[resource];
+
+    // E.g: the FSM is processed again because of another inquiry result. Keeps its place in the queue.
+    if (d->cold->pipeline.waiting == resource + 1)
+        return;
+
+    r->start = start;
+    if (!r->busy) {
+        start_resource(d, resource);
+        return;
+    }
+
+    logi("Pipeline: %s waiting for its turn (%s)\n", bd_addr_to_str(d->conn.btaddr),
+         uni_bt_pipeline_stage_to_str(g_queued_stages[resource]));
+    d->cold->pipeline.waiting = resource + 1;
+    d->cold->pipeline.queue_seq = g_queue_seq++;
+    uni_bt_pipeline_set_stage(d, g_queued_stages[resource]);
+}
+
+void uni_bt_pipeline_release(uni_bt_pipeline_resource_t resource) {
+    uni_hid_device_t* next = NULL;
+
+    g_resources[resource].busy = false;
+
+    // Deleted devices are no longer waiting, since their state is cleared.
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
+        uni_hid_device_t* d = uni_hid_device_get_instance_for_idx(i);
+        if (d->cold->pipeline.waiting != resource + 1)
+            continue;
+        // Sequence numbers can wrap around.
+        if (next == NULL || (int32_t)(d->cold->pipeline.queue_seq - next->cold->pipeline.queue_seq) < 0)
+            next = d;
+    }
+
+    if (next)
+        start_resource(next, resource);
+}
+
+bool uni_bt_pipeline_is_busy(uni_bt_pipeline_resource_t resource) {
+    return g_resources[resource].busy;
+}
+
+void uni_bt_pipeline_on_ready(uni_hid_device_t* d) {
+    uni_bt_pipeline_device_t* p = &d->cold->pipeline;
+    uint32_t now = btstack_run_loop_get_time_ms();
+
+    if (p->stage == UNI_BT_PIPELINE_STAGE_NONE)
+        return;
+
+    uni_latency_histogram_add(&g_stats.stages[p->stage], now - p->stage_start_ms);
+    uni_latency_histogram_add(&g_stats.ready, now - p->start_ms);
+    logi("Pipeline: %s ready in %" PRIu32 " ms\n", bd_addr_to_str(d->conn.btaddr), now - p->start_ms);
+    p->stage = UNI_BT_PIPELINE_STAGE_NONE;
+}
+
+void uni_bt_pipeline_on_timeout(uni_hid_device_t* d) {
+    uni_bt_pipeline_device_t* p = &d->cold->pipeline;
+
+    if (p->stage == UNI_BT_PIPELINE_STAGE_NONE)
+        return;
+
+    logi("Pipeline: %s timed out in stage '%s', after %" PRIu32 " ms\n", bd_addr_to_str(d->conn.btaddr),
+         uni_bt_pipeline_stage_to_str(p->stage), btstack_run_loop_get_time_ms() - p->stage_start_ms);
+    g_stats.timeouts[p->stage]++;
+}
+
+const char* uni_bt_pipeline_stage_to_str(uni_bt_pipeline_stage_t stage) {
+    switch (stage) {
+        case UNI_BT_PIPELINE_STAGE_NONE:
+            return "none";
+        case UNI_BT_PIPELINE_STAGE_NAME_QUEUED:
+            return "name (queued)";
+        case UNI_BT_PIPELINE_STAGE_NAME:
+            return "name";
+        case UNI_BT_PIPELINE_STAGE_SDP_QUEUED:
+            return "sdp (queued)";
+        case UNI_BT_PIPELINE_STAGE_SDP:
+            return "sdp";
+        case UNI_BT_PIPELINE_STAGE_L2CAP:
+            return "l2cap";
+        case UNI_BT_PIPELINE_STAGE_SETUP:
+            return "setup";
+        default:
+            return "unknown";
+    }
+}
+
+const uni_bt_pipeline_stats_t* uni_bt_pipeline_get_stats(void) {
+    return &g_stats;
+}
+
+void uni_bt_pipeline_reset_stats(void) {
+    memset(&g_stats, 0, sizeof(g_stats));
+}
+
+static void dump_histogram(const char* name, const uni_latency_histogram_t* h, uint32_t timeouts) {
+    if (h->count == 0 && timeouts == 0)
+        return;
+
+    logi("\t%s: n=%" PRIu32 ", mean=%" PRIu32 ", p50<=%" PRIu32 ", p90<=%" PRIu32 ", max=%" PRIu32
+         " ms, timeouts=%" PRIu32 "\n",
+         name, h->count, uni_latency_histogram_get_mean(h), uni_latency_histogram_get_percentile(h, 50),
+         uni_latency_histogram_get_percentile(h, 90), h->max, timeouts);
+}
+
+void uni_bt_pipeline_dump_stats(void) {
+    logi("Connection pipeline:\n");
+    for (int i = UNI_BT_PIPELINE_STAGE_NONE + 1; i < UNI_BT_PIPELINE_STAGE_COUNT; i++)
+        dump_histogram(uni_bt_pipeline_stage_to_str(i), &g_stats.stages[i], g_stats.timeouts[i]);
+    dump_histogram("time to ready", &g_stats.ready, 0);
+}
@@ -54,6 +54,7 @@
 
 #include "bt/uni_bt.h"
 #include "bt/uni_bt_bredr.h"
+#include "bt/uni_bt_pipeline.h"
 #include "uni_common.h"
 #include "uni_config.h"
 #include "uni_log.h"
@@ -63,19 +64,35 @@
 #error "This file can only be compiled for ESP32, Pico W, or Posix"
 #endif
 
-#define MAX_ATTRIBUTE_VALUE_SIZE 512  // Apparently PS4 has a 470-bytes report
-
-// Some old devices like "ThinkGeek 8-bitty Game Controller" takes a lot of time to respond
-// to SDP queries.
-#define SDP_QUERY_TIMEOUT_MS 13000
-_Static_assert(SDP_QUERY_TIMEOUT_MS < HID_DEVICE_CONNECTION_TIMEOUT_MS, "Timeout too big");
+#define MAX_ATTRIBUTE_VALUE_SIZE (HID_MAX_DESCRIPTOR_LEN + 16)  // The HID descriptor, plus its SDP header
 
 static uint8_t sdp_attribute_value[MAX_ATTRIBUTE_VALUE_SIZE];
 static const unsigned int sdp_attribute_value_buffer_size = MAX_ATTRIBUTE_VALUE_SIZE;
+// Device that owns the SDP client. Only one SDP query can run at the time, the other devices wait in
+// the pipeline queue. See uni_bt_pipeline.h.
 static uni_hid_device_t* sdp_device = NULL;
-static btstack_timer_source_t sdp_query_timer;
+static bd_addr_t sdp_device_addr;
+// Whether the HID descriptor of the query didn't fit in the HID descriptor store.
+static bool sdp_hid_descriptor_rejected;
+
+// NULL if the device was deleted while its query was running. Its results are ignored, but the query still
+// needs to complete before the next one can start.
+static uni_hid_device_t* get_sdp_device(void) {
+    uni_bt_conn_state_t state;
+
+    if (sdp_device == NULL || bd_addr_cmp(sdp_device->conn.btaddr, sdp_device_addr) != 0)
+        return NULL;
+    // Same address, but could be a new connection of the same controller.
+    state = uni_bt_conn_get_state(&sdp_device->conn);
+    if (state != UNI_BT_CONN_STATE_SDP_VENDOR_REQUESTED && state != UNI_BT_CONN_STATE_SDP_HID_DESCRIPTOR_REQUESTED)
+        return NULL;
+    return sdp_device;
+}
 
-static void sdp_query_timeout(btstack_timer_source_t* ts);
+static void sdp_query_release(void) {
+    sdp_device = NULL;
+    uni_bt_pipeline_release(UNI_BT_PIPELINE_RESOURCE_SDP);
+}
 
 // SDP Server
 static uint8_t device_id_sdp_service_buffer[100];
@@ -90,14 +107,12 @@ static void handle_sdp_hid_query_result(uint8_t packet_type, uint16_t channel, u
     des_iterator_t additional_des_it;
     uint8_t* des_element;
     uint8_t* element;
-
-    if (sdp_device == NULL) {
-        loge("ERROR: handle_sdp_hid_query_result. SDP device = NULL\n");
-        return;
-    }
+    uni_hid_device_t* d = get_sdp_device();
 
     switch (hci_event_packet_get_type(packet)) {
         case SDP_EVENT_QUERY_ATTRIBUTE_VALUE:
+            if (d == NULL)
+                break;
             if (sdp_event_query_attribute_byte_get_attribute_length(packet) <= sdp_attribute_value_buffer_size) {
                 sdp_attribute_value[sdp_event_query_attribute_byte_get_data_offset(packet)] =
                     sdp_event_query_attribute_byte_get_data(packet);
@@ -118,7 +133,8 @@ static void handle_sdp_hid_query_result(uint8_t packet_type, uint16_t channel, u
                                     const uint8_t* descriptor = de_get_string(element);
                                     int descriptor_len = de_get_data_size(element);
                                     logi("SDP HID Descriptor (%d):\n", descriptor_len);
-                                    uni_hid_device_set_hid_descriptor(sdp_device, descriptor, descriptor_len);
+                                    if (!uni_hid_device_set_hid_descriptor(d, descriptor, descriptor_len))
+                                        sdp_hid_descriptor_rejected = true;
                                     printf_hexdump(descriptor, descriptor_len);
                                 }
                             }
@@ -133,7 +149,21 @@ static void handle_sdp_hid_query_result(uint8_t packet_type, uint16_t channel, u
             }
             break;
         case SDP_EVENT_QUERY_COMPLETE:
-            uni_bt_sdp_query_end(sdp_device);
+            if (d == NULL) {
+                logi("SDP HID query finished, but its device was deleted\n");
+                sdp_query_release();
+                break;
+            }
+            if (sdp_hid_descriptor_rejected) {
+                loge("SDP HID query: %s can't be used without its HID descriptor, removing it\n",
+                     bd_addr_to_str(d->conn.btaddr));
+                sdp_query_release();
+                uni_hid_device_disconnect(d);
+                uni_hid_device_delete(d);
+                /* 'd' is destroyed after this call, don't use it */
+                break;
+            }
+            uni_bt_sdp_query_end(d);
             break;
         default:
             break;
@@ -147,14 +177,12 @@ static void handle_sdp_pid_query_result(uint8_t packet_type, uint16_t channel, u
     ARG_UNUSED(size);
 
     uint16_t id16;
-
-    if (sdp_device == NULL) {
-        loge("ERROR: handle_sdp_pid_query_result. SDP device = NULL\n");
-        return;
-    }
+    uni_hid_device_t* d = get_sdp_device();
 
     switch (hci_event_packet_get_type(packet)) {
         case SDP_EVENT_QUERY_ATTRIBUTE_VALUE:
+            if (d == NULL)
+                break;
             if (sdp_event_query_attribute_byte_get_attribute_length(packet) <= sdp_attribute_value_buffer_size) {
                 sdp_attribute_value[sdp_event_query_attribute_byte_get_data_offset(packet)] =
                     sdp_event_query_attribute_byte_get_data(packet);
@@ -163,14 +191,14 @@ static void handle_sdp_pid_query_result(uint8_t packet_type, uint16_t channel, u
                     switch (sdp_event_query_attribute_byte_get_attribute_id(packet)) {
                         case BLUETOOTH_ATTRIBUTE_VENDOR_ID:
                             if (de_element_get_uint16(sdp_attribute_value, &id16))
-                                uni_hid_device_set_vendor_id(sdp_device, id16);
+                                uni_hid_device_set_vendor_id(d, id16);
                             else
                                 loge("Error getting vendor id\n");
                             break;
 
                         case BLUETOOTH_ATTRIBUTE_PRODUCT_ID:
                             if (de_element_get_uint16(sdp_attribute_value, &id16))
-                                uni_hid_device_set_product_id(sdp_device, id16);
+                                uni_hid_device_set_product_id(d, id16);
                             else
                                 loge("Error getting product id\n");
                             break;
@@ -184,11 +212,17 @@ static void handle_sdp_pid_query_result(uint8_t packet_type, uint16_t channel, u
             }
             break;
         case SDP_EVENT_QUERY_COMPLETE:
-            logi("Vendor ID: 0x%04x - Product ID: 0x%04x\n", uni_hid_device_get_vendor_id(sdp_device),
-                 uni_hid_device_get_product_id(sdp_device));
-            uni_hid_device_guess_controller_type_from_pid_vid(sdp_device);
-            uni_bt_conn_set_state(&sdp_device->conn, UNI_BT_CONN_STATE_SDP_VENDOR_FETCHED);
-            uni_bt_bredr_process_fsm(sdp_device);
+            if (d == NULL) {
+                logi("SDP VID/PID query finished, but its device was deleted\n");
+                sdp_query_release();
+                break;
+            }
+            logi("Vendor ID: 0x%04x - Product ID: 0x%04x\n", uni_hid_device_get_vendor_id(d),
+                 uni_hid_device_get_product_id(d));
+            uni_hid_device_guess_controller_type_from_pid_vid(d);
+            uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_SDP_VENDOR_FETCHED);
+            // Keeps the SDP client: the HID descriptor query goes next.
+            uni_bt_bredr_process_fsm(d);
             break;
         default:
             // TODO: xxx
@@ -197,61 +231,34 @@ static void handle_sdp_pid_query_result(uint8_t packet_type, uint16_t channel, u
     }
 }
 
-static void sdp_query_timeout(btstack_timer_source_t* ts) {
-    loge("<------- sdp_query_timeout()\n");
-    uni_hid_device_t* d = btstack_run_loop_get_timer_context(ts);
-    if (!sdp_device) {
-        loge("sdp_query_timeout: unexpeced, sdp_device should not be NULL\n");
-        return;
-    }
-    if (d != sdp_device) {
-        loge("sdp_query_timeout: unexpected device values, they should be equal, got: %s != %s",
-             bd_addr_to_str(d->conn.btaddr), bd_addr_to_str(sdp_device->conn.btaddr));
-        return;
-    }
-
-    logi("Failed to query SDP for %s, timeout\n", bd_addr_to_str(d->conn.btaddr));
-    sdp_device = NULL;
-}
-
 // Public functions
 
 void uni_bt_sdp_query_start(uni_hid_device_t* d) {
     logi("-----------> sdp_query_start()\n");
-    // Needed for the SDP query since it only supports one SDP query at the time.
-    if (sdp_device != NULL) {
-        logi("Another SDP query is in progress (%s), disconnecting...\n", bd_addr_to_str(sdp_device->conn.btaddr));
-        uni_hid_device_disconnect(d);
-        uni_hid_device_delete(d);
-        /* 'd'' is destroyed after this call, don't use it */
-        return;
-    }
-
-    sdp_device = d;
-    btstack_run_loop_set_timer_context(&sdp_query_timer, d);
-    btstack_run_loop_set_timer_handler(&sdp_query_timer, &sdp_query_timeout);
-    btstack_run_loop_set_timer(&sdp_query_timer, SDP_QUERY_TIMEOUT_MS);
-    btstack_run_loop_add_timer(&sdp_query_timer);
-
-    uni_bt_sdp_query_start_vid_pid(d);
+    // Only one SDP query can run at the time. If another device is using it, this one waits for its turn.
+    uni_bt_pipeline_acquire(d, UNI_BT_PIPELINE_RESOURCE_SDP, uni_bt_sdp_query_start_vid_pid);
+    /* 'd' might be invalid */
 }
 
 void uni_bt_sdp_query_end(uni_hid_device_t* d) {
     logi("<----------- sdp_query_end()\n");
     uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_SDP_HID_DESCRIPTOR_FETCHED);
-    sdp_device = NULL;
-    btstack_run_loop_remove_timer(&sdp_query_timer);
+    // Before processing the FSM, so that the next device can start its query while this one connects.
+    sdp_query_release();
     uni_bt_bredr_process_fsm(d);
 }
 
 void uni_bt_sdp_query_start_vid_pid(uni_hid_device_t* d) {
     logi("Starting SDP VID/PID query for %s\n", bd_addr_to_str(d->conn.btaddr));
 
+    sdp_device = d;
+    bd_addr_copy(sdp_device_addr, d->conn.btaddr);
     uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_SDP_VENDOR_REQUESTED);
     uint8_t status =
         sdp_client_query_uuid16(&handle_sdp_pid_query_result, d->conn.btaddr, BLUETOOTH_SERVICE_CLASS_PNP_INFORMATION);
     if (status != 0) {
         loge("Failed to perform SDP VID/PID query\n");
+        sdp_query_release();
         uni_hid_device_disconnect(d);
         uni_hid_device_delete(d);
         /* 'd' is destroyed after this call, don't use it */
@@ -268,18 +275,19 @@ void uni_bt_sdp_query_start_hid_descriptor(uni_hid_device_t* d) {
 
     logi("Starting SDP HID-descriptor query for %s\n", bd_addr_to_str(d->conn.btaddr));
 
-    // Needed for the SDP query since it only supports one SDP query at the time.
-    if (sdp_device == NULL) {
-        logi("...but sdp_vendor was not set, aborting query for %s\n", bd_addr_to_str(d->conn.btaddr));
+    // The VID/PID query of this device should have left it the SDP client.
+    if (sdp_device != d) {
+        loge("...but the SDP client is not owned by it, aborting query for %s\n", bd_addr_to_str(d->conn.btaddr));
         return;
     }
 
     uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_SDP_HID_DESCRIPTOR_REQUESTED);
+    sdp_hid_descriptor_rejected = false;
     uint8_t status = sdp_client_query_uuid16(&handle_sdp_hid_query_result, d->conn.btaddr,
                                              BLUETOOTH_SERVICE_CLASS_HUMAN_INTERFACE_DEVICE_SERVICE);
     if (status != 0) {
         loge("Failed to perform SDP query for %s. Removing it...\n", bd_addr_to_str(d->conn.btaddr));
-        btstack_run_loop_remove_timer(&sdp_query_timer);
+        sdp_query_release();
         uni_hid_device_disconnect(d);
         uni_hid_device_delete(d);
         /* 'd'' is destroyed after this call, don't use it */
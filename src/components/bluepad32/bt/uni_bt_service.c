@@ -27,10 +27,13 @@
 // Don't know how to increate MTU for notification, so use the minimum which is 20 (23 - 3)
 #define NOTIFICATION_MTU 20
 
+// Max length of an attribute value.
+#define ATT_MAX_VALUE_LEN 512
+
 // Struct sent to the BLE client
 // A compact version of uni_hid_device_t.
 typedef struct __attribute((packed)) {
-    uint8_t idx;          // device index number: 0...CONFIG_BLUEPAD32_MAX_DEVICES-1
+    uint8_t idx;          // device index number: 0...uni_hid_device_get_max_devices()-1
     bd_addr_t addr;       // 6 bytes
     uint16_t vendor_id;   // 2 bytes
     uint16_t product_id;  // 2 bytes
@@ -40,6 +43,7 @@ typedef struct __attribute((packed)) {
     uni_controller_subtype_t controller_subtype;
 } compact_device_t;
 _Static_assert(sizeof(compact_device_t) <= NOTIFICATION_MTU, "compact_device_t too big");
+_Static_assert(UNI_HID_DEVICE_POOL_MAX_DEVICES <= 32, "dirty_devices too small");
 
 // client connection
 typedef struct {
@@ -51,10 +55,10 @@ static client_connection_t client_connections[MAX_NR_CLIENT_CONNECTIONS];
 
 // Iterate all over the connected clients, but only one is supported. Hardcoded to 0, don't change.
 static int notification_connection_idx;
-// Iterate all over the connected controllers
-static int notification_device_idx;
+// Devices that changed since they were notified. One bit per device index.
+// Entries are built from the devices when they are sent, so the service has no per-device state.
+static uint32_t dirty_devices;
 
-static compact_device_t compact_devices[CONFIG_BLUEPAD32_MAX_DEVICES];
 static bool service_enabled;
 
 // clang-format off
@@ -84,52 +88,93 @@ static uint16_t att_read_callback(hci_con_handle_t conn_handle,
                                   uint8_t* buffer,
                                   uint16_t buffer_size);
 static client_connection_t* connection_for_conn_handle(hci_con_handle_t conn_handle);
-static bool next_notify_device(void);
 static void notify_client(void);
-static void maybe_notify_client();
+static void maybe_notify_client(int idx);
 
 static bool is_notify_client_valid(void) {
     return ((client_connections[notification_connection_idx].connection_handle != HCI_CON_HANDLE_INVALID) &&
             (client_connections[notification_connection_idx].notification_enabled));
 }
 
-static bool next_notify_device(void) {
-    // TODO: For simplicity, we send all 4 devices.
-    // But we should only send the connected ones.
-    notification_device_idx++;
-    if (notification_device_idx == CONFIG_BLUEPAD32_MAX_DEVICES) {
-        notification_device_idx = 0;
-        return true;
+// Disconnected devices only have the index, so that the client knows that they are gone.
+static void fill_compact_device(int idx, compact_device_t* entry) {
+    const uni_hid_device_t* d = uni_hid_device_get_instance_for_idx(idx);
+
+    memset(entry, 0, sizeof(*entry));
+    entry->idx = idx;
+    if (!d->conn.connected)
+        return;
+
+    entry->vendor_id = d->vendor_id;
+    entry->product_id = d->product_id;
+    entry->controller_type = d->controller_type;
+    entry->controller_subtype = d->controller_subtype;
+    memcpy(entry->addr, d->conn.btaddr, 6);
+    // Once the device is ready, "state" is the "connected" flag.
+    if (d->conn.state >= UNI_BT_CONN_STATE_DEVICE_PENDING_READY)
+        entry->state = d->conn.connected;
+    else
+        entry->state = d->conn.state;
+    entry->incoming = d->conn.incoming;
+}
+
+// Like att_read_callback_handle_blob(), but the blob is built from the connected devices.
+static uint16_t read_connected_devices(uint16_t offset, uint8_t* buffer, uint16_t buffer_size) {
+    int max_devices = uni_hid_device_get_max_devices();
+    uint16_t blob_size = 0;
+    uint16_t copied = 0;
+    compact_device_t entry;
+
+    for (int i = 0; i < max_devices && blob_size + sizeof(entry) <= ATT_MAX_VALUE_LEN; i++) {
+        if (!uni_hid_device_get_instance_for_idx(i)->conn.connected)
+            continue;
+        uint16_t entry_offset = blob_size;
+        blob_size += sizeof(entry);
+        if (buffer == NULL || blob_size <= offset + copied)
+            continue;
+        if (copied == buffer_size)
+            break;
+
+        fill_compact_device(i, &entry);
+        uint16_t from = offset + copied - entry_offset;
+        uint16_t len = btstack_min(sizeof(entry) - from, buffer_size - copied);
+        memcpy(&buffer[copied], (const uint8_t*)&entry + from, len);
+        copied += len;
     }
-    return false;
+    return buffer == NULL ? blob_size : copied;
 }
 
 static void notify_client(void) {
-    logd("Notifying client idx = %d, device idx = %d\n", notification_connection_idx, notification_device_idx);
     uint8_t status;
     client_connection_t* ctx;
-    bool finish_round;
+    compact_device_t entry;
 
-    if (!is_notify_client_valid())
+    if (!is_notify_client_valid() || dirty_devices == 0)
         return;
 
     ctx = &client_connections[notification_connection_idx];
 
-    // send
-    status = att_server_notify(ctx->connection_handle, ctx->value_handle,
-                               (const uint8_t*)&compact_devices[notification_device_idx], sizeof(compact_devices[0]));
+    // Only the devices that changed are sent, one per "can send now" event.
+    int idx = 0;
+    while ((dirty_devices & BIT(idx)) == 0)
+        idx++;
+    logd("Notifying client idx = %d, device idx = %d\n", notification_connection_idx, idx);
+    fill_compact_device(idx, &entry);
+    status = att_server_notify(ctx->connection_handle, ctx->value_handle, (const uint8_t*)&entry, sizeof(entry));
     if (status != ERROR_CODE_SUCCESS) {
         loge("BLE Service: Failed to notify client, error: %#x\n", status);
     }
+    dirty_devices &= ~BIT(idx);
 
-    finish_round = next_notify_device();
-    if (!finish_round)
+    if (dirty_devices != 0)
         att_server_request_can_send_now_event(ctx->connection_handle);
 }
 
-static void maybe_notify_client(void) {
+static void maybe_notify_client(int idx) {
     client_connection_t* ctx = NULL;
 
+    dirty_devices |= BIT(idx);
+
     for (int i = 0; i < MAX_NR_CLIENT_CONNECTIONS; i++) {
         if (client_connections[i].connection_handle != HCI_CON_HANDLE_INVALID &&
             client_connections[i].notification_enabled) {
@@ -179,8 +224,14 @@ static int att_write_callback(hci_con_handle_t con_handle,
             ctx->notification_enabled =
                 little_endian_read_16(buffer, 0) == GATT_CLIENT_CHARACTERISTICS_CONFIGURATION_NOTIFICATION;
             ctx->value_handle = ATT_CHARACTERISTIC_4627C4A4_AC06_46B9_B688_AFC5C1BF7F63_01_VALUE_HANDLE;
-            if (ctx->notification_enabled)
+            if (ctx->notification_enabled) {
+                // New client: send all the connected devices.
+                for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
+                    if (uni_hid_device_get_instance_for_idx(i)->conn.connected)
+                        dirty_devices |= BIT(i);
+                }
                 att_server_request_can_send_now_event(ctx->connection_handle);
+            }
 
             logi("BLE Service: Notification enabled = %d for handle %#x\n", ctx->notification_enabled,
                  ctx->connection_handle);
@@ -222,7 +273,7 @@ static int att_write_callback(hci_con_handle_t con_handle,
             if (buffer_size != 1 || offset != 0)
                 return ATT_ERROR_REQUEST_NOT_SUPPORTED;
             int idx = buffer[0];
-            if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES)
+            if (idx < 0 || idx >= uni_hid_device_get_max_devices())
                 return ATT_ERROR_REQUEST_NOT_SUPPORTED;
             uni_hid_device_t* d = uni_hid_device_get_instance_for_idx(idx);
             uni_hid_device_disconnect(d);
@@ -269,7 +320,7 @@ static uint16_t att_read_callback(hci_con_handle_t conn_handle,
                                                  buffer, buffer_size);
         case ATT_CHARACTERISTIC_4627C4A4_AC02_46B9_B688_AFC5C1BF7F63_01_VALUE_HANDLE: {
             // Max supported connections
-            const uint8_t max = CONFIG_BLUEPAD32_MAX_DEVICES;
+            const uint8_t max = uni_hid_device_get_max_devices();
             return att_read_callback_handle_blob(&max, (uint16_t)1, offset, buffer, buffer_size);
         }
         case ATT_CHARACTERISTIC_4627C4A4_AC03_46B9_B688_AFC5C1BF7F63_01_VALUE_HANDLE: {
@@ -283,9 +334,8 @@ static uint16_t att_read_callback(hci_con_handle_t conn_handle,
             return att_read_callback_handle_blob(&scanning, (uint16_t)1, offset, buffer, buffer_size);
         }
         case ATT_CHARACTERISTIC_4627C4A4_AC05_46B9_B688_AFC5C1BF7F63_01_VALUE_HANDLE:
-            // Connected devices
-            return att_read_callback_handle_blob((const void*)compact_devices, (uint16_t)sizeof(compact_devices),
-                                                 offset, buffer, buffer_size);
+            // Connected devices. Only the connected ones are included.
+            return read_connected_devices(offset, buffer, buffer_size);
         case ATT_CHARACTERISTIC_4627C4A4_AC06_46B9_B688_AFC5C1BF7F63_01_VALUE_HANDLE:
             // Notify all connected devices, only when there is a change, one at a time.
             // Ideally it should be merged with the previous one, but don't know how to increase
@@ -442,12 +492,10 @@ void uni_bt_service_init(void) {
     bd_addr_t null_addr;
 
     memset(null_addr, 0, 6);
-    memset(compact_devices, 0, sizeof(compact_devices));
+    dirty_devices = 0;
     memset(&client_connections, 0, sizeof(client_connections));
     for (int i = 0; i < MAX_NR_CLIENT_CONNECTIONS; i++)
         client_connections[i].connection_handle = HCI_CON_HANDLE_INVALID;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++)
-        compact_devices[i].idx = i;
 
     // register for ATT events
     att_server_register_packet_handler(att_packet_handler);
@@ -473,7 +521,7 @@ void uni_bt_service_set_enabled(bool enabled) {
         uni_bt_service_deinit();
 }
 
-void uni_bt_service_on_device_ready(const uni_hid_device_t* d) {
+static void on_device_changed(const uni_hid_device_t* d) {
     // Must be called from BTstack task
     if (!d)
         return;
@@ -484,46 +532,17 @@ void uni_bt_service_on_device_ready(const uni_hid_device_t* d) {
     if (idx < 0)
         return;
 
-    // Update the things that could have changed from "on_device_connected" callback.
-    compact_devices[idx].controller_subtype = d->controller_subtype;
-    compact_devices[idx].state = d->conn.connected;
+    maybe_notify_client(idx);
+}
 
-    maybe_notify_client();
+void uni_bt_service_on_device_ready(const uni_hid_device_t* d) {
+    on_device_changed(d);
 }
 
 void uni_bt_service_on_device_connected(const uni_hid_device_t* d) {
-    // Must be called from BTstack task
-    if (!d)
-        return;
-    if (!service_enabled)
-        return;
-
-    int idx = uni_hid_device_get_idx_for_instance(d);
-    if (idx < 0)
-        return;
-    compact_devices[idx].vendor_id = d->vendor_id;
-    compact_devices[idx].product_id = d->product_id;
-    compact_devices[idx].controller_type = d->controller_type;
-    compact_devices[idx].controller_subtype = d->controller_subtype;
-    memcpy(compact_devices[idx].addr, d->conn.btaddr, 6);
-    compact_devices[idx].state = d->conn.state;
-    compact_devices[idx].incoming = d->conn.incoming;
-
-    maybe_notify_client();
+    on_device_changed(d);
 }
 
 void uni_bt_service_on_device_disconnected(const uni_hid_device_t* d) {
-    // Must be called from BTstack task
-    if (!d)
-        return;
-    if (!service_enabled)
-        return;
-
-    int idx = uni_hid_device_get_idx_for_instance(d);
-    if (idx < 0)
-        return;
-    memset(&compact_devices[idx], 0, sizeof(compact_devices[0]));
-    compact_devices[idx].idx = idx;
-
-    maybe_notify_client();
+    on_device_changed(d);
 }
@@ -138,7 +138,7 @@ int uni_bt_setup(void) {
     if (IS_ENABLED(UNI_ENABLE_BLE))
         ble_enabled = uni_bt_le_is_enabled();
 
-    logi("Max connected gamepads: %d\n", CONFIG_BLUEPAD32_MAX_DEVICES);
+    logi("Max connected gamepads: %d\n", uni_hid_device_get_max_devices());
 
     logi("BR/EDR support: %s\n", bredr_enabled ? "enabled" : "disabled");
     logi("BLE support: %s\n", ble_enabled ? "enabled" : "disabled");
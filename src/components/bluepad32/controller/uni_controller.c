@@ -3,8 +3,84 @@
 // http://retro.moe/unijoysticle2
 
 #include "controller/uni_controller.h"
+
+#include <stdlib.h>
+#include <string.h>
+
 #include "uni_log.h"
 
+static uni_controller_change_filter_t change_filter;
+
+static bool value_changed(int32_t prev, int32_t value, uint16_t threshold) {
+    // 64-bit to prevent overflows with out-of-range values.
+    return llabs((int64_t)value - (int64_t)prev) > threshold;
+}
+
+static bool values_changed(const int32_t* prev, const int32_t* values, uint16_t threshold) {
+    return value_changed(prev[0], values[0], threshold) || value_changed(prev[1], values[1], threshold) ||
+           value_changed(prev[2], values[2], threshold);
+}
+
+static uint32_t get_gamepad_changes(const uni_gamepad_t* prev,
+                                    const uni_gamepad_t* gp,
+                                    const uni_controller_change_filter_t* f) {
+    uint32_t changes = 0;
+
+    if (gp->buttons != prev->buttons)
+        changes |= UNI_CONTROLLER_CHANGE_BUTTONS;
+    if (gp->dpad != prev->dpad)
+        changes |= UNI_CONTROLLER_CHANGE_DPAD;
+    if (gp->misc_buttons != prev->misc_buttons)
+        changes |= UNI_CONTROLLER_CHANGE_MISC_BUTTONS;
+    if (value_changed(prev->axis_x, gp->axis_x, f->axis_x))
+        changes |= UNI_CONTROLLER_CHANGE_AXIS_X;
+    if (value_changed(prev->axis_y, gp->axis_y, f->axis_y))
+        changes |= UNI_CONTROLLER_CHANGE_AXIS_Y;
+    if (value_changed(prev->axis_rx, gp->axis_rx, f->axis_rx))
+        changes |= UNI_CONTROLLER_CHANGE_AXIS_RX;
+    if (value_changed(prev->axis_ry, gp->axis_ry, f->axis_ry))
+        changes |= UNI_CONTROLLER_CHANGE_AXIS_RY;
+    if (value_changed(prev->brake, gp->brake, f->brake))
+        changes |= UNI_CONTROLLER_CHANGE_BRAKE;
+    if (value_changed(prev->throttle, gp->throttle, f->throttle))
+        changes |= UNI_CONTROLLER_CHANGE_THROTTLE;
+    if (values_changed(prev->gyro, gp->gyro, f->gyro))
+        changes |= UNI_CONTROLLER_CHANGE_GYRO;
+    if (values_changed(prev->accel, gp->accel, f->accel))
+        changes |= UNI_CONTROLLER_CHANGE_ACCEL;
+
+    return changes;
+}
+
+static uint32_t get_mouse_changes(const uni_mouse_t* prev, const uni_mouse_t* ms) {
+    uint32_t changes = 0;
+
+    if (ms->buttons != prev->buttons)
+        changes |= UNI_CONTROLLER_CHANGE_BUTTONS;
+    if (ms->misc_buttons != prev->misc_buttons)
+        changes |= UNI_CONTROLLER_CHANGE_MISC_BUTTONS;
+    // Deltas and wheel are relative: a movement is a change, and so is going back to zero.
+    if (ms->delta_x != 0 || prev->delta_x != 0)
+        changes |= UNI_CONTROLLER_CHANGE_AXIS_X;
+    if (ms->delta_y != 0 || prev->delta_y != 0)
+        changes |= UNI_CONTROLLER_CHANGE_AXIS_Y;
+    if (ms->scroll_wheel != 0 || prev->scroll_wheel != 0)
+        changes |= UNI_CONTROLLER_CHANGE_SCROLL_WHEEL;
+
+    return changes;
+}
+
+static uint32_t get_keyboard_changes(const uni_keyboard_t* prev, const uni_keyboard_t* kb) {
+    uint32_t changes = 0;
+
+    if (kb->modifiers != prev->modifiers)
+        changes |= UNI_CONTROLLER_CHANGE_BUTTONS;
+    if (memcmp(kb->pressed_keys, prev->pressed_keys, sizeof(kb->pressed_keys)) != 0)
+        changes |= UNI_CONTROLLER_CHANGE_KEYS;
+
+    return changes;
+}
+
 void uni_controller_dump(const uni_controller_t* ctl) {
     switch (ctl->klass) {
         case UNI_CONTROLLER_CLASS_BALANCE_BOARD:
@@ -25,3 +101,47 @@ void uni_controller_dump(const uni_controller_t* ctl) {
     }
     logi(", battery=%d\n", ctl->battery);
 }
+
+uint32_t uni_controller_get_changes(const uni_controller_t* prev,
+                                    const uni_controller_t* ctl,
+                                    const uni_controller_change_filter_t* filter) {
+    static const uni_controller_change_filter_t no_filter;
+    uint32_t changes = 0;
+
+    if (ctl->klass != prev->klass)
+        return UNI_CONTROLLER_CHANGE_ALL;
+
+    if (filter == NULL)
+        filter = &no_filter;
+
+    switch (ctl->klass) {
+        case UNI_CONTROLLER_CLASS_GAMEPAD:
+            changes = get_gamepad_changes(&prev->gamepad, &ctl->gamepad, filter);
+            break;
+        case UNI_CONTROLLER_CLASS_MOUSE:
+            changes = get_mouse_changes(&prev->mouse, &ctl->mouse);
+            break;
+        case UNI_CONTROLLER_CLASS_KEYBOARD:
+            changes = get_keyboard_changes(&prev->keyboard, &ctl->keyboard);
+            break;
+        case UNI_CONTROLLER_CLASS_BALANCE_BOARD:
+            if (memcmp(&ctl->balance_board, &prev->balance_board, sizeof(ctl->balance_board)) != 0)
+                changes = UNI_CONTROLLER_CHANGE_BALANCE_BOARD;
+            break;
+        default:
+            break;
+    }
+
+    if (ctl->battery != prev->battery)
+        changes |= UNI_CONTROLLER_CHANGE_BATTERY;
+
+    return changes;
+}
+
+void uni_controller_set_change_filter(const uni_controller_change_filter_t* filter) {
+    change_filter = *filter;
+}
+
+const uni_controller_change_filter_t* uni_controller_get_change_filter(void) {
+    return &change_filter;
+}
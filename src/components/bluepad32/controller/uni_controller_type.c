@@ -26,50 +26,40 @@
 #include <stdbool.h>
 #include <stdio.h>
 
-#include "controller/uni_controller_list.h"
-#include "sdkconfig.h"
+#include "controller/uni_controller_list_sorted.h"
 #include "uni_common.h"
-#include "uni_log.h"
-
-uni_controller_type_t uni_guess_controller_type(uint16_t vid, uint16_t pid) {
-#ifdef CONFIG_TARGET_POSIX
-    //  Verify that there are no duplicates in the controller list
-    //  If the list were sorted, we could do this much more efficiently, as well as improve lookup speed.
-    static bool checked_for_duplicates;
-    if (!checked_for_duplicates) {
-        checked_for_duplicates = true;
-        int i, j;
-        for (i = 0; i < ARRAY_SIZE(arrControllers); ++i) {
-            for (j = i + 1; j < ARRAY_SIZE(arrControllers); ++j) {
-                if (arrControllers[i].device_id == arrControllers[j].device_id) {
-                    loge("Duplicate controller entry found for VID 0x%.4x PID 0x%.4x (%d,%d)\n",
-                         (arrControllers[i].device_id >> 16), arrControllers[i].device_id & 0xffff, i, j);
-                }
-            }
-        }
-    }
-#endif  // CONFIG_TARGET_POSIX
 
+// arrControllers is sorted by device_id, and it has no duplicates.
+// Both are guaranteed by tools/gen_controller_list.py.
+static const uni_controller_description_t* find_controller(uint16_t vid, uint16_t pid) {
     uint32_t device_id = MAKE_CONTROLLER_ID(vid, pid);
-    int i;
+    int lo = 0;
+    int hi = ARRAY_SIZE(arrControllers) - 1;
 
-    for (i = 0; i < ARRAY_SIZE(arrControllers); ++i) {
-        if (device_id == arrControllers[i].device_id) {
-            return arrControllers[i].controller_type;
-        }
+    while (lo <= hi) {
+        int mid = lo + (hi - lo) / 2;
+        uint32_t mid_id = arrControllers[mid].device_id;
+        if (mid_id == device_id)
+            return &arrControllers[mid];
+        if (mid_id < device_id)
+            lo = mid + 1;
+        else
+            hi = mid - 1;
     }
+    return NULL;
+}
 
+uni_controller_type_t uni_guess_controller_type(uint16_t vid, uint16_t pid) {
+    const uni_controller_description_t* desc = find_controller(vid, pid);
+    if (desc)
+        return desc->controller_type;
     return k_eControllerType_UnknownNonSteamController;
 }
 
 const char* uni_guess_controller_name(uint16_t vid, uint16_t pid) {
-    uint32_t device_id = MAKE_CONTROLLER_ID(vid, pid);
-    int i;
-    for (i = 0; i < sizeof(arrControllers) / sizeof(arrControllers[0]); ++i) {
-        if (device_id == arrControllers[i].device_id) {
-            return arrControllers[i].name;
-        }
-    }
+    const uni_controller_description_t* desc = find_controller(vid, pid);
+    if (desc)
+        return desc->name;
     return NULL;
 }
 
@@ -31,6 +31,9 @@ void uni_bt_del_keys_safe(void);
 void uni_bt_del_keys_unsafe(void);
 // Dump all connected devices.
 void uni_bt_dump_devices_safe(void);
+// Dump / reset the latency statistics of all connected devices, and the ones of the connection pipeline.
+void uni_bt_dump_latency_safe(void);
+void uni_bt_reset_latency_safe(void);
 // Whether to enable new Bluetooth connections.
 // When enabled, the device scans for new connections, and it will try to auto-connect to supported devices.
 // When disabled, only devices that have paired before can connect.
@@ -43,6 +43,7 @@ void uni_bt_bredr_on_hci_connection_request(uint16_t channel, const uint8_t* pac
 void uni_bt_bredr_on_hci_connection_complete(uint16_t channel, const uint8_t* packet, uint16_t size);
 void uni_bt_bredr_on_hci_disconnection_complete(uint16_t channel, const uint8_t* packet, uint16_t size);
 void uni_bt_bredr_on_hci_pin_code_request(uint16_t channel, const uint8_t* packet, uint16_t size);
+void uni_bt_bredr_on_hci_link_key_notification(uint16_t channel, const uint8_t* packet, uint16_t size);
 void uni_bt_bredr_on_hci_remote_name_request_complete(uint16_t channel, const uint8_t* packet, uint16_t size);
 
 #ifdef __cplusplus
@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_BT_BREDR_CACHE_H
+#define UNI_BT_BREDR_CACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+
+#include <btstack.h>
+
+#include "uni_hid_device.h"
+
+// BR/EDR connection cache.
+// What is learned from a controller the first time it connects (name, VID/PID, controller type and subtype,
+// COD and HID descriptor) is stored in the BTstack TLV, keyed by BD_ADDR.
+// When it reconnects, the remote name request and the SDP queries are skipped.
+// An entry is only valid with the link key that it was stored with.
+
+// Fills "d" with the cached info. Returns false if there is no valid entry for it.
+bool uni_bt_bredr_cache_load(uni_hid_device_t* d);
+// Stores "d" if it has a link key. Does nothing if the entry didn't change.
+void uni_bt_bredr_cache_store(uni_hid_device_t* d);
+void uni_bt_bredr_cache_delete(bd_addr_t addr);
+void uni_bt_bredr_cache_delete_all(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // UNI_BT_BREDR_CACHE_H
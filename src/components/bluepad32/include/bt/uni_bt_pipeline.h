@@ -0,0 +1,110 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_BT_PIPELINE_H
+#define UNI_BT_PIPELINE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "uni_latency.h"
+
+// Connection pipeline: the stages that a BR/EDR device goes through until it is ready.
+// The stages of different devices run at the same time, except the ones that BTstack can only do one
+// at the time: the remote name request and the SDP query. Devices wait for them in FIFO order,
+// instead of being disconnected.
+// Each stage has its own timeout, so a slow stage of one device doesn't eat the time of the next ones.
+
+// Time that each stage has to finish. Once it expires the device is deleted.
+// Queued stages have no timeout: however many devices are ahead, a device gets the whole time of the stage
+// once it starts it.
+// A backstop: the name request has its own, shorter, timeout that fakes the name.
+#define UNI_BT_PIPELINE_NAME_TIMEOUT_MS 8000
+// Some old devices like "ThinkGeek 8-bitty Game Controller" takes a lot of time to respond
+// to SDP queries.
+#define UNI_BT_PIPELINE_SDP_TIMEOUT_MS 13000
+// Includes the authentication.
+#define UNI_BT_PIPELINE_L2CAP_TIMEOUT_MS 15000
+// The parser setup. E.g: Switch reads the calibration from the SPI flash.
+#define UNI_BT_PIPELINE_SETUP_TIMEOUT_MS 15000
+
+typedef enum {
+    UNI_BT_PIPELINE_STAGE_NONE,  // Not in the pipeline. E.g: BLE devices, or ready ones.
+    UNI_BT_PIPELINE_STAGE_NAME_QUEUED,
+    UNI_BT_PIPELINE_STAGE_NAME,
+    UNI_BT_PIPELINE_STAGE_SDP_QUEUED,
+    UNI_BT_PIPELINE_STAGE_SDP,
+    UNI_BT_PIPELINE_STAGE_L2CAP,
+    UNI_BT_PIPELINE_STAGE_SETUP,
+
+    UNI_BT_PIPELINE_STAGE_COUNT,
+} uni_bt_pipeline_stage_t;
+
+// What only one device can use at the time.
+typedef enum {
+    UNI_BT_PIPELINE_RESOURCE_NAME,  // gap_remote_name_request()
+    UNI_BT_PIPELINE_RESOURCE_SDP,   // sdp_client_query()
+
+    UNI_BT_PIPELINE_RESOURCE_COUNT,
+} uni_bt_pipeline_resource_t;
+
+// Per-device state. Stored in uni_hid_device_cold_t.
+typedef struct {
+    // When the first stage, and the current one, started.
+    uint32_t start_ms;
+    uint32_t stage_start_ms;
+    // Order in the queue of the resource that it is waiting for. Lower goes first.
+    uint32_t queue_seq;
+    uint8_t stage;  // uni_bt_pipeline_stage_t
+    // Resource that it is waiting for, plus one. 0 if none.
+    uint8_t waiting;
+} uni_bt_pipeline_device_t;
+
+// Times are in milliseconds: stages take from a few milliseconds to several seconds. The histograms
+// have buckets up to 262s.
+typedef struct {
+    // Time spent in each stage. Indexed by uni_bt_pipeline_stage_t. NONE is not used.
+    uni_latency_histogram_t stages[UNI_BT_PIPELINE_STAGE_COUNT];
+    // From the first stage until the device is ready.
+    uni_latency_histogram_t ready;
+    // Devices deleted because a stage didn't finish in time.
+    uint32_t timeouts[UNI_BT_PIPELINE_STAGE_COUNT];
+} uni_bt_pipeline_stats_t;
+
+struct uni_hid_device_s;
+
+// Called when it is the turn of the device to use the resource.
+typedef void (*uni_bt_pipeline_start_fn_t)(struct uni_hid_device_s* d);
+
+// Finishes the current stage, and starts the timeout of the new one.
+void uni_bt_pipeline_set_stage(struct uni_hid_device_s* d, uni_bt_pipeline_stage_t stage);
+// Calls "start" when the resource is free: now, or after the devices that asked for it before.
+// The device is in the queued stage while it waits, and in the running one when "start" gets called.
+// "start" might delete the device.
+void uni_bt_pipeline_acquire(struct uni_hid_device_s* d,
+                             uni_bt_pipeline_resource_t resource,
+                             uni_bt_pipeline_start_fn_t start);
+// To be called once BTstack is done with the resource, even if the device that used it was deleted.
+// Starts the next device in the queue, if any.
+void uni_bt_pipeline_release(uni_bt_pipeline_resource_t resource);
+bool uni_bt_pipeline_is_busy(uni_bt_pipeline_resource_t resource);
+
+// Called by uni_hid_device.
+void uni_bt_pipeline_on_ready(struct uni_hid_device_s* d);
+void uni_bt_pipeline_on_timeout(struct uni_hid_device_s* d);
+
+const char* uni_bt_pipeline_stage_to_str(uni_bt_pipeline_stage_t stage);
+const uni_bt_pipeline_stats_t* uni_bt_pipeline_get_stats(void);
+void uni_bt_pipeline_reset_stats(void);
+void uni_bt_pipeline_dump_stats(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // UNI_BT_PIPELINE_H
@@ -9,6 +9,7 @@
 extern "C" {
 #endif
 
+#include <stdbool.h>
 #include <stdint.h>
 
 #include "controller/uni_balance_board.h"
@@ -67,10 +68,65 @@ typedef struct {
         uni_keyboard_t keyboard;
     };
     uint8_t battery;  // 0=emtpy, 254=full, 255=battery report not available
+    // When the report was received, in microseconds. See uni_system_get_time_us().
+    uint64_t timestamp_us;
 } uni_controller_t;
 
+// What changed between two uni_controller_t. Returned by uni_controller_get_changes().
+// Mouse and keyboard reuse the gamepad bits: buttons, misc buttons, and X/Y for the mouse deltas.
+enum {
+    UNI_CONTROLLER_CHANGE_BUTTONS = BIT(0),
+    UNI_CONTROLLER_CHANGE_DPAD = BIT(1),
+    UNI_CONTROLLER_CHANGE_MISC_BUTTONS = BIT(2),
+    UNI_CONTROLLER_CHANGE_AXIS_X = BIT(3),
+    UNI_CONTROLLER_CHANGE_AXIS_Y = BIT(4),
+    UNI_CONTROLLER_CHANGE_AXIS_RX = BIT(5),
+    UNI_CONTROLLER_CHANGE_AXIS_RY = BIT(6),
+    UNI_CONTROLLER_CHANGE_BRAKE = BIT(7),
+    UNI_CONTROLLER_CHANGE_THROTTLE = BIT(8),
+    UNI_CONTROLLER_CHANGE_GYRO = BIT(9),
+    UNI_CONTROLLER_CHANGE_ACCEL = BIT(10),
+    UNI_CONTROLLER_CHANGE_BATTERY = BIT(11),
+    UNI_CONTROLLER_CHANGE_SCROLL_WHEEL = BIT(12),
+    UNI_CONTROLLER_CHANGE_KEYS = BIT(13),
+    UNI_CONTROLLER_CHANGE_BALANCE_BOARD = BIT(14),
+    // The class changed, e.g: first report. All the other bits are set as well.
+    UNI_CONTROLLER_CHANGE_CLASS = BIT(15),
+
+    UNI_CONTROLLER_CHANGE_ALL = 0xffff,
+};
+
+// Thresholds used to compute the changes. Differences smaller or equal than the threshold are ignored.
+// 0 means that any difference is a change.
+typedef struct {
+    // When true, on_controller_data (and on_controller_data_changed) is only called when something changed.
+    // Otherwise, it is called for every report.
+    bool only_on_change;
+
+    uint16_t axis_x;
+    uint16_t axis_y;
+    uint16_t axis_rx;
+    uint16_t axis_ry;
+    uint16_t brake;
+    uint16_t throttle;
+    // Applies to each one of the three values.
+    uint16_t gyro;
+    uint16_t accel;
+} uni_controller_change_filter_t;
+
 void uni_controller_dump(const uni_controller_t* ctl);
 
+// Returns a mask of UNI_CONTROLLER_CHANGE_ with what changed between prev and ctl, using the thresholds of
+// filter. filter can be NULL, in which case any difference is a change.
+// The mouse deltas are relative: a non-zero delta is always a change, even if it is the same as the previous one.
+uint32_t uni_controller_get_changes(const uni_controller_t* prev,
+                                    const uni_controller_t* ctl,
+                                    const uni_controller_change_filter_t* filter);
+
+// The filter used by the core before calling the platform. By default, all reports are delivered.
+void uni_controller_set_change_filter(const uni_controller_change_filter_t* filter);
+const uni_controller_change_filter_t* uni_controller_get_change_filter(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -103,7 +103,10 @@ enum {
 // In the Legacy firmware it was possible for a gamepad to take more than one
 // seat, but since the v2.0 it might not be needed anymore.
 // TODO: Investigate if this really needs to be a "bit".
-typedef enum {
+// Being bits, a mask of seats can have one seat per device: up to 32 (UNI_HID_DEVICE_POOL_MAX_DEVICES).
+typedef uint32_t uni_gamepad_seat_t;
+
+enum {
     GAMEPAD_SEAT_NONE = 0,
     GAMEPAD_SEAT_A = BIT(0),
     GAMEPAD_SEAT_B = BIT(1),
@@ -112,7 +115,10 @@ typedef enum {
 
     // Masks
     GAMEPAD_SEAT_AB_MASK = (GAMEPAD_SEAT_A | GAMEPAD_SEAT_B),
-} uni_gamepad_seat_t;
+};
+
+// Seat of the device with index "idx". E.g: 0 is GAMEPAD_SEAT_A.
+#define GAMEPAD_SEAT_FOR_IDX(_idx) ((uni_gamepad_seat_t)BIT(_idx))
 
 // uni_gamepad_t is a virtual gamepad.
 // Different parsers should populate this virtual gamepad accordingly.
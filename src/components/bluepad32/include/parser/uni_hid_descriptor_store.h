@@ -0,0 +1,75 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_HID_DESCRIPTOR_STORE_H
+#define UNI_HID_DESCRIPTOR_STORE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#include "parser/uni_hid_plan.h"
+
+// HID descriptors of all the devices, together with their compiled plan.
+// Identical descriptors, like the ones of gamepads of the same model, are stored and compiled once.
+// Each descriptor takes only the bytes it needs from a shared pool.
+// Devices hold a handle, that is reference counted.
+// Must be called from the BTstack task.
+
+// Largest HID descriptor accepted. Descriptors only take the bytes they need.
+#define HID_MAX_DESCRIPTOR_LEN 1024
+
+// The store has an entry per device, plus one so that a device can replace its descriptor, and a pool of
+// CONFIG_BLUEPAD32_HID_DESCRIPTOR_POOL_SIZE bytes shared by all of them.
+// The pool holds the descriptors and the used part of their plan tables. The plan tables are
+// only stored if they fit, and are dropped when a new descriptor needs their room. Devices without them
+// parse their reports with btstack_hid_parser.
+// By default, the pool has 512 bytes per device: what each device had before the pool was shared.
+// By default, the store is static and sized for CONFIG_BLUEPAD32_MAX_DEVICES. A device pool set with
+// uni_hid_device_set_pool() brings its own store, with the same pool budget per device.
+#ifdef CONFIG_BLUEPAD32_HID_DESCRIPTOR_POOL_SIZE
+#define UNI_HID_DESCRIPTOR_STORE_POOL_SIZE CONFIG_BLUEPAD32_HID_DESCRIPTOR_POOL_SIZE
+#else
+#define UNI_HID_DESCRIPTOR_STORE_POOL_SIZE (CONFIG_BLUEPAD32_MAX_DEVICES * 512)
+#endif
+
+typedef uint8_t uni_hid_descriptor_handle_t;
+#define UNI_HID_DESCRIPTOR_HANDLE_INVALID 0
+
+typedef struct {
+    uint8_t entries;
+    uint16_t refs;
+    uint16_t pool_used;
+    uint16_t pool_size;
+} uni_hid_descriptor_store_stats_t;
+
+// Returns the handle of a descriptor with the same content, and takes a reference to it.
+// Returns UNI_HID_DESCRIPTOR_HANDLE_INVALID if there is no room for it.
+uni_hid_descriptor_handle_t uni_hid_descriptor_store_acquire(const uint8_t* descriptor, uint16_t len);
+void uni_hid_descriptor_store_release(uni_hid_descriptor_handle_t handle);
+
+// The pool is compacted when a descriptor is released, so the returned pointers are only valid
+// until the next uni_hid_descriptor_store_release().
+const uint8_t* uni_hid_descriptor_store_get_data(uni_hid_descriptor_handle_t handle, uint16_t* len);
+// CRC32 of the descriptor, computed when it was stored. 0 if the handle is not valid.
+// Cheap way to know if a descriptor changed.
+uint32_t uni_hid_descriptor_store_get_crc(uni_hid_descriptor_handle_t handle);
+// NULL if the descriptor could not be compiled.
+const uni_hid_plan_t* uni_hid_descriptor_store_get_plan(uni_hid_descriptor_handle_t handle);
+// When disabled, uni_hid_descriptor_store_get_plan() returns NULL, so that reports are parsed with
+// btstack_hid_parser. For benchmarks and debugging. Enabled by default.
+void uni_hid_descriptor_store_set_plans_enabled(bool enabled);
+
+void uni_hid_descriptor_store_get_stats(uni_hid_descriptor_store_stats_t* stats);
+
+// Called by uni_hid_device_set_pool(), that includes the store in the device pool.
+// Returns the number of bytes needed by a store for "max_devices". 0 if "max_devices" is invalid.
+size_t uni_hid_descriptor_store_get_arena_size(int max_devices);
+// "arena" must be 8-byte aligned, and have uni_hid_descriptor_store_get_arena_size() bytes.
+// NULL restores the static store. Returns false if a descriptor is in use.
+bool uni_hid_descriptor_store_set_arena(void* arena, int max_devices);
+
+#endif  // UNI_HID_DESCRIPTOR_STORE_H
@@ -7,9 +7,20 @@
 
 #include <stdint.h>
 
+#include "uni_haptics.h"
+
 // Forward declarations
 struct uni_hid_device_s;
 
+// Axis and pedal normalization coefficients, precomputed from the logical min/max.
+// Used to normalize the values without doing a division for each report.
+struct hid_normalization_s {
+    int32_t center;  // range / 2 + logical_minimum
+    uint32_t mul;    // ceil(2^shift / range)
+    uint8_t shift;   // 0 means not precomputed
+};
+typedef struct hid_normalization_s hid_normalization_t;
+
 // BTstack bug:
 // see: https://github.com/bluekitchen/btstack/issues/187
 struct hid_globals_s {
@@ -19,6 +30,7 @@ struct hid_globals_s {
     uint8_t report_size;
     uint8_t report_count;
     uint8_t report_id;
+    hid_normalization_t normalization;
 };
 typedef struct hid_globals_s hid_globals_t;
 
@@ -48,6 +60,10 @@ typedef void (*report_play_dual_rumble_fn_t)(struct uni_hid_device_s* d,
                                              uint16_t duration_ms,
                                              uint8_t weak_magnitude,
                                              uint8_t strong_magnitude);
+// Builds and sends the report that sets the motors. All zeros means turn off the motors.
+// Timing (delayed start, duration) is handled by the haptics engine. See uni_haptics.h
+typedef uni_haptics_result_t (*report_set_rumble_fn_t)(struct uni_hid_device_s* d,
+                                                       const uni_haptics_motors_t* motors);
 typedef void (*report_device_dump_t)(struct uni_hid_device_s* d);
 
 // Parsers should implement these optional functions:
@@ -66,13 +82,25 @@ typedef struct {
     report_set_player_leds_fn_t set_player_leds;
     // If implemented, changes the lightbar color (e.g.: in DS4 and DualSense)
     report_set_lightbar_color_fn_t set_lightbar_color;
-    // If implemented, activates rumble in the gamepad
+    // If implemented, activates rumble in the gamepad.
+    // Set automatically to uni_haptics_play_dual_rumble() when "set_rumble" is implemented, unless the parser
+    // sets its own. E.g: Wii, that ignores the magnitudes.
     report_play_dual_rumble_fn_t play_dual_rumble;
+    // If implemented, sets the motors. Used by the haptics engine.
+    report_set_rumble_fn_t set_rumble;
     // If implemented, it dumps device info
     report_device_dump_t device_dump;
 } uni_report_parser_t;
 
+// "received_us" is when the report was received, taken by the L2CAP (BR/EDR) or GATT (BLE) packet handlers.
+// It is used for the latency stats and the controller timestamp. See uni_latency.h.
+void uni_hid_parse_input_report_at(struct uni_hid_device_s* d,
+                                   const uint8_t* report,
+                                   uint16_t report_len,
+                                   uint64_t received_us);
+// Same, but the report is considered received now. E.g: replayed reports.
 void uni_hid_parse_input_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t report_len);
+void uni_hid_parser_init_normalization(hid_globals_t* globals);
 int32_t uni_hid_parser_process_axis(hid_globals_t* globals, uint32_t value);
 int32_t uni_hid_parser_process_pedal(hid_globals_t* globals, uint32_t value);
 uint8_t uni_hid_parser_process_hat(hid_globals_t* globals, uint32_t value);
@@ -13,10 +13,7 @@
 #define UNI_HID_PARSER_STADIA_PID 0x9400
 
 void uni_hid_parser_stadia_setup(struct uni_hid_device_s* d);
-void uni_hid_parser_stadia_play_dual_rumble(struct uni_hid_device_s* d,
-                                            uint16_t start_delay_ms,
-                                            uint16_t duration_ms,
-                                            uint8_t weak_magnitude,
-                                            uint8_t strong_magnitude);
+uni_haptics_result_t uni_hid_parser_stadia_set_rumble(struct uni_hid_device_s* d,
+                                                      const uni_haptics_motors_t* motors);
 
 #endif  // UNI_HID_PARSER_STADIA_H
@@ -20,6 +20,7 @@ void uni_hid_parser_wii_setup(struct uni_hid_device_s* d);
 void uni_hid_parser_wii_init_report(struct uni_hid_device_s* d);
 void uni_hid_parser_wii_parse_input_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t len);
 void uni_hid_parser_wii_set_player_leds(struct uni_hid_device_s* d, uint8_t leds);
+uni_haptics_result_t uni_hid_parser_wii_set_rumble(struct uni_hid_device_s* d, const uni_haptics_motors_t* motors);
 void uni_hid_parser_wii_play_dual_rumble(struct uni_hid_device_s* d,
                                          uint16_t start_delay_ms,
                                          uint16_t duration_ms,
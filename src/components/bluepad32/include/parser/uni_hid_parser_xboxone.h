@@ -19,11 +19,8 @@ void uni_hid_parser_xboxone_parse_usage(struct uni_hid_device_s* d,
                                         uint16_t usage_page,
                                         uint16_t usage,
                                         int32_t value);
-void uni_hid_parser_xboxone_play_dual_rumble(struct uni_hid_device_s* d,
-                                             uint16_t start_delay_ms,
-                                             uint16_t duration_ms,
-                                             uint8_t weak_magnitude,
-                                             uint8_t strong_magnitude);
+uni_haptics_result_t uni_hid_parser_xboxone_set_rumble(struct uni_hid_device_s* d,
+                                                       const uni_haptics_motors_t* motors);
 void uni_hid_parser_xboxone_device_dump(struct uni_hid_device_s* d);
 
 // Unique to Xbox. Not part of the "hid_parser" interface
@@ -0,0 +1,93 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_HID_PLAN_H
+#define UNI_HID_PLAN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "parser/uni_hid_parser.h"
+
+// A "plan" is the HID descriptor compiled into a flat table of input fields.
+// The descriptor is walked only once, when it is set, and then each input report
+// is decoded by extracting the fields directly from the report bytes.
+// This avoids walking the whole descriptor for each report, which is what
+// btstack_hid_parser does.
+
+// Max number of Main "Input" items. Each item has its own globals.
+#define UNI_HID_PLAN_MAX_ITEMS 24
+// Max number of field runs. A run is a group of consecutive fields that belong to the same
+// item and that have the same usage (or consecutive usages).
+#define UNI_HID_PLAN_MAX_FIELDS 48
+// Max number of different Report IDs.
+#define UNI_HID_PLAN_MAX_REPORTS 8
+
+enum {
+    UNI_HID_PLAN_ITEM_FLAG_VARIABLE = 1 << 0,  // If not set, it is an "array" item
+    UNI_HID_PLAN_ITEM_FLAG_SIGNED = 1 << 1,    // Logical minimum is negative
+};
+
+enum {
+    UNI_HID_PLAN_FIELD_FLAG_USAGE_RANGE = 1 << 0,  // Usage is incremented for each field in the run
+};
+
+typedef struct {
+    hid_globals_t globals;
+    uint8_t flags;
+} uni_hid_plan_item_t;
+
+typedef struct {
+    uint16_t bit_offset;  // Offset from the beginning of the report, including the Report ID byte
+    uint16_t usage_page;
+    uint16_t usage;  // Usage of the first field in the run
+    uint8_t count;   // Number of fields in the run
+    uint8_t item_idx;
+    uint8_t flags;
+} uni_hid_plan_field_t;
+
+typedef struct {
+    uint8_t report_id;
+    uint8_t first_field;
+    uint8_t num_fields;
+} uni_hid_plan_report_t;
+
+typedef struct {
+    bool valid;
+    bool has_report_ids;
+    uint8_t num_items;
+    uint8_t num_fields;
+    uint8_t num_reports;
+    uni_hid_plan_item_t* items;
+    uni_hid_plan_field_t* fields;
+    uni_hid_plan_report_t* reports;
+} uni_hid_plan_t;
+
+// Compiles the input part of a HID descriptor. The tables of the plan are stored in "buffer", that must be
+// 4-byte aligned. They only take the bytes needed by this descriptor: see uni_hid_plan_get_tables_size().
+// Returns false if the descriptor could not be compiled, like when it has too many fields, or when the tables
+// don't fit in "buffer_size". In that case callers should fall back to btstack_hid_parser.
+bool uni_hid_plan_compile(uni_hid_plan_t* plan,
+                          void* buffer,
+                          uint16_t buffer_size,
+                          const uint8_t* descriptor,
+                          uint16_t descriptor_len);
+void uni_hid_plan_reset(uni_hid_plan_t* plan);
+
+// Bytes used by the tables of a compiled plan: only the items, fields and reports that it has.
+uint16_t uni_hid_plan_get_tables_size(const uni_hid_plan_t* plan);
+// Moves the tables of the plan to "buffer", that must be 4-byte aligned and have uni_hid_plan_get_tables_size()
+// bytes. "buffer" can overlap the current tables, as long as it is not after them.
+void uni_hid_plan_move_tables(uni_hid_plan_t* plan, void* buffer);
+
+// Calls parse_usage() for each field in the report, in the same order as btstack_hid_parser would do.
+void uni_hid_plan_parse_report(const uni_hid_plan_t* plan,
+                               struct uni_hid_device_s* d,
+                               report_parse_usage_fn_t parse_usage,
+                               const uint8_t* report,
+                               uint16_t report_len);
+
+void uni_hid_plan_dump(const uni_hid_plan_t* plan);
+
+#endif  // UNI_HID_PLAN_H
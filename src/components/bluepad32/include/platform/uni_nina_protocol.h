@@ -0,0 +1,229 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_NINA_PROTOCOL_H
+#define UNI_NINA_PROTOCOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "controller/uni_controller.h"
+#include "uni_common.h"
+#include "uni_hid_device.h"
+
+// NINA / AirLift protocol: what Bluepad32 speaks over SPI with the main processor (Arduino, CircuitPython).
+// It doesn't depend on the SPI driver nor on FreeRTOS, so that it can be tested on the host.
+// See examples/posix/bench/bench_nina.c.
+//
+// It has two sides, that might run on different CPUs:
+// - Bluetooth side: the uni_nina_protocol_*_controller() functions, called from the platform callbacks.
+// - SPI side: uni_nina_protocol_process_request() and uni_nina_protocol_get_controllers_frame().
+// Each side is single threaded, and they never wait for each other.
+
+// Command and response buffers. Must be modulo 4 and word aligned for the SPI DMA.
+// A higher value up to SPI_MAX_DMA_LEN can be defined if needed.
+#define UNI_NINA_PROTOCOL_BUFFER_LEN 256
+
+/* Cmd Struct Message, from:
+https://github.com/arduino-libraries/WiFiNINA/blob/master/src/utility/spi_drv.cpp
+ ________________________________________________________________________
+| START CMD | C/R  | CMD  | N.PARAM | PARAM LEN | PARAM  | .. | END CMD |
+|___________|______|______|_________|___________|________|____|_________|
+|   8 bit   | 1bit | 7bit |  8bit   |   8bit    | nbytes | .. |   8bit  |
+|___________|______|______|_________|___________|________|____|_________|
+*/
+
+// NINA-fw commands. Taken from:
+// https://github.com/arduino-libraries/WiFiNINA/blob/master/src/utility/wifi_spi.h
+// https://github.com/adafruit/Adafruit_CircuitPython_ESP32SPI/blob/master/adafruit_esp32spi/adafruit_esp32spi.py
+enum {
+    UNI_NINA_CMD_START = 0xe0,
+    UNI_NINA_CMD_END = 0xee,
+    UNI_NINA_CMD_ERR = 0xef,
+    UNI_NINA_CMD_REPLY_FLAG = BIT(7),
+};
+
+// 0x00 -> 0x0f: Bluepad32 own extensions.
+// These 16 entries are NULL in NINA. Perhaps they are reserved for future
+// use? Seems to be safe to use them for Bluepad32 commands.
+// 0x10 and above are the NINA-fw ones, handled by the platform.
+enum {
+    UNI_NINA_CMD_PROTOCOL_VERSION = 0x00,       // protocol version. Negotiates v2
+    UNI_NINA_CMD_GAMEPADS_DATA = 0x01,          // Deprecated by CONTROLLERS_DATA
+    UNI_NINA_CMD_SET_PLAYER_LEDS = 0x02,        // the 4 LEDs that is available in many gamepads.
+    UNI_NINA_CMD_SET_COLOR_LED = 0x03,          // available on DS4, DualSense
+    UNI_NINA_CMD_SET_RUMBLE = 0x04,             // available on DS4, Xbox, Switch, etc.
+    UNI_NINA_CMD_FORGET_BT_KEYS = 0x05,         // forget stored Bluetooth keys
+    UNI_NINA_CMD_GET_PROPERTIES = 0x06,         // get gamepad properties like BTAddr, VID/PID, etc.
+    UNI_NINA_CMD_ENABLE_BT_CONNECTIONS = 0x07,  // Enable/Disable bluetooth connection
+    UNI_NINA_CMD_DISCONNECT = 0x08,             // Disconnect gamepad
+    UNI_NINA_CMD_CONTROLLERS_DATA = 0x09,       // Gamepad, Mouse, Balance.
+    UNI_NINA_CMD_CONTROLLERS_CHANGES = 0x0a,    // v2: only what changed. Deprecates CONTROLLERS_DATA
+    UNI_NINA_CMD_BATCH = 0x0b,                  // v2: several commands in one transaction
+
+    UNI_NINA_CMD_BLUEPAD32_MAX = 0x10,
+};
+
+// Possible answers when the request doesn't need an answer, like in "set_xxx".
+enum {
+    UNI_NINA_RESPONSE_ERROR = 0,
+    UNI_NINA_RESPONSE_OK = 1,
+};
+
+#define UNI_NINA_PROTOCOL_VERSION_HI 0x01
+#define UNI_NINA_PROTOCOL_VERSION_LO 0x04
+#define UNI_NINA_PROTOCOL_V2_VERSION_HI 0x02
+#define UNI_NINA_PROTOCOL_V2_VERSION_LO 0x00
+
+enum {
+    UNI_NINA_CONTROLLER_INVALID = -1,
+};
+
+// Instead of using the uni_gamepad, we create one.
+// This is because this "struct" is sent via the wire and the format, padding,
+// etc. must not change.
+typedef struct __attribute__((packed)) {
+    // Usage Page: 0x01 (Generic Desktop Controls)
+    uint8_t dpad;
+    int32_t axis_x;
+    int32_t axis_y;
+    int32_t axis_rx;
+    int32_t axis_ry;
+
+    // Usage Page: 0x02 (Sim controls)
+    int32_t brake;
+    int32_t throttle;
+
+    // Usage Page: 0x09 (Button)
+    uint16_t buttons;
+
+    // Misc buttons (from 0x0c (Consumer) and others)
+    uint8_t misc_buttons;
+
+    // Gyro / Accel
+    int32_t gyro[3];
+    int32_t accel[3];
+} uni_nina_gamepad_t;
+
+typedef struct __attribute__((packed)) {
+    int32_t delta_x;
+    int32_t delta_y;
+    uint8_t buttons;
+    uint8_t misc_buttons;
+    int8_t scroll_wheel;
+} uni_nina_mouse_t;
+
+typedef struct __attribute__((packed)) {
+    uint16_t tr;      // Top right
+    uint16_t br;      // Bottom right
+    uint16_t tl;      // Top left
+    uint16_t bl;      // Bottom left
+    int temperature;  // Temperature
+} uni_nina_balance_board_t;
+
+enum {
+    UNI_NINA_CONTROLLER_CLASS_NONE,
+    UNI_NINA_CONTROLLER_CLASS_GAMEPAD,
+    UNI_NINA_CONTROLLER_CLASS_MOUSE,
+    UNI_NINA_CONTROLLER_CLASS_KEYBOARD,
+    UNI_NINA_CONTROLLER_CLASS_BALANCE_BOARD,
+};
+
+typedef struct __attribute__((packed)) {
+    int8_t idx;
+    // Class of controller: gamepad, mouse, balance, etc.
+    uint8_t klass;
+    union {
+        uni_nina_gamepad_t gamepad;
+        uni_nina_mouse_t mouse;
+        uni_nina_balance_board_t balance;
+    };
+    uint8_t battery;
+} uni_nina_controller_t;
+
+enum {
+    UNI_NINA_PROPERTY_FLAG_RUMBLE = BIT(0),
+    UNI_NINA_PROPERTY_FLAG_PLAYER_LEDS = BIT(1),
+    UNI_NINA_PROPERTY_FLAG_PLAYER_LIGHTBAR = BIT(2),
+
+    UNI_NINA_PROPERTY_FLAG_BALANCE_BOARD = BIT(12),
+    UNI_NINA_PROPERTY_FLAG_GAMEPAD = BIT(13),
+    UNI_NINA_PROPERTY_FLAG_MOUSE = BIT(14),
+    UNI_NINA_PROPERTY_FLAG_KEYBOARD = BIT(15),
+};
+
+// This is sent via the wire. Adding new properties at the end Ok.
+// If so, update Protocol version.
+typedef struct __attribute__((packed)) {
+    uint8_t idx;          // Device index
+    uint8_t btaddr[6];    // BT Addr
+    uint8_t type;         // model: copy from nina_gamepad_t
+    uint8_t subtype;      // subtype. E.g: Wii Remote 2nd version
+    uint16_t vendor_id;   // VID
+    uint16_t product_id;  // PID
+    uint16_t flags;       // Features like Rumble, LEDs, etc.
+} uni_nina_controller_properties_t;
+
+// Protocol v2: "controllers changes" sends one record per controller that changed:
+// idx, change bitmap (16-bit little endian), klass (if UNI_NINA_V2_CHANGE_CLASS), the fields that changed,
+// in bit order, and battery (if UNI_NINA_V2_CHANGE_BATTERY).
+// Bits 0-13 are the fields of the class, in the order of its struct. Gyro and accel are one bit each.
+// Fields keep the width of the v1 structs.
+enum {
+    UNI_NINA_V2_CHANGE_BATTERY = BIT(14),
+    UNI_NINA_V2_CHANGE_CLASS = BIT(15),
+};
+
+enum {
+    // Everything is sent: the host didn't acknowledge the previous response.
+    UNI_NINA_V2_FLAG_FULL = BIT(0),
+};
+
+// Requests that must be executed by the Bluetooth task.
+enum {
+    UNI_NINA_REQUEST_CMD_NONE = 0,
+    UNI_NINA_REQUEST_CMD_LIGHTBAR_COLOR = 1,
+    UNI_NINA_REQUEST_CMD_PLAYER_LEDS = 2,
+    UNI_NINA_REQUEST_CMD_RUMBLE = 3,
+    UNI_NINA_REQUEST_CMD_DISCONNECT = 4,
+};
+
+typedef struct {
+    uint8_t controller_idx;
+    uint8_t cmd;
+    uint8_t args[8];
+} uni_nina_request_t;
+
+// Parameters start at response[2]. Returns the response length, without CMD_END. 0 or less on error.
+// response[0], response[1] (CMD_START and command) and CMD_END are set by uni_nina_protocol_process_request().
+// "command" always has UNI_NINA_PROTOCOL_BUFFER_LEN bytes, zero padded.
+typedef int (*uni_nina_command_handler_t)(const uint8_t command[], uint8_t response[] /* out */);
+
+// Called from the SPI side.
+typedef struct {
+    // LEDs, rumble and disconnect. To be executed by the Bluetooth task.
+    void (*queue_request)(const uni_nina_request_t* request);
+    void (*forget_bluetooth_keys)(void);
+    void (*enable_bluetooth_connections)(bool enabled);
+    // NINA-fw commands: 0x10 and above. NULL if not supported.
+    uni_nina_command_handler_t process_nina_fw_request;
+} uni_nina_protocol_callbacks_t;
+
+// Resets the state: no controllers, protocol v1. Must be called before the SPI side starts.
+void uni_nina_protocol_init(const uni_nina_protocol_callbacks_t* callbacks);
+
+// Bluetooth side.
+// Assigns a seat to the device, and returns its idx. UNI_NINA_CONTROLLER_INVALID if there are no free seats.
+int uni_nina_protocol_add_controller(uni_hid_device_t* d);
+void uni_nina_protocol_remove_controller(int idx);
+void uni_nina_protocol_set_controller_data(int idx, const uni_controller_t* ctl);
+
+// SPI side.
+// "command" must have UNI_NINA_PROTOCOL_BUFFER_LEN bytes, zero padded. Returns the response length.
+int uni_nina_protocol_process_request(const uint8_t command[], int command_len, uint8_t response[] /* out */);
+// The "controllers data" response, prebuilt by the Bluetooth side. Can be sent as is.
+// Owned by the SPI side until the next call. Same as sending UNI_NINA_CMD_CONTROLLERS_DATA, without the copy.
+const uint8_t* uni_nina_protocol_get_controllers_frame(int* len);
+
+#endif  // UNI_NINA_PROTOCOL_H
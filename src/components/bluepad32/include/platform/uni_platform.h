@@ -65,6 +65,11 @@ struct uni_platform {
     // Indicates that a controller button, stick, gyro, etc. has changed.
     void (*on_controller_data)(uni_hid_device_t* d, uni_controller_t* ctl);
 
+    // Same as on_controller_data, but it also receives what changed since the previous call:
+    // a mask of UNI_CONTROLLER_CHANGE_. When defined, it is called instead of on_controller_data.
+    // To be called only when something changed, use uni_controller_set_change_filter().
+    void (*on_controller_data_changed)(uni_hid_device_t* d, uni_controller_t* ctl, uint32_t changes);
+
     // Return a property entry, or NULL if not supported.
     const uni_property_t* (*get_property)(uni_property_idx_t idx);
 
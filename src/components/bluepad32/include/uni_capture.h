@@ -0,0 +1,118 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_CAPTURE_H
+#define UNI_CAPTURE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdkconfig.h"
+
+#include "parser/uni_hid_descriptor_store.h"
+
+// Capture and replay of the reports received from the controllers.
+//
+// Capture: every input report, as it enters uni_hid_parse_input_report(), and every feature report
+// is streamed to a sink, like a file.
+// Replay: reads a capture, and pushes the reports through the real parsers and
+// uni_hid_device_process_controller(), either at the original pace or as fast as possible.
+// Useful to reproduce bugs, to benchmark the parsers with real traffic and to run regression tests
+// without the physical controllers.
+// Only built with CONFIG_BLUEPAD32_CAPTURE. Otherwise, the calls made by Bluepad32 do nothing.
+//
+// Format. Values are little-endian.
+// - File header: "BP32CAP" followed by the version (1 byte).
+// - Records: 8-byte header followed by the payload.
+//   - Type (1 byte): uni_capture_record_type_t
+//   - Device index (1 byte)
+//   - Payload length (2 bytes)
+//   - Microseconds since the previous record (4 bytes). Saturates at UINT32_MAX.
+//
+// Payloads:
+// - DEVICE: vendor id (2 bytes), product id (2 bytes), controller type (2 bytes), flags (1 byte),
+//   reserved (1 byte), followed by the HID descriptor, if any.
+//   Written before the first report of the device, and again if any of these values change.
+// - INPUT_REPORT and FEATURE_REPORT: the report, without the HID header (0xa1 or 0xa3).
+
+#define UNI_CAPTURE_VERSION 1
+#define UNI_CAPTURE_FILE_HEADER_SIZE 8
+#define UNI_CAPTURE_RECORD_HEADER_SIZE 8
+#define UNI_CAPTURE_DEVICE_PAYLOAD_SIZE 8
+// Max size of a record payload. Bigger records are invalid.
+// Big enough for a DEVICE record with the largest HID descriptor.
+#define UNI_CAPTURE_MAX_PAYLOAD_LEN (UNI_CAPTURE_DEVICE_PAYLOAD_SIZE + HID_MAX_DESCRIPTOR_LEN)
+
+typedef enum {
+    UNI_CAPTURE_RECORD_DEVICE = 1,
+    UNI_CAPTURE_RECORD_INPUT_REPORT = 2,
+    UNI_CAPTURE_RECORD_FEATURE_REPORT = 3,
+} uni_capture_record_type_t;
+
+// The device was already set up when it was added to the capture. Replay skips the parser setup.
+#define UNI_CAPTURE_DEVICE_FLAG_READY (1 << 0)
+
+// Per-device state of the capture: last values written in the DEVICE record.
+// Stored in the cold part of the device. Only used by uni_capture.c.
+typedef struct {
+    bool announced;
+    uint16_t vendor_id;
+    uint16_t product_id;
+    uint16_t controller_type;
+    uint32_t hid_descriptor_crc;
+} uni_capture_device_t;
+
+struct uni_hid_device_s;
+
+#ifdef CONFIG_BLUEPAD32_CAPTURE
+
+// Called for each chunk of the capture. Must write "len" bytes in order.
+typedef void (*uni_capture_write_fn_t)(const uint8_t* data, uint16_t len, void* context);
+
+// Starts a capture that is written to "write_fn". Stops the previous one, if any.
+void uni_capture_start(uni_capture_write_fn_t write_fn, void* context);
+// Starts a capture that is streamed to a file. Returns false if the file cannot be created.
+bool uni_capture_start_file(const char* path);
+void uni_capture_stop(void);
+bool uni_capture_is_active(void);
+
+// Called by Bluepad32 when a report is received, before it is parsed.
+void uni_capture_on_input_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t len);
+void uni_capture_on_feature_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t len);
+
+// Replays a capture file. Each device of the capture is replayed with a new device, that is
+// reported to the platform like any other device. They are deleted once the replay finishes.
+// Devices whose parser setup was captured, go through the same setup. Reports sent to them are dropped.
+// "on_done" is called once the replay finishes. Might be NULL.
+// Returns false if the file is not valid, or if there is a replay in progress.
+bool uni_capture_replay_file(const char* path, bool as_fast_as_possible, void (*on_done)(void));
+// Replays a capture that is in memory, synchronously, and deletes its devices before returning.
+// Used by the fuzzers. Returns false if the header is not valid.
+bool uni_capture_replay_buffer(const uint8_t* data, size_t len);
+
+#else  // !CONFIG_BLUEPAD32_CAPTURE
+
+static inline void uni_capture_on_input_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t len) {
+    (void)d;
+    (void)report;
+    (void)len;
+}
+static inline void uni_capture_on_feature_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t len) {
+    (void)d;
+    (void)report;
+    (void)len;
+}
+
+#endif  // !CONFIG_BLUEPAD32_CAPTURE
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // UNI_CAPTURE_H
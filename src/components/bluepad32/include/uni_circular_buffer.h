@@ -7,10 +7,18 @@
 
 #include <stdint.h>
 
-// UNI_CIRCULAR_BUFFER_SIZE represents how many packets can be queued
+#include "sdkconfig.h"
+
+// Packets are stored back-to-back, each one with a small header, so a short packet
+// only takes the bytes it needs.
+// UNI_CIRCULAR_BUFFER_SIZE represents how many bytes can be queued per device.
 // Multiple gamepads could be connected at the same time, each queuing
 // multiple packets: Think of 8 gamepads wanted to rumble at the same time.
-#define UNI_CIRCULAR_BUFFER_SIZE 32
+#ifdef CONFIG_BLUEPAD32_OUTGOING_BUFFER_SIZE
+#define UNI_CIRCULAR_BUFFER_SIZE CONFIG_BLUEPAD32_OUTGOING_BUFFER_SIZE
+#else
+#define UNI_CIRCULAR_BUFFER_SIZE 1024
+#endif
 // UNI_CIRCULAR_BUFFER_DATA_SIZE represents the max size of each packet
 #define UNI_CIRCULAR_BUFFER_DATA_SIZE 128
 
@@ -19,23 +27,39 @@ enum {
     UNI_CIRCULAR_BUFFER_ERROR_BUFFER_FULL,
     UNI_CIRCULAR_BUFFER_ERROR_BUFFER_EMPTY,
     UNI_CIRCULAR_BUFFER_ERROR_BUFFER_TOO_BIG,
+    UNI_CIRCULAR_BUFFER_ERROR_NOT_FOUND,
 };
 
-typedef struct uni_ciruclar_buffer_data_s {
-    int16_t cid;
-    uint8_t data[UNI_CIRCULAR_BUFFER_DATA_SIZE];
-    int data_len;
-} uni_circular_buffer_data_t;
-
 typedef struct uni_circular_buffer_s {
-    uni_circular_buffer_data_t buffer[UNI_CIRCULAR_BUFFER_SIZE];
-    int16_t head_idx;
-    int16_t tail_idx;
+    uint8_t buffer[UNI_CIRCULAR_BUFFER_SIZE];
+    // Offset of the oldest packet still in use. Includes the one returned by the last "get".
+    uint16_t head_idx;
+    // Offset of the next packet to "get".
+    uint16_t read_idx;
+    // Offset where the next packet will be "put".
+    uint16_t tail_idx;
+    // Number of packets that haven't been returned by "get" yet.
+    uint16_t count;
+    // Whether the packet returned by the last "get" is still in the buffer.
+    uint8_t has_pending;
+    // Stats
+    // Packets that replaced a queued one. See uni_circular_buffer_replace()
+    uint32_t merged_count;
+    // Packets that were not queued because the buffer was full
+    uint32_t dropped_count;
 } uni_circular_buffer_t;
 
 uint8_t uni_circular_buffer_put(uni_circular_buffer_t* b, int16_t cid, const void* data, int len);
+// The returned data is valid until the next call to get() or reset().
 uint8_t uni_circular_buffer_get(uni_circular_buffer_t* b, int16_t* cid, void** data, int* len);
+// Like get(), but the packet stays in the buffer. Valid until the next put(), get() or reset().
+uint8_t uni_circular_buffer_peek(uni_circular_buffer_t* b, int16_t* cid, void** data, int* len);
+// Replaces, in place, the oldest queued packet that has the same cid, the same length, and
+// the same first "key_len" bytes. Returns UNI_CIRCULAR_BUFFER_ERROR_NOT_FOUND if there is no such packet.
+// The packet returned by the last get() is not considered, since it is already owned by the caller.
+uint8_t uni_circular_buffer_replace(uni_circular_buffer_t* b, int16_t cid, const void* data, int len, int key_len);
 uint8_t uni_circular_buffer_is_empty(uni_circular_buffer_t* b);
+// Returns true if a packet of the max size (UNI_CIRCULAR_BUFFER_DATA_SIZE - 1) cannot be queued.
 uint8_t uni_circular_buffer_is_full(uni_circular_buffer_t* b);
 void uni_circular_buffer_reset(uni_circular_buffer_t* b);
 
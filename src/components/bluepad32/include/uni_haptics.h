@@ -0,0 +1,91 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_HAPTICS_H
+#define UNI_HAPTICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Haptics engine: takes care of the rumble timing (delayed start, duration and queued effects)
+// for all the devices, using a single run-loop timer.
+// Parsers only need to implement "set_rumble" in uni_report_parser_t, which builds and sends
+// the report that sets the motors.
+
+// Max number of effects that can be queued per device, not including the one being played.
+#define UNI_HAPTICS_MAX_QUEUED_EFFECTS 4
+
+// If the parser can't send the report right now (e.g: BLE busy), it is retried after this delay.
+#define UNI_HAPTICS_RETRY_MS 50
+
+typedef struct {
+    uint8_t weak_magnitude;
+    uint8_t strong_magnitude;
+    // Only used by controllers with "impulse triggers", like Xbox.
+    uint8_t trigger_left;
+    uint8_t trigger_right;
+} uni_haptics_motors_t;
+
+typedef struct {
+    // Delay before the effect starts. Motors keep their previous state during the delay.
+    uint16_t start_delay_ms;
+    // 0 means stop the motors.
+    uint16_t duration_ms;
+    uni_haptics_motors_t motors;
+} uni_haptics_effect_t;
+
+typedef enum {
+    UNI_HAPTICS_RESULT_OK,
+    // Could not send the report now. Will be retried after UNI_HAPTICS_RETRY_MS.
+    UNI_HAPTICS_RESULT_RETRY,
+    // Could not send the report, and it should not be retried.
+    UNI_HAPTICS_RESULT_ERROR,
+} uni_haptics_result_t;
+
+// Per-device state of the engine. Stored in the cold part of the device, one per device of the pool.
+// Only used by uni_haptics.c.
+typedef struct {
+    uint8_t state;
+    bool motors_on;
+    uint8_t queue_head;
+    uint8_t queue_len;
+    uint32_t deadline_ms;
+    uni_haptics_effect_t current;
+    uni_haptics_effect_t queue[UNI_HAPTICS_MAX_QUEUED_EFFECTS];
+} uni_haptics_device_t;
+
+struct uni_hid_device_s;
+
+// Cancels the current effect and the queued ones, and plays this one.
+void uni_haptics_play(struct uni_hid_device_s* d, const uni_haptics_effect_t* effect);
+// Plays the effect after the current one (and the ones that are already queued) finish.
+// Returns false if the queue is full.
+bool uni_haptics_queue(struct uni_hid_device_s* d, const uni_haptics_effect_t* effect);
+// Cancels all the effects, and turns off the motors.
+void uni_haptics_stop(struct uni_hid_device_s* d);
+// Like stop, but doesn't send any report. Used when the device gets deleted.
+void uni_haptics_cancel(struct uni_hid_device_s* d);
+// Whether the motors are on.
+bool uni_haptics_is_playing(struct uni_hid_device_s* d);
+
+// Same signature as report_play_dual_rumble_fn_t. Used for all the parsers that implement "set_rumble".
+void uni_haptics_play_dual_rumble(struct uni_hid_device_s* d,
+                                  uint16_t start_delay_ms,
+                                  uint16_t duration_ms,
+                                  uint8_t weak_magnitude,
+                                  uint8_t strong_magnitude);
+
+// Advances the effects whose deadline is <= now_ms. Called from the engine timer.
+// Exposed so that the engine can be driven by tests and benchmarks without a run loop.
+void uni_haptics_process(uint32_t now_ms);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // UNI_HAPTICS_H
@@ -9,43 +9,55 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#include "sdkconfig.h"
+
 #include "bt/uni_bt_conn.h"
+#include "bt/uni_bt_pipeline.h"
 #include "controller/uni_controller.h"
 #include "controller/uni_controller_type.h"
 #include "parser/uni_hid_parser.h"
+#include "parser/uni_hid_descriptor_store.h"
+#include "uni_capture.h"
 #include "uni_circular_buffer.h"
 #include "uni_error.h"
+#include "uni_haptics.h"
+#include "uni_latency.h"
+#include "uni_snapshot.h"
 
 #define HID_MAX_NAME_LEN 240
-#define HID_MAX_DESCRIPTOR_LEN 512
-#define HID_DEVICE_MAX_PARSER_DATA 256
-#define HID_DEVICE_MAX_PLATFORM_DATA 256
+// HID_MAX_DESCRIPTOR_LEN is defined in uni_hid_descriptor_store.h
+// Big enough for the biggest parser instance, the Switch one.
+// Each parser checks that its instance fits with a static assert.
+#define HID_DEVICE_MAX_PARSER_DATA 160
+// Each platform checks that its instance fits with a static assert.
+#define HID_DEVICE_MAX_PLATFORM_DATA 128
 // HID_DEVICE_CONNECTION_TIMEOUT_MS includes the time from when the device is created until it is ready.
+// BR/EDR devices use a timeout per stage instead, once they enter the connection pipeline. See uni_bt_pipeline.h.
 #define HID_DEVICE_CONNECTION_TIMEOUT_MS 20000
 
+// Max number of devices of a pool set with uni_hid_device_set_pool().
+// Limited by the seats, which are bits of a 32-bit mask (see uni_gamepad_seat_t).
+#define UNI_HID_DEVICE_POOL_MAX_DEVICES 32
+
 typedef enum {
     SDP_QUERY_AFTER_CONNECT,   // If not set, this is the default one.
     SDP_QUERY_BEFORE_CONNECT,  // Special case for DualShock4 1st generation.
     SDP_QUERY_NOT_NEEDED,      // Because the Controller type was inferred by other means.
 } uni_sdp_query_type_t;
 
-struct uni_hid_device_s {
-    uint32_t cod;  // Class of Device.
-    uint16_t vendor_id;
-    uint16_t product_id;
+// Device state that is not needed to find the device and to track the controller data: it is only used while
+// connecting, when sending reports, for the statistics, or through the parser and platform instances.
+// Kept in its own pool, so that the hot part of the devices is smaller and contiguous.
+typedef struct {
     char name[HID_MAX_NAME_LEN];
 
-    // hid, cod, etc...
-    uint32_t flags;
-
     // Will abort connection if the connection was not established after timeout.
     btstack_timer_source_t connection_timer;
     // Max amount of time to wait to get the device name.
     btstack_timer_source_t inquiry_remote_name_timer;
+    // Needed for Nintendo Switch family of controllers.
+    btstack_timer_source_t misc_button_delay_timer;
 
-    // SDP
-    uint8_t hid_descriptor[HID_MAX_DESCRIPTOR_LEN];
-    uint16_t hid_descriptor_len;
     // DualShock4 1st gen requires to do the SDP query before l2cap connect,
     // otherwise it won't work.
     // And Nintendo Switch Pro gamepad requires to do the SDP query after l2cap
@@ -56,40 +68,71 @@ struct uni_hid_device_s {
     // connection.
     uni_sdp_query_type_t sdp_query_type;
 
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+    // Report rate, parse and platform callback times.
+    uni_latency_t latency;
+#endif  // CONFIG_BLUEPAD32_LATENCY_STATS
+
+    // Bytes reserved to controller's parser instances.
+    // E.g.: The Wii driver uses it for the state machine.
+    // Aligned, since it is cast to the instance struct, that might have pointers.
+    // Not in the hot part: parsers reach it through the device they already have, while the lookups
+    // scan all the hot parts, so it would only make them bigger.
+    uint8_t parser_data[HID_DEVICE_MAX_PARSER_DATA] __attribute__((aligned(8)));
+
+    // Bytes reserved to different platforms.
+    // E.g.: C64 or Airlift might use it to store different values.
+    uint8_t platform_data[HID_DEVICE_MAX_PLATFORM_DATA] __attribute__((aligned(8)));
+
+    // State of the modules that keep per-device data. One per device of the pool.
+    uni_haptics_device_t haptics;
+#ifdef CONFIG_BLUEPAD32_CAPTURE
+    uni_capture_device_t capture;
+#endif
+    uni_bt_pipeline_device_t pipeline;
+
+    // Circular buffer that contains the outgoing packets that couldn't be sent
+    // immediately.
+    uni_circular_buffer_t outgoing_buffer;
+} uni_hid_device_cold_t;
+
+// Fields used for each input report go first.
+struct uni_hid_device_s {
+    // Bluetooth connection info.
+    uni_bt_conn_t conn;
     // Channels
     uint16_t hids_cid;  // BLE only
 
+    // hid, cod, etc...
+    uint32_t flags;
+
+    // Functions used to parse the usage page/usage.
+    uni_report_parser_t report_parser;
+    // HID descriptor and its compiled plan, shared with the devices that have the same one.
+    // See uni_hid_device_get_hid_descriptor() and uni_hid_descriptor_store_get_plan().
+    uni_hid_descriptor_handle_t hid_descriptor;
+
     // TODO: Create a union of gamepad/mouse/keyboard structs
     // At the moment "mouse" reuses gamepad struct, but it is a hack.
     // Gamepad
     uni_controller_type_t controller_type;        // type of controller. E.g: DualShock4, Switch, etc.
     uni_controller_subtype_t controller_subtype;  // sub-type of controller attached, used for Wii mostly
     uni_controller_t controller;                  // Data
-
-    // Functions used to parse the usage page/usage.
-    uni_report_parser_t report_parser;
+    // When the last input report was received, taken by the L2CAP / GATT handlers. 0 if none.
+    uint64_t last_report_us;
+    // Last data delivered to the platform. Used to compute what changed. See uni_controller_get_changes().
+    // Can be read from other tasks / CPUs with uni_hid_device_get_controller_snapshot().
+    uni_controller_t controller_delivered;
+    uni_snapshot_t controller_snapshot;
 
     // Buttons that need to be released before triggering the action again.
     uint32_t misc_button_wait_release;
     // Buttons that need to wait for a delay before triggering the action again.
     uint32_t misc_button_wait_delay;
-    // Needed for Nintendo Switch family of controllers.
-    btstack_timer_source_t misc_button_delay_timer;
-
-    // Circular buffer that contains the outgoing packets that couldn't be sent
-    // immediately.
-    uni_circular_buffer_t outgoing_buffer;
-
-    // Bytes reserved to controller's parser instances.
-    // E.g.: The Wii driver uses it for the state machine.
-    uint8_t parser_data[HID_DEVICE_MAX_PARSER_DATA];
 
-    // Bytes reserved to different platforms.
-    // E.g.: C64 or Airlift might use it to store different values.
-    uint8_t platform_data[HID_DEVICE_MAX_PLATFORM_DATA];
-
-    // Bluetooth connection info.
-    uni_bt_conn_t conn;
+    uint32_t cod;  // Class of Device.
+    uint16_t vendor_id;
+    uint16_t product_id;
 
     // Link to parent device. Used only when the device is a "virtual child".
     // Safe to assume that when parent != NULL, then it is a "virtual" device.
@@ -98,6 +141,9 @@ struct uni_hid_device_s {
     // When a physical controller has a child, like a "virtual device"
     // For example, DualShock4 has the "mouse" as a child.
     struct uni_hid_device_s* child;
+
+    // Always valid: each device has its own entry in the cold pool.
+    uni_hid_device_cold_t* cold;
 };
 typedef struct uni_hid_device_s uni_hid_device_t;
 
@@ -106,6 +152,19 @@ typedef uint8_t (*uni_hid_device_predicate_t)(uni_hid_device_t* d, void* data);
 
 void uni_hid_device_setup(void);
 
+// Device pool. By default it has CONFIG_BLUEPAD32_MAX_DEVICES devices, that are statically allocated.
+// Hosts with more memory, like Linux, can provide a bigger pool at runtime, up to
+// UNI_HID_DEVICE_POOL_MAX_DEVICES devices.
+// Returns the number of bytes needed by a pool of "max_devices". 0 if "max_devices" is invalid.
+size_t uni_hid_device_get_pool_size(int max_devices);
+// Uses "arena" for the devices, their cold parts, the lookup indexes and the HID descriptor store.
+// It must be 8-byte aligned, have at least uni_hid_device_get_pool_size() bytes, and stay valid while it is used.
+// NULL restores the static pool. Call it before uni_init(), or while there are no devices.
+// Returns false if the pool cannot be changed.
+bool uni_hid_device_set_pool(void* arena, size_t arena_size, int max_devices);
+// Number of devices of the current pool. Valid indexes are [0, max_devices).
+int uni_hid_device_get_max_devices(void);
+
 uni_hid_device_t* uni_hid_device_create(bd_addr_t address);
 
 // Used for controllers that implement two input devices like DualShock4, which is a gamepad and a mouse
@@ -132,6 +191,9 @@ bool uni_hid_device_set_ready_complete(uni_hid_device_t* d);
 
 void uni_hid_device_request_inquire(void);
 
+// Restarts the timer that deletes the device if it is not ready before "timeout_ms". 0 removes it.
+void uni_hid_device_set_connection_timeout(uni_hid_device_t* d, uint32_t timeout_ms);
+
 void uni_hid_device_on_connected(uni_hid_device_t* d, bool connected);
 void uni_hid_device_connect(uni_hid_device_t* d);
 void uni_hid_device_disconnect(uni_hid_device_t* d);
@@ -148,8 +210,12 @@ bool uni_hid_device_is_cod_supported(uint32_t cod);
 // @returns UNI_ERROR_SUCCESS if a connection to the device should be established.
 uni_error_t uni_hid_device_on_device_discovered(bd_addr_t addr, const char* name, uint16_t cod, uint8_t rssi);
 
-void uni_hid_device_set_hid_descriptor(uni_hid_device_t* d, const uint8_t* descriptor, int len);
+// Returns false if there is no room for it in the HID descriptor store. The connection should fail then,
+// since its reports can't be parsed.
+bool uni_hid_device_set_hid_descriptor(uni_hid_device_t* d, const uint8_t* descriptor, int len);
 bool uni_hid_device_has_hid_descriptor(uni_hid_device_t* d);
+// NULL, and "len" 0, if it doesn't have one. Valid until a device releases its descriptor.
+const uint8_t* uni_hid_device_get_hid_descriptor(uni_hid_device_t* d, uint16_t* len);
 
 void uni_hid_device_set_incoming(uni_hid_device_t* d, bool incoming);
 bool uni_hid_device_is_incoming(uni_hid_device_t* d);
@@ -165,18 +231,37 @@ uint16_t uni_hid_device_get_vendor_id(uni_hid_device_t* d);
 
 void uni_hid_device_dump_device(uni_hid_device_t* d);
 void uni_hid_device_dump_all(void);
+// Latency statistics of all the devices. See uni_latency.h.
+// Only collected when CONFIG_BLUEPAD32_LATENCY_STATS is enabled.
+void uni_hid_device_dump_latency_all(void);
+void uni_hid_device_reset_latency_all(void);
 
 bool uni_hid_device_guess_controller_type_from_name(uni_hid_device_t* d, const char* name);
 void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d);
+// Sets the controller type, and the parser for it. Overrides the previous one, if any.
+void uni_hid_device_set_controller_type(uni_hid_device_t* d, uni_controller_type_t type);
 bool uni_hid_device_has_controller_type(uni_hid_device_t* d);
 
 void uni_hid_device_process_controller(uni_hid_device_t* d);
+// Safe to call from any task / CPU, without blocking the Bluetooth one: copies the last data delivered
+// to the platform. Returns a number that changes each time new data is delivered.
+uint32_t uni_hid_device_get_controller_snapshot(uni_hid_device_t* d, uni_controller_t* out);
 
+// Always use these setters instead of modifying the fields directly, since they
+// keep the lookup indexes used by get_instance_for_XXX() in sync.
 void uni_hid_device_set_connection_handle(uni_hid_device_t* d, hci_con_handle_t handle);
+void uni_hid_device_set_control_cid(uni_hid_device_t* d, uint16_t cid);
+void uni_hid_device_set_interrupt_cid(uni_hid_device_t* d, uint16_t cid);
+// BLE only
+void uni_hid_device_set_hids_cid(uni_hid_device_t* d, uint16_t cid);
 
 void uni_hid_device_send_report(uni_hid_device_t* d, uint16_t cid, const uint8_t* report, uint16_t len);
 void uni_hid_device_send_intr_report(uni_hid_device_t* d, const uint8_t* report, uint16_t len);
 void uni_hid_device_send_ctrl_report(uni_hid_device_t* d, const uint8_t* report, uint16_t len);
+// Latest-wins: a queued report with the same Report ID is replaced instead of queuing a new one.
+// Only for reports that contain the whole state, like rumble / LEDs.
+void uni_hid_device_send_intr_report_coalesced(uni_hid_device_t* d, const uint8_t* report, uint16_t len);
+void uni_hid_device_send_ctrl_report_coalesced(uni_hid_device_t* d, const uint8_t* report, uint16_t len);
 void uni_hid_device_send_queued_reports(uni_hid_device_t* d);
 
 bool uni_hid_device_does_require_hid_descriptor(uni_hid_device_t* d);
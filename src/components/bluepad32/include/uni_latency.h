@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_LATENCY_H
+#define UNI_LATENCY_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+// Per-device latency statistics of the input reports:
+// - inter-arrival: time between two input reports. Shows the report rate, and its degradation under interference.
+// - parse: from the reception of the report until the parser finishes.
+// - callback: time spent in the platform "on_controller_data" callback.
+// - total: from the reception of the report until the platform callback returns. End-to-end latency.
+// The reception time is taken by the L2CAP (BR/EDR) and GATT (BLE) packet handlers.
+// Times are in microseconds, taken with uni_system_get_time_us().
+// Only collected for the devices when CONFIG_BLUEPAD32_LATENCY_STATS is enabled, since it adds work to each report.
+
+// Histograms don't have a unit: it is the one of the values added. uni_latency_t uses microseconds, and
+// the connection pipeline milliseconds (see uni_bt_pipeline.h).
+// Bucket 0 contains 0, and bucket N (N > 0) contains [2^(N-1), 2^N).
+// The last one contains everything above: >= 2^18 (262ms in microseconds, 262s in milliseconds).
+#define UNI_LATENCY_HISTOGRAM_BUCKETS 20
+
+typedef struct {
+    uint32_t buckets[UNI_LATENCY_HISTOGRAM_BUCKETS];
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t total;
+} uni_latency_histogram_t;
+
+typedef struct {
+    uni_latency_histogram_t inter_arrival;
+    uni_latency_histogram_t parse;
+    uni_latency_histogram_t callback;
+    uni_latency_histogram_t total;
+} uni_latency_t;
+
+void uni_latency_histogram_add(uni_latency_histogram_t* h, uint64_t value);
+// Returns the upper bound of the bucket that contains the percentile (0-100), or the max if it is lower.
+// 0 if empty.
+uint32_t uni_latency_histogram_get_percentile(const uni_latency_histogram_t* h, int percentile);
+uint32_t uni_latency_histogram_get_mean(const uni_latency_histogram_t* h);
+
+// To be called when an input report is received. Updates the inter-arrival histogram.
+// "last_us" is when the previous one was received, 0 if none.
+void uni_latency_on_input_report(uni_latency_t* l, uint64_t last_us, uint64_t now_us);
+void uni_latency_reset(uni_latency_t* l);
+void uni_latency_dump(const uni_latency_t* l);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // UNI_LATENCY_H
@@ -0,0 +1,60 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#ifndef UNI_SNAPSHOT_H
+#define UNI_SNAPSHOT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Snapshot: lock-free sharing of a small struct between tasks, or between CPUs. A sequence lock.
+//
+// One task (the producer, usually the BTstack one) writes the data, and any number of tasks read it.
+// The producer never waits for the readers. A reader never blocks: if it reads while the producer
+// is writing, it copies the data again. Never read from a higher priority task that runs on the
+// same CPU as the producer: it would retry forever since the producer can't finish.
+//
+// The data is owned by the user. The snapshot only protects it. E.g:
+//
+//   static uni_snapshot_t snapshot;
+//   static my_data_t shared;
+//
+//   // Producer
+//   uni_snapshot_write_begin(&snapshot);
+//   shared.x = x;
+//   uni_snapshot_write_end(&snapshot);
+//
+//   // Consumer
+//   my_data_t copy;
+//   uni_snapshot_read(&snapshot, &copy, &shared, sizeof(copy));
+
+typedef struct {
+    // Odd while the producer is writing. Accessed with atomic builtins only: this header is included from C++.
+    uint32_t seq;
+} uni_snapshot_t;
+
+void uni_snapshot_init(uni_snapshot_t* s);
+
+// Producer only. Data can be modified in place between begin and end.
+void uni_snapshot_write_begin(uni_snapshot_t* s);
+void uni_snapshot_write_end(uni_snapshot_t* s);
+// Same as write_begin + memcpy + write_end.
+void uni_snapshot_publish(uni_snapshot_t* s, void* shared, const void* src, size_t size);
+
+// Any task. Copies "shared" into "dst", retrying until the copy is consistent.
+// Returns the sequence number of the copy. It changes each time the producer publishes.
+uint32_t uni_snapshot_read(uni_snapshot_t* s, void* dst, const void* shared, size_t size);
+// Same, but returns false instead of retrying if the producer is writing or wrote during the copy.
+bool uni_snapshot_try_read(uni_snapshot_t* s, void* dst, const void* shared, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // UNI_SNAPSHOT_H
@@ -11,6 +11,18 @@
 // Little-endian CRC32.
 // ESP32 has its own crc32_le as well, but they don't return the same values (?).
 // It is important to use ours with the "uni_" prefix.
+// Uses a table-driven "slice-by-8" implementation, unless another backend was set.
 uint32_t uni_crc32_le(uint32_t crc, const uint8_t* data, size_t len);
 
+// Reference bit-at-a-time implementation. Slow. Only useful for testing other backends.
+uint32_t uni_crc32_le_bitwise(uint32_t crc, const uint8_t* data, size_t len);
+
+// Architectures with a ROM or hardware CRC32 can plug theirs in.
+// It must return the same values as uni_crc32_le_bitwise().
+// E.g: in ESP-IDF, esp_rom_crc32_le() inverts the CRC at the input and output, so
+// a wrapper should return: ~esp_rom_crc32_le(~crc, data, len).
+// Passing NULL restores the default implementation.
+typedef uint32_t (*uni_crc32_le_fn_t)(uint32_t crc, const uint8_t* data, size_t len);
+void uni_crc32_le_set_backend(uni_crc32_le_fn_t fn);
+
 #endif  // UNI_UTILS_H
@@ -0,0 +1,246 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "parser/uni_hid_descriptor_store.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "uni_log.h"
+#include "uni_utils.h"
+
+// Entries in the pool are 4-byte aligned, since the plan tables have 32-bit fields.
+#define ALIGN4(x) (((x) + 3u) & ~3u)
+
+// One entry per device, plus one so that a device can replace its descriptor.
+#define MAX_ENTRIES(_max_devices) ((_max_devices) + 1)
+// Stores of a device pool have the same budget per device as the static store.
+#define POOL_SIZE(_max_devices) (ALIGN4(UNI_HID_DESCRIPTOR_STORE_POOL_SIZE / CONFIG_BLUEPAD32_MAX_DEVICES) * (_max_devices))
+#define ARENA_ALIGN(_size) (((_size) + 7) & ~(size_t)7)
+
+_Static_assert(MAX_ENTRIES(CONFIG_BLUEPAD32_MAX_DEVICES) < UINT8_MAX, "Handle too small");
+_Static_assert(UNI_HID_DESCRIPTOR_STORE_POOL_SIZE <= UINT16_MAX, "Pool offsets too small");
+_Static_assert(UNI_HID_DESCRIPTOR_STORE_POOL_SIZE >= HID_MAX_DESCRIPTOR_LEN, "Pool too small for a descriptor");
+
+typedef struct {
+    // 0 if the entry is free.
+    uint16_t refs;
+    uint16_t len;
+    uint32_t hash;
+    // Location in the pool: the descriptor, followed by the plan tables.
+    uint16_t offset;
+    uint16_t size;
+    uni_hid_plan_t plan;
+} entry_t;
+
+// Static store, used unless the host provides one with uni_hid_device_set_pool().
+static entry_t static_entries[MAX_ENTRIES(CONFIG_BLUEPAD32_MAX_DEVICES)];
+static uint8_t static_pool[UNI_HID_DESCRIPTOR_STORE_POOL_SIZE] __attribute__((aligned(4)));
+
+static entry_t* entries = static_entries;
+static int max_entries = MAX_ENTRIES(CONFIG_BLUEPAD32_MAX_DEVICES);
+// Entries are kept back-to-back: the free space is always at the end.
+static uint8_t* pool = static_pool;
+static uint16_t pool_size = sizeof(static_pool);
+static uint16_t pool_used;
+static bool plans_disabled;
+
+static entry_t* get_entry(uni_hid_descriptor_handle_t handle) {
+    if (handle == UNI_HID_DESCRIPTOR_HANDLE_INVALID || handle > max_entries)
+        return NULL;
+    entry_t* e = &entries[handle - 1];
+    return e->refs ? e : NULL;
+}
+
+static void move_entry(entry_t* e, uint16_t offset) {
+    uint8_t* dst = &pool[offset];
+
+    memmove(dst, &pool[e->offset], e->len);
+    if (e->plan.valid)
+        uni_hid_plan_move_tables(&e->plan, dst + ALIGN4(e->len));
+    e->offset = offset;
+}
+
+// Moves down the entries that start at "from" or after it, in order, to "cursor", so that there are no holes.
+static void compact(uint16_t cursor, uint16_t from) {
+    while (true) {
+        entry_t* next = NULL;
+        for (int i = 0; i < max_entries; i++) {
+            entry_t* e = &entries[i];
+            if (e->refs && e->offset >= from && (next == NULL || e->offset < next->offset))
+                next = e;
+        }
+        if (next == NULL)
+            break;
+        from = next->offset + next->size;
+        move_entry(next, cursor);
+        cursor += next->size;
+    }
+    pool_used = cursor;
+}
+
+// Descriptors have priority over plans: the plan with the biggest tables is dropped to make room.
+// Its device parses the reports with btstack_hid_parser from now on.
+// Returns false if there are no plans left.
+static bool drop_plan(void) {
+    entry_t* victim = NULL;
+    for (int i = 0; i < max_entries; i++) {
+        entry_t* e = &entries[i];
+        if (e->refs && e->plan.valid && (victim == NULL || e->size > victim->size))
+            victim = e;
+    }
+    if (victim == NULL)
+        return false;
+
+    uint16_t end = victim->offset + victim->size;
+    uni_hid_plan_reset(&victim->plan);
+    victim->size = ALIGN4(victim->len);
+    compact(victim->offset + victim->size, end);
+    return true;
+}
+
+uni_hid_descriptor_handle_t uni_hid_descriptor_store_acquire(const uint8_t* descriptor, uint16_t len) {
+    entry_t* e = NULL;
+
+    if (len == 0)
+        return UNI_HID_DESCRIPTOR_HANDLE_INVALID;
+
+    uint32_t hash = uni_crc32_le(0, descriptor, len);
+    int free_idx = -1;
+    for (int i = 0; i < max_entries; i++) {
+        e = &entries[i];
+        if (e->refs == 0) {
+            if (free_idx < 0)
+                free_idx = i;
+            continue;
+        }
+        if (e->hash == hash && e->len == len && memcmp(&pool[e->offset], descriptor, len) == 0) {
+            e->refs++;
+            return i + 1;
+        }
+    }
+
+    if (free_idx < 0) {
+        loge("HID descriptor store: no free entries\n");
+        return UNI_HID_DESCRIPTOR_HANDLE_INVALID;
+    }
+    uint32_t size = ALIGN4(len);
+    while (pool_used + size > pool_size && drop_plan())
+        ;
+    if (pool_used + size > pool_size) {
+        loge("HID descriptor store: no room for a %d-byte descriptor (%d/%d bytes used)\n", len, pool_used,
+             pool_size);
+        return UNI_HID_DESCRIPTOR_HANDLE_INVALID;
+    }
+
+    e = &entries[free_idx];
+    memset(e, 0, sizeof(*e));
+    e->refs = 1;
+    e->len = len;
+    e->hash = hash;
+    e->offset = pool_used;
+    memcpy(&pool[e->offset], descriptor, len);
+
+    // Compile it once, instead of walking it for each input report. The tables go right after the descriptor.
+    // If it fails, or if they don't fit, the input reports are parsed with btstack_hid_parser.
+    // They are dropped later if another descriptor needs their room.
+    if (uni_hid_plan_compile(&e->plan, &pool[e->offset + size], pool_size - pool_used - size, &pool[e->offset],
+                             len)) {
+        size += ALIGN4(uni_hid_plan_get_tables_size(&e->plan));
+    } else {
+        logi("Could not compile HID descriptor, using slow path\n");
+    }
+
+    e->size = size;
+    pool_used += size;
+    return free_idx + 1;
+}
+
+void uni_hid_descriptor_store_release(uni_hid_descriptor_handle_t handle) {
+    entry_t* e = get_entry(handle);
+    if (e == NULL) {
+        loge("HID descriptor store: invalid handle %d\n", handle);
+        return;
+    }
+
+    if (--e->refs > 0)
+        return;
+    compact(e->offset, e->offset + e->size);
+}
+
+const uint8_t* uni_hid_descriptor_store_get_data(uni_hid_descriptor_handle_t handle, uint16_t* len) {
+    entry_t* e = get_entry(handle);
+    if (e == NULL) {
+        *len = 0;
+        return NULL;
+    }
+    *len = e->len;
+    return &pool[e->offset];
+}
+
+uint32_t uni_hid_descriptor_store_get_crc(uni_hid_descriptor_handle_t handle) {
+    entry_t* e = get_entry(handle);
+    return e ? e->hash : 0;
+}
+
+const uni_hid_plan_t* uni_hid_descriptor_store_get_plan(uni_hid_descriptor_handle_t handle) {
+    entry_t* e = get_entry(handle);
+    if (e == NULL || !e->plan.valid || plans_disabled)
+        return NULL;
+    return &e->plan;
+}
+
+void uni_hid_descriptor_store_set_plans_enabled(bool enabled) {
+    plans_disabled = !enabled;
+}
+
+size_t uni_hid_descriptor_store_get_arena_size(int max_devices) {
+    if (max_devices <= 0 || MAX_ENTRIES(max_devices) >= UINT8_MAX || POOL_SIZE(max_devices) > UINT16_MAX)
+        return 0;
+    return ARENA_ALIGN(MAX_ENTRIES(max_devices) * sizeof(entry_t)) + POOL_SIZE(max_devices);
+}
+
+bool uni_hid_descriptor_store_set_arena(void* arena, int max_devices) {
+    // Handles are indexes, and the plans point to the pool. They can't be moved.
+    for (int i = 0; i < max_entries; i++) {
+        if (entries[i].refs) {
+            loge("HID descriptor store: cannot change the arena, descriptors in use\n");
+            return false;
+        }
+    }
+
+    if (arena == NULL) {
+        entries = static_entries;
+        max_entries = MAX_ENTRIES(CONFIG_BLUEPAD32_MAX_DEVICES);
+        pool = static_pool;
+        pool_size = sizeof(static_pool);
+    } else {
+        uint8_t* ptr = arena;
+        if (uni_hid_descriptor_store_get_arena_size(max_devices) == 0 || ((uintptr_t)arena & 7) != 0) {
+            loge("HID descriptor store: invalid arena for %d devices\n", max_devices);
+            return false;
+        }
+        entries = (entry_t*)ptr;
+        max_entries = MAX_ENTRIES(max_devices);
+        ptr += ARENA_ALIGN(max_entries * sizeof(entry_t));
+        pool = ptr;
+        pool_size = POOL_SIZE(max_devices);
+    }
+    memset(entries, 0, max_entries * sizeof(entry_t));
+    pool_used = 0;
+    return true;
+}
+
+void uni_hid_descriptor_store_get_stats(uni_hid_descriptor_store_stats_t* stats) {
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < max_entries; i++) {
+        if (entries[i].refs) {
+            stats->entries++;
+            stats->refs += entries[i].refs;
+        }
+    }
+    stats->pool_used = pool_used;
+    stats->pool_size = pool_size;
+}
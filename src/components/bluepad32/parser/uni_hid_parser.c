@@ -4,20 +4,38 @@
 
 #include "parser/uni_hid_parser.h"
 
+#include <string.h>
+
 #include "hid_usage.h"
+#include "uni_capture.h"
 #include "uni_hid_device.h"
 #include "uni_log.h"
+#include "uni_system.h"
 
 // HID Usage Tables:
 // https://www.usb.org/sites/default/files/documents/hut1_12v2.pdf
 
 void uni_hid_parse_input_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t report_len) {
+    uni_hid_parse_input_report_at(d, report, report_len, uni_system_get_time_us());
+}
+
+void uni_hid_parse_input_report_at(struct uni_hid_device_s* d,
+                                   const uint8_t* report,
+                                   uint16_t report_len,
+                                   uint64_t received_us) {
     btstack_hid_parser_t parser;
 
     uni_report_parser_t* rp = &d->report_parser;
 
     //    printf_hexdump(report, report_len);
 
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+    uni_latency_on_input_report(&d->cold->latency, d->last_report_us, received_us);
+#endif
+    d->last_report_us = received_us;
+
+    uni_capture_on_input_report(d, report, report_len);
+
     // Certain devices like iCade might not set "init_report".
     if (rp->init_report)
         rp->init_report(d);
@@ -29,8 +47,14 @@ void uni_hid_parse_input_report(struct uni_hid_device_s* d, const uint8_t* repor
     }
 
     // Devices that suport regular HID reports.
-    if (rp->parse_usage) {
-        btstack_hid_parser_init(&parser, d->hid_descriptor, d->hid_descriptor_len, HID_REPORT_TYPE_INPUT, report,
+    const uni_hid_plan_t* plan = uni_hid_descriptor_store_get_plan(d->hid_descriptor);
+    if (rp->parse_usage && plan) {
+        // Fast path: use the compiled HID descriptor.
+        uni_hid_plan_parse_report(plan, d, rp->parse_usage, report, report_len);
+    } else if (rp->parse_usage) {
+        uint16_t hid_descriptor_len;
+        const uint8_t* hid_descriptor = uni_hid_device_get_hid_descriptor(d, &hid_descriptor_len);
+        btstack_hid_parser_init(&parser, hid_descriptor, hid_descriptor_len, HID_REPORT_TYPE_INPUT, report,
                                 report_len);
         while (btstack_hid_parser_has_more(&parser)) {
             uint16_t usage_page;
@@ -38,6 +62,9 @@ void uni_hid_parse_input_report(struct uni_hid_device_s* d, const uint8_t* repor
             int32_t value;
             hid_globals_t globals;
 
+            // Normalization coefficients are not precomputed in the slow path.
+            memset(&globals.normalization, 0, sizeof(globals.normalization));
+
             // Save globals, since they are destroyed by btstack_hid_parser_get_field()
             // see: https://github.com/bluekitchen/btstack/issues/187
             globals.logical_minimum = parser.global_logical_minimum;
@@ -53,53 +80,118 @@ void uni_hid_parse_input_report(struct uni_hid_device_s* d, const uint8_t* repor
             rp->parse_usage(d, &globals, usage_page, usage, value);
         }
     }
+
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+    uni_latency_histogram_add(&d->cold->latency.parse, uni_system_get_time_us() - received_us);
+#endif
 }
 
-// Converts a possible value between (0, x) to (-x/2, x/2), and normalizes it
-// between -512 and 511.
-int32_t uni_hid_parser_process_axis(hid_globals_t* globals, uint32_t value) {
+// Values that, once multiplied by AXIS_NORMALIZE_RANGE, are below this magnitude are normalized using the
+// precomputed coefficients. Bigger ones, only possible with fields of more than 20 bits, use a division.
+#define NORMALIZATION_MAX_FAST_VALUE (1u << 30)
+
+static int32_t get_logical_maximum(const hid_globals_t* globals) {
     int32_t max = globals->logical_maximum;
-    int32_t min = globals->logical_minimum;
 
     // Amazon Fire 1st Gen reports max value as unsigned (0xff == 255) but the
     // spec says they are signed. So the parser correctly treats it as -1 (0xff).
     if (max == -1) {
         max = (1 << globals->report_size) - 1;
     }
+    return max;
+}
 
-    // Get the range: how big can be the number
-    int32_t range = (max - min) + 1;
+// Precomputes the coefficients used by uni_hid_parser_process_axis() and uni_hid_parser_process_pedal().
+// Should be called once per field, when the HID descriptor is parsed.
+// Division by a constant is replaced by a multiplication and a shift:
+//   n / range == (n * ceil(2^(30+l) / range)) >> (30+l)
+// which is exact for any 0 <= n < 2^30, being l = ceil(log2(range)).
+void uni_hid_parser_init_normalization(hid_globals_t* globals) {
+    hid_normalization_t* norm = &globals->normalization;
+    memset(norm, 0, sizeof(*norm));
+
+    int64_t range = (int64_t)get_logical_maximum(globals) - globals->logical_minimum + 1;
+    if (range <= 0 || range > INT32_MAX)
+        return;
+
+    uint8_t l = 0;
+    while ((1LL << l) < range)
+        l++;
+
+    norm->shift = 30 + l;
+    norm->mul = (uint32_t)(((1ULL << norm->shift) + range - 1) / range);
+    norm->center = (int32_t)(range / 2 + globals->logical_minimum);
+}
+
+static inline uint32_t normalization_div(const hid_normalization_t* norm, uint32_t n) {
+    return (uint32_t)(((uint64_t)n * norm->mul) >> norm->shift);
+}
+
+// Converts a possible value between (0, x) to (-x/2, x/2), and normalizes it
+// between -512 and 511.
+static int32_t process_axis_slow(hid_globals_t* globals, uint32_t value) {
+    int32_t max = get_logical_maximum(globals);
+    int32_t min = globals->logical_minimum;
+
+    // Get the range: how big can be the number.
+    // 64-bit, since any logical minimum / maximum and any value are possible.
+    int64_t range = ((int64_t)max - min) + 1;
+    if (range <= 0)
+        return 0;
 
     // First, we "center" the value, meaning that 0 is when the axis is not used.
-    int32_t centered = value - range / 2 - min;
+    int64_t centered = (int64_t)(int32_t)value - range / 2 - min;
 
     // Then we normalize between -512 and 511
-    int32_t normalized = centered * AXIS_NORMALIZE_RANGE / range;
-    logd("original = %d, centered = %d, normalized = %d (range = %d, min=%d, max=%d)\n", value, centered, normalized,
-         range, min, max);
+    int32_t normalized = (int32_t)(centered * AXIS_NORMALIZE_RANGE / range);
+    logd("original = %d, normalized = %d (min=%d, max=%d)\n", value, normalized, min, max);
 
     return normalized;
 }
 
-// Converts a possible value between (0, x) to (0, 1023)
-int32_t uni_hid_parser_process_pedal(hid_globals_t* globals, uint32_t value) {
-    int32_t max = globals->logical_maximum;
-    int32_t min = globals->logical_minimum;
+int32_t uni_hid_parser_process_axis(hid_globals_t* globals, uint32_t value) {
+    const hid_normalization_t* norm = &globals->normalization;
+    if (norm->shift == 0)
+        return process_axis_slow(globals, value);
 
-    // Amazon Fire 1st Gen reports max value as unsigned (0xff == 255), but the
-    // spec says they are signed. So the parser correctly treats it as -1 (0xff).
-    if (max == -1) {
-        max = (1 << globals->report_size) - 1;
+    // Same as process_axis_slow(), but without the division.
+    // 64-bit, so that the values of the wide fields don't wrap into the fast range.
+    int64_t scaled = ((int64_t)(int32_t)value - norm->center) * AXIS_NORMALIZE_RANGE;
+    if (scaled >= 0) {
+        if (scaled < NORMALIZATION_MAX_FAST_VALUE)
+            return normalization_div(norm, (uint32_t)scaled);
+    } else if (scaled > -(int64_t)NORMALIZATION_MAX_FAST_VALUE) {
+        // Division truncates towards zero.
+        return -(int32_t)normalization_div(norm, (uint32_t)-scaled);
     }
+    return process_axis_slow(globals, value);
+}
+
+// Converts a possible value between (0, x) to (0, 1023)
+static int32_t process_pedal_slow(hid_globals_t* globals, uint32_t value) {
+    int32_t max = get_logical_maximum(globals);
+    int32_t min = globals->logical_minimum;
 
     // Get the range: how big can be the number
-    int32_t range = (max - min) + 1;
-    int32_t normalized = value * AXIS_NORMALIZE_RANGE / range;
-    logd("original = %d, normalized = %d (range = %d, min=%d, max=%d)\n", value, normalized, range, min, max);
+    int64_t range = ((int64_t)max - min) + 1;
+    if (range <= 0 || range > UINT32_MAX)
+        return 0;
+    int32_t normalized = value * AXIS_NORMALIZE_RANGE / (uint32_t)range;
+    logd("original = %d, normalized = %d (min=%d, max=%d)\n", value, normalized, min, max);
 
     return normalized;
 }
 
+int32_t uni_hid_parser_process_pedal(hid_globals_t* globals, uint32_t value) {
+    const hid_normalization_t* norm = &globals->normalization;
+    uint32_t scaled = value * AXIS_NORMALIZE_RANGE;
+
+    // Same as process_pedal_slow(), but without the division.
+    if (norm->shift != 0 && scaled < NORMALIZATION_MAX_FAST_VALUE)
+        return normalization_div(norm, scaled);
+    return process_pedal_slow(globals, value);
+}
+
 uint8_t uni_hid_parser_process_hat(hid_globals_t* globals, uint32_t value) {
     int32_t v = (int32_t)value;
     // Assumes if value is outside valid range, then it is a "null value"
@@ -52,7 +52,7 @@ static void atari_parse_report_id_01(struct uni_hid_device_s* d, const uint8_t*
 
     // Convert joystick to dpad
     uint8_t joy_value = r->buttons[1] >> 4;
-    ctl->gamepad.dpad = dpad_map[joy_value];
+    ctl->gamepad.dpad = (joy_value < ARRAY_SIZE(dpad_map)) ? dpad_map[joy_value] : 0;
 
     // No need to map, already in the 0, 0x400 range, but just in case in changes.
     ctl->gamepad.throttle = r->axis & 0x3ff;
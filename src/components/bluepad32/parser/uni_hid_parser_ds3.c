@@ -44,28 +44,13 @@ typedef enum ds3_fsm {
     DS3_FSM_LED_UPDATED,          // LED updated
 } ds3_fsm_t;
 
-typedef enum {
-    DS3_STATE_RUMBLE_DISABLED,
-    DS3_STATE_RUMBLE_DELAYED,
-    DS3_STATE_RUMBLE_IN_PROGRESS,
-} ds3_state_rumble_t;
-
 // ds3_instance_t represents data used by the DS3 driver instance.
 typedef struct ds3_instance_s {
     ds3_fsm_t state;
     uint8_t player_leds;  // bitmap of LEDs
     bool clone_controller;
-
-    btstack_timer_source_t rumble_timer_duration;
-    btstack_timer_source_t rumble_timer_delayed_start;
-    ds3_state_rumble_t rumble_state;
-
-    // Used by delayed start
-    uint16_t rumble_weak_magnitude;
-    uint16_t rumble_strong_magnitude;
-    uint16_t rumble_duration_ms;
 } ds3_instance_t;
-_Static_assert(sizeof(ds3_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "DS3 instance too big");
+_Static_assert(sizeof(ds3_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "DS3 instance too big");
 
 // As defined here:
 // https://github.com/ros-drivers/joystick_drivers/blob/52e8fcfb5619382a04756207b228fbc569f9a3ca/ps3joy/scripts/ps3joy_node.py#L276
@@ -137,13 +122,6 @@ typedef struct __attribute((packed)) {
 static ds3_instance_t* get_ds3_instance(uni_hid_device_t* d);
 static void ds3_update_led(uni_hid_device_t* d, uint8_t player_leds);
 static void ds3_send_output_report(uni_hid_device_t* d, ds3_output_report_t* out);
-static void on_ds3_set_rumble_on(btstack_timer_source_t* ts);
-static void on_ds3_set_rumble_off(btstack_timer_source_t* ts);
-static void ds3_stop_rumble_now(uni_hid_device_t* d);
-static void ds3_play_dual_rumble_now(uni_hid_device_t* d,
-                                     uint16_t duration_ms,
-                                     uint8_t weak_magnitude,
-                                     uint8_t strong_magnitude);
 
 void uni_hid_parser_ds3_init_report(uni_hid_device_t* d) {
     uni_controller_t* ctl = &d->controller;
@@ -266,43 +244,26 @@ void uni_hid_parser_ds3_set_player_leds(uni_hid_device_t* d, uint8_t leds) {
     ds3_update_led(d, leds);
 }
 
-void uni_hid_parser_ds3_play_dual_rumble(struct uni_hid_device_s* d,
-                                         uint16_t start_delay_ms,
-                                         uint16_t duration_ms,
-                                         uint8_t weak_magnitude,
-                                         uint8_t strong_magnitude) {
-    if (d == NULL) {
-        loge("DS3: Invalid device\n");
-        return;
-    }
-
+uni_haptics_result_t uni_hid_parser_ds3_set_rumble(struct uni_hid_device_s* d, const uni_haptics_motors_t* motors) {
     ds3_instance_t* ins = get_ds3_instance(d);
-    switch (ins->rumble_state) {
-        case DS3_STATE_RUMBLE_DELAYED:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_delayed_start);
-            break;
-        case DS3_STATE_RUMBLE_IN_PROGRESS:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_duration);
-            break;
-        default:
-            // Do nothing
-            break;
-    }
 
-    if (start_delay_ms == 0) {
-        ds3_play_dual_rumble_now(d, duration_ms, weak_magnitude, strong_magnitude);
-    } else {
-        // Set timer to have a delayed start
-        ins->rumble_timer_delayed_start.process = &on_ds3_set_rumble_on;
-        ins->rumble_timer_delayed_start.context = d;
-        ins->rumble_state = DS3_STATE_RUMBLE_DELAYED;
-        ins->rumble_duration_ms = duration_ms;
-        ins->rumble_strong_magnitude = strong_magnitude;
-        ins->rumble_weak_magnitude = weak_magnitude;
-
-        btstack_run_loop_set_timer(&ins->rumble_timer_delayed_start, start_delay_ms);
-        btstack_run_loop_add_timer(&ins->rumble_timer_delayed_start);
+    ds3_output_report_t out = {0};
+
+    if (motors->weak_magnitude != 0 || motors->strong_magnitude != 0) {
+        // Spec says that 0xff is "forever", but depends on the devices.
+        // Clones might work different.
+        out.motor_right_duration = 0xff;
+        out.motor_right_enabled = (motors->weak_magnitude != 0);  // 0 or 1 only
+        out.motor_left_duration = 0xff;
+        out.motor_left_force = motors->strong_magnitude;
     }
+
+    // Don't overwrite Player LEDs
+    // LED cmd. LED1==2, LED2==4, etc...
+    out.player_leds = ins->player_leds << 1;
+
+    ds3_send_output_report(d, &out);
+    return UNI_HAPTICS_RESULT_OK;
 }
 
 void uni_hid_parser_ds3_setup(struct uni_hid_device_s* d) {
@@ -348,7 +309,7 @@ bool uni_hid_parser_ds3_does_name_match(struct uni_hid_device_s* d, const char*
 // Helpers
 //
 static ds3_instance_t* get_ds3_instance(uni_hid_device_t* d) {
-    return (ds3_instance_t*)&d->parser_data[0];
+    return (ds3_instance_t*)&d->cold->parser_data[0];
 }
 
 static void ds3_update_led(uni_hid_device_t* d, uint8_t player_leds) {
@@ -363,69 +324,6 @@ static void ds3_update_led(uni_hid_device_t* d, uint8_t player_leds) {
     ds3_send_output_report(d, &out);
 }
 
-static void ds3_stop_rumble_now(uni_hid_device_t* d) {
-    ds3_instance_t* ins = get_ds3_instance(d);
-
-    // No need to protect it with a mutex since it runs in the same main thread
-    assert(ins->rumble_state == DS3_STATE_RUMBLE_IN_PROGRESS);
-    ins->rumble_state = DS3_STATE_RUMBLE_DISABLED;
-
-    ds3_output_report_t out = {0};
-
-    // Don't overwrite Player LEDs
-    // LED cmd. LED1==2, LED2==4, etc...
-    out.player_leds = ins->player_leds << 1;
-
-    ds3_send_output_report(d, &out);
-}
-
-static void ds3_play_dual_rumble_now(uni_hid_device_t* d,
-                                     uint16_t duration_ms,
-                                     uint8_t weak_magnitude,
-                                     uint8_t strong_magnitude) {
-    ds3_instance_t* ins = get_ds3_instance(d);
-
-    if (duration_ms == 0) {
-        if (ins->rumble_state == DS3_STATE_RUMBLE_IN_PROGRESS)
-            ds3_stop_rumble_now(d);
-        return;
-    }
-
-    ds3_output_report_t out = {0};
-
-    // Spec says that 0xff is "forever", but depends on the devices.
-    // Clones might work different.
-    out.motor_right_duration = 0xff;
-    out.motor_right_enabled = (weak_magnitude != 0);  // 0 or 1 only
-    out.motor_left_duration = 0xff;
-    out.motor_left_force = strong_magnitude;
-
-    // Don't overwrite Player LEDs
-    // LED cmd. LED1==2, LED2==4, etc...
-    out.player_leds = ins->player_leds << 1;
-
-    ds3_send_output_report(d, &out);
-
-    // Set timer to turn off rumble
-    ins->rumble_timer_duration.process = &on_ds3_set_rumble_off;
-    ins->rumble_timer_duration.context = d;
-    ins->rumble_state = DS3_STATE_RUMBLE_IN_PROGRESS;
-    btstack_run_loop_set_timer(&ins->rumble_timer_duration, duration_ms);
-    btstack_run_loop_add_timer(&ins->rumble_timer_duration);
-}
-
-static void on_ds3_set_rumble_off(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    ds3_stop_rumble_now(d);
-}
-
-static void on_ds3_set_rumble_on(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    ds3_instance_t* ins = get_ds3_instance(d);
-
-    ds3_play_dual_rumble_now(d, ins->rumble_duration_ms, ins->rumble_weak_magnitude, ins->rumble_strong_magnitude);
-}
-
 static void ds3_send_output_report(uni_hid_device_t* d, ds3_output_report_t* out) {
     out->transation_type = 0x52;  // SET_REPORT output
     out->report_id = 0x01;
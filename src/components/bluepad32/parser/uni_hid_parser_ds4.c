@@ -11,8 +11,6 @@
 
 #include "parser/uni_hid_parser_ds4.h"
 
-#include <assert.h>
-
 #include "bt/uni_bt_defines.h"
 #include "hid_usage.h"
 #include "uni_config.h"
@@ -40,12 +38,6 @@ enum {
     DS4_FF_FLAG_BLINK_COLOR_RUMBLE = DS4_FF_FLAG_RUMBLE | DS4_FF_FLAG_LED_COLOR | DS4_FF_FLAG_LED_BLINK,
 };
 
-typedef enum {
-    DS4_STATE_RUMBLE_DISABLED,
-    DS4_STATE_RUMBLE_DELAYED,
-    DS4_STATE_RUMBLE_IN_PROGRESS,
-} ds4_state_rumble_t;
-
 // Calibration data for motion sensors.
 struct ds4_calibration_data {
     int16_t bias;
@@ -54,21 +46,14 @@ struct ds4_calibration_data {
 };
 
 typedef struct {
-    // Although technically, we can use one timer for delay and duration, easier to debug/maintain if we have two.
-    btstack_timer_source_t rumble_timer_duration;
-    btstack_timer_source_t rumble_timer_delayed_start;
-    ds4_state_rumble_t rumble_state;
-
-    // Used by delayed start
-    uint16_t rumble_weak_magnitude;
-    uint16_t rumble_strong_magnitude;
-    uint16_t rumble_duration_ms;
-
     uint16_t fw_version;
     uint16_t hw_version;
 
     struct ds4_calibration_data gyro_calib_data[3];
     struct ds4_calibration_data accel_calib_data[3];
+    // Set by setup. Without it, like when replaying a capture started after the setup,
+    // there is no calibration data and the raw motion values are reported.
+    bool calibrated;
 
     // Prev Touchpad values, to convert them from absolute
     // coordinates into relative ones.
@@ -83,7 +68,7 @@ typedef struct {
     uint8_t prev_rumble_weak_magnitude;
     uint8_t prev_rumble_strong_magnitude;
 } ds4_instance_t;
-_Static_assert(sizeof(ds4_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "DS4 instance too big");
+_Static_assert(sizeof(ds4_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "DS4 instance too big");
 
 typedef struct __attribute((packed)) {
     // Report related
@@ -208,13 +193,6 @@ static void ds4_send_output_report(uni_hid_device_t* d, ds4_output_report_t* out
 static void ds4_request_calibration_report(uni_hid_device_t* d);
 static void ds4_request_firmware_version_report(uni_hid_device_t* d);
 static void ds4_send_enable_lightbar_report(uni_hid_device_t* d);
-static void on_ds4_set_rumble_on(btstack_timer_source_t* ts);
-static void on_ds4_set_rumble_off(btstack_timer_source_t* ts);
-static void ds4_stop_rumble_now(uni_hid_device_t* d);
-static void ds4_play_dual_rumble_now(uni_hid_device_t* d,
-                                     uint16_t duration_ms,
-                                     uint8_t weak_magnitude,
-                                     uint8_t strong_magnitude);
 static void ds4_parse_mouse(uni_hid_device_t* d, const ds4_input_report_11_t* r);
 
 void uni_hid_parser_ds4_setup(struct uni_hid_device_s* d) {
@@ -231,6 +209,7 @@ void uni_hid_parser_ds4_setup(struct uni_hid_device_s* d) {
         ins->accel_calib_data[i].sens_numer = DS4_ACC_RANGE;
         ins->accel_calib_data[i].sens_denom = INT16_MAX;
     }
+    ins->calibrated = true;
 
     // Send in order:
     // - enable lightbar: enables light and enables report 0x11 on most devices
@@ -477,6 +456,10 @@ static void ds4_parse_input_report_11(uni_hid_device_t* d, const ds4_input_repor
     // Gyro
     for (size_t i = 0; i < ARRAY_SIZE(r->gyro); i++) {
         int32_t raw_data = (int16_t)r->gyro[i];
+        if (!ins->calibrated) {
+            ctl->gamepad.gyro[i] = raw_data;
+            continue;
+        }
         int32_t calib_data =
             mult_frac(ins->gyro_calib_data[i].sens_numer, raw_data, ins->gyro_calib_data[i].sens_denom);
         ctl->gamepad.gyro[i] = calib_data;
@@ -485,6 +468,10 @@ static void ds4_parse_input_report_11(uni_hid_device_t* d, const ds4_input_repor
     // Accel
     for (size_t i = 0; i < ARRAY_SIZE(r->accel); i++) {
         int32_t raw_data = (int16_t)r->accel[i];
+        if (!ins->calibrated) {
+            ctl->gamepad.accel[i] = raw_data;
+            continue;
+        }
         int32_t calib_data =
             mult_frac(ins->accel_calib_data[i].sens_numer, raw_data, ins->accel_calib_data[i].sens_denom);
         ctl->gamepad.accel[i] = calib_data;
@@ -537,43 +524,25 @@ void uni_hid_parser_ds4_set_lightbar_color(uni_hid_device_t* d, uint8_t r, uint8
     ds4_send_output_report(d, &out);
 }
 
-void uni_hid_parser_ds4_play_dual_rumble(struct uni_hid_device_s* d,
-                                         uint16_t start_delay_ms,
-                                         uint16_t duration_ms,
-                                         uint8_t weak_magnitude,
-                                         uint8_t strong_magnitude) {
-    if (d == NULL) {
-        loge("DS4: Invalid device\n");
-        return;
-    }
-
+uni_haptics_result_t uni_hid_parser_ds4_set_rumble(struct uni_hid_device_s* d, const uni_haptics_motors_t* motors) {
     ds4_instance_t* ins = get_ds4_instance(d);
-    switch (ins->rumble_state) {
-        case DS4_STATE_RUMBLE_DELAYED:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_delayed_start);
-            break;
-        case DS4_STATE_RUMBLE_IN_PROGRESS:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_duration);
-            break;
-        default:
-            // Do nothing
-            break;
-    }
 
-    if (start_delay_ms == 0) {
-        ds4_play_dual_rumble_now(d, duration_ms, weak_magnitude, strong_magnitude);
-    } else {
-        // Set timer to have a delayed start
-        ins->rumble_timer_delayed_start.process = &on_ds4_set_rumble_on;
-        ins->rumble_timer_delayed_start.context = d;
-        ins->rumble_state = DS4_STATE_RUMBLE_DELAYED;
-        ins->rumble_duration_ms = duration_ms;
-        ins->rumble_strong_magnitude = strong_magnitude;
-        ins->rumble_weak_magnitude = weak_magnitude;
-
-        btstack_run_loop_set_timer(&ins->rumble_timer_delayed_start, start_delay_ms);
-        btstack_run_loop_add_timer(&ins->rumble_timer_delayed_start);
-    }
+    // Сache the rumble value. Used by set_lightbar_color
+    ins->prev_rumble_weak_magnitude = motors->weak_magnitude;
+    ins->prev_rumble_strong_magnitude = motors->strong_magnitude;
+
+    ds4_output_report_t out = {
+        .flags = DS4_FF_FLAG_BLINK_COLOR_RUMBLE,  // blink + LED + motor
+        // Right motor: small force; left motor: big force
+        .motor_right = motors->weak_magnitude,
+        .motor_left = motors->strong_magnitude,
+        // Prev LED color values to keep the LED color from turning off
+        .led_red = ins->prev_color_red,
+        .led_green = ins->prev_color_green,
+        .led_blue = ins->prev_color_blue,
+    };
+    ds4_send_output_report(d, &out);
+    return UNI_HAPTICS_RESULT_OK;
 }
 
 void uni_hid_parser_ds4_device_dump(uni_hid_device_t* d) {
@@ -585,7 +554,7 @@ void uni_hid_parser_ds4_device_dump(uni_hid_device_t* d) {
 // Helpers
 //
 static ds4_instance_t* get_ds4_instance(uni_hid_device_t* d) {
-    return (ds4_instance_t*)&d->parser_data[0];
+    return (ds4_instance_t*)&d->cold->parser_data[0];
 }
 
 static void ds4_send_output_report(uni_hid_device_t* d, ds4_output_report_t* out) {
@@ -594,75 +563,8 @@ static void ds4_send_output_report(uni_hid_device_t* d, ds4_output_report_t* out
     out->unk0[0] = 0xc4;    // HID alone + poll interval
     out->crc32 = ~uni_crc32_le(0xffffffff, (uint8_t*)out, sizeof(*out) - 4);
 
-    uni_hid_device_send_intr_report(d, (uint8_t*)out, sizeof(*out));
-}
-
-static void ds4_stop_rumble_now(uni_hid_device_t* d) {
-    ds4_instance_t* ins = get_ds4_instance(d);
-    // No need to protect it with a mutex since it runs in the same main thread
-    assert(ins->rumble_state == DS4_STATE_RUMBLE_IN_PROGRESS);
-    ins->rumble_state = DS4_STATE_RUMBLE_DISABLED;
-
-    // Сache the previous rumble value
-    ins->prev_rumble_weak_magnitude = 0;
-    ins->prev_rumble_strong_magnitude = 0;
-
-    ds4_output_report_t out = {
-        .flags = DS4_FF_FLAG_BLINK_COLOR_RUMBLE,  // blink + LED + motor
-        // Prev LED color values to keep the LED color from turning off
-        .led_red = ins->prev_color_red,
-        .led_green = ins->prev_color_green,
-        .led_blue = ins->prev_color_blue,
-    };
-    ds4_send_output_report(d, &out);
-}
-
-static void ds4_play_dual_rumble_now(uni_hid_device_t* d,
-                                     uint16_t duration_ms,
-                                     uint8_t weak_magnitude,
-                                     uint8_t strong_magnitude) {
-    ds4_instance_t* ins = get_ds4_instance(d);
-
-    if (duration_ms == 0) {
-        if (ins->rumble_state != DS4_STATE_RUMBLE_DISABLED)
-            ds4_stop_rumble_now(d);
-        return;
-    }
-
-    // Сache the previous rumble value
-    ins->prev_rumble_weak_magnitude = weak_magnitude;
-    ins->prev_rumble_strong_magnitude = strong_magnitude;
-
-    ds4_output_report_t out = {
-        .flags = DS4_FF_FLAG_BLINK_COLOR_RUMBLE,  // blink + LED + motor
-        // Right motor: small force; left motor: big force
-        .motor_right = weak_magnitude,
-        .motor_left = strong_magnitude,
-        // Prev LED color values to keep the LED color from turning off
-        .led_red = ins->prev_color_red,
-        .led_green = ins->prev_color_green,
-        .led_blue = ins->prev_color_blue,
-    };
-    ds4_send_output_report(d, &out);
-
-    // Set timer to turn off rumble
-    ins->rumble_timer_duration.process = &on_ds4_set_rumble_off;
-    ins->rumble_timer_duration.context = d;
-    ins->rumble_state = DS4_STATE_RUMBLE_IN_PROGRESS;
-    btstack_run_loop_set_timer(&ins->rumble_timer_duration, duration_ms);
-    btstack_run_loop_add_timer(&ins->rumble_timer_duration);
-}
-
-static void on_ds4_set_rumble_on(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    ds4_instance_t* ins = get_ds4_instance(d);
-
-    ds4_play_dual_rumble_now(d, ins->rumble_duration_ms, ins->rumble_weak_magnitude, ins->rumble_strong_magnitude);
-}
-
-static void on_ds4_set_rumble_off(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    ds4_stop_rumble_now(d);
+    // Each report has the whole state (LEDs + rumble), so only the latest one needs to be sent.
+    uni_hid_device_send_intr_report_coalesced(d, (uint8_t*)out, sizeof(*out));
 }
 
 static void ds4_request_calibration_report(uni_hid_device_t* d) {
@@ -10,8 +10,6 @@
 
 #include "parser/uni_hid_parser_ds5.h"
 
-#include <assert.h>
-
 #include "bt/uni_bt_defines.h"
 #include "uni_config.h"
 #include "uni_hid_device.h"
@@ -76,12 +74,6 @@ enum {
     DS5_ADAPTIVE_TRIGGER_EFFECT_VIBRATION = 0x26,
 };
 
-typedef enum {
-    DS5_STATE_RUMBLE_DISABLED,
-    DS5_STATE_RUMBLE_DELAYED,
-    DS5_STATE_RUMBLE_IN_PROGRESS,
-} ds5_state_rumble_t;
-
 // Calibration data for motion sensors.
 struct ds5_calibration_data {
     int16_t bias;
@@ -90,16 +82,6 @@ struct ds5_calibration_data {
 };
 
 typedef struct {
-    // Although technically, we can use one timer for delay and duration, easier to debug/maintain if we have two.
-    btstack_timer_source_t rumble_timer_duration;
-    btstack_timer_source_t rumble_timer_delayed_start;
-    ds5_state_rumble_t rumble_state;
-
-    // Used by delayed start
-    uint16_t rumble_weak_magnitude;
-    uint16_t rumble_strong_magnitude;
-    uint16_t rumble_duration_ms;
-
     uint8_t output_seq;
     ds5_state_t state;
     uint32_t hw_version;
@@ -109,6 +91,9 @@ typedef struct {
 
     struct ds5_calibration_data gyro_calib_data[3];
     struct ds5_calibration_data accel_calib_data[3];
+    // Set by setup. Without it, like when replaying a capture started after the setup,
+    // there is no calibration data and the raw motion values are reported.
+    bool calibrated;
 
     // Prev Touchpad values, to convert them from absolute
     // coordinates into relative ones.
@@ -117,7 +102,7 @@ typedef struct {
     bool prev_touch_active;
 
 } ds5_instance_t;
-_Static_assert(sizeof(ds5_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "DS5 instance too big");
+_Static_assert(sizeof(ds5_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "DS5 instance too big");
 
 typedef struct __attribute((packed)) {
     // Bluetooth only
@@ -233,13 +218,6 @@ static void ds5_send_enable_lightbar_report(uni_hid_device_t* d);
 static void ds5_request_pairing_info_report(uni_hid_device_t* d);
 static void ds5_request_firmware_version_report(uni_hid_device_t* d);
 static void ds5_request_calibration_report(uni_hid_device_t* d);
-static void on_ds5_set_rumble_on(btstack_timer_source_t* ts);
-static void on_ds5_set_rumble_off(btstack_timer_source_t* ts);
-static void ds5_stop_rumble_now(uni_hid_device_t* d);
-static void ds5_play_dual_rumble_now(uni_hid_device_t* d,
-                                     uint16_t duration_ms,
-                                     uint8_t weak_magnitude,
-                                     uint8_t strong_magnitude);
 static void ds5_parse_mouse(uni_hid_device_t* d, const uint8_t* report, uint16_t len);
 
 ds5_adaptive_trigger_effect_t ds5_new_adaptive_trigger_effect_off(void) {
@@ -417,6 +395,7 @@ void uni_hid_parser_ds5_setup(uni_hid_device_t* d) {
         ins->accel_calib_data[i].sens_numer = DS5_ACC_RANGE;
         ins->accel_calib_data[i].sens_denom = INT16_MAX;
     }
+    ins->calibrated = true;
 
     ds5_request_pairing_info_report(d);
 }
@@ -623,6 +602,10 @@ void uni_hid_parser_ds5_parse_input_report(uni_hid_device_t* d, const uint8_t* r
     // Gyro
     for (size_t i = 0; i < ARRAY_SIZE(r->gyro); i++) {
         int32_t raw_data = (int16_t)r->gyro[i];
+        if (!ins->calibrated) {
+            ctl->gamepad.gyro[i] = raw_data;
+            continue;
+        }
         int32_t calib_data =
             mult_frac(ins->gyro_calib_data[i].sens_numer, raw_data, ins->gyro_calib_data[i].sens_denom);
         ctl->gamepad.gyro[i] = calib_data;
@@ -631,6 +614,10 @@ void uni_hid_parser_ds5_parse_input_report(uni_hid_device_t* d, const uint8_t* r
     // Accel
     for (size_t i = 0; i < ARRAY_SIZE(r->accel); i++) {
         int32_t raw_data = (int16_t)r->accel[i];
+        if (!ins->calibrated) {
+            ctl->gamepad.accel[i] = raw_data;
+            continue;
+        }
         int32_t calib_data =
             mult_frac(ins->accel_calib_data[i].sens_numer, raw_data, ins->accel_calib_data[i].sens_denom);
         ctl->gamepad.accel[i] = calib_data;
@@ -682,43 +669,24 @@ void uni_hid_parser_ds5_set_lightbar_color(struct uni_hid_device_s* d, uint8_t r
     ds5_send_output_report(d, &out);
 }
 
-void uni_hid_parser_ds5_play_dual_rumble(struct uni_hid_device_s* d,
-                                         uint16_t start_delay_ms,
-                                         uint16_t duration_ms,
-                                         uint8_t weak_magnitude,
-                                         uint8_t strong_magnitude) {
-    if (d == NULL) {
-        loge("DS5: Invalid device\n");
-        return;
-    }
-
+uni_haptics_result_t uni_hid_parser_ds5_set_rumble(struct uni_hid_device_s* d, const uni_haptics_motors_t* motors) {
     ds5_instance_t* ins = get_ds5_instance(d);
-    switch (ins->rumble_state) {
-        case DS5_STATE_RUMBLE_DELAYED:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_delayed_start);
-            break;
-        case DS5_STATE_RUMBLE_IN_PROGRESS:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_duration);
-            break;
-        default:
-            // Do nothing
-            break;
-    }
 
-    if (start_delay_ms == 0) {
-        ds5_play_dual_rumble_now(d, duration_ms, weak_magnitude, strong_magnitude);
-    } else {
-        // Set timer to have a delayed start
-        ins->rumble_timer_delayed_start.process = &on_ds5_set_rumble_on;
-        ins->rumble_timer_delayed_start.context = d;
-        ins->rumble_state = DS5_STATE_RUMBLE_DELAYED;
-        ins->rumble_duration_ms = duration_ms;
-        ins->rumble_strong_magnitude = strong_magnitude;
-        ins->rumble_weak_magnitude = weak_magnitude;
-
-        btstack_run_loop_set_timer(&ins->rumble_timer_delayed_start, start_delay_ms);
-        btstack_run_loop_add_timer(&ins->rumble_timer_delayed_start);
-    }
+    ds5_output_report_t out = {
+        .valid_flag0 = DS5_FLAG0_HAPTICS_SELECT,
+
+        // Right motor: small force; left motor: big force
+        .motor_right = motors->weak_magnitude,
+        .motor_left = motors->strong_magnitude,
+    };
+
+    if (ins->use_vibration2)
+        out.valid_flag2 |= DS5_FLAG2_COMPATIBLE_VIBRATION2;
+    else
+        out.valid_flag0 |= DS5_FLAG0_COMPATIBLE_VIBRATION;
+
+    ds5_send_output_report(d, &out);
+    return UNI_HAPTICS_RESULT_OK;
 }
 
 void uni_hid_parser_ds5_device_dump(uni_hid_device_t* d) {
@@ -731,7 +699,7 @@ void uni_hid_parser_ds5_device_dump(uni_hid_device_t* d) {
 // Helpers
 //
 static ds5_instance_t* get_ds5_instance(uni_hid_device_t* d) {
-    return (ds5_instance_t*)&d->parser_data[0];
+    return (ds5_instance_t*)&d->cold->parser_data[0];
 }
 
 static void ds5_send_output_report(uni_hid_device_t* d, ds5_output_report_t* out) {
@@ -752,72 +720,6 @@ static void ds5_send_output_report(uni_hid_device_t* d, ds5_output_report_t* out
     uni_hid_device_send_intr_report(d, (uint8_t*)out, sizeof(*out));
 }
 
-static void ds5_stop_rumble_now(uni_hid_device_t* d) {
-    ds5_instance_t* ins = get_ds5_instance(d);
-
-    // No need to protect it with a mutex since it runs in the same main thread
-    assert(ins->rumble_state != DS5_STATE_RUMBLE_DISABLED);
-    ins->rumble_state = DS5_STATE_RUMBLE_DISABLED;
-
-    ds5_output_report_t out = {
-        .valid_flag0 = DS5_FLAG0_HAPTICS_SELECT,
-    };
-
-    if (ins->use_vibration2)
-        out.valid_flag2 |= DS5_FLAG2_COMPATIBLE_VIBRATION2;
-    else
-        out.valid_flag0 |= DS5_FLAG0_COMPATIBLE_VIBRATION;
-
-    ds5_send_output_report(d, &out);
-}
-
-static void ds5_play_dual_rumble_now(uni_hid_device_t* d,
-                                     uint16_t duration_ms,
-                                     uint8_t weak_magnitude,
-                                     uint8_t strong_magnitude) {
-    ds5_instance_t* ins = get_ds5_instance(d);
-
-    if (duration_ms == 0) {
-        if (ins->rumble_state != DS5_STATE_RUMBLE_DISABLED)
-            ds5_stop_rumble_now(d);
-        return;
-    }
-
-    ds5_output_report_t out = {
-        .valid_flag0 = DS5_FLAG0_HAPTICS_SELECT,
-
-        // Right motor: small force; left motor: big force
-        .motor_right = weak_magnitude,
-        .motor_left = strong_magnitude,
-    };
-
-    if (ins->use_vibration2)
-        out.valid_flag2 |= DS5_FLAG2_COMPATIBLE_VIBRATION2;
-    else
-        out.valid_flag0 |= DS5_FLAG0_COMPATIBLE_VIBRATION;
-
-    ds5_send_output_report(d, &out);
-
-    // Set timer to turn off rumble
-    ins->rumble_timer_duration.process = &on_ds5_set_rumble_off;
-    ins->rumble_timer_duration.context = d;
-    ins->rumble_state = DS5_STATE_RUMBLE_IN_PROGRESS;
-    btstack_run_loop_set_timer(&ins->rumble_timer_duration, duration_ms);
-    btstack_run_loop_add_timer(&ins->rumble_timer_duration);
-}
-
-static void on_ds5_set_rumble_on(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    ds5_instance_t* ins = get_ds5_instance(d);
-
-    ds5_play_dual_rumble_now(d, ins->rumble_duration_ms, ins->rumble_weak_magnitude, ins->rumble_strong_magnitude);
-}
-
-static void on_ds5_set_rumble_off(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    ds5_stop_rumble_now(d);
-}
-
 static void ds5_request_calibration_report(uni_hid_device_t* d) {
     ds5_instance_t* ins = get_ds5_instance(d);
     ins->state = DS5_STATE_CALIBRATION_REQUEST;
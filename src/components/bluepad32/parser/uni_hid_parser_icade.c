@@ -65,7 +65,7 @@ typedef enum {
 typedef struct icade_instance_s {
     icade_model_t model;  // ICADE_CABINET or ICADE_8BITTY
 } icade_instance_t;
-_Static_assert(sizeof(icade_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "iCade intance too big");
+_Static_assert(sizeof(icade_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "iCade intance too big");
 
 static icade_instance_t* get_icade_instance(uni_hid_device_t* d);
 
@@ -299,5 +299,5 @@ void uni_hid_parser_icade_parse_usage(uni_hid_device_t* d,
 // Helpers
 //
 static icade_instance_t* get_icade_instance(uni_hid_device_t* d) {
-    return (icade_instance_t*)&d->parser_data[0];
+    return (icade_instance_t*)&d->cold->parser_data[0];
 }
@@ -33,6 +33,7 @@ typedef struct {
     bool using_jx_05;
     keyboard_jx_05_t jx_05;
 } keyboard_instance_t;
+_Static_assert(sizeof(keyboard_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "Keyboard instance too big");
 
 static keyboard_instance_t* get_keyboard_instance(uni_hid_device_t* d);
 
@@ -285,5 +286,5 @@ void uni_hid_parser_keyboard_set_leds(struct uni_hid_device_s* d, uint8_t led_bi
 
 // Helpers
 static keyboard_instance_t* get_keyboard_instance(uni_hid_device_t* d) {
-    return (keyboard_instance_t*)&d->parser_data[0];
+    return (keyboard_instance_t*)&d->cold->parser_data[0];
 }
@@ -27,7 +27,7 @@ typedef struct __attribute((packed)) tank_mouse_input_report {
 typedef struct {
     float scale;
 } mouse_instance_t;
-_Static_assert(sizeof(mouse_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "Mouse intance too big");
+_Static_assert(sizeof(mouse_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "Mouse intance too big");
 
 struct mouse_resolution {
     uint16_t vid;
@@ -38,7 +38,7 @@ struct mouse_resolution {
 };
 
 static mouse_instance_t* get_mouse_instance(uni_hid_device_t* d) {
-    return (mouse_instance_t*)&d->parser_data[0];
+    return (mouse_instance_t*)&d->cold->parser_data[0];
 }
 
 // TL;DR: Mouse reports are hit and miss.
@@ -115,7 +115,7 @@ void uni_hid_parser_mouse_setup(uni_hid_device_t* d) {
 
     for (unsigned int i = 0; i < ARRAY_SIZE(resolutions); i++) {
         if (resolutions[i].vid == d->vendor_id && resolutions[i].pid == d->product_id &&
-            (resolutions[i].name == NULL || strcmp(resolutions[i].name, d->name) == 0)) {
+            (resolutions[i].name == NULL || strcmp(resolutions[i].name, d->cold->name) == 0)) {
             scale = resolutions[i].scale;
             break;
         }
@@ -123,7 +123,7 @@ void uni_hid_parser_mouse_setup(uni_hid_device_t* d) {
 
     ins->scale = scale;
 
-    logi("mouse: vid=0x%04x, pid=0x%04x, name='%s' uses scale:", d->vendor_id, d->product_id, d->name);
+    logi("mouse: vid=0x%04x, pid=0x%04x, name='%s' uses scale:", d->vendor_id, d->product_id, d->cold->name);
     // ets_printf() doesn't support "%f"
     sprintf(buf, "%f\n", ins->scale);
     logi(buf);
@@ -8,8 +8,6 @@
 
 #include "parser/uni_hid_parser_switch.h"
 
-#include <assert.h>
-
 #define ENABLE_SPI_FLASH_DUMP 0
 #define ENABLE_IMU_REPORT 1
 
@@ -110,12 +108,6 @@ enum switch_subcmd {
     SUBCMD_ENABLE_IMU = 0x40,
 };
 
-typedef enum {
-    SWITCH_STATE_RUMBLE_DISABLED,
-    SWITCH_STATE_RUMBLE_DELAYED,
-    SWITCH_STATE_RUMBLE_IN_PROGRESS,
-} switch_state_rumble_t;
-
 // Calibration values for a stick.
 typedef struct switch_cal_stick_s {
     int32_t min;
@@ -131,18 +123,8 @@ typedef struct switch_cal_imu_s {
 
 // switch_instance_t represents data used by the Switch driver instance.
 typedef struct switch_instance_s {
-    // Although technically, we can use one timer for delay and duration, easier to debug/maintain if we have two.
-    btstack_timer_source_t rumble_timer_duration;
-    btstack_timer_source_t rumble_timer_delayed_start;
-    switch_state_rumble_t rumble_state;
-
     btstack_timer_source_t setup_timer;
 
-    // Used by delayed start
-    uint16_t rumble_weak_magnitude;
-    uint16_t rumble_strong_magnitude;
-    uint16_t rumble_duration_ms;
-
     enum switch_state state;
     enum switch_flags mode;
     uint8_t firmware_version_hi;
@@ -166,7 +148,7 @@ typedef struct switch_instance_s {
     int debug_fd;         // File descriptor where dump is saved
     uint32_t debug_addr;  // Current dump address
 } switch_instance_t;
-_Static_assert(sizeof(switch_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "Switch instance too big");
+_Static_assert(sizeof(switch_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "Switch instance too big");
 
 struct switch_subcmd_request {
     // Report related
@@ -332,13 +314,6 @@ static void process_reply_set_player_leds(struct uni_hid_device_s* d, const stru
 static void process_reply_enable_imu(struct uni_hid_device_s* d, const struct switch_report_21_s* r, int len);
 static int32_t calibrate_axis(int32_t v, switch_cal_stick_t cal);
 static void set_led(uni_hid_device_t* d, uint8_t leds);
-static void on_switch_set_rumble_on(btstack_timer_source_t* ts);
-static void on_switch_set_rumble_off(btstack_timer_source_t* ts);
-static void switch_stop_rumble_now(uni_hid_device_t* d);
-static void switch_play_dual_rumble_now(uni_hid_device_t* d,
-                                        uint16_t duration_ms,
-                                        uint8_t weak_magnitude,
-                                        uint8_t strong_magnitude);
 static void switch_setup_timeout_callback(btstack_timer_source_t* ts);
 static void parse_stick_calibration(switch_cal_stick_t* x, switch_cal_stick_t* y, const uint8_t* data, bool is_left);
 
@@ -769,8 +744,11 @@ static void parse_imu(uni_hid_device_t* d, const struct switch_imu_data_s* r) {
             accel[i] = r->accel[i];
         else
             accel[i] = (r->accel[i] * ins->cal_accel.scale[i]) / ins->imu_cal_accel_divisor[i];
-        gyro[i] = mult_frac((SWITCH_IMU_PREC_RANGE_SCALE * (r->gyro[i] - ins->cal_gyro.offset[i])),
-                            ins->cal_gyro.scale[i], ins->imu_cal_gyro_divisor[i]);
+        if (ins->imu_cal_gyro_divisor[i] == 0)
+            gyro[i] = r->gyro[i];
+        else
+            gyro[i] = mult_frac((SWITCH_IMU_PREC_RANGE_SCALE * (r->gyro[i] - ins->cal_gyro.offset[i])),
+                                ins->cal_gyro.scale[i], ins->imu_cal_gyro_divisor[i]);
     }
 
     // Right joycon has Y and Z axes negated.
@@ -1169,43 +1147,24 @@ void uni_hid_parser_switch_set_player_leds(uni_hid_device_t* d, uint8_t leds) {
     set_led(d, leds);
 }
 
-void uni_hid_parser_switch_play_dual_rumble(struct uni_hid_device_s* d,
-                                            uint16_t start_delay_ms,
-                                            uint16_t duration_ms,
-                                            uint8_t weak_magnitude,
-                                            uint8_t strong_magnitude) {
-    if (d == NULL) {
-        loge("Switch: Invalid device\n");
-        return;
-    }
-
-    switch_instance_t* ins = get_switch_instance(d);
-    switch (ins->rumble_state) {
-        case SWITCH_STATE_RUMBLE_DELAYED:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_delayed_start);
-            break;
-        case SWITCH_STATE_RUMBLE_IN_PROGRESS:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_duration);
-            break;
-        default:
-            // Do nothing
-            break;
-    }
+uni_haptics_result_t uni_hid_parser_switch_set_rumble(struct uni_hid_device_s* d,
+                                                      const uni_haptics_motors_t* motors) {
+    struct switch_subcmd_request req = {
+        .report_id = OUTPUT_RUMBLE_ONLY,
+    };
 
-    if (start_delay_ms == 0) {
-        switch_play_dual_rumble_now(d, duration_ms, weak_magnitude, strong_magnitude);
+    if (motors->weak_magnitude == 0 && motors->strong_magnitude == 0) {
+        uint8_t rumble_default[4] = {0x00, 0x01, 0x40, 0x40};
+        memcpy(req.rumble_left, rumble_default, sizeof(req.rumble_left));
+        memcpy(req.rumble_right, rumble_default, sizeof(req.rumble_left));
     } else {
-        // Set timer to have a delayed start
-        ins->rumble_timer_delayed_start.process = &on_switch_set_rumble_on;
-        ins->rumble_timer_delayed_start.context = d;
-        ins->rumble_state = SWITCH_STATE_RUMBLE_DELAYED;
-        ins->rumble_duration_ms = duration_ms;
-        ins->rumble_strong_magnitude = strong_magnitude;
-        ins->rumble_weak_magnitude = weak_magnitude;
-
-        btstack_run_loop_set_timer(&ins->rumble_timer_delayed_start, start_delay_ms);
-        btstack_run_loop_add_timer(&ins->rumble_timer_delayed_start);
+        switch_encode_rumble(req.rumble_left, motors->weak_magnitude << 2, motors->weak_magnitude, 500);
+        switch_encode_rumble(req.rumble_right, motors->strong_magnitude << 2, motors->strong_magnitude, 500);
     }
+
+    // Rumble request don't include the last byte of "switch_subcmd_request": subcmd_id
+    send_subcmd(d, &req, sizeof(req) - 1);
+    return UNI_HAPTICS_RESULT_OK;
 }
 
 bool uni_hid_parser_switch_does_name_match(struct uni_hid_device_s* d, const char* name) {
@@ -1243,7 +1202,7 @@ bool uni_hid_parser_switch_does_name_match(struct uni_hid_device_s* d, const cha
 // Helpers
 //
 static switch_instance_t* get_switch_instance(uni_hid_device_t* d) {
-    return (switch_instance_t*)&d->parser_data[0];
+    return (switch_instance_t*)&d->cold->parser_data[0];
 }
 
 static void set_led(uni_hid_device_t* d, uint8_t leds) {
@@ -1270,7 +1229,11 @@ static void send_subcmd(uni_hid_device_t* d, struct switch_subcmd_request* r, in
     if (packet_num > 0x0f)
         packet_num = 0;
     r->transaction_type = (HID_MESSAGE_TYPE_DATA << 4) | HID_REPORT_TYPE_OUTPUT;
-    uni_hid_device_send_intr_report(d, (const uint8_t*)r, len);
+    // Sub-commands must not be dropped, but a rumble-only report can replace a queued one.
+    if (r->report_id == OUTPUT_RUMBLE_ONLY)
+        uni_hid_device_send_intr_report_coalesced(d, (const uint8_t*)r, len);
+    else
+        uni_hid_device_send_intr_report(d, (const uint8_t*)r, len);
 }
 
 static int32_t calibrate_axis(int32_t v, switch_cal_stick_t cal) {
@@ -1288,65 +1251,6 @@ static int32_t calibrate_axis(int32_t v, switch_cal_stick_t cal) {
     return ret;
 }
 
-static void switch_stop_rumble_now(uni_hid_device_t* d) {
-    switch_instance_t* ins = get_switch_instance(d);
-
-    // No need to protect it with a mutex since it runs in the same main thread
-    assert(ins->rumble_state == SWITCH_STATE_RUMBLE_IN_PROGRESS);
-    ins->rumble_state = SWITCH_STATE_RUMBLE_DISABLED;
-
-    struct switch_subcmd_request req = {0};
-
-    req.report_id = OUTPUT_RUMBLE_ONLY;
-    uint8_t rumble_default[4] = {0x00, 0x01, 0x40, 0x40};
-    memcpy(req.rumble_left, rumble_default, sizeof(req.rumble_left));
-    memcpy(req.rumble_right, rumble_default, sizeof(req.rumble_left));
-
-    // Rumble request don't include the last byte of "switch_subcmd_request": subcmd_id
-    send_subcmd(d, (struct switch_subcmd_request*)&req, sizeof(req) - 1);
-}
-
-static void switch_play_dual_rumble_now(uni_hid_device_t* d,
-                                        uint16_t duration_ms,
-                                        uint8_t weak_magnitude,
-                                        uint8_t strong_magnitude) {
-    switch_instance_t* ins = get_switch_instance(d);
-
-    if (duration_ms == 0) {
-        if (ins->rumble_state != SWITCH_STATE_RUMBLE_DISABLED)
-            switch_stop_rumble_now(d);
-        return;
-    }
-
-    struct switch_subcmd_request req = {
-        .report_id = OUTPUT_RUMBLE_ONLY,
-    };
-    switch_encode_rumble(req.rumble_left, weak_magnitude << 2, weak_magnitude, 500);
-    switch_encode_rumble(req.rumble_right, strong_magnitude << 2, strong_magnitude, 500);
-
-    // Rumble request don't include the last byte of "switch_subcmd_request": subcmd_id
-    send_subcmd(d, &req, sizeof(req) - 1);
-
-    // Set timer to turn off rumble
-    ins->rumble_timer_duration.process = &on_switch_set_rumble_off;
-    ins->rumble_timer_duration.context = d;
-    ins->rumble_state = SWITCH_STATE_RUMBLE_IN_PROGRESS;
-    btstack_run_loop_set_timer(&ins->rumble_timer_duration, duration_ms);
-    btstack_run_loop_add_timer(&ins->rumble_timer_duration);
-}
-
-static void on_switch_set_rumble_on(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    switch_instance_t* ins = get_switch_instance(d);
-
-    switch_play_dual_rumble_now(d, ins->rumble_duration_ms, ins->rumble_weak_magnitude, ins->rumble_strong_magnitude);
-}
-
-static void on_switch_set_rumble_off(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = btstack_run_loop_get_timer_context(ts);
-    switch_stop_rumble_now(d);
-}
-
 void switch_setup_timeout_callback(btstack_timer_source_t* ts) {
     uni_hid_device_t* d = btstack_run_loop_get_timer_context(ts);
     switch_instance_t* ins = get_switch_instance(d);
@@ -6,8 +6,6 @@
 // http://wiibrew.org/wiki/Wiimote
 // https://github.com/dvdhrm/xwiimote/blob/master/doc/PROTOCOL
 
-#include <assert.h>
-
 #define ENABLE_EEPROM_DUMP 0
 
 #if ENABLE_EEPROM_DUMP
@@ -102,12 +100,6 @@ enum wii_fsm {
                            // Gamepad ready to be used
 };
 
-typedef enum {
-    WII_STATE_RUMBLE_DISABLED,
-    WII_STATE_RUMBLE_DELAYED,
-    WII_STATE_RUMBLE_IN_PROGRESS,
-} wii_state_rumble_t;
-
 // As defined here: http://wiibrew.org/wiki/Wiimote#0x21:_Read_Memory_Data
 typedef enum wii_read_type {
     WII_READ_FROM_MEM = 0,
@@ -152,13 +144,8 @@ typedef struct wii_instance_s {
     enum wii_exttype ext_type;
     uni_gamepad_seat_t gamepad_seat;
 
-    // Although technically, we can use one timer for delay and duration, easier to debug/maintain if we have two.
-    btstack_timer_source_t rumble_timer_duration;
-    btstack_timer_source_t rumble_timer_delayed_start;
-    wii_state_rumble_t rumble_state;
-
-    // Used by delayed start
-    uint16_t rumble_duration_ms;
+    // Cached, since the LED report also sets the rumble
+    bool rumble_on;
 
     balance_board_calibration_t balance_board_calibration;
 
@@ -166,7 +153,7 @@ typedef struct wii_instance_s {
     int debug_fd;         // File descriptor where dump is saved
     uint32_t debug_addr;  // Current dump address
 } wii_instance_t;
-_Static_assert(sizeof(wii_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "Wii instance too big");
+_Static_assert(sizeof(wii_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "Wii instance too big");
 
 static void process_req_status(uni_hid_device_t* d, const uint8_t* report, uint16_t len);
 static void process_req_data(uni_hid_device_t* d, const uint8_t* report, uint16_t len);
@@ -194,9 +181,6 @@ static void wii_fsm_dump_eeprom(uni_hid_device_t* d);
 static void wii_read_mem(uni_hid_device_t* d, wii_read_type_t t, uint32_t offset, uint16_t size);
 static wii_instance_t* get_wii_instance(uni_hid_device_t* d);
 static void wii_set_led(uni_hid_device_t* d, uni_gamepad_seat_t seat);
-static void on_wii_set_rumble_on(btstack_timer_source_t* ts);
-static void on_wii_set_rumble_off(btstack_timer_source_t* ts);
-static void wii_play_dual_rumble_now(struct uni_hid_device_s* d, uint16_t duration_ms);
 
 // Constants
 static const char* wii_devtype_names[] = {
@@ -1274,6 +1258,22 @@ void uni_hid_parser_wii_set_player_leds(uni_hid_device_t* d, uint8_t leds) {
     wii_set_led(d, leds);
 }
 
+uni_haptics_result_t uni_hid_parser_wii_set_rumble(struct uni_hid_device_s* d, const uni_haptics_motors_t* motors) {
+    wii_instance_t* ins = get_wii_instance(d);
+    if (ins->state < WII_FSM_LED_UPDATED) {
+        return UNI_HAPTICS_RESULT_ERROR;
+    }
+
+    // Wii has only one motor, and it can only be turned on or off
+    ins->rumble_on = (motors->weak_magnitude != 0 || motors->strong_magnitude != 0);
+
+    uint8_t report[] = {
+        0xa2, WIIPROTO_REQ_RUMBLE, ins->rumble_on ? 0x01 : 0x00 /* Rumble on/off */
+    };
+    uni_hid_device_send_intr_report(d, report, sizeof(report));
+    return UNI_HAPTICS_RESULT_OK;
+}
+
 void uni_hid_parser_wii_play_dual_rumble(struct uni_hid_device_s* d,
                                          uint16_t start_delay_ms,
                                          uint16_t duration_ms,
@@ -1282,40 +1282,8 @@ void uni_hid_parser_wii_play_dual_rumble(struct uni_hid_device_s* d,
     ARG_UNUSED(weak_magnitude);
     ARG_UNUSED(strong_magnitude);
 
-    if (d == NULL) {
-        loge("Wii: Invalid device\n");
-        return;
-    }
-
-    wii_instance_t* ins = get_wii_instance(d);
-    if (ins->state < WII_FSM_LED_UPDATED) {
-        return;
-    }
-
-    switch (ins->rumble_state) {
-        case WII_STATE_RUMBLE_DELAYED:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_delayed_start);
-            break;
-        case WII_STATE_RUMBLE_IN_PROGRESS:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_duration);
-            break;
-        default:
-            // Do nothing
-            break;
-    }
-
-    if (start_delay_ms == 0) {
-        wii_play_dual_rumble_now(d, duration_ms);
-    } else {
-        // Set timer to have a delayed start
-        ins->rumble_timer_delayed_start.process = &on_wii_set_rumble_on;
-        ins->rumble_timer_delayed_start.context = d;
-        ins->rumble_state = WII_STATE_RUMBLE_DELAYED;
-        ins->rumble_duration_ms = duration_ms;
-
-        btstack_run_loop_set_timer(&ins->rumble_timer_delayed_start, start_delay_ms);
-        btstack_run_loop_add_timer(&ins->rumble_timer_delayed_start);
-    }
+    // The magnitudes can't be honored. As always, it rumbles for the whole duration, even if they are 0.
+    uni_haptics_play_dual_rumble(d, start_delay_ms, duration_ms, 0xff, 0xff);
 }
 
 void uni_hid_parser_wii_set_mode(uni_hid_device_t* d, wii_mode_t mode) {
@@ -1345,7 +1313,7 @@ void uni_hid_parser_wii_set_mode(uni_hid_device_t* d, wii_mode_t mode) {
 // Helpers
 //
 static wii_instance_t* get_wii_instance(uni_hid_device_t* d) {
-    return (wii_instance_t*)&d->parser_data[0];
+    return (wii_instance_t*)&d->cold->parser_data[0];
 }
 
 static void wii_set_led(uni_hid_device_t* d, uni_gamepad_seat_t seat) {
@@ -1367,61 +1335,13 @@ static void wii_set_led(uni_hid_device_t* d, uni_gamepad_seat_t seat) {
     }
 
     // Rumble could be enabled
-    if (ins->rumble_state == WII_STATE_RUMBLE_IN_PROGRESS)
+    if (ins->rumble_on)
         led |= 0x01;
 
     report[2] = led;
     uni_hid_device_send_intr_report(d, report, sizeof(report));
 }
 
-static void wii_stop_rumble_now(uni_hid_device_t* d) {
-    wii_instance_t* ins = get_wii_instance(d);
-
-    // No need to protect it with a mutex since it runs in the same main thread
-    assert(ins->rumble_state == WII_STATE_RUMBLE_IN_PROGRESS);
-    ins->rumble_state = WII_STATE_RUMBLE_DISABLED;
-
-    // Disable rumble
-    uint8_t report[] = {
-        0xa2, WIIPROTO_REQ_RUMBLE, 0x00 /* Rumble off*/
-    };
-    uni_hid_device_send_intr_report(d, report, sizeof(report));
-}
-
-static void wii_play_dual_rumble_now(uni_hid_device_t* d, uint16_t duration_ms) {
-    wii_instance_t* ins = get_wii_instance(d);
-
-    if (duration_ms == 0) {
-        if (ins->rumble_state == WII_STATE_RUMBLE_IN_PROGRESS)
-            wii_stop_rumble_now(d);
-        return;
-    }
-
-    uint8_t report[] = {
-        0xa2, WIIPROTO_REQ_RUMBLE, 0x01 /* Rumble on*/
-    };
-    uni_hid_device_send_intr_report(d, report, sizeof(report));
-
-    // Set timer to turn off rumble
-    ins->rumble_timer_duration.process = &on_wii_set_rumble_off;
-    ins->rumble_timer_duration.context = d;
-    ins->rumble_state = WII_STATE_RUMBLE_IN_PROGRESS;
-    btstack_run_loop_set_timer(&ins->rumble_timer_duration, duration_ms);
-    btstack_run_loop_add_timer(&ins->rumble_timer_duration);
-}
-
-static void on_wii_set_rumble_on(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    wii_instance_t* ins = get_wii_instance(d);
-
-    wii_play_dual_rumble_now(d, ins->rumble_duration_ms);
-}
-
-static void on_wii_set_rumble_off(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = btstack_run_loop_get_timer_context(ts);
-    wii_stop_rumble_now(d);
-}
-
 static void wii_read_mem(uni_hid_device_t* d, wii_read_type_t t, uint32_t offset, uint16_t size) {
     logi("****** read_mem: offset=0x%04x, size=%d from=%d\n", offset, size, t);
     uint8_t report[] = {
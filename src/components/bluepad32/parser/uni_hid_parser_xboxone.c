@@ -22,8 +22,6 @@
 
 #define XBOX_RUMBLE_REPORT_ID 0x03
 
-#define BLE_RETRY_MS 50
-
 static const uint16_t XBOX_WIRELESS_VID = 0x045e;  // Microsoft
 static const uint16_t XBOX_WIRELESS_PID = 0x02e0;  // Xbox One (Bluetooth)
 
@@ -64,17 +62,6 @@ enum {
     XBOXONE_FF_TRIGGER_LEFT = BIT(3),
 };
 
-typedef enum {
-    XBOXONE_STATE_RUMBLE_DISABLED,
-    XBOXONE_STATE_RUMBLE_DELAYED,
-    XBOXONE_STATE_RUMBLE_IN_PROGRESS,
-} xboxone_state_rumble_t;
-
-typedef enum {
-    XBOXONE_RETRY_CMD_RUMBLE_ON,
-    XBOXONE_RETRY_CMD_RUMBLE_OFF,
-} xboxone_retry_cmd_t;
-
 struct xboxone_ff_report {
     // Report related
     uint8_t transaction_type;  // type of transaction
@@ -94,36 +81,10 @@ struct xboxone_ff_report {
 // xboxone_instance_t represents data used by the Xbox driver instance.
 typedef struct xboxone_instance_s {
     enum xboxone_firmware version;
-    // Cannot use the Xbox duration field because 8BitDo controllers keep rumbling forever.
-    // So we use a timer to cancel the rumbling after "duration".
-    // https://gitlab.com/ricardoquesada/unijoysticle2/-/issues/10
-    // https://github.com/ricardoquesada/bluepad32/issues/85
-    // We also use a delayed timer, instead of the internal Xbox delay. More compatible.
-    btstack_timer_source_t rumble_timer_duration;
-    btstack_timer_source_t rumble_timer_delayed_start;
-    xboxone_state_rumble_t rumble_state;
-
-    // Used by delayed start
-    uint16_t rumble_duration_ms;
-    uint8_t rumble_trigger_left;
-    uint8_t rumble_trigger_right;
-    uint8_t rumble_weak_magnitude;
-    uint8_t rumble_strong_magnitude;
-
 } xboxone_instance_t;
-_Static_assert(sizeof(xboxone_instance_t) < HID_DEVICE_MAX_PARSER_DATA, "Xbox one instance too big");
+_Static_assert(sizeof(xboxone_instance_t) <= HID_DEVICE_MAX_PARSER_DATA, "Xbox one instance too big");
 
 static xboxone_instance_t* get_xboxone_instance(uni_hid_device_t* d);
-static void on_xboxone_set_rumble_on(btstack_timer_source_t* ts);
-static void on_xboxone_set_rumble_off(btstack_timer_source_t* ts);
-static void xboxone_stop_rumble_now(uni_hid_device_t* d);
-static void xboxone_play_quad_rumble_now(uni_hid_device_t* d,
-                                         uint16_t duration_ms,
-                                         uint8_t trigger_left,
-                                         uint8_t trigger_right,
-                                         uint8_t weak_magnitude,
-                                         uint8_t strong_magnitude);
-static void xboxone_retry_cmd(uni_hid_device_t* d, xboxone_retry_cmd_t cmd);
 static void parse_usage_firmware_v3_1(uni_hid_device_t* d,
                                       hid_globals_t* globals,
                                       uint16_t usage_page,
@@ -154,12 +115,14 @@ bool uni_hid_parser_xboxone_does_name_match(struct uni_hid_device_s* d, const ch
 
 void uni_hid_parser_xboxone_setup(uni_hid_device_t* d) {
     xboxone_instance_t* ins = get_xboxone_instance(d);
+    uint16_t hid_descriptor_len;
+    uni_hid_device_get_hid_descriptor(d, &hid_descriptor_len);
     // FIXME: Parse HID descriptor and see if it supports 0xf buttons. Checking
     // for the len is a horrible hack.
     if (gap_get_connection_type(d->conn.handle) == GAP_CONNECTION_LE) {
         logi("Xbox: Assuming it is firmware v5.x\n");
         ins->version = XBOXONE_FIRMWARE_V5;
-    } else if (d->hid_descriptor_len > 330) {
+    } else if (hid_descriptor_len > 330) {
         logi("Xbox: Assuming it is firmware v4.8\n");
         ins->version = XBOXONE_FIRMWARE_V4_8;
     } else {
@@ -500,162 +463,20 @@ static void parse_usage_firmware_v4_v5(uni_hid_device_t* d,
     }
 }
 
-void uni_hid_parser_xboxone_play_dual_rumble(struct uni_hid_device_s* d,
-                                             uint16_t start_delay_ms,
-                                             uint16_t duration_ms,
-                                             uint8_t weak_magnitude,
-                                             uint8_t strong_magnitude) {
-    xboxone_play_quad_rumble(d, start_delay_ms, duration_ms, 0 /* left trigger */, 0 /* right trigger */,
-                             weak_magnitude, strong_magnitude);
-}
-
-void xboxone_play_quad_rumble(struct uni_hid_device_s* d,
-                              uint16_t start_delay_ms,
-                              uint16_t duration_ms,
-                              uint8_t left_trigger,
-                              uint8_t right_trigger,
-                              uint8_t weak_magnitude,
-                              uint8_t strong_magnitude) {
-    if (d == NULL) {
-        loge("Xbox: Invalid device\n");
-        return;
-    }
-
-    xboxone_instance_t* ins = get_xboxone_instance(d);
-    switch (ins->rumble_state) {
-        case XBOXONE_STATE_RUMBLE_DELAYED:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_delayed_start);
-            break;
-        case XBOXONE_STATE_RUMBLE_IN_PROGRESS:
-            btstack_run_loop_remove_timer(&ins->rumble_timer_duration);
-            break;
-        default:
-            // Do nothing
-            break;
-    }
-
-    if (start_delay_ms == 0) {
-        xboxone_play_quad_rumble_now(d, duration_ms, left_trigger, right_trigger, weak_magnitude, strong_magnitude);
-    } else {
-        // Set timer to have a delayed start
-        ins->rumble_timer_delayed_start.process = &on_xboxone_set_rumble_on;
-        ins->rumble_timer_delayed_start.context = d;
-        ins->rumble_state = XBOXONE_STATE_RUMBLE_DELAYED;
-        ins->rumble_duration_ms = duration_ms;
-        ins->rumble_trigger_left = left_trigger;
-        ins->rumble_trigger_right = right_trigger;
-        ins->rumble_strong_magnitude = strong_magnitude;
-        ins->rumble_weak_magnitude = weak_magnitude;
-
-        btstack_run_loop_set_timer(&ins->rumble_timer_delayed_start, start_delay_ms);
-        btstack_run_loop_add_timer(&ins->rumble_timer_delayed_start);
-    }
-}
-
-void uni_hid_parser_xboxone_device_dump(uni_hid_device_t* d) {
-    static const char* versions[] = {
-        "v3.1",
-        "v4.8",
-        "v5.x",
-    };
-    xboxone_instance_t* ins = get_xboxone_instance(d);
-    if (ins->version >= 0 && ins->version < ARRAY_SIZE(versions))
-        logi("\tXbox: FW version %s\n", versions[ins->version]);
-}
-
-//
-// Helpers
-//
-xboxone_instance_t* get_xboxone_instance(uni_hid_device_t* d) {
-    return (xboxone_instance_t*)&d->parser_data[0];
-}
-
-static void xboxone_retry_cmd(uni_hid_device_t* d, xboxone_retry_cmd_t cmd) {
-    xboxone_instance_t* ins = get_xboxone_instance(d);
-    ins->rumble_timer_delayed_start.context = d;
-
-    switch (cmd) {
-        case XBOXONE_RETRY_CMD_RUMBLE_ON:
-            ins->rumble_timer_delayed_start.process = &on_xboxone_set_rumble_on;
-            ins->rumble_state = XBOXONE_STATE_RUMBLE_DELAYED;
-            btstack_run_loop_set_timer(&ins->rumble_timer_delayed_start, BLE_RETRY_MS);
-            btstack_run_loop_add_timer(&ins->rumble_timer_delayed_start);
-            break;
-        case XBOXONE_RETRY_CMD_RUMBLE_OFF:
-            ins->rumble_timer_duration.process = &on_xboxone_set_rumble_off;
-            ins->rumble_state = XBOXONE_STATE_RUMBLE_IN_PROGRESS;
-            btstack_run_loop_set_timer(&ins->rumble_timer_duration, BLE_RETRY_MS);
-            btstack_run_loop_add_timer(&ins->rumble_timer_duration);
-            break;
-        default:
-            break;
-    }
-}
-
-static void xboxone_stop_rumble_now(uni_hid_device_t* d) {
-    uint8_t status;
-    xboxone_instance_t* ins = get_xboxone_instance(d);
-
-    // No need to protect it with a mutex since it runs in the same main thread
-    assert(ins->rumble_state != XBOXONE_STATE_RUMBLE_DISABLED);
-    ins->rumble_state = XBOXONE_STATE_RUMBLE_DISABLED;
-
-    struct xboxone_ff_report ff = {
-        .transaction_type = (HID_MESSAGE_TYPE_DATA << 4) | HID_REPORT_TYPE_OUTPUT,
-        .report_id = XBOX_RUMBLE_REPORT_ID,
-        .enable_actuators = XBOXONE_FF_TRIGGER_LEFT | XBOXONE_FF_TRIGGER_RIGHT | XBOXONE_FF_WEAK | XBOXONE_FF_STRONG,
-        .magnitude_left_trigger = 0,
-        .magnitude_right_trigger = 0,
-        .magnitude_strong = 0,
-        .magnitude_weak = 0,
-        .duration_10ms = 0,
-        .start_delay_10ms = 0,
-        .loop_count = 0,
-    };
-
-    if (ins->version == XBOXONE_FIRMWARE_V5) {
-        status = hids_client_send_write_report(d->hids_cid, XBOX_RUMBLE_REPORT_ID, HID_REPORT_TYPE_OUTPUT,
-                                               &ff.enable_actuators,  // skip the first type bytes,
-                                               sizeof(ff) - 2         // subtract the 2 bytes from total
-        );
-        if (status == ERROR_CODE_COMMAND_DISALLOWED) {
-            logd("Xbox: Failed to turn off rumble, error=%#x, retrying...\n", status);
-            xboxone_retry_cmd(d, XBOXONE_RETRY_CMD_RUMBLE_OFF);
-            return;
-        } else if (status != ERROR_CODE_SUCCESS) {
-            // Do nothing, log the error
-            logi("Xbox: Failed to turn off rumble, error=%#x\n", status);
-        }
-        // else, SUCCESS
-    } else {
-        uni_hid_device_send_intr_report(d, (uint8_t*)&ff, sizeof(ff));
-    }
-}
-
-static void xboxone_play_quad_rumble_now(uni_hid_device_t* d,
-                                         uint16_t duration_ms,
-                                         uint8_t left_trigger,
-                                         uint8_t right_trigger,
-                                         uint8_t weak_magnitude,
-                                         uint8_t strong_magnitude) {
+uni_haptics_result_t uni_hid_parser_xboxone_set_rumble(struct uni_hid_device_s* d,
+                                                       const uni_haptics_motors_t* motors) {
     uint8_t status;
     uint8_t mask = 0;
 
     xboxone_instance_t* ins = get_xboxone_instance(d);
 
-    if (duration_ms == 0) {
-        if (ins->rumble_state != XBOXONE_STATE_RUMBLE_DISABLED)
-            xboxone_stop_rumble_now(d);
-        return;
-    }
-
-    mask |= (left_trigger != 0) ? XBOXONE_FF_TRIGGER_LEFT : 0;
-    mask |= (right_trigger != 0) ? XBOXONE_FF_TRIGGER_RIGHT : 0;
-    mask |= (weak_magnitude != 0) ? XBOXONE_FF_WEAK : 0;
-    mask |= (strong_magnitude != 0) ? XBOXONE_FF_STRONG : 0;
+    mask |= (motors->trigger_left != 0) ? XBOXONE_FF_TRIGGER_LEFT : 0;
+    mask |= (motors->trigger_right != 0) ? XBOXONE_FF_TRIGGER_RIGHT : 0;
+    mask |= (motors->weak_magnitude != 0) ? XBOXONE_FF_WEAK : 0;
+    mask |= (motors->strong_magnitude != 0) ? XBOXONE_FF_STRONG : 0;
 
-    logd("xbox rumble: duration=%d, left=%d, right=%d, weak=%d, strong=%d, mask=%#x\n", duration_ms, left_trigger,
-         right_trigger, weak_magnitude, strong_magnitude, mask);
+    logd("xbox rumble: left=%d, right=%d, weak=%d, strong=%d, mask=%#x\n", motors->trigger_left,
+         motors->trigger_right, motors->weak_magnitude, motors->strong_magnitude, mask);
 
     // Magnitude is 0..100 so scale the 8-bit input here
 
@@ -663,16 +484,27 @@ static void xboxone_play_quad_rumble_now(uni_hid_device_t* d,
         .transaction_type = (HID_MESSAGE_TYPE_DATA << 4) | HID_REPORT_TYPE_OUTPUT,
         .report_id = XBOX_RUMBLE_REPORT_ID,
         .enable_actuators = mask,
-        .magnitude_left_trigger = ((uint16_t)(left_trigger * 100)) / UINT8_MAX,
-        .magnitude_right_trigger = ((uint16_t)(right_trigger * 100)) / UINT8_MAX,
-        .magnitude_strong = ((uint16_t)(strong_magnitude * 100)) / UINT8_MAX,
-        .magnitude_weak = ((uint16_t)(weak_magnitude * 100)) / UINT8_MAX,
-        .duration_10ms = 0xff,  // forever, timer will turn it off
+        .magnitude_left_trigger = ((uint16_t)(motors->trigger_left * 100)) / UINT8_MAX,
+        .magnitude_right_trigger = ((uint16_t)(motors->trigger_right * 100)) / UINT8_MAX,
+        .magnitude_strong = ((uint16_t)(motors->strong_magnitude * 100)) / UINT8_MAX,
+        .magnitude_weak = ((uint16_t)(motors->weak_magnitude * 100)) / UINT8_MAX,
+        // Cannot use the Xbox duration field because 8BitDo controllers keep rumbling forever.
+        // So the haptics engine turns the motors off after "duration".
+        // https://gitlab.com/ricardoquesada/unijoysticle2/-/issues/10
+        // https://github.com/ricardoquesada/bluepad32/issues/85
+        .duration_10ms = 0xff,  // forever, the haptics engine will turn it off
         .start_delay_10ms = 0,
-        .loop_count = 25,  // timer will turn it off, but in case it fails, limit it to no more than
+        .loop_count = 25,  // engine will turn it off, but in case it fails, limit it to no more than
                            // the max 65535 ms accepted for duration: 255 * 10ms * 26 = 66300ms
     };
 
+    if (mask == 0) {
+        // Turn off all the actuators
+        ff.enable_actuators = XBOXONE_FF_TRIGGER_LEFT | XBOXONE_FF_TRIGGER_RIGHT | XBOXONE_FF_WEAK | XBOXONE_FF_STRONG;
+        ff.duration_10ms = 0;
+        ff.loop_count = 0;
+    }
+
     if (ins->version == XBOXONE_FIRMWARE_V5) {
         status = hids_client_send_write_report(d->hids_cid, XBOX_RUMBLE_REPORT_ID, HID_REPORT_TYPE_OUTPUT,
                                                &ff.enable_actuators,  // skip the first two bytes,
@@ -680,35 +512,59 @@ static void xboxone_play_quad_rumble_now(uni_hid_device_t* d,
         );
         if (status == ERROR_CODE_COMMAND_DISALLOWED) {
             logd("Xbox: Failed to send rumble report, error=%#x, retrying...\n", status);
-            xboxone_retry_cmd(d, XBOXONE_RETRY_CMD_RUMBLE_ON);
-            return;
+            return UNI_HAPTICS_RESULT_RETRY;
         } else if (status != ERROR_CODE_SUCCESS) {
             // Don't retry, log the error and return
             logi("Xbox: Failed to send rumble report, error=%#x\n", status);
-            return;
+            return UNI_HAPTICS_RESULT_ERROR;
         }
     } else {
         uni_hid_device_send_intr_report(d, (uint8_t*)&ff, sizeof(ff));
     }
+    return UNI_HAPTICS_RESULT_OK;
+}
 
-    // Set timer to turn off rumble
-    ins->rumble_timer_duration.process = &on_xboxone_set_rumble_off;
-    ins->rumble_timer_duration.context = d;
-    ins->rumble_state = XBOXONE_STATE_RUMBLE_IN_PROGRESS;
+void xboxone_play_quad_rumble(struct uni_hid_device_s* d,
+                              uint16_t start_delay_ms,
+                              uint16_t duration_ms,
+                              uint8_t left_trigger,
+                              uint8_t right_trigger,
+                              uint8_t weak_magnitude,
+                              uint8_t strong_magnitude) {
+    const uni_haptics_effect_t effect = {
+        .start_delay_ms = start_delay_ms,
+        .duration_ms = duration_ms,
+        .motors =
+            {
+                .weak_magnitude = weak_magnitude,
+                .strong_magnitude = strong_magnitude,
+                .trigger_left = left_trigger,
+                .trigger_right = right_trigger,
+            },
+    };
 
-    btstack_run_loop_set_timer(&ins->rumble_timer_duration, duration_ms);
-    btstack_run_loop_add_timer(&ins->rumble_timer_duration);
+    if (d == NULL) {
+        loge("Xbox: Invalid device\n");
+        return;
+    }
+    uni_haptics_play(d, &effect);
 }
 
-static void on_xboxone_set_rumble_on(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
+void uni_hid_parser_xboxone_device_dump(uni_hid_device_t* d) {
+    static const char* versions[] = {
+        "v3.1",
+        "v4.8",
+        "v5.x",
+    };
     xboxone_instance_t* ins = get_xboxone_instance(d);
-
-    xboxone_play_quad_rumble_now(d, ins->rumble_duration_ms, ins->rumble_trigger_left, ins->rumble_trigger_right,
-                                 ins->rumble_weak_magnitude, ins->rumble_strong_magnitude);
+    if (ins->version >= 0 && ins->version < ARRAY_SIZE(versions))
+        logi("\tXbox: FW version %s\n", versions[ins->version]);
 }
 
-static void on_xboxone_set_rumble_off(btstack_timer_source_t* ts) {
-    uni_hid_device_t* d = ts->context;
-    xboxone_stop_rumble_now(d);
+//
+// Helpers
+//
+xboxone_instance_t* get_xboxone_instance(uni_hid_device_t* d) {
+    return (xboxone_instance_t*)&d->cold->parser_data[0];
 }
+
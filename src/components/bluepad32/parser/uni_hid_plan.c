@@ -0,0 +1,550 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "parser/uni_hid_plan.h"
+
+#include <inttypes.h>
+#include <string.h>
+
+#include "uni_log.h"
+
+// HID Device Class Definition, section 6.2.2: Report Descriptor
+// https://www.usb.org/sites/default/files/hid1_11.pdf
+
+enum {
+    ITEM_TYPE_MAIN = 0,
+    ITEM_TYPE_GLOBAL = 1,
+    ITEM_TYPE_LOCAL = 2,
+};
+
+enum {
+    MAIN_TAG_INPUT = 0x8,
+    MAIN_TAG_OUTPUT = 0x9,
+    MAIN_TAG_COLLECTION = 0xa,
+    MAIN_TAG_FEATURE = 0xb,
+    MAIN_TAG_END_COLLECTION = 0xc,
+};
+
+enum {
+    GLOBAL_TAG_USAGE_PAGE = 0x0,
+    GLOBAL_TAG_LOGICAL_MINIMUM = 0x1,
+    GLOBAL_TAG_LOGICAL_MAXIMUM = 0x2,
+    GLOBAL_TAG_REPORT_SIZE = 0x7,
+    GLOBAL_TAG_REPORT_ID = 0x8,
+    GLOBAL_TAG_REPORT_COUNT = 0x9,
+};
+
+enum {
+    LOCAL_TAG_USAGE = 0x0,
+    LOCAL_TAG_USAGE_MINIMUM = 0x1,
+    LOCAL_TAG_USAGE_MAXIMUM = 0x2,
+};
+
+enum {
+    INPUT_FLAG_CONSTANT = 1 << 0,
+    INPUT_FLAG_VARIABLE = 1 << 1,
+};
+
+#define LONG_ITEM_PREFIX 0xfe
+#define MAX_USAGE_RANGES 16
+
+// A local "Usage" is stored as a range of one element. Consecutive ones are merged.
+typedef struct {
+    // Like btstack_hid_parser, the usage page is the one when the usage is declared,
+    // unless the usage was defined using 4 bytes.
+    uint16_t usage_page;
+    uint16_t min;
+    uint16_t max;
+    bool is_range;  // Defined with Usage Minimum / Maximum
+} usage_range_t;
+
+typedef struct {
+    // The descriptor is compiled twice: first to count the items and fields, so that the tables take only
+    // the bytes they need, and then to fill them.
+    bool counting;
+    hid_globals_t globals;
+
+    usage_range_t usages[MAX_USAGE_RANGES];
+    uint8_t num_usages;
+    bool has_usage_minimum;
+    uint32_t usage_minimum;  // Usage page in the upper 16 bits
+
+    // Reports are stored here, and copied after the fields once they are known.
+    uni_hid_plan_report_t reports[UNI_HID_PLAN_MAX_REPORTS];
+    // Current offset, in bits, for each one of the reports.
+    uint16_t report_bits[UNI_HID_PLAN_MAX_REPORTS];
+    // Reports where btstack_hid_parser stops, because an item has more fields than usages.
+    // Fields after that are not reported.
+    bool report_stopped[UNI_HID_PLAN_MAX_REPORTS];
+    // Report index for each one of the fields. Used to group the fields by report at the end.
+    uint8_t field_report_idx[UNI_HID_PLAN_MAX_FIELDS];
+} compile_state_t;
+
+static int find_or_add_report(uni_hid_plan_t* plan, compile_state_t* st, uint8_t report_id) {
+    for (int i = 0; i < plan->num_reports; i++) {
+        if (st->reports[i].report_id == report_id)
+            return i;
+    }
+    if (plan->num_reports >= UNI_HID_PLAN_MAX_REPORTS)
+        return -1;
+
+    int idx = plan->num_reports++;
+    st->reports[idx].report_id = report_id;
+    // When Report IDs are used, the first byte of the report is the Report ID.
+    st->report_bits[idx] = (report_id != 0) ? 8 : 0;
+    return idx;
+}
+
+static bool add_field(uni_hid_plan_t* plan,
+                      compile_state_t* st,
+                      int report_idx,
+                      uint16_t bit_offset,
+                      uint16_t usage_page,
+                      uint16_t usage,
+                      uint8_t count,
+                      uint8_t flags) {
+    if (plan->num_fields >= UNI_HID_PLAN_MAX_FIELDS)
+        return false;
+
+    int idx = plan->num_fields++;
+    st->field_report_idx[idx] = report_idx;
+    if (st->counting)
+        return true;
+
+    uni_hid_plan_field_t* f = &plan->fields[idx];
+    memset(f, 0, sizeof(*f));
+    f->bit_offset = bit_offset;
+    f->usage_page = usage_page;
+    f->usage = usage;
+    f->count = count;
+    f->item_idx = plan->num_items - 1;
+    f->flags = flags;
+    return true;
+}
+
+static bool process_input(uni_hid_plan_t* plan, compile_state_t* st, uint32_t input_flags) {
+    const hid_globals_t* g = &st->globals;
+    uint32_t total_bits = g->report_size * g->report_count;
+
+    int report_idx = find_or_add_report(plan, st, g->report_id);
+    if (report_idx < 0) {
+        loge("HID plan: too many reports\n");
+        return false;
+    }
+
+    uint16_t bit_offset = st->report_bits[report_idx];
+    if (bit_offset + total_bits > UINT16_MAX) {
+        loge("HID plan: report too big\n");
+        return false;
+    }
+    st->report_bits[report_idx] += total_bits;
+
+    // Constant items are padding: skipped, even if they have usages. Same as btstack_hid_parser.
+    if ((input_flags & INPUT_FLAG_CONSTANT) || total_bits == 0 || st->report_stopped[report_idx])
+        return true;
+
+    // btstack_hid_parser stops parsing the report when a data item has no usages.
+    if (st->num_usages == 0) {
+        st->report_stopped[report_idx] = true;
+        return true;
+    }
+
+    if (g->report_size > 32) {
+        loge("HID plan: unsupported report size: %d\n", g->report_size);
+        return false;
+    }
+
+    if (plan->num_items >= UNI_HID_PLAN_MAX_ITEMS) {
+        loge("HID plan: too many items\n");
+        return false;
+    }
+    int item_idx = plan->num_items++;
+    if (!st->counting) {
+        uni_hid_plan_item_t* item = &plan->items[item_idx];
+        // The buffer is not cleared: padding included, so that the tables only depend on the descriptor.
+        memset(item, 0, sizeof(*item));
+        item->globals = *g;
+        uni_hid_parser_init_normalization(&item->globals);
+        if (input_flags & INPUT_FLAG_VARIABLE)
+            item->flags |= UNI_HID_PLAN_ITEM_FLAG_VARIABLE;
+        if (g->logical_minimum < 0)
+            item->flags |= UNI_HID_PLAN_ITEM_FLAG_SIGNED;
+    }
+
+    if (!(input_flags & INPUT_FLAG_VARIABLE)) {
+        // Array: the value is the usage. Only the usage page is needed.
+        return add_field(plan, st, report_idx, bit_offset, st->usages[0].usage_page, 0, g->report_count, 0);
+    }
+
+    // Variable: assign the usages in order.
+    int remaining = g->report_count;
+    for (int i = 0; i < st->num_usages; i++) {
+        const usage_range_t* r = &st->usages[i];
+        int n = (r->max >= r->min) ? (r->max - r->min + 1) : 1;
+        if (n > remaining)
+            n = remaining;
+
+        if (!add_field(plan, st, report_idx, bit_offset, r->usage_page, r->min, n,
+                       (n > 1) ? UNI_HID_PLAN_FIELD_FLAG_USAGE_RANGE : 0)) {
+            loge("HID plan: too many fields\n");
+            return false;
+        }
+        bit_offset += n * g->report_size;
+        remaining -= n;
+        if (remaining == 0)
+            return true;
+        // Usage Minimum / Maximum smaller than the Report Count: btstack_hid_parser ignores the remaining fields.
+        if (r->is_range)
+            return true;
+    }
+
+    // More fields than single usages: btstack_hid_parser stops parsing the report here.
+    st->report_stopped[report_idx] = true;
+    return true;
+}
+
+// Returns the usage page in the upper 16 bits, and the usage in the lower ones.
+static uint32_t get_extended_usage(const compile_state_t* st, uint32_t value, uint8_t size) {
+    if (size == 4)
+        return value;
+    return ((uint32_t)st->globals.usage_page << 16) | (value & 0xffff);
+}
+
+static bool add_usage(compile_state_t* st, uint32_t usage, bool is_range) {
+    // Consecutive usages, like X, Y, Z, are merged into the same range. Reduces the number of fields.
+    if (!is_range && st->num_usages > 0) {
+        usage_range_t* last = &st->usages[st->num_usages - 1];
+        if (!last->is_range && last->usage_page == (usage >> 16) && (uint32_t)last->max + 1 == (usage & 0xffff)) {
+            last->max++;
+            return true;
+        }
+    }
+
+    if (st->num_usages >= MAX_USAGE_RANGES) {
+        loge("HID plan: too many usages\n");
+        return false;
+    }
+    usage_range_t* r = &st->usages[st->num_usages++];
+    r->is_range = is_range;
+    if (is_range) {
+        // The usage page is the one of the Usage Minimum.
+        r->usage_page = st->usage_minimum >> 16;
+        r->min = st->usage_minimum & 0xffff;
+        r->max = usage & 0xffff;
+    } else {
+        r->usage_page = usage >> 16;
+        r->min = r->max = usage & 0xffff;
+    }
+    return true;
+}
+
+static void reset_locals(compile_state_t* st) {
+    st->num_usages = 0;
+    st->has_usage_minimum = false;
+}
+
+// Group the fields by report, preserving the descriptor order within each report.
+// Insertion sort, in place: there are only a few fields, and it is done once per descriptor.
+static void sort_fields_by_report(uni_hid_plan_t* plan, compile_state_t* st) {
+    for (int i = 1; i < plan->num_fields; i++) {
+        uni_hid_plan_field_t f = plan->fields[i];
+        uint8_t report_idx = st->field_report_idx[i];
+        int j = i - 1;
+        for (; j >= 0 && st->field_report_idx[j] > report_idx; j--) {
+            plan->fields[j + 1] = plan->fields[j];
+            st->field_report_idx[j + 1] = st->field_report_idx[j];
+        }
+        plan->fields[j + 1] = f;
+        st->field_report_idx[j + 1] = report_idx;
+    }
+
+    int first = 0;
+    for (int r = 0; r < plan->num_reports; r++) {
+        st->reports[r].first_field = first;
+        st->reports[r].num_fields = 0;
+        while (first < plan->num_fields && st->field_report_idx[first] == r) {
+            st->reports[r].num_fields++;
+            first++;
+        }
+    }
+}
+
+void uni_hid_plan_reset(uni_hid_plan_t* plan) {
+    memset(plan, 0, sizeof(*plan));
+}
+
+uint16_t uni_hid_plan_get_tables_size(const uni_hid_plan_t* plan) {
+    return plan->num_items * sizeof(plan->items[0]) + plan->num_fields * sizeof(plan->fields[0]) +
+           plan->num_reports * sizeof(plan->reports[0]);
+}
+
+void uni_hid_plan_move_tables(uni_hid_plan_t* plan, void* buffer) {
+    uint8_t* dst = buffer;
+
+    // In this order, and with memmove, so that they can be moved to a lower address within the same buffer.
+    memmove(dst, plan->items, plan->num_items * sizeof(plan->items[0]));
+    plan->items = (uni_hid_plan_item_t*)dst;
+    dst += plan->num_items * sizeof(plan->items[0]);
+
+    memmove(dst, plan->fields, plan->num_fields * sizeof(plan->fields[0]));
+    plan->fields = (uni_hid_plan_field_t*)dst;
+    dst += plan->num_fields * sizeof(plan->fields[0]);
+
+    memmove(dst, plan->reports, plan->num_reports * sizeof(plan->reports[0]));
+    plan->reports = (uni_hid_plan_report_t*)dst;
+}
+
+// Walks the descriptor once. When counting, only the number of items, fields and reports is updated.
+static bool compile_descriptor(uni_hid_plan_t* plan,
+                               compile_state_t* st,
+                               const uint8_t* descriptor,
+                               uint16_t descriptor_len) {
+    int pos = 0;
+    while (pos < descriptor_len) {
+        uint8_t prefix = descriptor[pos++];
+
+        if (prefix == LONG_ITEM_PREFIX) {
+            // Long items are reserved, and not used by any known device. Skip them.
+            if (pos >= descriptor_len)
+                return false;
+            pos += descriptor[pos] + 2;
+            continue;
+        }
+
+        uint8_t size = prefix & 0x03;
+        if (size == 3)
+            size = 4;
+        uint8_t type = (prefix >> 2) & 0x03;
+        uint8_t tag = prefix >> 4;
+
+        if (pos + size > descriptor_len) {
+            loge("HID plan: truncated descriptor\n");
+            return false;
+        }
+
+        uint32_t value = 0;
+        for (int i = 0; i < size; i++)
+            value |= (uint32_t)descriptor[pos + i] << (i * 8);
+        pos += size;
+
+        // Logical Minimum / Maximum are signed.
+        int32_t svalue = (int32_t)value;
+        if (size == 1)
+            svalue = (int8_t)value;
+        else if (size == 2)
+            svalue = (int16_t)value;
+
+        switch (type) {
+            case ITEM_TYPE_MAIN:
+                if (tag == MAIN_TAG_INPUT && !process_input(plan, st, value))
+                    return false;
+                // Output, Feature, Collection and End Collection only reset the locals.
+                reset_locals(st);
+                break;
+            case ITEM_TYPE_GLOBAL:
+                switch (tag) {
+                    case GLOBAL_TAG_USAGE_PAGE:
+                        st->globals.usage_page = value;
+                        break;
+                    case GLOBAL_TAG_LOGICAL_MINIMUM:
+                        st->globals.logical_minimum = svalue;
+                        break;
+                    case GLOBAL_TAG_LOGICAL_MAXIMUM:
+                        st->globals.logical_maximum = svalue;
+                        break;
+                    case GLOBAL_TAG_REPORT_SIZE:
+                        if (value > UINT8_MAX) {
+                            loge("HID plan: unsupported report size: %" PRIu32 "\n", value);
+                            return false;
+                        }
+                        st->globals.report_size = value;
+                        break;
+                    case GLOBAL_TAG_REPORT_ID:
+                        // Stored in uint8_t fields. Valid IDs are 1-255 anyway.
+                        if (value > UINT8_MAX) {
+                            loge("HID plan: unsupported report ID: %" PRIu32 "\n", value);
+                            return false;
+                        }
+                        st->globals.report_id = value;
+                        plan->has_report_ids = true;
+                        break;
+                    case GLOBAL_TAG_REPORT_COUNT:
+                        if (value > UINT8_MAX) {
+                            loge("HID plan: unsupported report count: %" PRIu32 "\n", value);
+                            return false;
+                        }
+                        st->globals.report_count = value;
+                        break;
+                    default:
+                        // Unit, exponent, physical min/max: not used.
+                        // Push and Pop are ignored by btstack_hid_parser, so they are ignored here too.
+                        break;
+                }
+                break;
+            case ITEM_TYPE_LOCAL:
+                switch (tag) {
+                    case LOCAL_TAG_USAGE:
+                        if (!add_usage(st, get_extended_usage(st, value, size), false))
+                            return false;
+                        break;
+                    case LOCAL_TAG_USAGE_MINIMUM:
+                        st->usage_minimum = get_extended_usage(st, value, size);
+                        st->has_usage_minimum = true;
+                        break;
+                    case LOCAL_TAG_USAGE_MAXIMUM:
+                        if (st->has_usage_minimum && !add_usage(st, get_extended_usage(st, value, size), true))
+                            return false;
+                        st->has_usage_minimum = false;
+                        break;
+                    default:
+                        // Designators, strings, delimiters: not used
+                        break;
+                }
+                break;
+            default:
+                // Reserved
+                break;
+        }
+    }
+
+    return true;
+}
+
+bool uni_hid_plan_compile(uni_hid_plan_t* plan,
+                          void* buffer,
+                          uint16_t buffer_size,
+                          const uint8_t* descriptor,
+                          uint16_t descriptor_len) {
+    compile_state_t st;
+
+    uni_hid_plan_reset(plan);
+    memset(&st, 0, sizeof(st));
+    st.counting = true;
+    if (!compile_descriptor(plan, &st, descriptor, descriptor_len))
+        return false;
+
+    uint16_t tables_size = uni_hid_plan_get_tables_size(plan);
+    if (tables_size > buffer_size) {
+        logi("HID plan: tables need %d bytes, only %d available\n", tables_size, buffer_size);
+        uni_hid_plan_reset(plan);
+        return false;
+    }
+
+    // Same layout as uni_hid_plan_move_tables(): items, fields and then reports.
+    uint8_t* ptr = buffer;
+    plan->items = (uni_hid_plan_item_t*)ptr;
+    ptr += plan->num_items * sizeof(plan->items[0]);
+    plan->fields = (uni_hid_plan_field_t*)ptr;
+    ptr += plan->num_fields * sizeof(plan->fields[0]);
+    plan->reports = (uni_hid_plan_report_t*)ptr;
+
+    plan->num_items = 0;
+    plan->num_fields = 0;
+    plan->num_reports = 0;
+    memset(&st, 0, sizeof(st));
+    if (!compile_descriptor(plan, &st, descriptor, descriptor_len)) {
+        uni_hid_plan_reset(plan);
+        return false;
+    }
+
+    sort_fields_by_report(plan, &st);
+    memcpy(plan->reports, st.reports, plan->num_reports * sizeof(plan->reports[0]));
+    plan->valid = true;
+    return true;
+}
+
+// Bytes past the end of the report are read as 0.
+static inline int32_t extract_field(const uint8_t* report,
+                                    uint16_t report_len,
+                                    uint32_t bit_offset,
+                                    uint8_t size,
+                                    bool is_signed) {
+    uint32_t first = bit_offset >> 3;
+    uint8_t shift = bit_offset & 0x07;
+    uint8_t bytes = (shift + size + 7) >> 3;
+
+    uint64_t raw = 0;
+    for (uint32_t i = 0; i < bytes && first + i < report_len; i++)
+        raw |= (uint64_t)report[first + i] << (i * 8);
+
+    uint32_t value = (uint32_t)(raw >> shift);
+    if (size < 32) {
+        uint32_t mask = (1u << size) - 1;
+        value &= mask;
+        if (is_signed && (value & (1u << (size - 1))))
+            value |= ~mask;
+    }
+    return (int32_t)value;
+}
+
+void uni_hid_plan_parse_report(const uni_hid_plan_t* plan,
+                               struct uni_hid_device_s* d,
+                               report_parse_usage_fn_t parse_usage,
+                               const uint8_t* report,
+                               uint16_t report_len) {
+    const uni_hid_plan_report_t* r = NULL;
+    uint8_t report_id = 0;
+
+    if (plan->has_report_ids) {
+        if (report_len < 1)
+            return;
+        report_id = report[0];
+    }
+
+    for (int i = 0; i < plan->num_reports; i++) {
+        if (plan->reports[i].report_id == report_id) {
+            r = &plan->reports[i];
+            break;
+        }
+    }
+    if (r == NULL)
+        return;
+
+    const uni_hid_plan_field_t* f = &plan->fields[r->first_field];
+    const uni_hid_plan_field_t* end = f + r->num_fields;
+
+    for (; f < end; f++) {
+        const uni_hid_plan_item_t* item = &plan->items[f->item_idx];
+        // parse_usage() might modify the globals, so pass a copy.
+        hid_globals_t globals = item->globals;
+        const uint8_t size = globals.report_size;
+        const bool is_signed = (item->flags & UNI_HID_PLAN_ITEM_FLAG_SIGNED) != 0;
+        const bool is_variable = (item->flags & UNI_HID_PLAN_ITEM_FLAG_VARIABLE) != 0;
+        uint32_t bit_offset = f->bit_offset;
+        uint16_t usage = f->usage;
+
+        // A shorter report than expected is not an error: btstack_hid_parser keeps going as well,
+        // clamping the reads to the end of the report.
+        for (int i = 0; i < f->count; i++, bit_offset += size) {
+            int32_t value = extract_field(report, report_len, bit_offset, size, is_signed);
+            if (is_variable) {
+                parse_usage(d, &globals, f->usage_page, usage, value);
+                if (f->flags & UNI_HID_PLAN_FIELD_FLAG_USAGE_RANGE)
+                    usage++;
+            } else {
+                // Array: the value is the usage.
+                parse_usage(d, &globals, f->usage_page, (uint16_t)value, 1);
+            }
+        }
+    }
+}
+
+void uni_hid_plan_dump(const uni_hid_plan_t* plan) {
+    if (!plan->valid) {
+        logi("\tHID plan: not compiled\n");
+        return;
+    }
+    logi("\tHID plan: reports=%d, items=%d, fields=%d\n", plan->num_reports, plan->num_items, plan->num_fields);
+    for (int r = 0; r < plan->num_reports; r++) {
+        const uni_hid_plan_report_t* report = &plan->reports[r];
+        logi("\t  report_id=%d, fields=%d\n", report->report_id, report->num_fields);
+        for (int i = report->first_field; i < report->first_field + report->num_fields; i++) {
+            const uni_hid_plan_field_t* f = &plan->fields[i];
+            const uni_hid_plan_item_t* item = &plan->items[f->item_idx];
+            logi("\t    bit=%d, size=%d, count=%d, page=0x%04x, usage=0x%04x, min=%d, max=%d, flags=0x%02x\n",
+                 f->bit_offset, item->globals.report_size, f->count, f->usage_page, f->usage,
+                 item->globals.logical_minimum, item->globals.logical_maximum, item->flags);
+        }
+    }
+}
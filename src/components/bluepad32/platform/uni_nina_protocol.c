@@ -0,0 +1,759 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+// NINA / AirLift protocol. The SPI and GPIO parts are in uni_platform_nina.c.
+
+#include "platform/uni_nina_protocol.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "sdkconfig.h"
+
+#include "uni_log.h"
+#include "uni_snapshot.h"
+
+// Prebuilt response of "controllers data" (command 0x09), the one that the hosts poll.
+// The Bluetooth side serializes it each time a controller changes, and the SPI side sends it as is:
+// no copies, no waiting.
+//
+// Triple buffered: the Bluetooth side owns "back", the SPI side owns "front", and "ready" is swapped
+// atomically between them. With only two buffers, the Bluetooth side could overwrite the frame that the
+// DMA is still sending.
+// FRAME_FLAG_FRESH is set in "ready" when it has a frame that the SPI side hasn't taken yet.
+typedef struct {
+    uint8_t data[UNI_NINA_PROTOCOL_BUFFER_LEN] __attribute__((aligned(4)));
+    int len;
+} nina_frame_t;
+_Static_assert(3 + CONFIG_BLUEPAD32_MAX_DEVICES * (1 + sizeof(uni_nina_controller_t)) + 1 <=
+                   UNI_NINA_PROTOCOL_BUFFER_LEN,
+               "NINA controllers frame too big");
+
+#define FRAME_FLAG_FRESH ((uintptr_t)1)
+
+// Protocol v2: each bit of the change bitmap is one field of the controller class, in the order of these tables.
+typedef struct {
+    uint8_t offset;  // In uni_nina_controller_t
+    uint8_t len;
+} nina_v2_field_t;
+
+#define V2_FIELD(_field) {offsetof(uni_nina_controller_t, _field), sizeof(((uni_nina_controller_t*)0)->_field)}
+static const nina_v2_field_t v2_gamepad_fields[] = {
+    V2_FIELD(gamepad.dpad),          // Bit 0
+    V2_FIELD(gamepad.axis_x),        // Bit 1
+    V2_FIELD(gamepad.axis_y),        // Bit 2
+    V2_FIELD(gamepad.axis_rx),       // Bit 3
+    V2_FIELD(gamepad.axis_ry),       // Bit 4
+    V2_FIELD(gamepad.brake),         // Bit 5
+    V2_FIELD(gamepad.throttle),      // Bit 6
+    V2_FIELD(gamepad.buttons),       // Bit 7
+    V2_FIELD(gamepad.misc_buttons),  // Bit 8
+    V2_FIELD(gamepad.gyro),          // Bit 9
+    V2_FIELD(gamepad.accel),         // Bit 10
+};
+static const nina_v2_field_t v2_mouse_fields[] = {
+    V2_FIELD(mouse.delta_x),       // Bit 0
+    V2_FIELD(mouse.delta_y),       // Bit 1
+    V2_FIELD(mouse.buttons),       // Bit 2
+    V2_FIELD(mouse.misc_buttons),  // Bit 3
+    V2_FIELD(mouse.scroll_wheel),  // Bit 4
+};
+static const nina_v2_field_t v2_balance_fields[] = {
+    V2_FIELD(balance.tr),           // Bit 0
+    V2_FIELD(balance.br),           // Bit 1
+    V2_FIELD(balance.tl),           // Bit 2
+    V2_FIELD(balance.bl),           // Bit 3
+    V2_FIELD(balance.temperature),  // Bit 4
+};
+#undef V2_FIELD
+
+// Worst case: all the controllers are sent in full. Param len, change bitmap and the whole uni_nina_controller_t.
+_Static_assert(8 + CONFIG_BLUEPAD32_MAX_DEVICES * (1 + 2 + sizeof(uni_nina_controller_t)) + 1 <=
+                   UNI_NINA_PROTOCOL_BUFFER_LEN,
+               "NINA v2 response too big");
+_Static_assert(CONFIG_BLUEPAD32_MAX_DEVICES <= 8, "NINA v2 seats don't fit in one byte");
+
+static uni_nina_protocol_callbacks_t _callbacks;
+
+// Written by the Bluetooth side, read by the SPI side. Each snapshot protects both _controllers[i]
+// and _controllers_properties[i]. The Bluetooth side never waits, no matter how slow the SPI master is.
+static uni_snapshot_t _controllers_snapshot[CONFIG_BLUEPAD32_MAX_DEVICES];
+static uni_nina_controller_t _controllers[CONFIG_BLUEPAD32_MAX_DEVICES];
+static uni_nina_controller_properties_t _controllers_properties[CONFIG_BLUEPAD32_MAX_DEVICES];
+static volatile uni_gamepad_seat_t _gamepad_seats;
+
+static nina_frame_t _controllers_frames[3];
+static nina_frame_t* _controllers_frame_back;   // Bluetooth side only
+static nina_frame_t* _controllers_frame_front;  // SPI side only
+// Accessed with atomic builtins only.
+static uintptr_t _controllers_frame_ready;
+
+// SPI side only.
+static bool _protocol_v2;
+static uint16_t _v2_seq;
+// What the host has if it received the response with _v2_seq.
+static uni_gamepad_seat_t _v2_seats;
+static uni_nina_controller_t _v2_sent[CONFIG_BLUEPAD32_MAX_DEVICES];
+// Used by each command of a batch.
+static uint8_t _batch_command[UNI_NINA_PROTOCOL_BUFFER_LEN];
+static uint8_t _batch_response[UNI_NINA_PROTOCOL_BUFFER_LEN];
+
+static int dispatch_request(const uint8_t command[], uint8_t response[]);
+
+//
+// Bluetooth side
+//
+
+// _controllers[] is only written by the Bluetooth side, so it can be read without the snapshot.
+static void build_controllers_frame(nina_frame_t* frame) {
+    // Same format as any other response:
+    // byte 0: CMD_START
+    //      1: command | CMD_REPLY_FLAG
+    //      2: number of parameters (contains the number of controllers)
+    //      3: param len (sizeof(_controllers[0])
+    //      4: controller N data
+    //      ...
+    //      N: CMD_END
+    uint8_t* response = frame->data;
+    int total_controllers = 0;
+    int offset = 3;
+
+    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+        if (_gamepad_seats & GAMEPAD_SEAT_FOR_IDX(i)) {
+            total_controllers++;
+            response[offset] = sizeof(_controllers[0]);
+            memcpy(&response[offset + 1], &_controllers[i], sizeof(_controllers[0]));
+            offset += sizeof(_controllers[0]) + 1;
+        }
+    }
+
+    response[0] = UNI_NINA_CMD_START;
+    response[1] = UNI_NINA_CMD_CONTROLLERS_DATA | UNI_NINA_CMD_REPLY_FLAG;
+    response[2] = total_controllers;
+    response[offset] = UNI_NINA_CMD_END;
+    frame->len = offset + 1;
+}
+
+// To be called each time _controllers[] or _gamepad_seats changes.
+static void publish_controllers_frame(void) {
+    build_controllers_frame(_controllers_frame_back);
+
+    uintptr_t prev = __atomic_exchange_n(&_controllers_frame_ready,
+                                         (uintptr_t)_controllers_frame_back | FRAME_FLAG_FRESH, __ATOMIC_ACQ_REL);
+    _controllers_frame_back = (nina_frame_t*)(prev & ~FRAME_FLAG_FRESH);
+}
+
+int uni_nina_protocol_add_controller(uni_hid_device_t* d) {
+    int idx = UNI_NINA_CONTROLLER_INVALID;
+
+    // Find first available seat
+    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+        if ((_gamepad_seats & GAMEPAD_SEAT_FOR_IDX(i)) == 0) {
+            idx = i;
+            break;
+        }
+    }
+    if (idx == UNI_NINA_CONTROLLER_INVALID)
+        return UNI_NINA_CONTROLLER_INVALID;
+
+    // This is how "client" knows which gamepad emitted the events.
+    uni_snapshot_write_begin(&_controllers_snapshot[idx]);
+    _controllers[idx].idx = idx;
+
+    // FIXME: To save RAM gamepad_properties should be updated at "request time".
+    // It requires to add a mutex in uni_hid_device, and that has its own issues.
+    // As a quick hack, it is easier to copy them now.
+    uni_nina_controller_properties_t* properties = &_controllers_properties[idx];
+    properties->idx = idx;
+    properties->type = d->controller_type;
+    properties->subtype = d->controller_subtype;
+    properties->vendor_id = d->vendor_id;
+    properties->product_id = d->product_id;
+    properties->flags = (d->report_parser.set_player_leds ? UNI_NINA_PROPERTY_FLAG_PLAYER_LEDS : 0) |
+                        (d->report_parser.play_dual_rumble ? UNI_NINA_PROPERTY_FLAG_RUMBLE : 0) |
+                        (d->report_parser.set_lightbar_color ? UNI_NINA_PROPERTY_FLAG_PLAYER_LIGHTBAR : 0);
+
+    // TODO: Most probably a device cannot be a mouse a keyboard and a gamepad at the same time,
+    // and 2 bits should be more than enough.
+    // But for simplicity, let's use one bit for each category.
+    if (uni_hid_device_is_mouse(d))
+        properties->flags |= UNI_NINA_PROPERTY_FLAG_MOUSE;
+
+    if (uni_hid_device_is_keyboard(d))
+        properties->flags |= UNI_NINA_PROPERTY_FLAG_KEYBOARD;
+
+    if (uni_hid_device_is_gamepad(d))
+        properties->flags |= UNI_NINA_PROPERTY_FLAG_GAMEPAD;
+
+    memcpy(properties->btaddr, d->conn.btaddr, sizeof(properties->btaddr));
+    uni_snapshot_write_end(&_controllers_snapshot[idx]);
+
+    // Once it is filled, so that the SPI side never sees a half-added controller.
+    _gamepad_seats |= GAMEPAD_SEAT_FOR_IDX(idx);
+    publish_controllers_frame();
+    return idx;
+}
+
+void uni_nina_protocol_remove_controller(int idx) {
+    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
+        loge("NINA: unexpected controller idx, got: %d, want: [0-%d]\n", idx, CONFIG_BLUEPAD32_MAX_DEVICES);
+        return;
+    }
+    _gamepad_seats &= ~GAMEPAD_SEAT_FOR_IDX(idx);
+
+    uni_snapshot_write_begin(&_controllers_snapshot[idx]);
+    memset(&_controllers[idx], 0, sizeof(_controllers[0]));
+    _controllers[idx].idx = UNI_NINA_CONTROLLER_INVALID;
+
+    memset(&_controllers_properties[idx], 0, sizeof(_controllers_properties[0]));
+    _controllers_properties[idx].idx = UNI_NINA_CONTROLLER_INVALID;
+    uni_snapshot_write_end(&_controllers_snapshot[idx]);
+
+    publish_controllers_frame();
+}
+
+void uni_nina_protocol_set_controller_data(int idx, const uni_controller_t* ctl) {
+    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
+        loge("NINA: unexpected controller idx, got: %d, want: [0-%d]\n", idx, CONFIG_BLUEPAD32_MAX_DEVICES);
+        return;
+    }
+
+    // Populate gamepad data on shared struct.
+    uni_nina_controller_t* out = &_controllers[idx];
+    uni_snapshot_write_begin(&_controllers_snapshot[idx]);
+    switch (ctl->klass) {
+        case UNI_CONTROLLER_CLASS_GAMEPAD:
+            out->gamepad.dpad = ctl->gamepad.dpad;
+            out->gamepad.axis_x = ctl->gamepad.axis_x;
+            out->gamepad.axis_y = ctl->gamepad.axis_y;
+            out->gamepad.axis_rx = ctl->gamepad.axis_rx;
+            out->gamepad.axis_ry = ctl->gamepad.axis_ry;
+            out->gamepad.brake = ctl->gamepad.brake;
+            out->gamepad.throttle = ctl->gamepad.throttle;
+            out->gamepad.buttons = ctl->gamepad.buttons;
+            out->gamepad.misc_buttons = ctl->gamepad.misc_buttons;
+            memcpy(out->gamepad.gyro, ctl->gamepad.gyro, sizeof(ctl->gamepad.gyro));
+            memcpy(out->gamepad.accel, ctl->gamepad.accel, sizeof(ctl->gamepad.accel));
+            break;
+        case UNI_CONTROLLER_CLASS_MOUSE:
+            out->mouse.delta_x = ctl->mouse.delta_x;
+            out->mouse.delta_y = ctl->mouse.delta_y;
+            out->mouse.buttons = ctl->mouse.buttons;
+            out->mouse.misc_buttons = ctl->mouse.misc_buttons;
+            out->mouse.scroll_wheel = ctl->mouse.scroll_wheel;
+            break;
+        case UNI_CONTROLLER_CLASS_BALANCE_BOARD:
+            break;
+        default:
+            break;
+    }
+
+    out->klass = ctl->klass;
+    out->battery = ctl->battery;
+    uni_snapshot_write_end(&_controllers_snapshot[idx]);
+
+    publish_controllers_frame();
+}
+
+//
+// SPI side
+//
+
+const uint8_t* uni_nina_protocol_get_controllers_frame(int* len) {
+    if (__atomic_load_n(&_controllers_frame_ready, __ATOMIC_RELAXED) & FRAME_FLAG_FRESH) {
+        uintptr_t ready =
+            __atomic_exchange_n(&_controllers_frame_ready, (uintptr_t)_controllers_frame_front, __ATOMIC_ACQ_REL);
+        _controllers_frame_front = (nina_frame_t*)(ready & ~FRAME_FLAG_FRESH);
+    }
+    *len = _controllers_frame_front->len;
+    return _controllers_frame_front->data;
+}
+
+static int reply_status(uint8_t response[], uint8_t ret) {
+    response[2] = 1;  // Number of parameters
+    response[3] = 1;  // Param len
+    response[4] = ret;
+    return 5;
+}
+
+static int queue_request(const uni_nina_request_t* request, uint8_t response[]) {
+    if (request->controller_idx >= CONFIG_BLUEPAD32_MAX_DEVICES || _callbacks.queue_request == NULL)
+        return reply_status(response, UNI_NINA_RESPONSE_ERROR);
+
+    _callbacks.queue_request(request);
+
+    // TODO: We really don't know whether this request will succeed
+    return reply_status(response, UNI_NINA_RESPONSE_OK);
+}
+
+// Command 0x00
+static int request_protocol_version(const uint8_t command[], uint8_t response[]) {
+    // Hosts that support v2 ask for it. The rest send no parameters, and keep getting v1.
+    // command[2]: total params
+    // command[3]: param len
+    // command[4]: wanted version (major)
+    _protocol_v2 = (command[2] >= 1 && command[3] >= 1 && command[4] >= UNI_NINA_PROTOCOL_V2_VERSION_HI);
+
+    response[2] = 1;  // Number of parameters
+    response[3] = 2;  // Param len
+    if (_protocol_v2) {
+        // Start with a full response.
+        _v2_seats = 0;
+        response[4] = UNI_NINA_PROTOCOL_V2_VERSION_HI;
+        response[5] = UNI_NINA_PROTOCOL_V2_VERSION_LO;
+    } else {
+        response[4] = UNI_NINA_PROTOCOL_VERSION_HI;
+        response[5] = UNI_NINA_PROTOCOL_VERSION_LO;
+    }
+
+    return 6;
+}
+
+// Command 0x01
+static int request_gamepads_data(const uint8_t command[], uint8_t response[]) {
+    // Returned struct:
+    // --- generic to all requests
+    // byte 2: number of parameters (contains the number of gamepads)
+    //      3: param len (sizeof(_gamepads[0])
+    //      4: gamepad N data
+
+    int total_controllers = 0;
+    int offset = 3;
+    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+        if (_gamepad_seats & GAMEPAD_SEAT_FOR_IDX(i)) {
+            uni_nina_controller_t ctl;
+            uni_snapshot_read(&_controllers_snapshot[i], &ctl, &_controllers[i], sizeof(ctl));
+
+            total_controllers++;
+            // Update param len
+            // +1 is for the "idx" field
+            response[offset] = sizeof(ctl.gamepad) + 1;
+            // Update param (data)
+            response[offset + 1] = ctl.idx;
+            memcpy(&response[offset + 2], &ctl.gamepad, sizeof(ctl.gamepad));
+            // +1 for len
+            // +1 for idx
+            offset += sizeof(ctl.gamepad) + 1 + 1;
+        }
+    }
+
+    response[2] = total_controllers;  // total params
+
+    // "offset" has the total length
+    return offset;
+}
+
+// Command 0x02
+static int request_set_gamepad_player_leds(const uint8_t command[], uint8_t response[]) {
+    // command[2]: total params
+    // command[3]: param len
+    // command[4]: idx
+    // command[5]: param len
+    // command[6]: leds
+    uni_nina_request_t request = (uni_nina_request_t){
+        .controller_idx = command[4],
+        .cmd = UNI_NINA_REQUEST_CMD_PLAYER_LEDS,
+        .args[0] = command[6],
+    };
+    return queue_request(&request, response);
+}
+
+// Command 0x03
+static int request_set_gamepad_color_led(const uint8_t command[], uint8_t response[]) {
+    // command[2]: total params
+    // command[3]: param len
+    // command[4]: idx
+    // command[5]: param len
+    // command[6-8]: RGB
+    uni_nina_request_t request = (uni_nina_request_t){
+        .controller_idx = command[4],
+        .cmd = UNI_NINA_REQUEST_CMD_LIGHTBAR_COLOR,
+        .args[0] = command[6],
+        .args[1] = command[7],
+        .args[2] = command[8],
+    };
+    return queue_request(&request, response);
+}
+
+// Command 0x04
+static int request_set_gamepad_rumble(const uint8_t command[], uint8_t response[]) {
+    // command[2]: total params
+    // command[3]: param len
+    // command[4]: idx
+    // command[5]: param len
+    // command[6,7]: force, duration
+    uni_nina_request_t request = (uni_nina_request_t){
+        .controller_idx = command[4],
+        .cmd = UNI_NINA_REQUEST_CMD_RUMBLE,
+        .args[0] = command[6],
+        .args[1] = command[7],
+    };
+    return queue_request(&request, response);
+}
+
+// Command 0x05
+static int request_forget_bluetooth_keys(const uint8_t command[], uint8_t response[]) {
+    if (_callbacks.forget_bluetooth_keys != NULL)
+        _callbacks.forget_bluetooth_keys();
+    return reply_status(response, UNI_NINA_RESPONSE_OK);
+}
+
+// Command 0x06
+static int request_get_gamepad_properties(const uint8_t command[], uint8_t response[]) {
+    // command[2]: total params
+    // command[3]: param len
+    int idx = command[4];
+
+    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
+        // To be consistent with the "OK" case, we return 2 parameters on "Error".
+        response[2] = 2;  // Number of parameters
+        response[3] = 1;  // Param len
+        response[4] = UNI_NINA_RESPONSE_ERROR;
+        response[5] = 1;  // Param len
+        response[6] = 0;  // Ignore
+        return 7;
+    };
+
+    response[2] = 2;                                   // Number of parameters
+    response[3] = 1;                                   // Param len
+    response[4] = UNI_NINA_RESPONSE_OK;                // Ok
+    response[5] = sizeof(_controllers_properties[0]);  // Param len
+
+    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+        uni_nina_controller_properties_t properties;
+        uni_snapshot_read(&_controllers_snapshot[i], &properties, &_controllers_properties[i], sizeof(properties));
+        if (properties.idx == idx) {
+            memcpy(&response[6], &properties, sizeof(properties));
+            break;
+        }
+    }
+
+    return 6 + sizeof(uni_nina_controller_properties_t);
+}
+
+// Command 0x07
+static int request_enable_bluetooth_connections(const uint8_t command[], uint8_t response[]) {
+    bool enabled = command[4];
+    if (_callbacks.enable_bluetooth_connections != NULL)
+        _callbacks.enable_bluetooth_connections(enabled);
+    return reply_status(response, UNI_NINA_RESPONSE_OK);
+}
+
+// Command 0x08
+static int request_disconnect_gamepad(const uint8_t command[], uint8_t response[]) {
+    // command[2]: total params
+    // command[3]: param len
+    // command[4]: idx
+    uni_nina_request_t request = (uni_nina_request_t){
+        .controller_idx = command[4],
+        .cmd = UNI_NINA_REQUEST_CMD_DISCONNECT,
+    };
+    return queue_request(&request, response);
+}
+
+// Command 0x09
+static int request_controllers_data(const uint8_t command[], uint8_t response[]) {
+    // Returned struct:
+    // --- generic to all requests
+    // byte 2: number of parameters (contains the number of controllers)
+    //      3: param len (sizeof(_controllers[0])
+    //      4: gamepad N data
+
+    // Built by the Bluetooth side, see build_controllers_frame().
+    // The SPI driver can send it without calling this handler. See uni_nina_protocol_get_controllers_frame().
+    int len;
+    const uint8_t* frame = uni_nina_protocol_get_controllers_frame(&len);
+
+    // Without the header and CMD_END: uni_nina_protocol_process_request() adds them.
+    memcpy(&response[2], &frame[2], len - 3);
+    return len - 1;
+}
+
+static const nina_v2_field_t* get_v2_fields(uint8_t klass, int* count) {
+    switch (klass) {
+        case UNI_NINA_CONTROLLER_CLASS_GAMEPAD:
+            *count = ARRAY_SIZE(v2_gamepad_fields);
+            return v2_gamepad_fields;
+        case UNI_NINA_CONTROLLER_CLASS_MOUSE:
+            *count = ARRAY_SIZE(v2_mouse_fields);
+            return v2_mouse_fields;
+        case UNI_NINA_CONTROLLER_CLASS_BALANCE_BOARD:
+            *count = ARRAY_SIZE(v2_balance_fields);
+            return v2_balance_fields;
+        default:
+            *count = 0;
+            return NULL;
+    }
+}
+
+// Writes idx, change bitmap, klass (if changed), the fields that changed and battery (if changed).
+// Returns the number of bytes written, or 0 if nothing changed.
+static int encode_v2_controller(const uni_nina_controller_t* prev,
+                                const uni_nina_controller_t* ctl,
+                                bool full,
+                                uint8_t out[]) {
+    const uint8_t* prev_bytes = (const uint8_t*)prev;
+    const uint8_t* ctl_bytes = (const uint8_t*)ctl;
+    uint16_t changes = 0;
+    int offset = 3;
+    int count;
+
+    // Goes first: the host needs it to decode the rest.
+    if (full || ctl->klass != prev->klass) {
+        full = true;
+        changes |= UNI_NINA_V2_CHANGE_CLASS;
+        out[offset++] = ctl->klass;
+    }
+
+    const nina_v2_field_t* fields = get_v2_fields(ctl->klass, &count);
+    for (int i = 0; i < count; i++) {
+        const nina_v2_field_t* f = &fields[i];
+        if (full || memcmp(&prev_bytes[f->offset], &ctl_bytes[f->offset], f->len) != 0) {
+            changes |= BIT(i);
+            memcpy(&out[offset], &ctl_bytes[f->offset], f->len);
+            offset += f->len;
+        }
+    }
+
+    if (full || ctl->battery != prev->battery) {
+        changes |= UNI_NINA_V2_CHANGE_BATTERY;
+        out[offset++] = ctl->battery;
+    }
+
+    if (changes == 0)
+        return 0;
+
+    out[0] = ctl->idx;
+    little_endian_store_16(out, 1, changes);
+    return offset;
+}
+
+// Command 0x0a. Protocol v2 only. Replaces "controllers data" (0x09).
+static int request_controllers_changes(const uint8_t command[], uint8_t response[]) {
+    // command[2]: total params
+    // command[3]: param len
+    // command[4-5]: sequence of the last response received by the host, little endian.
+    //               Without it, or if it is not the last one sent, everything is sent again.
+    //
+    // Returned struct:
+    // --- generic to all requests
+    // byte 2: number of parameters: 1 + number of controllers that changed
+    //      3: param len (4)
+    //      4: sequence of this response, 16-bit little endian
+    //      6: seats: one bit per connected controller
+    //      7: flags: UNI_NINA_V2_FLAG_FULL
+    //      8: param len
+    //      9: controller N: idx, change bitmap (16-bit little endian) and what changed. See encode_v2_controller().
+    // Fields not sent keep their previous value. New controllers are sent in full.
+    if (!_protocol_v2)
+        return 0;
+
+    bool full = !(command[2] >= 1 && command[3] == 2 && little_endian_read_16(command, 4) == _v2_seq);
+    uni_gamepad_seat_t seats = _gamepad_seats;
+    int total_params = 1;
+    int offset = 8;
+
+    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+        if ((seats & BIT(i)) == 0)
+            continue;
+
+        uni_nina_controller_t ctl;
+        uni_snapshot_read(&_controllers_snapshot[i], &ctl, &_controllers[i], sizeof(ctl));
+
+        bool new_controller = full || (_v2_seats & BIT(i)) == 0;
+        int len = encode_v2_controller(&_v2_sent[i], &ctl, new_controller, &response[offset + 1]);
+        if (len == 0)
+            continue;
+
+        response[offset] = len;
+        offset += len + 1;
+        total_params++;
+        _v2_sent[i] = ctl;
+    }
+
+    _v2_seq++;
+    _v2_seats = seats;
+
+    response[2] = total_params;
+    response[3] = 4;
+    little_endian_store_16(response, 4, _v2_seq);
+    response[6] = seats;
+    response[7] = full ? UNI_NINA_V2_FLAG_FULL : 0;
+
+    return offset;
+}
+
+// Worst case response of a command, without CMD_END: what a batch needs to run it.
+// 0 if it can't be part of a batch: nested batches, and the NINA-fw commands, whose response size is unknown.
+static int get_max_response_len(uint8_t cmd) {
+    switch (cmd) {
+        case UNI_NINA_CMD_PROTOCOL_VERSION:
+            return 6;
+        case UNI_NINA_CMD_GAMEPADS_DATA:
+            return 3 + CONFIG_BLUEPAD32_MAX_DEVICES * (1 + 1 + sizeof(uni_nina_gamepad_t));
+        case UNI_NINA_CMD_SET_PLAYER_LEDS:
+        case UNI_NINA_CMD_SET_COLOR_LED:
+        case UNI_NINA_CMD_SET_RUMBLE:
+        case UNI_NINA_CMD_FORGET_BT_KEYS:
+        case UNI_NINA_CMD_ENABLE_BT_CONNECTIONS:
+        case UNI_NINA_CMD_DISCONNECT:
+            return 5;
+        case UNI_NINA_CMD_GET_PROPERTIES:
+            return 6 + sizeof(uni_nina_controller_properties_t);
+        case UNI_NINA_CMD_CONTROLLERS_DATA:
+            return 3 + CONFIG_BLUEPAD32_MAX_DEVICES * (1 + sizeof(uni_nina_controller_t));
+        case UNI_NINA_CMD_CONTROLLERS_CHANGES:
+            return 8 + CONFIG_BLUEPAD32_MAX_DEVICES * (1 + 2 + sizeof(uni_nina_controller_t));
+        default:
+            return 0;
+    }
+}
+
+// Command 0x0b. Protocol v2 only.
+static int request_batch(const uint8_t command[], uint8_t response[]) {
+    // command[2]: total params: one per command
+    // command[3]: param len
+    // command[4]: command without CMD_START and CMD_END: command, number of parameters, and parameters
+    //
+    // Returned struct:
+    // --- generic to all requests
+    // byte 2: number of parameters: one per executed command
+    //      3: param len
+    //      4: response without CMD_START and CMD_END: command | CMD_REPLY_FLAG, number of parameters, and parameters.
+    //         Or CMD_ERR if the command failed, or if it can't be part of a batch.
+    // Commands are executed in order. A command is executed only if its worst case response fits. Once one
+    // doesn't fit, it and the rest are not executed: the host has to send them again.
+    if (!_protocol_v2)
+        return 0;
+
+    int total_commands = command[2];
+    int in = 3;
+    int out = 3;
+    int executed = 0;
+
+    for (; executed < total_commands; executed++) {
+        if (in >= UNI_NINA_PROTOCOL_BUFFER_LEN)
+            break;
+        int len = command[in];
+        const uint8_t* sub = &command[in + 1];
+        if (len == 0 || in + 1 + len > UNI_NINA_PROTOCOL_BUFFER_LEN)
+            break;
+        // Checked before running it: commands have side effects, and must run only once.
+        int max_len = get_max_response_len(sub[0]);
+        // Room for its response, or for CMD_ERR, plus CMD_END.
+        if (out + (max_len > 2 ? max_len : 2) + 1 > UNI_NINA_PROTOCOL_BUFFER_LEN)
+            break;
+
+        int sub_len = 0;
+        if (max_len > 0) {
+            memset(_batch_command, 0, sizeof(_batch_command));
+            _batch_command[0] = UNI_NINA_CMD_START;
+            memcpy(&_batch_command[1], sub, len);
+            sub_len = dispatch_request(_batch_command, _batch_response);
+        }
+
+        // Command + response, without the CMD_START and command of the handler.
+        int param_len = sub_len - 1;
+        if (sub_len <= 0 || param_len > 0xff || out + 1 + param_len + 1 > UNI_NINA_PROTOCOL_BUFFER_LEN) {
+            response[out] = 1;
+            response[out + 1] = UNI_NINA_CMD_ERR;
+            out += 2;
+        } else {
+            response[out] = param_len;
+            response[out + 1] = sub[0] | UNI_NINA_CMD_REPLY_FLAG;
+            memcpy(&response[out + 2], &_batch_response[2], sub_len - 2);
+            out += param_len + 1;
+        }
+        in += len + 1;
+    }
+
+    response[2] = executed;
+    return out;
+}
+
+static const uni_nina_command_handler_t command_handlers[UNI_NINA_CMD_BLUEPAD32_MAX] = {
+    request_protocol_version,
+    request_gamepads_data,                 // data
+    request_set_gamepad_player_leds,       // the 4 LEDs that is available in many gamepads.
+    request_set_gamepad_color_led,         // available on DS4, DualSense
+    request_set_gamepad_rumble,            // available on DS4, Xbox, Switch, etc.
+    request_forget_bluetooth_keys,         // forget stored Bluetooth keys
+    request_get_gamepad_properties,        // get gamepad properties like BTAddr, VID/PID, etc.
+    request_enable_bluetooth_connections,  // Enable/Disable bluetooth connection
+    request_disconnect_gamepad,            // Disconnect gamepad
+    request_controllers_data,              // Gamepad, Mouse, Balance. Deprecates request_gamepads_data
+    request_controllers_changes,           // v2: only what changed. Deprecates request_controllers_data
+    request_batch,                         // v2: several commands in one transaction
+    NULL,
+    NULL,
+    NULL,
+    NULL,
+};
+
+static int dispatch_request(const uint8_t command[], uint8_t response[]) {
+    uint8_t cmd = command[1];
+
+    if (cmd < UNI_NINA_CMD_BLUEPAD32_MAX) {
+        if (command_handlers[cmd] == NULL)
+            return 0;
+        return command_handlers[cmd](command, response);
+    }
+    if (_callbacks.process_nina_fw_request == NULL)
+        return 0;
+    return _callbacks.process_nina_fw_request(command, response);
+}
+
+int uni_nina_protocol_process_request(const uint8_t command[], int command_len, uint8_t response[] /* out */) {
+    int response_len = 0;
+
+    if (command_len >= 2 && command[0] == UNI_NINA_CMD_START && command[1] < UNI_NINA_CMD_REPLY_FLAG) {
+        // To make the code "compatible", we pass "command" to all the request
+        // handlers. On an ideal world, we should pass &command[2] instead.
+        response_len = dispatch_request(command, response);
+    }
+
+    if (response_len <= 0) {
+        loge("NINA: Error in request:\n");
+        printf_hexdump(command, command_len);
+        // Response for invalid requests
+        response[0] = UNI_NINA_CMD_ERR;
+        response[1] = 0x00;
+        response[2] = UNI_NINA_CMD_END;
+
+        response_len = 3;
+    } else {
+        response[0] = UNI_NINA_CMD_START;
+        response[1] = (command[1] | UNI_NINA_CMD_REPLY_FLAG);
+
+        // Add extra byte to indicate end of command
+        response[response_len] = UNI_NINA_CMD_END;
+        response_len++;
+    }
+
+    return response_len;
+}
+
+void uni_nina_protocol_init(const uni_nina_protocol_callbacks_t* callbacks) {
+    _callbacks = *callbacks;
+
+    _gamepad_seats = 0;
+    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+        uni_snapshot_init(&_controllers_snapshot[i]);
+        memset(&_controllers[i], 0, sizeof(_controllers[0]));
+        _controllers[i].idx = UNI_NINA_CONTROLLER_INVALID;
+        memset(&_controllers_properties[i], 0, sizeof(_controllers_properties[0]));
+        _controllers_properties[i].idx = UNI_NINA_CONTROLLER_INVALID;
+    }
+
+    // No controllers yet. Set before the SPI side starts: it can't see them half-built.
+    for (size_t i = 0; i < ARRAY_SIZE(_controllers_frames); i++)
+        build_controllers_frame(&_controllers_frames[i]);
+    _controllers_frame_front = &_controllers_frames[0];
+    _controllers_frame_ready = (uintptr_t)&_controllers_frames[1];
+    _controllers_frame_back = &_controllers_frames[2];
+
+    _protocol_v2 = false;
+    _v2_seq = 0;
+    _v2_seats = 0;
+}
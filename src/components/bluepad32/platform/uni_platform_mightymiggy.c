@@ -538,7 +538,8 @@ typedef struct RuntimeControllerInfo_s {
     PadButton programmedButton;
 } RuntimeControllerInfo;
 
-_Static_assert(sizeof(RuntimeControllerInfo) < HID_DEVICE_MAX_PLATFORM_DATA, "RuntimeControllerInfo instance too big");
+_Static_assert(sizeof(RuntimeControllerInfo) <= HID_DEVICE_MAX_PLATFORM_DATA,
+               "RuntimeControllerInfo instance too big");
 
 enum {
     EVENT_ENABLE_CD32_SEAT_A = (1 << 0),
@@ -1127,7 +1128,7 @@ static void mapJoystickCustom(const RuntimeControllerInfo* cinfo, TwoButtonJoyst
 //! @{
 
 static RuntimeControllerInfo* getControllerInstance(uni_hid_device_t* d) {
-    return (RuntimeControllerInfo*)&d->platform_data[0];
+    return (RuntimeControllerInfo*)&d->cold->platform_data[0];
 }
 
 static void setSeat(uni_hid_device_t* d, uni_gamepad_seat_t seat) {
@@ -1971,7 +1972,7 @@ static void onPadModeChange(void* arg) {
 static uni_hid_device_t* getControllerForSeat(const uni_gamepad_seat_t seat) {
     uni_hid_device_t* ret = NULL;
 
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES && ret == NULL; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices() && ret == NULL; i++) {
         uni_hid_device_t* dev = uni_hid_device_get_instance_for_idx(i);
         if (dev && bd_addr_cmp(dev->conn.btaddr, zero_addr) != 0) {
             RuntimeControllerInfo* cinfo = getControllerInstance(dev);
@@ -2048,7 +2049,7 @@ static void loopCore0(void* arg) {
             /* Force the state machine to run even if no update was received,
              * since some transitions are time-driven
              */
-            for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+            for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
                 uni_hid_device_t* dev = uni_hid_device_get_instance_for_idx(i);
                 cinfo = getControllerInstance(dev);
                 if (cinfo->seat == GAMEPAD_SEAT_A || cinfo->seat == GAMEPAD_SEAT_B) {
@@ -2359,7 +2360,7 @@ static void mightymiggy_on_device_disconnected(uni_hid_device_t* d) {
 static bool seatInUse(uni_gamepad_seat_t seat) {
     bool inUse = false;
 
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES && !inUse; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices() && !inUse; i++) {
         uni_hid_device_t* dev = uni_hid_device_get_instance_for_idx(i);
         if (dev && bd_addr_cmp(dev->conn.btaddr, zero_addr) != 0) {
             RuntimeControllerInfo* cinfo = getControllerInstance(dev);
@@ -2512,7 +2513,7 @@ static void mightymiggy_on_oob_event(uni_platform_oob_event_t event, void* data)
 
     //~ // Swap joysticks iff one device is attached.
     //~ int num_devices = 0;
-    //~ for (int j = 0; j < CONFIG_BLUEPAD32_MAX_DEVICES; j++) {
+    //~ for (int j = 0; j < uni_hid_device_get_max_devices(); j++) {
     //~ uni_hid_device_t* tmp_d = uni_hid_device_get_instance_for_idx(j);
     //~ if ((bd_addr_cmp(tmp_d->conn.btaddr, zero_addr) != 0) &&
     //~ (get_mightymiggy_instance(tmp_d)->gamepad_seat > 0)) {
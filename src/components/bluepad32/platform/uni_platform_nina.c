@@ -32,6 +32,7 @@
 
 #include "bt/uni_bt.h"
 #include "controller/uni_controller.h"
+#include "platform/uni_nina_protocol.h"
 #include "platform/uni_platform.h"
 #include "uni_common.h"
 #include "uni_config.h"
@@ -66,95 +67,6 @@
 #define GPIO_READY GPIO_NUM_33
 #define DMA_CHANNEL 1
 
-enum {
-    NINA_CONTROLLER_INVALID = -1,
-};
-
-// Instead of using the uni_gamepad, we create one.
-// This is because this "struct" is sent via the wire and the format, padding,
-// etc. must not change.
-typedef struct __attribute__((packed)) {
-    // Usage Page: 0x01 (Generic Desktop Controls)
-    uint8_t dpad;
-    int32_t axis_x;
-    int32_t axis_y;
-    int32_t axis_rx;
-    int32_t axis_ry;
-
-    // Usage Page: 0x02 (Sim controls)
-    int32_t brake;
-    int32_t throttle;
-
-    // Usage Page: 0x09 (Button)
-    uint16_t buttons;
-
-    // Misc buttons (from 0x0c (Consumer) and others)
-    uint8_t misc_buttons;
-
-    // Gyro / Accel
-    int32_t gyro[3];
-    int32_t accel[3];
-} nina_gamepad_t;
-
-typedef struct __attribute__((packed)) {
-    int32_t delta_x;
-    int32_t delta_y;
-    uint8_t buttons;
-    uint8_t misc_buttons;
-    int8_t scroll_wheel;
-} nina_mouse_t;
-
-typedef struct __attribute__((packed)) {
-    uint16_t tr;      // Top right
-    uint16_t br;      // Bottom right
-    uint16_t tl;      // Top left
-    uint16_t bl;      // Bottom left
-    int temperature;  // Temperature
-} nina_balance_board_t;
-
-enum {
-    CONTROLLER_CLASS_NONE,
-    CONTROLLER_CLASS_GAMEPAD,
-    CONTROLLER_CLASS_MOUSE,
-    CONTROLLER_CLASS_KEYBOARD,
-    CONTROLLER_CLASS_BALANCE_BOARD,
-};
-
-typedef struct __attribute__((packed)) {
-    int8_t idx;
-    // Class of controller: gamepad, mouse, balance, etc.
-    uint8_t klass;
-    union {
-        nina_gamepad_t gamepad;
-        nina_mouse_t mouse;
-        nina_balance_board_t balance;
-    };
-    uint8_t battery;
-} nina_controller_t;
-
-enum {
-    PROPERTY_FLAG_RUMBLE = BIT(0),
-    PROPERTY_FLAG_PLAYER_LEDS = BIT(1),
-    PROPERTY_FLAG_PLAYER_LIGHTBAR = BIT(2),
-
-    PROPERTY_FLAG_BALANCE_BOARD = BIT(12),
-    PROPERTY_FLAG_GAMEPAD = BIT(13),
-    PROPERTY_FLAG_MOUSE = BIT(14),
-    PROPERTY_FLAG_KEYBOARD = BIT(15),
-};
-
-// This is sent via the wire. Adding new properties at the end Ok.
-// If so, update Protocol version.
-typedef struct __attribute__((packed)) {
-    uint8_t idx;          // Device index
-    uint8_t btaddr[6];    // BT Addr
-    uint8_t type;         // model: copy from nina_gamepad_t
-    uint8_t subtype;      // subtype. E.g: Wii Remote 2nd version
-    uint16_t vendor_id;   // VID
-    uint16_t product_id;  // PID
-    uint16_t flags;       // Features like Rumble, LEDs, etc.
-} nina_controller_properties_t;
-
 //
 // Globals
 //
@@ -170,21 +82,18 @@ static const char FIRMWARE_VERSION[] = "";
 // NINA device "instance"
 typedef struct nina_instance_s {
     // Gamepad index, from 0 to CONFIG_BLUEPAD32_MAX_DEVICES
-    // NINA_CONTROLLER_INVALID means gamepad was not assigned yet.
+    // UNI_NINA_CONTROLLER_INVALID means gamepad was not assigned yet.
     int8_t controller_idx;
 } nina_instance_t;
-_Static_assert(sizeof(nina_instance_t) < HID_DEVICE_MAX_PLATFORM_DATA, "NINA intance too big");
+_Static_assert(sizeof(nina_instance_t) <= HID_DEVICE_MAX_PLATFORM_DATA, "NINA intance too big");
 
 static SemaphoreHandle_t _ready_semaphore = NULL;
 static QueueHandle_t _pending_queue = NULL;
-static SemaphoreHandle_t controller_mutex = NULL;
-static nina_controller_t _controllers[CONFIG_BLUEPAD32_MAX_DEVICES];
-static nina_controller_properties_t _controllers_properties[CONFIG_BLUEPAD32_MAX_DEVICES];
-static volatile uni_gamepad_seat_t _gamepad_seats;
 
 static nina_instance_t* get_nina_instance(uni_hid_device_t* d);
 
 static uint8_t predicate_nina_index(uni_hid_device_t* d, void* data);
+static void process_pending_requests(void* context);
 
 //
 //
@@ -196,21 +105,19 @@ static uint8_t predicate_nina_index(uni_hid_device_t* d, void* data);
 // CPU0 will read from them and execute the commands.
 //
 //
-enum {
-    PENDING_REQUEST_CMD_NONE = 0,
-    PENDING_REQUEST_CMD_LIGHTBAR_COLOR = 1,
-    PENDING_REQUEST_CMD_PLAYER_LEDS = 2,
-    PENDING_REQUEST_CMD_RUMBLE = 3,
-    PENDING_REQUEST_CMD_DISCONNECT = 4,
-};
+#define MAX_PENDING_REQUESTS 16
 
-typedef struct {
-    uint8_t controller_idx;
-    uint8_t cmd;
-    uint8_t args[8];
-} pending_request_t;
+// Drains _pending_queue from the BTstack run loop. Registering it while it is already registered is a no-op.
+static btstack_context_callback_registration_t _pending_requests_registration = {
+    .callback = process_pending_requests,
+};
 
-#define MAX_PENDING_REQUESTS 16
+// Called from CPU1. The request is processed by CPU0 in its next run loop iteration.
+static void queue_pending_request(const uni_nina_request_t* request) {
+    if (xQueueSendToBack(_pending_queue, request, (TickType_t)0) != pdTRUE)
+        loge("NINA: pending queue is full, dropping request: %d\n", request->cmd);
+    btstack_run_loop_execute_on_main_thread(&_pending_requests_registration);
+}
 
 //
 //
@@ -225,7 +132,7 @@ typedef struct {
 // SPI / NINA-fw related
 //
 
-static int spi_transfer(uint8_t out[], uint8_t in[], size_t len) {
+static int spi_transfer(const uint8_t out[], uint8_t in[], size_t len) {
     spi_slave_transaction_t* slv_ret_trans;
 
     spi_slave_transaction_t slv_trans = {.length = len * 8, .trans_len = 0, .tx_buffer = out, .rx_buffer = in};
@@ -248,267 +155,6 @@ static int spi_transfer(uint8_t out[], uint8_t in[], size_t len) {
     return (slv_trans.trans_len / 8);
 }
 
-// Possible answers when the request doesn't need an answer, like in "set_xxx".
-enum {
-    RESPONSE_ERROR = 0,
-    RESPONSE_OK = 1,
-};
-
-// Command 0x00
-static int request_protocol_version(const uint8_t command[], uint8_t response[]) {
-#define PROTOCOL_VERSION_HI 0x01
-#define PROTOCOL_VERSION_LO 0x04
-
-    response[2] = 1;  // Number of parameters
-    response[3] = 2;  // Param len
-    response[4] = PROTOCOL_VERSION_HI;
-    response[5] = PROTOCOL_VERSION_LO;
-
-    return 6;
-}
-
-// Command 0x01
-static int request_gamepads_data(const uint8_t command[], uint8_t response[]) {
-    // Returned struct:
-    // --- generic to all requests
-    // byte 2: number of parameters (contains the number of gamepads)
-    //      3: param len (sizeof(_gamepads[0])
-    //      4: gamepad N data
-
-    xSemaphoreTake(controller_mutex, portMAX_DELAY);
-
-    int total_controllers = 0;
-    int offset = 3;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        if (_gamepad_seats & BIT(i)) {
-            total_controllers++;
-            // Update param len
-            // +1 is for the "idx" field
-            response[offset] = sizeof(_controllers[0].gamepad) + 1;
-            // Update param (data)
-            response[offset + 1] = _controllers[i].idx;
-            memcpy(&response[offset + 2], &_controllers[i].gamepad, sizeof(_controllers[0].gamepad));
-            // +1 for len
-            // +1 for idx
-            offset += sizeof(_controllers[0].gamepad) + 1 + 1;
-        }
-    }
-
-    response[2] = total_controllers;  // total params
-
-    xSemaphoreGive(controller_mutex);
-
-    // "offset" has the total length
-    return offset;
-}
-
-// Command 0x02
-static int request_set_gamepad_player_leds(const uint8_t command[], uint8_t response[]) {
-    // command[2]: total params
-    // command[3]: param len
-    int idx = command[4];
-    // command[5]: param len
-    // command[6]: leds
-
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
-        response[2] = 1;  // total params
-        response[3] = 1;  // param len
-        response[4] = RESPONSE_ERROR;
-
-        return 5;
-    }
-
-    pending_request_t request = (pending_request_t){
-        .controller_idx = idx,
-        .cmd = PENDING_REQUEST_CMD_PLAYER_LEDS,
-        .args[0] = command[6],
-    };
-    xQueueSendToBack(_pending_queue, &request, (TickType_t)0);
-
-    // TODO: We really don't know whether this request will succeed
-    response[2] = 1;  // Number of parameters
-    response[3] = 1;  // Lenghts of each parameter
-    response[4] = RESPONSE_OK;
-
-    return 5;
-}
-
-// Command 0x03
-static int request_set_gamepad_color_led(const uint8_t command[], uint8_t response[]) {
-    // command[2]: total params
-    // command[3]: param len
-    int idx = command[4];
-    // command[5]: param len
-    // command[6-8]: RGB
-
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
-        response[2] = 1;  // total params
-        response[3] = 1;  // param len
-        response[4] = RESPONSE_ERROR;
-
-        return 5;
-    }
-
-    pending_request_t request = (pending_request_t){
-        .controller_idx = idx,
-        .cmd = PENDING_REQUEST_CMD_LIGHTBAR_COLOR,
-        .args[0] = command[6],
-        .args[1] = command[7],
-        .args[2] = command[8],
-    };
-    xQueueSendToBack(_pending_queue, &request, (TickType_t)0);
-
-    // TODO: We really don't know whether this request will succeed
-    response[2] = 1;  // Number of parameters
-    response[3] = 1;  // Lenghts of each parameter
-    response[4] = RESPONSE_OK;
-
-    return 5;
-}
-
-// Command 0x04
-static int request_set_gamepad_rumble(const uint8_t command[], uint8_t response[]) {
-    // command[2]: total params
-    // command[3]: param len
-    int idx = command[4];
-    // command[5]: param len
-    // command[6,7]: force, duration
-
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
-        response[2] = 1;  // total params
-        response[3] = 1;  // param len
-        response[4] = RESPONSE_ERROR;
-
-        return 5;
-    }
-
-    pending_request_t request = (pending_request_t){
-        .controller_idx = idx,
-        .cmd = PENDING_REQUEST_CMD_RUMBLE,
-        .args[0] = command[6],
-        .args[1] = command[7],
-    };
-    xQueueSendToBack(_pending_queue, &request, (TickType_t)0);
-
-    // TODO: We really don't know whether this request will succeed
-    response[2] = 1;  // Number of parameters
-    response[3] = 1;  // Param len
-    response[4] = RESPONSE_OK;
-
-    return 5;
-}
-
-// Command 0x05
-static int request_forget_bluetooth_keys(const uint8_t command[], uint8_t response[]) {
-    response[2] = 1;  // Number of parameters
-    response[3] = 1;  // Param len
-    response[4] = RESPONSE_OK;
-
-    uni_bt_del_keys_safe();
-    return 5;
-}
-
-// Command 0x06
-static int request_get_gamepad_properties(const uint8_t command[], uint8_t response[]) {
-    // command[2]: total params
-    // command[3]: param len
-    int idx = command[4];
-
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
-        // To be consistent with the "OK" case, we return 2 parameters on "Error".
-        response[2] = 2;  // Number of parameters
-        response[3] = 1;  // Param len
-        response[4] = RESPONSE_ERROR;
-        response[5] = 1;  // Param len
-        response[6] = 0;  // Ignore
-        return 7;
-    };
-
-    response[2] = 2;                                   // Number of parameters
-    response[3] = 1;                                   // Param len
-    response[4] = RESPONSE_OK;                         // Ok
-    response[5] = sizeof(_controllers_properties[0]);  // Param len
-
-    xSemaphoreTake(controller_mutex, portMAX_DELAY);
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        if (_controllers_properties[i].idx == idx) {
-            memcpy(&response[6], &_controllers_properties[i], sizeof(_controllers_properties[0]));
-            break;
-        }
-    }
-    xSemaphoreGive(controller_mutex);
-
-    return 6 + sizeof(nina_controller_properties_t);
-}
-
-// Command 0x07
-static int request_enable_bluetooth_connections(const uint8_t command[], uint8_t response[]) {
-    bool enabled = command[4];
-    uni_bt_enable_new_connections_safe(enabled);
-
-    response[2] = 1;  // total params
-    response[3] = 1;  // param len
-    response[4] = RESPONSE_OK;
-
-    return 5;
-}
-
-// Command 0x08
-static int request_disconnect_gamepad(const uint8_t command[], uint8_t response[]) {
-    // command[2]: total params
-    // command[3]: param len
-    int idx = command[4];
-    uint8_t ret = RESPONSE_OK;
-
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
-        ret = RESPONSE_ERROR;
-        goto exit;
-    }
-
-    pending_request_t request = (pending_request_t){
-        .controller_idx = idx,
-        .cmd = PENDING_REQUEST_CMD_DISCONNECT,
-    };
-    xQueueSendToBack(_pending_queue, &request, (TickType_t)0);
-
-exit:
-    response[2] = 1;  // total params
-    response[3] = 1;  // param len
-    response[4] = ret;
-    return 5;
-}
-
-// Command 0x09
-static int request_controllers_data(const uint8_t command[], uint8_t response[]) {
-    // Returned struct:
-    // --- generic to all requests
-    // byte 2: number of parameters (contains the number of controllers)
-    //      3: param len (sizeof(_controllers[0])
-    //      4: gamepad N data
-
-    xSemaphoreTake(controller_mutex, portMAX_DELAY);
-
-    int total_controllers = 0;
-    int offset = 3;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        if (_gamepad_seats & BIT(i)) {
-            total_controllers++;
-            // Update param len
-            response[offset] = sizeof(_controllers[0]);
-            // Update param (data)
-            memcpy(&response[offset + 1], &_controllers[i], sizeof(_controllers[0]));
-            offset += sizeof(_controllers[0]) + 1;
-        }
-    }
-
-    response[2] = total_controllers;  // total params
-
-    xSemaphoreGive(controller_mutex);
-
-    // "offset" has the total length
-    return offset;
-}
-
 // Command 0x1a
 static int request_set_debug(const uint8_t command[], uint8_t response[]) {
     // Since v4.0, this feature is not supported anymore. Cannot enable/disable output in runtime
@@ -562,7 +208,7 @@ static int request_get_fw_version(const uint8_t command[], uint8_t response[]) {
 
 // Command 0x50
 static int request_set_pin_mode(const uint8_t command[], uint8_t response[]) {
-    uint8_t ret = RESPONSE_OK;
+    uint8_t ret = UNI_NINA_RESPONSE_OK;
     enum {
         INPUT = 0,
         OUTPUT = 1,
@@ -573,7 +219,7 @@ static int request_set_pin_mode(const uint8_t command[], uint8_t response[]) {
     // command[3]: param len, should be 1
     uint8_t pin = command[4];
     if (pin >= GPIO_NUM_MAX) {
-        ret = RESPONSE_ERROR;
+        ret = UNI_NINA_RESPONSE_ERROR;
         goto exit;
     }
 
@@ -608,12 +254,12 @@ exit:
 
 // Command 0x51
 static int request_digital_write(const uint8_t command[], uint8_t response[]) {
-    uint8_t ret = RESPONSE_OK;
+    uint8_t ret = UNI_NINA_RESPONSE_OK;
     // command[2]: total params, should be 2
     // command[3]: param len, should be 1
     uint8_t pin = command[4];
     if (pin >= GPIO_NUM_MAX) {
-        ret = RESPONSE_ERROR;
+        ret = UNI_NINA_RESPONSE_ERROR;
         goto exit;
     }
 
@@ -631,12 +277,12 @@ exit:
 
 // Command 0x52
 static int request_analog_write(const uint8_t command[], uint8_t response[]) {
-    uint8_t ret = RESPONSE_OK;
+    uint8_t ret = UNI_NINA_RESPONSE_OK;
     // command[2]: total params, should be 2
     // command[3]: param len, should be 1
     uint8_t pin = command[4];
     if (pin >= GPIO_NUM_MAX) {
-        ret = RESPONSE_ERROR;
+        ret = UNI_NINA_RESPONSE_ERROR;
         goto exit;
     }
     // command[5]: param len, should be 1
@@ -680,30 +326,8 @@ static int request_analog_read(const uint8_t command[], uint8_t response[]) {
     return 6;
 }
 
-typedef int (*command_handler_t)(const uint8_t command[], uint8_t response[] /* out */);
-
-const command_handler_t command_handlers[] = {
-    // 0x00 -> 0x0f: Bluepad32 own extensions
-    // These 16 entries are NULL in NINA. Perhaps they are reserved for future
-    // use? Seems to be safe to use them for Bluepad32 commands.
-    request_protocol_version,
-    request_gamepads_data,                 // data
-    request_set_gamepad_player_leds,       // the 4 LEDs that is available in many gamepads.
-    request_set_gamepad_color_led,         // available on DS4, DualSense
-    request_set_gamepad_rumble,            // available on DS4, Xbox, Switch, etc.
-    request_forget_bluetooth_keys,         // forget stored Bluetooth keys
-    request_get_gamepad_properties,        // get gamepad properties like BTAddr, VID/PID, etc.
-    request_enable_bluetooth_connections,  // Enable/Disable bluetooth connection
-    request_disconnect_gamepad,            // Disconnect gamepad
-    request_controllers_data,              // Gamepad, Mouse, Balance. Deprecates request_gamepads_data
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-    NULL,
-
-    // 0x10 -> 0x1f
+// Commands 0x10 and above. 0x00 -> 0x0f are the Bluepad32 ones, in uni_nina_protocol.c.
+static const uni_nina_command_handler_t nina_fw_handlers[] = {
     NULL,  // setNet
     NULL,  // setPassPhrase,
     NULL,  // setKey,
@@ -811,58 +435,12 @@ const command_handler_t command_handlers[] = {
     NULL,
     NULL,
 };
-#define COMMAND_HANDLERS_MAX (sizeof(command_handlers) / sizeof(command_handlers[0]))
-
-static int process_request(const uint8_t command[], int command_len, uint8_t response[] /* out */) {
-    // NINA-fw commands. Taken from:
-    // https://github.com/arduino-libraries/WiFiNINA/blob/master/src/utility/wifi_spi.h
-    // https://github.com/adafruit/Adafruit_CircuitPython_ESP32SPI/blob/master/adafruit_esp32spi/adafruit_esp32spi.py
-    enum {
-        CMD_START = 0xe0,
-        CMD_END = 0xee,
-        CMD_ERR = 0xef,
-        CMD_REPLY_FLAG = BIT(7),
-    };
-
-    int response_len = 0;
-    /* Cmd Struct Message, from:
-    https://github.com/arduino-libraries/WiFiNINA/blob/master/src/utility/spi_drv.cpp
-     ________________________________________________________________________
-    | START CMD | C/R  | CMD  | N.PARAM | PARAM LEN | PARAM  | .. | END CMD |
-    |___________|______|______|_________|___________|________|____|_________|
-    |   8 bit   | 1bit | 7bit |  8bit   |   8bit    | nbytes | .. |   8bit  |
-    |___________|______|______|_________|___________|________|____|_________|
-    */
-
-    if (command_len >= 2 && command[0] == CMD_START && command[1] < COMMAND_HANDLERS_MAX) {
-        command_handler_t command_handler = command_handlers[command[1]];
-
-        if (command_handler) {
-            // To make the code "compatible", we pass "command" to all the request
-            // handlers. On an ideal world, we should pass &command[2] instead.
-            response_len = command_handler(command, response);
-        }
-    }
-
-    if (response_len <= 0) {
-        loge("NINA: Error in request:\n");
-        printf_hexdump(command, command_len);
-        // Response for invalid requests
-        response[0] = CMD_ERR;
-        response[1] = 0x00;
-        response[2] = CMD_END;
-
-        response_len = 3;
-    } else {
-        response[0] = CMD_START;
-        response[1] = (command[1] | CMD_REPLY_FLAG);
-
-        // Add extra byte to indicate end of command
-        response[response_len] = CMD_END;
-        response_len++;
-    }
 
-    return response_len;
+static int process_nina_fw_request(const uint8_t command[], uint8_t response[]) {
+    int idx = command[1] - UNI_NINA_CMD_BLUEPAD32_MAX;
+    if (idx < 0 || idx >= (int)ARRAY_SIZE(nina_fw_handlers) || nina_fw_handlers[idx] == NULL)
+        return 0;
+    return nina_fw_handlers[idx](command, response);
 }
 
 // Called after a transaction is queued and ready for pickup by master.
@@ -917,21 +495,27 @@ static void spi_main_loop(void* arg) {
     esp_err_t ret = spi_slave_initialize(VSPI_HOST, &buscfg, &slvcfg, DMA_CHANNEL);
     assert(ret == ESP_OK);
 
-    // Must be modulo 4 and word aligned.
-    // A higher value up to SPI_MAX_DMA_LEN can be defined if needed.
-#define SPI_BUFFER_LEN 256
-    WORD_ALIGNED_ATTR uint8_t response_buf[SPI_BUFFER_LEN];
-    WORD_ALIGNED_ATTR uint8_t command_buf[SPI_BUFFER_LEN];
+    WORD_ALIGNED_ATTR uint8_t response_buf[UNI_NINA_PROTOCOL_BUFFER_LEN];
+    WORD_ALIGNED_ATTR uint8_t command_buf[UNI_NINA_PROTOCOL_BUFFER_LEN];
 
     while (1) {
-        memset(command_buf, 0, SPI_BUFFER_LEN);
-        int command_len = spi_transfer(NULL, command_buf, SPI_BUFFER_LEN);
+        memset(command_buf, 0, UNI_NINA_PROTOCOL_BUFFER_LEN);
+        int command_len = spi_transfer(NULL, command_buf, UNI_NINA_PROTOCOL_BUFFER_LEN);
         if (command_len == 0)
             continue;
 
+        if (command_len >= 2 && command_buf[0] == UNI_NINA_CMD_START &&
+            command_buf[1] == UNI_NINA_CMD_CONTROLLERS_DATA) {
+            // Polled at high rates: the prebuilt frame is handed to the DMA as is.
+            int frame_len;
+            const uint8_t* frame = uni_nina_protocol_get_controllers_frame(&frame_len);
+            spi_transfer(frame, NULL, frame_len);
+            continue;
+        }
+
         // process request
-        memset(response_buf, 0, SPI_BUFFER_LEN);
-        int response_len = process_request(command_buf, command_len, response_buf);
+        memset(response_buf, 0, UNI_NINA_PROTOCOL_BUFFER_LEN);
+        int response_len = uni_nina_protocol_process_request(command_buf, command_len, response_buf);
 
         spi_transfer(response_buf, NULL, response_len);
     }
@@ -945,34 +529,36 @@ static void spi_main_loop(void* arg) {
 // Be extra careful when calling code that runs on the other CPU
 //
 
-static void process_pending_requests(void) {
-    pending_request_t request;
+static void process_pending_requests(void* context) {
+    uni_nina_request_t request;
+    ARG_UNUSED(context);
 
     while (xQueueReceive(_pending_queue, &request, (TickType_t)0) == pdTRUE) {
         int idx = request.controller_idx;
         uni_hid_device_t* d = uni_hid_device_get_instance_with_predicate(predicate_nina_index, (void*)idx);
         if (d == NULL) {
+            // Don't stop: the rest of the requests might be for other devices.
             loge("NINA: device cannot be found while processing pending request\n");
-            return;
+            continue;
         }
         switch (request.cmd) {
-            case PENDING_REQUEST_CMD_LIGHTBAR_COLOR:
+            case UNI_NINA_REQUEST_CMD_LIGHTBAR_COLOR:
                 if (d->report_parser.set_lightbar_color != NULL)
                     d->report_parser.set_lightbar_color(d, request.args[0], request.args[1], request.args[2]);
                 break;
-            case PENDING_REQUEST_CMD_PLAYER_LEDS:
+            case UNI_NINA_REQUEST_CMD_PLAYER_LEDS:
                 if (d->report_parser.set_player_leds != NULL)
                     d->report_parser.set_player_leds(d, request.args[0]);
                 break;
 
-            case PENDING_REQUEST_CMD_RUMBLE:
+            case UNI_NINA_REQUEST_CMD_RUMBLE:
                 if (d->report_parser.play_dual_rumble != NULL)
                     d->report_parser.play_dual_rumble(d, 0 /* delayed start ms */, request.args[1] * 4 /* duration */,
                                                       request.args[0] /* weak magnitude */,
                                                       request.args[0] /* strong magnitude */);
                 break;
 
-            case PENDING_REQUEST_CMD_DISCONNECT:
+            case UNI_NINA_REQUEST_CMD_DISCONNECT:
                 // Don't call "uni_hid_device_disconnect" since it will
                 // disconnect the "d" immediately and functions in the
                 // stack trace might depend on it.
@@ -1014,10 +600,16 @@ static void nina_on_init_complete(void) {
     PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[1], PIN_FUNC_GPIO);
     PIN_FUNC_SELECT(GPIO_PIN_MUX_REG[3], PIN_FUNC_GPIO);
 
-    controller_mutex = xSemaphoreCreateMutex();
-    assert(controller_mutex != NULL);
+    // Before the SPI task starts.
+    uni_nina_protocol_callbacks_t callbacks = {
+        .queue_request = queue_pending_request,
+        .forget_bluetooth_keys = uni_bt_del_keys_safe,
+        .enable_bluetooth_connections = uni_bt_enable_new_connections_safe,
+        .process_nina_fw_request = process_nina_fw_request,
+    };
+    uni_nina_protocol_init(&callbacks);
 
-    _pending_queue = xQueueCreate(MAX_PENDING_REQUESTS, sizeof(pending_request_t));
+    _pending_queue = xQueueCreate(MAX_PENDING_REQUESTS, sizeof(uni_nina_request_t));
     assert(_pending_queue != NULL);
 
     // Create SPI main loop thread.
@@ -1030,86 +622,32 @@ static void nina_on_init_complete(void) {
 static void nina_on_device_connected(uni_hid_device_t* d) {
     nina_instance_t* ins = get_nina_instance(d);
     memset(ins, 0, sizeof(*ins));
-    ins->controller_idx = NINA_CONTROLLER_INVALID;
+    ins->controller_idx = UNI_NINA_CONTROLLER_INVALID;
 }
 
 static void nina_on_device_disconnected(uni_hid_device_t* d) {
     nina_instance_t* ins = get_nina_instance(d);
     // Only process it if the controller has been assigned before
-    if (ins->controller_idx != NINA_CONTROLLER_INVALID) {
-        if (ins->controller_idx < 0 || ins->controller_idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
-            loge("NINA: unexpected controller idx, got: %d, want: [0-%d]\n", ins->controller_idx,
-                 CONFIG_BLUEPAD32_MAX_DEVICES);
-            return;
-        }
-        _gamepad_seats &= ~BIT(ins->controller_idx);
-
-        memset(&_controllers[ins->controller_idx], 0, sizeof(_controllers[0]));
-        _controllers[ins->controller_idx].idx = NINA_CONTROLLER_INVALID;
-
-        memset(&_controllers_properties[ins->controller_idx], 0, sizeof(_controllers_properties[0]));
-        _controllers_properties[ins->controller_idx].idx = NINA_CONTROLLER_INVALID;
-
-        ins->controller_idx = NINA_CONTROLLER_INVALID;
+    if (ins->controller_idx != UNI_NINA_CONTROLLER_INVALID) {
+        uni_nina_protocol_remove_controller(ins->controller_idx);
+        ins->controller_idx = UNI_NINA_CONTROLLER_INVALID;
     }
 }
 
 static uni_error_t nina_on_device_ready(uni_hid_device_t* d) {
-    if (_gamepad_seats == (GAMEPAD_SEAT_A | GAMEPAD_SEAT_B | GAMEPAD_SEAT_C | GAMEPAD_SEAT_D)) {
-        // No more available seats, reject connection
-        logi("NINA: More available seats\n");
-        return UNI_ERROR_NO_SLOTS;
-    }
-
     nina_instance_t* ins = get_nina_instance(d);
-    if (ins->controller_idx != NINA_CONTROLLER_INVALID) {
+    if (ins->controller_idx != UNI_NINA_CONTROLLER_INVALID) {
         loge("NINA: unexpected value for on_device_ready; got: %d, want: -1\n", ins->controller_idx);
         return UNI_ERROR_INVALID_CONTROLLER;
     }
 
-    // Find first available gamepad
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        if ((_gamepad_seats & BIT(i)) == 0) {
-            ins->controller_idx = i;
-            _gamepad_seats |= BIT(i);
-            break;
-        }
-    }
-
-    if (ins->controller_idx == NINA_CONTROLLER_INVALID) {
-        loge("NINA: could not found valid seat for gamepad\n");
+    int idx = uni_nina_protocol_add_controller(d);
+    if (idx == UNI_NINA_CONTROLLER_INVALID) {
+        // No more available seats, reject connection
+        logi("NINA: No more available seats\n");
         return UNI_ERROR_NO_SLOTS;
     }
-
-    // This is how "client" knows which gamepad emitted the events.
-    int idx = ins->controller_idx;
-    _controllers[idx].idx = idx;
-
-    // FIXME: To save RAM gamepad_properties should be updated at "request time".
-    // It requires to add a mutex in uni_hid_device, and that has its own issues.
-    // As a quick hack, it is easier to copy them now.
-    _controllers_properties[idx].idx = idx;
-    _controllers_properties[idx].type = d->controller_type;
-    _controllers_properties[idx].subtype = d->controller_subtype;
-    _controllers_properties[idx].vendor_id = d->vendor_id;
-    _controllers_properties[idx].product_id = d->product_id;
-    _controllers_properties[idx].flags = (d->report_parser.set_player_leds ? PROPERTY_FLAG_PLAYER_LEDS : 0) |
-                                         (d->report_parser.play_dual_rumble ? PROPERTY_FLAG_RUMBLE : 0) |
-                                         (d->report_parser.set_lightbar_color ? PROPERTY_FLAG_PLAYER_LIGHTBAR : 0);
-
-    // TODO: Most probably a device cannot be a mouse a keyboard and a gamepad at the same time,
-    // and 2 bits should be more than enough.
-    // But for simplicity, let's use one bit for each category.
-    if (uni_hid_device_is_mouse(d))
-        _controllers_properties[idx].flags |= PROPERTY_FLAG_MOUSE;
-
-    if (uni_hid_device_is_keyboard(d))
-        _controllers_properties[idx].flags |= PROPERTY_FLAG_KEYBOARD;
-
-    if (uni_hid_device_is_gamepad(d))
-        _controllers_properties[idx].flags |= PROPERTY_FLAG_GAMEPAD;
-
-    memcpy(_controllers_properties[idx].btaddr, d->conn.btaddr, sizeof(_controllers_properties[0].btaddr));
+    ins->controller_idx = idx;
 
     if (d->report_parser.set_player_leds != NULL) {
         d->report_parser.set_player_leds(d, BIT(idx));
@@ -1125,55 +663,14 @@ static uint8_t predicate_nina_index(uni_hid_device_t* d, void* data) {
     return 1;
 }
 
-static void nina_on_controller_data(uni_hid_device_t* d, uni_controller_t* ctl) {
-    // FIXME:
-    // When SPI-slave (CPU1) receives a request that cannot be fulfilled
-    // immediately (e.g: the ones that needs to run on CPU0), it is processed from
-    // this callback. This works because a "gamepad_data" event is generated
-    // almost immediately after the SPI-slave request was made. Although unlikely,
-    // it could happen that "gamepad_data" gets called after a delay.
-    process_pending_requests();
-
-    nina_instance_t* ins = get_nina_instance(d);
-    if (ins->controller_idx < 0 || ins->controller_idx >= CONFIG_BLUEPAD32_MAX_DEVICES) {
-        loge("NINA: unexpected controller idx, got: %d, want: [0-%d]\n", ins->controller_idx,
-             CONFIG_BLUEPAD32_MAX_DEVICES);
+static void nina_on_controller_data_changed(uni_hid_device_t* d, uni_controller_t* ctl, uint32_t changes) {
+    // Pending requests are processed from the run loop, not here. Nothing to do if the data is the same:
+    // the controllers frame and the v2 changes would be rebuilt with the same content.
+    if (changes == 0)
         return;
-    }
 
-    // Populate gamepad data on shared struct.
-    xSemaphoreTake(controller_mutex, portMAX_DELAY);
-    switch (ctl->klass) {
-        case UNI_CONTROLLER_CLASS_GAMEPAD:
-            _controllers[ins->controller_idx].gamepad.dpad = ctl->gamepad.dpad;
-            _controllers[ins->controller_idx].gamepad.axis_x = ctl->gamepad.axis_x;
-            _controllers[ins->controller_idx].gamepad.axis_y = ctl->gamepad.axis_y;
-            _controllers[ins->controller_idx].gamepad.axis_rx = ctl->gamepad.axis_rx;
-            _controllers[ins->controller_idx].gamepad.axis_ry = ctl->gamepad.axis_ry;
-            _controllers[ins->controller_idx].gamepad.brake = ctl->gamepad.brake;
-            _controllers[ins->controller_idx].gamepad.throttle = ctl->gamepad.throttle;
-            _controllers[ins->controller_idx].gamepad.buttons = ctl->gamepad.buttons;
-            _controllers[ins->controller_idx].gamepad.misc_buttons = ctl->gamepad.misc_buttons;
-            memcpy(_controllers[ins->controller_idx].gamepad.gyro, ctl->gamepad.gyro, sizeof(ctl->gamepad.gyro));
-            memcpy(_controllers[ins->controller_idx].gamepad.accel, ctl->gamepad.accel, sizeof(ctl->gamepad.accel));
-            break;
-        case UNI_CONTROLLER_CLASS_MOUSE:
-            _controllers[ins->controller_idx].mouse.delta_x = ctl->mouse.delta_x;
-            _controllers[ins->controller_idx].mouse.delta_y = ctl->mouse.delta_y;
-            _controllers[ins->controller_idx].mouse.buttons = ctl->mouse.buttons;
-            _controllers[ins->controller_idx].mouse.misc_buttons = ctl->mouse.misc_buttons;
-            _controllers[ins->controller_idx].mouse.scroll_wheel = ctl->mouse.scroll_wheel;
-            break;
-        case UNI_CONTROLLER_CLASS_BALANCE_BOARD:
-            break;
-        default:
-            break;
-    }
-
-    _controllers[ins->controller_idx].klass = ctl->klass;
-    _controllers[ins->controller_idx].battery = ctl->battery;
-
-    xSemaphoreGive(controller_mutex);
+    nina_instance_t* ins = get_nina_instance(d);
+    uni_nina_protocol_set_controller_data(ins->controller_idx, ctl);
 }
 
 static void nina_on_oob_event(uni_platform_oob_event_t event, void* data) {
@@ -1191,7 +688,7 @@ static const uni_property_t* nina_get_property(uni_property_idx_t idx) {
 // Helpers
 //
 static nina_instance_t* get_nina_instance(uni_hid_device_t* d) {
-    return (nina_instance_t*)&d->platform_data[0];
+    return (nina_instance_t*)&d->cold->platform_data[0];
 }
 
 //
@@ -1206,7 +703,7 @@ struct uni_platform* uni_platform_nina_create(void) {
         .on_device_disconnected = nina_on_device_disconnected,
         .on_device_ready = nina_on_device_ready,
         .on_oob_event = nina_on_oob_event,
-        .on_controller_data = nina_on_controller_data,
+        .on_controller_data_changed = nina_on_controller_data_changed,
         .get_property = nina_get_property,
     };
 
@@ -1223,7 +720,7 @@ struct uni_platform* uni_platform_airlift_create(void) {
         .on_device_disconnected = nina_on_device_disconnected,
         .on_device_ready = nina_on_device_ready,
         .on_oob_event = nina_on_oob_event,
-        .on_controller_data = nina_on_controller_data,
+        .on_controller_data_changed = nina_on_controller_data_changed,
         .get_property = nina_get_property,
     };
 
@@ -435,7 +435,7 @@ static void unijoysticle_on_device_disconnected(uni_hid_device_t* d) {
 
     // Only count "physical" devices
     connected = 0;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         tmp_d = uni_hid_device_get_instance_for_idx(i);
         if (uni_bt_conn_is_connected(&tmp_d->conn) && !uni_hid_device_is_virtual_device(tmp_d))
             connected++;
@@ -474,7 +474,7 @@ static uni_error_t unijoysticle_on_device_ready(uni_hid_device_t* d) {
     // Allow new connections when a physical + virtual is present.
     // The virtual one will get disconnected.
     uint32_t used_joystick_ports = 0;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         tmp_d = uni_hid_device_get_instance_for_idx(i);
         if (tmp_d != d && uni_hid_device_is_virtual_device(tmp_d)) {
             // Only one virtual device can be present, so it won't be overridden.
@@ -518,7 +518,7 @@ static uni_error_t unijoysticle_on_device_ready(uni_hid_device_t* d) {
     set_gamepad_seat(d, wanted_seat);
 
     connected = 0;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         uni_hid_device_t* tmp_d = uni_hid_device_get_instance_for_idx(i);
         if (uni_bt_conn_is_connected(&tmp_d->conn) && !uni_hid_device_is_virtual_device(tmp_d))
             connected++;
@@ -1160,7 +1160,7 @@ static void set_gamepad_seat(uni_hid_device_t* d, uni_gamepad_seat_t seat) {
 
     // Fetch all enabled ports
     uni_gamepad_seat_t all_seats = GAMEPAD_SEAT_NONE;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         uni_hid_device_t* tmp_d = uni_hid_device_get_instance_for_idx(i);
         if (tmp_d == NULL)
             continue;
@@ -1405,7 +1405,7 @@ static void get_gamepad_mode(uni_hid_device_t* d) {
     int num_devices = 0;
 
     if (d == NULL) {
-        for (int j = 0; j < CONFIG_BLUEPAD32_MAX_DEVICES; j++) {
+        for (int j = 0; j < uni_hid_device_get_max_devices(); j++) {
             uni_hid_device_t* tmp_d = uni_hid_device_get_instance_for_idx(j);
             if (uni_bt_conn_is_connected(&tmp_d->conn)) {
                 num_devices++;
@@ -1447,7 +1447,7 @@ static void set_next_gamepad_mode(uni_hid_device_t* d) {
     uni_platform_unijoysticle_instance_t* ins;
 
     if (d == NULL) {
-        for (int j = 0; j < CONFIG_BLUEPAD32_MAX_DEVICES; j++) {
+        for (int j = 0; j < uni_hid_device_get_max_devices(); j++) {
             uni_hid_device_t* tmp_d = uni_hid_device_get_instance_for_idx(j);
             if (uni_bt_conn_is_connected(&tmp_d->conn)) {
                 if (uni_hid_device_is_gamepad(tmp_d)) {
@@ -1492,7 +1492,7 @@ static void set_next_gamepad_mode(uni_hid_device_t* d) {
 
 static void set_gamepad_mode(uni_hid_device_t* d, uni_platform_unijoysticle_gamepad_mode_t mode) {
     int num_devices = 0;
-    for (int j = 0; j < CONFIG_BLUEPAD32_MAX_DEVICES; j++) {
+    for (int j = 0; j < uni_hid_device_get_max_devices(); j++) {
         uni_hid_device_t* tmp_d = uni_hid_device_get_instance_for_idx(j);
         if (uni_bt_conn_is_connected(&tmp_d->conn) && !uni_hid_device_is_virtual_device(tmp_d)) {
             num_devices++;
@@ -1611,7 +1611,7 @@ static void swap_ports(void) {
     uni_platform_unijoysticle_instance_t* ins;
     uni_gamepad_seat_t prev_seat, new_seat;
 
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         d = uni_hid_device_get_instance_for_idx(i);
         if (uni_bt_conn_is_connected(&d->conn)) {
             ins = uni_platform_unijoysticle_get_instance(d);
@@ -1664,7 +1664,7 @@ static void try_swap_ports(uni_hid_device_t* d) {
     }
 
     // Find the possible 2nd connected device
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         uni_hid_device_t* tmp_d = uni_hid_device_get_instance_for_idx(i);
         if (tmp_d != d &&                              // Not current device
             uni_bt_conn_is_connected(&tmp_d->conn) &&  // Is it connected ?
@@ -1740,7 +1740,7 @@ static void maybe_enable_mouse_timers(void) {
     bool enable_timer_0 = false;
     bool enable_timer_1 = false;
 
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         uni_hid_device_t* d = uni_hid_device_get_instance_for_idx(i);
         if (uni_bt_conn_is_connected(&d->conn)) {
             uni_platform_unijoysticle_instance_t* ins = uni_platform_unijoysticle_get_instance(d);
@@ -1839,5 +1839,5 @@ struct uni_platform* uni_platform_unijoysticle_create(void) {
 }
 
 uni_platform_unijoysticle_instance_t* uni_platform_unijoysticle_get_instance(const uni_hid_device_t* d) {
-    return (uni_platform_unijoysticle_instance_t*)&d->platform_data[0];
+    return (uni_platform_unijoysticle_instance_t*)&d->cold->platform_data[0];
 }
@@ -116,7 +116,7 @@ static void enable_rumble_callback(void* context) {
     int seat = (int)context;
     uni_hid_device_t* d;
 
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < uni_hid_device_get_max_devices(); i++) {
         d = uni_hid_device_get_instance_for_idx(i);
         if (!uni_bt_conn_is_connected(&d->conn))
             continue;
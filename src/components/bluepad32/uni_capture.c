@@ -0,0 +1,466 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "uni_capture.h"
+
+#ifdef CONFIG_BLUEPAD32_CAPTURE
+
+#include <stdio.h>
+#include <string.h>
+
+#include <btstack.h>
+
+#include "sdkconfig.h"
+#include "uni_hid_device.h"
+#include "uni_log.h"
+#include "uni_system.h"
+#include "uni_utils.h"
+
+_Static_assert(UNI_CAPTURE_MAX_PAYLOAD_LEN <= UINT16_MAX, "Payload length is 16-bit");
+
+static const char file_magic[] = "BP32CAP";
+
+// Records processed in each run-loop iteration, when replaying as fast as possible.
+#define REPLAY_BATCH_SIZE 64
+
+//
+// Capture
+//
+
+static struct {
+    uni_capture_write_fn_t write_fn;
+    void* context;
+    // Only if the capture was started with uni_capture_start_file().
+    FILE* file;
+    uint64_t last_record_us;
+} g_capture;
+
+//
+// Replay
+//
+static struct {
+    FILE* file;
+    bool fast;
+    void (*on_done)(void);
+    btstack_timer_source_t timer;
+
+    // Record read from the file, but not processed yet.
+    bool has_record;
+    uint8_t header[UNI_CAPTURE_RECORD_HEADER_SIZE];
+    uint8_t payload[UNI_CAPTURE_MAX_PAYLOAD_LEN];
+    // Time of the pending record, relative to the first record.
+    uint64_t record_time_us;
+    bool first_record;
+    uint64_t start_us;
+
+    // Indexed by the device index of the capture.
+    uni_hid_device_t* devices[UNI_HID_DEVICE_POOL_MAX_DEVICES];
+
+    // Stats
+    uint32_t input_reports;
+    uint32_t feature_reports;
+    uint32_t num_devices;
+} g_replay;
+
+static void write_record(uint8_t type, uint8_t idx, const uint8_t* payload, uint16_t len) {
+    uint8_t header[UNI_CAPTURE_RECORD_HEADER_SIZE];
+    uint64_t now = uni_system_get_time_us();
+    uint64_t delta = now - g_capture.last_record_us;
+
+    g_capture.last_record_us = now;
+
+    header[0] = type;
+    header[1] = idx;
+    little_endian_store_16(header, 2, len);
+    little_endian_store_32(header, 4, delta > UINT32_MAX ? UINT32_MAX : (uint32_t)delta);
+
+    g_capture.write_fn(header, sizeof(header), g_capture.context);
+    if (len > 0)
+        g_capture.write_fn(payload, len, g_capture.context);
+}
+
+// Writes the DEVICE record if it is the first time the device is seen, or if it changed.
+static void announce_device(uni_hid_device_t* d, int idx) {
+    uni_capture_device_t* cd = &d->cold->capture;
+    uint16_t hid_descriptor_len;
+    // Computed by the store when the descriptor was added: it is not hashed again for each report.
+    uint32_t hid_descriptor_crc = uni_hid_descriptor_store_get_crc(d->hid_descriptor);
+
+    if (cd->announced && cd->vendor_id == d->vendor_id && cd->product_id == d->product_id &&
+        cd->controller_type == d->controller_type && cd->hid_descriptor_crc == hid_descriptor_crc)
+        return;
+
+    cd->announced = true;
+    cd->vendor_id = d->vendor_id;
+    cd->product_id = d->product_id;
+    cd->controller_type = d->controller_type;
+    cd->hid_descriptor_crc = hid_descriptor_crc;
+
+    const uint8_t* hid_descriptor = uni_hid_device_get_hid_descriptor(d, &hid_descriptor_len);
+    // Static since it is too big for the stack.
+    static uint8_t payload[UNI_CAPTURE_MAX_PAYLOAD_LEN];
+    little_endian_store_16(payload, 0, d->vendor_id);
+    little_endian_store_16(payload, 2, d->product_id);
+    little_endian_store_16(payload, 4, d->controller_type);
+    payload[6] = 0;
+    if (uni_bt_conn_get_state(&d->conn) == UNI_BT_CONN_STATE_DEVICE_READY)
+        payload[6] |= UNI_CAPTURE_DEVICE_FLAG_READY;
+    payload[7] = 0;
+    if (hid_descriptor_len > 0)
+        memcpy(&payload[UNI_CAPTURE_DEVICE_PAYLOAD_SIZE], hid_descriptor, hid_descriptor_len);
+    write_record(UNI_CAPTURE_RECORD_DEVICE, idx, payload, UNI_CAPTURE_DEVICE_PAYLOAD_SIZE + hid_descriptor_len);
+}
+
+static void capture_report(uint8_t type, uni_hid_device_t* d, const uint8_t* report, uint16_t len) {
+    if (g_capture.write_fn == NULL)
+        return;
+
+    int idx = uni_hid_device_get_idx_for_instance(d);
+    if (idx < 0)
+        return;
+
+    if (len > UNI_CAPTURE_MAX_PAYLOAD_LEN) {
+        loge("Capture: report too big (%d), skipping it\n", len);
+        return;
+    }
+
+    announce_device(d, idx);
+    write_record(type, idx, report, len);
+}
+
+void uni_capture_on_input_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t len) {
+    capture_report(UNI_CAPTURE_RECORD_INPUT_REPORT, d, report, len);
+}
+
+void uni_capture_on_feature_report(struct uni_hid_device_s* d, const uint8_t* report, uint16_t len) {
+    capture_report(UNI_CAPTURE_RECORD_FEATURE_REPORT, d, report, len);
+}
+
+void uni_capture_start(uni_capture_write_fn_t write_fn, void* context) {
+    uint8_t header[UNI_CAPTURE_FILE_HEADER_SIZE];
+    int max_devices = uni_hid_device_get_max_devices();
+
+    uni_capture_stop();
+
+    g_capture.write_fn = write_fn;
+    g_capture.context = context;
+    g_capture.last_record_us = uni_system_get_time_us();
+    // Devices get announced again in the new capture.
+    for (int i = 0; i < max_devices; i++)
+        uni_hid_device_get_instance_for_idx(i)->cold->capture.announced = false;
+
+    memcpy(header, file_magic, sizeof(header) - 1);
+    header[sizeof(header) - 1] = UNI_CAPTURE_VERSION;
+    write_fn(header, sizeof(header), context);
+}
+
+static void file_write(const uint8_t* data, uint16_t len, void* context) {
+    FILE* f = context;
+    if (fwrite(data, 1, len, f) != len)
+        loge("Capture: failed to write to file\n");
+}
+
+bool uni_capture_start_file(const char* path) {
+    FILE* f = fopen(path, "wb");
+    if (f == NULL) {
+        loge("Capture: failed to create %s\n", path);
+        return false;
+    }
+    uni_capture_start(file_write, f);
+    g_capture.file = f;
+    logi("Capture: writing reports to %s\n", path);
+    return true;
+}
+
+void uni_capture_stop(void) {
+    if (g_capture.file != NULL)
+        fclose(g_capture.file);
+    g_capture.file = NULL;
+    g_capture.write_fn = NULL;
+    g_capture.context = NULL;
+}
+
+bool uni_capture_is_active(void) {
+    return g_capture.write_fn != NULL;
+}
+
+//
+// Replay
+//
+
+// Replay devices are not Bluetooth devices. This address is only used to identify them.
+static void replay_get_address(uint8_t idx, bd_addr_t addr) {
+    static const bd_addr_t base = {0x00, 0x00, 0x00, 0x00, 0xca, 0x00};
+    bd_addr_copy(addr, base);
+    addr[5] = idx;
+}
+
+// Returns NULL if the device was deleted. E.g: rejected by the platform.
+static uni_hid_device_t* replay_get_device(uint8_t idx) {
+    bd_addr_t addr;
+    uni_hid_device_t* d = g_replay.devices[idx];
+
+    if (d == NULL)
+        return NULL;
+    replay_get_address(idx, addr);
+    if (bd_addr_cmp(d->conn.btaddr, addr) != 0 || uni_hid_device_is_virtual_device(d)) {
+        g_replay.devices[idx] = NULL;
+        return NULL;
+    }
+    return d;
+}
+
+// Like uni_hid_device_disconnect(), but without the Bluetooth part.
+static void replay_disconnect_device(uni_hid_device_t* d) {
+    if (d->child)
+        replay_disconnect_device(d->child);
+
+    bool connected = uni_bt_conn_is_connected(&d->conn);
+    uni_bt_conn_disconnect(&d->conn);
+    if (connected)
+        uni_hid_device_on_connected(d, false);
+}
+
+static void replay_delete_device(uint8_t idx) {
+    uni_hid_device_t* d = replay_get_device(idx);
+    if (d == NULL)
+        return;
+
+    replay_disconnect_device(d);
+    uni_hid_device_delete(d);
+    g_replay.devices[idx] = NULL;
+}
+
+static void replay_create_device(uint8_t idx, const uint8_t* payload, uint16_t len) {
+    bd_addr_t addr;
+    char name[16];
+
+    if (len < UNI_CAPTURE_DEVICE_PAYLOAD_SIZE) {
+        loge("Replay: invalid device record\n");
+        return;
+    }
+
+    // Controller changed, or reconnected: start with a new device.
+    replay_delete_device(idx);
+
+    replay_get_address(idx, addr);
+    uni_hid_device_t* d = uni_hid_device_create(addr);
+    if (d == NULL) {
+        loge("Replay: cannot create device for index %d\n", idx);
+        return;
+    }
+    g_replay.devices[idx] = d;
+    g_replay.num_devices++;
+
+    snprintf(name, sizeof(name), "replay-%d", idx);
+    uni_hid_device_set_name(d, name);
+    uni_hid_device_set_vendor_id(d, little_endian_read_16(payload, 0));
+    uni_hid_device_set_product_id(d, little_endian_read_16(payload, 2));
+    if (len > UNI_CAPTURE_DEVICE_PAYLOAD_SIZE)
+        uni_hid_device_set_hid_descriptor(d, &payload[UNI_CAPTURE_DEVICE_PAYLOAD_SIZE],
+                                          len - UNI_CAPTURE_DEVICE_PAYLOAD_SIZE);
+    // Use the parser of the capture, even if the VID/PID database changed since then.
+    uni_hid_device_set_controller_type(d, little_endian_read_16(payload, 4));
+    uni_hid_device_connect(d);
+
+    if (payload[6] & UNI_CAPTURE_DEVICE_FLAG_READY) {
+        // Setup was not captured.
+        uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_DEVICE_PENDING_READY);
+        uni_hid_device_set_ready_complete(d);
+    } else {
+        // The parser setup is driven by the captured reports, like with the real controller.
+        uni_hid_device_set_ready(d);
+    }
+}
+
+static void replay_process_record(const uint8_t* header, const uint8_t* payload) {
+    uint8_t type = header[0];
+    uint8_t idx = header[1];
+    uint16_t len = little_endian_read_16(header, 2);
+    uni_hid_device_t* d;
+
+    if (idx >= UNI_HID_DEVICE_POOL_MAX_DEVICES) {
+        loge("Replay: invalid device index %d, skipping record\n", idx);
+        return;
+    }
+
+    switch (type) {
+        case UNI_CAPTURE_RECORD_DEVICE:
+            replay_create_device(idx, payload, len);
+            break;
+        case UNI_CAPTURE_RECORD_INPUT_REPORT:
+            d = replay_get_device(idx);
+            if (d == NULL || len == 0)
+                break;
+            g_replay.input_reports++;
+            uni_hid_parse_input_report(d, payload, len);
+            uni_hid_device_process_controller(d);
+            break;
+        case UNI_CAPTURE_RECORD_FEATURE_REPORT:
+            d = replay_get_device(idx);
+            if (d == NULL || len == 0)
+                break;
+            g_replay.feature_reports++;
+            if (d->report_parser.parse_feature_report)
+                d->report_parser.parse_feature_report(d, payload, len);
+            break;
+        default:
+            // Newer record types are skipped.
+            logd("Replay: unknown record type %d, skipping it\n", type);
+            break;
+    }
+}
+
+// Reads the next record. Returns false at the end of the file, or on error.
+static bool replay_read_record(void) {
+    g_replay.has_record = false;
+
+    size_t n = fread(g_replay.header, 1, sizeof(g_replay.header), g_replay.file);
+    if (n == 0)
+        return false;
+    if (n != sizeof(g_replay.header)) {
+        loge("Replay: truncated record header\n");
+        return false;
+    }
+
+    uint16_t len = little_endian_read_16(g_replay.header, 2);
+    if (len > UNI_CAPTURE_MAX_PAYLOAD_LEN) {
+        loge("Replay: invalid record length %d\n", len);
+        return false;
+    }
+    if (fread(g_replay.payload, 1, len, g_replay.file) != len) {
+        loge("Replay: truncated record\n");
+        return false;
+    }
+
+    // The first record is played right away, regardless of when the capture was started.
+    if (!g_replay.first_record)
+        g_replay.record_time_us += little_endian_read_32(g_replay.header, 4);
+    g_replay.first_record = false;
+
+    g_replay.has_record = true;
+    return true;
+}
+
+static void replay_finish(void) {
+    uint64_t elapsed_us = uni_system_get_time_us() - g_replay.start_us;
+
+    btstack_run_loop_remove_timer(&g_replay.timer);
+    fclose(g_replay.file);
+    g_replay.file = NULL;
+
+    for (int i = 0; i < UNI_HID_DEVICE_POOL_MAX_DEVICES; i++)
+        replay_delete_device(i);
+
+    logi("Replay: %u devices, %u input reports, %u feature reports in %u ms\n", g_replay.num_devices,
+         g_replay.input_reports, g_replay.feature_reports, (uint32_t)(elapsed_us / 1000));
+    if (elapsed_us > 0)
+        logi("Replay: %u input reports/s\n", (uint32_t)(g_replay.input_reports * 1000000ull / elapsed_us));
+
+    if (g_replay.on_done)
+        g_replay.on_done();
+}
+
+static void replay_timeout(btstack_timer_source_t* ts) {
+    uint64_t elapsed_us = uni_system_get_time_us() - g_replay.start_us;
+    int processed = 0;
+
+    while (g_replay.has_record) {
+        if (g_replay.fast && processed == REPLAY_BATCH_SIZE)
+            break;
+        if (!g_replay.fast && g_replay.record_time_us > elapsed_us)
+            break;
+        replay_process_record(g_replay.header, g_replay.payload);
+        processed++;
+        replay_read_record();
+    }
+
+    if (!g_replay.has_record) {
+        replay_finish();
+        return;
+    }
+
+    uint32_t delay_ms = 0;
+    if (!g_replay.fast)
+        delay_ms = (g_replay.record_time_us - elapsed_us) / 1000;
+    btstack_run_loop_set_timer(ts, delay_ms);
+    btstack_run_loop_add_timer(ts);
+}
+
+static bool is_valid_file_header(const uint8_t* header) {
+    if (memcmp(header, file_magic, UNI_CAPTURE_FILE_HEADER_SIZE - 1) != 0) {
+        loge("Replay: not a capture file\n");
+        return false;
+    }
+    if (header[UNI_CAPTURE_FILE_HEADER_SIZE - 1] != UNI_CAPTURE_VERSION) {
+        loge("Replay: unsupported capture version %d\n", header[UNI_CAPTURE_FILE_HEADER_SIZE - 1]);
+        return false;
+    }
+    return true;
+}
+
+bool uni_capture_replay_file(const char* path, bool as_fast_as_possible, void (*on_done)(void)) {
+    uint8_t header[UNI_CAPTURE_FILE_HEADER_SIZE];
+
+    if (g_replay.file != NULL) {
+        loge("Replay: already replaying a file\n");
+        return false;
+    }
+
+    FILE* f = fopen(path, "rb");
+    if (f == NULL) {
+        loge("Replay: failed to open %s\n", path);
+        return false;
+    }
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || !is_valid_file_header(header)) {
+        loge("Replay: %s is not a valid capture file\n", path);
+        fclose(f);
+        return false;
+    }
+
+    memset(&g_replay, 0, sizeof(g_replay));
+    g_replay.file = f;
+    g_replay.fast = as_fast_as_possible;
+    g_replay.on_done = on_done;
+    g_replay.first_record = true;
+    g_replay.start_us = uni_system_get_time_us();
+    replay_read_record();
+
+    logi("Replay: playing %s%s\n", path, as_fast_as_possible ? " as fast as possible" : "");
+
+    btstack_run_loop_set_timer_handler(&g_replay.timer, replay_timeout);
+    btstack_run_loop_set_timer(&g_replay.timer, 0);
+    btstack_run_loop_add_timer(&g_replay.timer);
+    return true;
+}
+
+bool uni_capture_replay_buffer(const uint8_t* data, size_t len) {
+    size_t offset = UNI_CAPTURE_FILE_HEADER_SIZE;
+
+    if (g_replay.file != NULL) {
+        loge("Replay: already replaying a file\n");
+        return false;
+    }
+    if (len < UNI_CAPTURE_FILE_HEADER_SIZE || !is_valid_file_header(data))
+        return false;
+
+    memset(&g_replay, 0, sizeof(g_replay));
+
+    // Same as replay_read_record(), but from memory. A truncated record ends the replay.
+    while (len - offset >= UNI_CAPTURE_RECORD_HEADER_SIZE) {
+        const uint8_t* header = &data[offset];
+        uint16_t payload_len = little_endian_read_16(header, 2);
+        offset += UNI_CAPTURE_RECORD_HEADER_SIZE;
+        if (payload_len > UNI_CAPTURE_MAX_PAYLOAD_LEN || payload_len > len - offset)
+            break;
+        replay_process_record(header, &data[offset]);
+        offset += payload_len;
+    }
+
+    for (int i = 0; i < UNI_HID_DEVICE_POOL_MAX_DEVICES; i++)
+        replay_delete_device(i);
+    return true;
+}
+
+#endif  // CONFIG_BLUEPAD32_CAPTURE
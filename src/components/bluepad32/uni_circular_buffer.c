@@ -4,49 +4,176 @@
 
 #include "uni_circular_buffer.h"
 
+#include <stdbool.h>
 #include <string.h>
 
 #include "uni_log.h"
 
+// Each packet is stored as a header followed by the data.
+// Packets are never split: if a packet doesn't fit at the end of the buffer,
+// it is stored at the beginning, and a "wrap" header is left at the end (if there is room for it).
+typedef struct {
+    int16_t cid;
+    uint16_t len;
+} packet_header_t;
+
+#define HEADER_SIZE ((int)sizeof(packet_header_t))
+#define HEADER_LEN_WRAP 0xffff
+
+_Static_assert(UNI_CIRCULAR_BUFFER_SIZE >= 2 * (UNI_CIRCULAR_BUFFER_DATA_SIZE + HEADER_SIZE),
+               "UNI_CIRCULAR_BUFFER_SIZE too small");
+_Static_assert(UNI_CIRCULAR_BUFFER_SIZE < HEADER_LEN_WRAP, "UNI_CIRCULAR_BUFFER_SIZE too big");
+// The whole point of packing the packets is to save RAM. Make sure the bookkeeping stays small.
+_Static_assert(sizeof(uni_circular_buffer_t) <= UNI_CIRCULAR_BUFFER_SIZE + 32, "uni_circular_buffer_t too big");
+
+static bool is_in_use(const uni_circular_buffer_t* b) {
+    return b->count > 0 || b->has_pending;
+}
+
+// Returns the offset where a packet of "size" bytes (header included) can be stored, or -1 if there is no room.
+static int find_room(const uni_circular_buffer_t* b, int size) {
+    if (!is_in_use(b))
+        return 0;
+
+    if (b->tail_idx > b->head_idx) {
+        // Free space is [tail, end) + [0, head)
+        if (UNI_CIRCULAR_BUFFER_SIZE - b->tail_idx >= size)
+            return b->tail_idx;
+        if (b->head_idx >= size)
+            return 0;
+        return -1;
+    }
+
+    // Free space is [tail, head). If equal, the buffer is full.
+    if (b->head_idx - b->tail_idx >= size)
+        return b->tail_idx;
+    return -1;
+}
+
 uint8_t uni_circular_buffer_put(uni_circular_buffer_t* b, int16_t cid, const void* data, int len) {
-    if (uni_circular_buffer_is_full(b)) {
+    packet_header_t hdr;
+    int offset;
+
+    if (len < 0 || len >= UNI_CIRCULAR_BUFFER_DATA_SIZE) {
+        return UNI_CIRCULAR_BUFFER_ERROR_BUFFER_TOO_BIG;
+    }
+
+    if (!is_in_use(b))
+        b->head_idx = b->read_idx = b->tail_idx = 0;
+
+    offset = find_room(b, HEADER_SIZE + len);
+    if (offset < 0) {
+        b->dropped_count++;
         return UNI_CIRCULAR_BUFFER_ERROR_BUFFER_FULL;
     }
-    if (len >= UNI_CIRCULAR_BUFFER_DATA_SIZE) {
-        return UNI_CIRCULAR_BUFFER_ERROR_BUFFER_TOO_BIG;
+
+    if (offset != b->tail_idx && UNI_CIRCULAR_BUFFER_SIZE - b->tail_idx >= HEADER_SIZE) {
+        // Tell the reader to continue from the beginning.
+        hdr.cid = 0;
+        hdr.len = HEADER_LEN_WRAP;
+        memcpy(&b->buffer[b->tail_idx], &hdr, HEADER_SIZE);
     }
-    memcpy(&b->buffer[b->tail_idx].data, data, len);
-    b->buffer[b->tail_idx].data_len = len;
-    b->buffer[b->tail_idx].cid = cid;
 
-    b->tail_idx++;
-    if (b->tail_idx == UNI_CIRCULAR_BUFFER_SIZE)
-        b->tail_idx = 0;
+    hdr.cid = cid;
+    hdr.len = len;
+    memcpy(&b->buffer[offset], &hdr, HEADER_SIZE);
+    memcpy(&b->buffer[offset + HEADER_SIZE], data, len);
+
+    b->tail_idx = offset + HEADER_SIZE + len;
+    b->count++;
     return UNI_CIRCULAR_BUFFER_ERROR_OK;
 }
 
+// Returns the offset of the packet stored at "offset", skipping the "wrap" header if needed.
+static int packet_offset(const uni_circular_buffer_t* b, int offset) {
+    packet_header_t hdr;
+
+    if (UNI_CIRCULAR_BUFFER_SIZE - offset < HEADER_SIZE)
+        return 0;
+    memcpy(&hdr, &b->buffer[offset], HEADER_SIZE);
+    if (hdr.len == HEADER_LEN_WRAP)
+        return 0;
+    return offset;
+}
+
+uint8_t uni_circular_buffer_replace(uni_circular_buffer_t* b, int16_t cid, const void* data, int len, int key_len) {
+    packet_header_t hdr;
+    int offset;
+
+    if (key_len > len)
+        key_len = len;
+
+    offset = b->read_idx;
+    for (int i = 0; i < b->count; i++) {
+        offset = packet_offset(b, offset);
+        memcpy(&hdr, &b->buffer[offset], HEADER_SIZE);
+        if (hdr.cid == cid && hdr.len == len && memcmp(&b->buffer[offset + HEADER_SIZE], data, key_len) == 0) {
+            memcpy(&b->buffer[offset + HEADER_SIZE], data, len);
+            b->merged_count++;
+            return UNI_CIRCULAR_BUFFER_ERROR_OK;
+        }
+        offset += HEADER_SIZE + hdr.len;
+    }
+    return UNI_CIRCULAR_BUFFER_ERROR_NOT_FOUND;
+}
+
 uint8_t uni_circular_buffer_get(uni_circular_buffer_t* b, int16_t* cid, void** data, int* len) {
+    packet_header_t hdr;
+    int offset;
+
+    // Release the packet returned in the previous call.
+    b->head_idx = b->read_idx;
+    b->has_pending = false;
+
     if (uni_circular_buffer_is_empty(b)) {
         return UNI_CIRCULAR_BUFFER_ERROR_BUFFER_EMPTY;
     }
-    *data = &b->buffer[b->head_idx].data;
-    *len = b->buffer[b->head_idx].data_len;
-    *cid = b->buffer[b->head_idx].cid;
 
-    b->head_idx++;
-    if (b->head_idx == UNI_CIRCULAR_BUFFER_SIZE)
-        b->head_idx = 0;
+    offset = packet_offset(b, b->read_idx);
+    memcpy(&hdr, &b->buffer[offset], HEADER_SIZE);
+
+    *data = &b->buffer[offset + HEADER_SIZE];
+    *len = hdr.len;
+    *cid = hdr.cid;
+
+    // Keep the packet in the buffer until the next "get", so that the caller can use it,
+    // even if it "puts" it back.
+    b->head_idx = offset;
+    b->read_idx = offset + HEADER_SIZE + hdr.len;
+    b->has_pending = true;
+    b->count--;
+    return UNI_CIRCULAR_BUFFER_ERROR_OK;
+}
+
+uint8_t uni_circular_buffer_peek(uni_circular_buffer_t* b, int16_t* cid, void** data, int* len) {
+    packet_header_t hdr;
+    int offset;
+
+    if (uni_circular_buffer_is_empty(b)) {
+        return UNI_CIRCULAR_BUFFER_ERROR_BUFFER_EMPTY;
+    }
+
+    offset = packet_offset(b, b->read_idx);
+    memcpy(&hdr, &b->buffer[offset], HEADER_SIZE);
+
+    *data = &b->buffer[offset + HEADER_SIZE];
+    *len = hdr.len;
+    *cid = hdr.cid;
     return UNI_CIRCULAR_BUFFER_ERROR_OK;
 }
 
 uint8_t uni_circular_buffer_is_empty(uni_circular_buffer_t* b) {
-    return (b->head_idx == b->tail_idx);
+    return b->count == 0;
 }
 
 uint8_t uni_circular_buffer_is_full(uni_circular_buffer_t* b) {
-    return (b->tail_idx + 1 == b->head_idx) || (b->head_idx == 0 && b->tail_idx == UNI_CIRCULAR_BUFFER_SIZE - 1);
+    return find_room(b, HEADER_SIZE + UNI_CIRCULAR_BUFFER_DATA_SIZE - 1) < 0;
 }
 
 void uni_circular_buffer_reset(uni_circular_buffer_t* b) {
-    b->head_idx = b->tail_idx = 0;
+    b->head_idx = b->read_idx = b->tail_idx = 0;
+    b->count = 0;
+    b->has_pending = false;
+    b->merged_count = 0;
+    b->dropped_count = 0;
 }
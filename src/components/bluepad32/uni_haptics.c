@@ -0,0 +1,264 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "uni_haptics.h"
+
+#include <string.h>
+
+#include <btstack.h>
+
+#include "sdkconfig.h"
+#include "uni_common.h"
+#include "uni_hid_device.h"
+#include "uni_log.h"
+
+typedef enum {
+    HAPTICS_STATE_IDLE,
+    // Waiting to start "current", either because of the start delay, or a retry.
+    HAPTICS_STATE_DELAYED,
+    // Motors are on. Waiting for the duration to expire.
+    HAPTICS_STATE_PLAYING,
+    // Could not turn off the motors. Waiting to retry.
+    HAPTICS_STATE_STOPPING,
+} haptics_state_t;
+
+typedef uni_haptics_device_t haptics_device_t;
+
+// One timer for all the devices. It fires at the earliest deadline.
+static btstack_timer_source_t g_timer;
+
+static void start_current(uni_hid_device_t* d, haptics_device_t* h, uint32_t now);
+static void turn_off(uni_hid_device_t* d, haptics_device_t* h, uint32_t now);
+static void schedule_timer(uint32_t now);
+
+static haptics_device_t* get_haptics(uni_hid_device_t* d) {
+    if (d == NULL || d->cold == NULL)
+        return NULL;
+    return &d->cold->haptics;
+}
+
+static bool is_before(uint32_t a, uint32_t b) {
+    // Works even if the ms counter wraps around.
+    return (int32_t)(a - b) < 0;
+}
+
+static uni_haptics_result_t set_motors(uni_hid_device_t* d, const uni_haptics_motors_t* motors) {
+    if (d->report_parser.set_rumble == NULL)
+        return UNI_HAPTICS_RESULT_ERROR;
+    return d->report_parser.set_rumble(d, motors);
+}
+
+static void set_deadline(haptics_device_t* h, haptics_state_t state, uint32_t now, uint32_t delay_ms) {
+    h->state = state;
+    h->deadline_ms = now + delay_ms;
+}
+
+// Starts the next queued effect, if any.
+static void next_effect(uni_hid_device_t* d, haptics_device_t* h, uint32_t now) {
+    if (h->queue_len == 0) {
+        h->state = HAPTICS_STATE_IDLE;
+        return;
+    }
+
+    h->current = h->queue[h->queue_head];
+    h->queue_head = (h->queue_head + 1) % UNI_HAPTICS_MAX_QUEUED_EFFECTS;
+    h->queue_len--;
+
+    if (h->current.start_delay_ms == 0)
+        start_current(d, h, now);
+    else
+        set_deadline(h, HAPTICS_STATE_DELAYED, now, h->current.start_delay_ms);
+}
+
+static void start_current(uni_hid_device_t* d, haptics_device_t* h, uint32_t now) {
+    if (h->current.duration_ms == 0) {
+        if (h->motors_on)
+            turn_off(d, h, now);
+        else
+            next_effect(d, h, now);
+        return;
+    }
+
+    switch (set_motors(d, &h->current.motors)) {
+        case UNI_HAPTICS_RESULT_OK:
+            h->motors_on = true;
+            set_deadline(h, HAPTICS_STATE_PLAYING, now, h->current.duration_ms);
+            break;
+        case UNI_HAPTICS_RESULT_RETRY:
+            logd("Haptics: could not start effect, retrying...\n");
+            set_deadline(h, HAPTICS_STATE_DELAYED, now, UNI_HAPTICS_RETRY_MS);
+            break;
+        case UNI_HAPTICS_RESULT_ERROR:
+        default:
+            // Don't retry. Skip it.
+            next_effect(d, h, now);
+            break;
+    }
+}
+
+static void turn_off(uni_hid_device_t* d, haptics_device_t* h, uint32_t now) {
+    static const uni_haptics_motors_t off = {0};
+
+    switch (set_motors(d, &off)) {
+        case UNI_HAPTICS_RESULT_RETRY:
+            logd("Haptics: could not stop effect, retrying...\n");
+            set_deadline(h, HAPTICS_STATE_STOPPING, now, UNI_HAPTICS_RETRY_MS);
+            return;
+        case UNI_HAPTICS_RESULT_OK:
+        case UNI_HAPTICS_RESULT_ERROR:
+        default:
+            h->motors_on = false;
+            break;
+    }
+    next_effect(d, h, now);
+}
+
+static void on_deadline(uni_hid_device_t* d, haptics_device_t* h, uint32_t now) {
+    switch (h->state) {
+        case HAPTICS_STATE_DELAYED:
+            start_current(d, h, now);
+            break;
+        case HAPTICS_STATE_PLAYING:
+            // Chain effects without turning off the motors in between, if possible.
+            if (h->queue_len > 0 && h->queue[h->queue_head].start_delay_ms == 0)
+                next_effect(d, h, now);
+            else
+                turn_off(d, h, now);
+            break;
+        case HAPTICS_STATE_STOPPING:
+            turn_off(d, h, now);
+            break;
+        case HAPTICS_STATE_IDLE:
+        default:
+            break;
+    }
+}
+
+void uni_haptics_process(uint32_t now_ms) {
+    int max_devices = uni_hid_device_get_max_devices();
+
+    for (int i = 0; i < max_devices; i++) {
+        uni_hid_device_t* d = uni_hid_device_get_instance_for_idx(i);
+        haptics_device_t* h = &d->cold->haptics;
+        if (h->state == HAPTICS_STATE_IDLE || is_before(now_ms, h->deadline_ms))
+            continue;
+        on_deadline(d, h, now_ms);
+    }
+}
+
+static void on_timer(btstack_timer_source_t* ts) {
+    ARG_UNUSED(ts);
+    uint32_t now = btstack_run_loop_get_time_ms();
+
+    uni_haptics_process(now);
+    schedule_timer(now);
+}
+
+static void schedule_timer(uint32_t now) {
+    bool found = false;
+    uint32_t deadline = 0;
+    int max_devices = uni_hid_device_get_max_devices();
+
+    for (int i = 0; i < max_devices; i++) {
+        haptics_device_t* h = &uni_hid_device_get_instance_for_idx(i)->cold->haptics;
+        if (h->state == HAPTICS_STATE_IDLE)
+            continue;
+        if (!found || is_before(h->deadline_ms, deadline)) {
+            deadline = h->deadline_ms;
+            found = true;
+        }
+    }
+
+    btstack_run_loop_remove_timer(&g_timer);
+    if (!found)
+        return;
+
+    btstack_run_loop_set_timer_handler(&g_timer, on_timer);
+    btstack_run_loop_set_timer(&g_timer, is_before(now, deadline) ? deadline - now : 0);
+    btstack_run_loop_add_timer(&g_timer);
+}
+
+void uni_haptics_play(uni_hid_device_t* d, const uni_haptics_effect_t* effect) {
+    haptics_device_t* h = get_haptics(d);
+    if (h == NULL) {
+        loge("Haptics: Invalid device\n");
+        return;
+    }
+
+    uint32_t now = btstack_run_loop_get_time_ms();
+
+    h->queue_len = 0;
+    h->current = *effect;
+    if (effect->start_delay_ms == 0)
+        start_current(d, h, now);
+    else
+        set_deadline(h, HAPTICS_STATE_DELAYED, now, effect->start_delay_ms);
+
+    schedule_timer(now);
+}
+
+bool uni_haptics_queue(uni_hid_device_t* d, const uni_haptics_effect_t* effect) {
+    haptics_device_t* h = get_haptics(d);
+    if (h == NULL) {
+        loge("Haptics: Invalid device\n");
+        return false;
+    }
+
+    if (h->state == HAPTICS_STATE_IDLE) {
+        uni_haptics_play(d, effect);
+        return true;
+    }
+
+    if (h->queue_len == UNI_HAPTICS_MAX_QUEUED_EFFECTS)
+        return false;
+
+    h->queue[(h->queue_head + h->queue_len) % UNI_HAPTICS_MAX_QUEUED_EFFECTS] = *effect;
+    h->queue_len++;
+    return true;
+}
+
+void uni_haptics_stop(uni_hid_device_t* d) {
+    const uni_haptics_effect_t stop = {0};
+    uni_haptics_play(d, &stop);
+}
+
+void uni_haptics_cancel(uni_hid_device_t* d) {
+    haptics_device_t* h = get_haptics(d);
+    if (h == NULL)
+        return;
+
+    bool was_active = (h->state != HAPTICS_STATE_IDLE);
+    memset(h, 0, sizeof(*h));
+    if (was_active)
+        schedule_timer(btstack_run_loop_get_time_ms());
+}
+
+bool uni_haptics_is_playing(uni_hid_device_t* d) {
+    haptics_device_t* h = get_haptics(d);
+    if (h == NULL)
+        return false;
+    return h->motors_on;
+}
+
+void uni_haptics_play_dual_rumble(uni_hid_device_t* d,
+                                  uint16_t start_delay_ms,
+                                  uint16_t duration_ms,
+                                  uint8_t weak_magnitude,
+                                  uint8_t strong_magnitude) {
+    const uni_haptics_effect_t effect = {
+        .start_delay_ms = start_delay_ms,
+        .duration_ms = duration_ms,
+        .motors =
+            {
+                .weak_magnitude = weak_magnitude,
+                .strong_magnitude = strong_magnitude,
+            },
+    };
+
+    if (d == NULL) {
+        loge("Haptics: Invalid device\n");
+        return;
+    }
+    uni_haptics_play(d, &effect);
+}
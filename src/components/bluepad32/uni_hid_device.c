@@ -13,6 +13,7 @@
 #include "bt/uni_bt_bredr.h"
 #include "bt/uni_bt_defines.h"
 #include "bt/uni_bt_le.h"
+#include "bt/uni_bt_pipeline.h"
 #include "bt/uni_bt_service.h"
 #include "controller/uni_controller_type.h"
 #include "parser/uni_hid_parser_8bitdo.h"
@@ -37,7 +38,9 @@
 #include "platform/uni_platform.h"
 #include "uni_common.h"
 #include "uni_config.h"
+#include "uni_haptics.h"
 #include "uni_log.h"
+#include "uni_system.h"
 #include "uni_virtual_device.h"
 
 enum {
@@ -52,30 +55,237 @@ enum {
 
 #define MISC_BUTTON_DELAY_MS 200
 
-static uni_hid_device_t g_devices[CONFIG_BLUEPAD32_MAX_DEVICES];
+// Coalesced reports are considered the same if they have the same first two bytes:
+// the HID transaction header and the Report ID.
+#define OUTGOING_REPORT_KEY_LEN 2
+
+// Size of each lookup index. It must be a power of two, and have room for two entries
+// per device (control + interrupt cids) while keeping the load factor <= 50%.
+#define DEVICE_INDEX_MIN_SIZE(_max_devices) ((_max_devices) * 4)
+#define DEVICE_INDEX_SIZE(_max_devices)                 \
+    ((DEVICE_INDEX_MIN_SIZE(_max_devices) <= 16)    ? 16  \
+     : (DEVICE_INDEX_MIN_SIZE(_max_devices) <= 32)  ? 32  \
+     : (DEVICE_INDEX_MIN_SIZE(_max_devices) <= 64)  ? 64  \
+     : (DEVICE_INDEX_MIN_SIZE(_max_devices) <= 128) ? 128 \
+     : (DEVICE_INDEX_MIN_SIZE(_max_devices) <= 256) ? 256 \
+     : (DEVICE_INDEX_MIN_SIZE(_max_devices) <= 512) ? 512 \
+                                                    : 1024)
+// cid, hids cid, connection handle and address.
+#define DEVICE_INDEX_COUNT 4
+
+#define POOL_ALIGN(_size) (((_size) + 7) & ~(size_t)7)
+
+_Static_assert(CONFIG_BLUEPAD32_MAX_DEVICES <= UNI_HID_DEVICE_POOL_MAX_DEVICES, "CONFIG_BLUEPAD32_MAX_DEVICES too big");
+_Static_assert(UNI_HID_DEVICE_POOL_MAX_DEVICES <= 254, "UNI_HID_DEVICE_POOL_MAX_DEVICES too big");
+
+// Open-addressed (linear probing) map from "key" to device index.
+// Used to find a device from a cid / connection handle / address without scanning all the devices,
+// since these lookups are done for every received packet.
+// Entries are added / removed by the device lifecycle: create, set cid / handle, delete.
+typedef struct {
+    uint16_t key;
+    uint8_t slot;  // Device index + 1. 0 means empty
+} device_index_entry_t;
+
+typedef struct {
+    device_index_entry_t* entries;
+} device_index_t;
+
+// Static pool, used unless the host provides one with uni_hid_device_set_pool().
+static uni_hid_device_t g_static_devices[CONFIG_BLUEPAD32_MAX_DEVICES];
+static uni_hid_device_cold_t g_static_devices_cold[CONFIG_BLUEPAD32_MAX_DEVICES];
+static device_index_entry_t g_static_index_entries[DEVICE_INDEX_COUNT]
+                                                  [DEVICE_INDEX_SIZE(CONFIG_BLUEPAD32_MAX_DEVICES)];
+
+// Hot and cold parts of the devices. g_devices[i].cold points to g_devices_cold[i].
+static uni_hid_device_t* g_devices = g_static_devices;
+static uni_hid_device_cold_t* g_devices_cold = g_static_devices_cold;
+static int g_max_devices = CONFIG_BLUEPAD32_MAX_DEVICES;
 static const bd_addr_t zero_addr = {0, 0, 0, 0, 0, 0};
 
+// All the indexes have the same size.
+static uint16_t g_index_mask = DEVICE_INDEX_SIZE(CONFIG_BLUEPAD32_MAX_DEVICES) - 1;
+// Both control and interrupt cids are stored in the same index.
+static device_index_t g_cid_index = {g_static_index_entries[0]};
+static device_index_t g_hids_cid_index = {g_static_index_entries[1]};
+static device_index_t g_handle_index = {g_static_index_entries[2]};
+// Address index only stores a hash of the address. Virtual devices are not added to it,
+// since they share the same address with their parents.
+static device_index_t g_addr_index = {g_static_index_entries[3]};
+
 static void process_misc_button_system(uni_hid_device_t* d);
 static void process_misc_button_home(uni_hid_device_t* d);
 static void misc_button_enable_callback(btstack_timer_source_t* ts);
 static void device_connection_timeout(btstack_timer_source_t* ts);
-static void start_connection_timeout(uni_hid_device_t* d);
+
+static inline uint16_t index_hash(uint16_t key) {
+    // Fibonacci hashing: cids and handles are usually consecutive numbers.
+    return (uint16_t)(((uint32_t)key * 2654435769u) >> 16) & g_index_mask;
+}
+
+static uint16_t addr_key(const bd_addr_t addr) {
+    return ((addr[0] ^ addr[2] ^ addr[4]) << 8) | (addr[1] ^ addr[3] ^ addr[5]);
+}
+
+static void index_add(device_index_t* index, uint16_t key, const uni_hid_device_t* d) {
+    uint16_t i = index_hash(key);
+
+    // Can't be full: it has room for more entries than devices.
+    while (index->entries[i].slot != 0)
+        i = (i + 1) & g_index_mask;
+    index->entries[i].key = key;
+    index->entries[i].slot = (d - g_devices) + 1;
+}
+
+static void index_remove(device_index_t* index, uint16_t key, const uni_hid_device_t* d) {
+    uint8_t slot = (d - g_devices) + 1;
+    uint16_t i = index_hash(key);
+
+    while (index->entries[i].slot != 0) {
+        if (index->entries[i].key == key && index->entries[i].slot == slot)
+            break;
+        i = (i + 1) & g_index_mask;
+    }
+    if (index->entries[i].slot == 0)
+        return;
+
+    // Backward-shift deletion: move back the entries that belong to the same probe chain,
+    // so that lookups don't need tombstones.
+    uint16_t j = i;
+    while (true) {
+        j = (j + 1) & g_index_mask;
+        if (index->entries[j].slot == 0)
+            break;
+        uint16_t k = index_hash(index->entries[j].key);
+        // Entry at "j" can be moved to "i" only if its home "k" is not in the (i, j] range.
+        if ((i <= j) ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        index->entries[i] = index->entries[j];
+        i = j;
+    }
+    index->entries[i].slot = 0;
+}
+
+static uni_hid_device_t* index_find(const device_index_t* index, uint16_t key) {
+    uint16_t i = index_hash(key);
+
+    while (index->entries[i].slot != 0) {
+        if (index->entries[i].key == key)
+            return &g_devices[index->entries[i].slot - 1];
+        i = (i + 1) & g_index_mask;
+    }
+    return NULL;
+}
+
+static void index_set_cid(uint16_t* cid, uint16_t new_cid, const uni_hid_device_t* d) {
+    if (*cid == new_cid)
+        return;
+    if (*cid != 0)
+        index_remove(&g_cid_index, *cid, d);
+    *cid = new_cid;
+    if (new_cid != 0)
+        index_add(&g_cid_index, new_cid, d);
+}
+
+// Clears both parts of the device, keeping the link between them.
+// The keys of the indexes are set to "none", so that any valid value, like the connection handle 0, gets indexed.
+static void device_clear(uni_hid_device_t* d) {
+    uni_hid_device_cold_t* cold = &g_devices_cold[d - g_devices];
+
+    memset(d, 0, sizeof(*d));
+    memset(cold, 0, sizeof(*cold));
+    d->cold = cold;
+    d->hids_cid = 0xffff;
+    uni_bt_conn_init(&d->conn);
+}
 
 void uni_hid_device_setup(void) {
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++)
+    for (int i = 0; i < g_max_devices; i++) {
+        g_devices[i].cold = &g_devices_cold[i];
         uni_hid_device_init(&g_devices[i]);
+    }
+}
+
+size_t uni_hid_device_get_pool_size(int max_devices) {
+    // The descriptor store can't be that big with the configured budget per device.
+    size_t store_size = uni_hid_descriptor_store_get_arena_size(max_devices);
+    if (max_devices <= 0 || max_devices > UNI_HID_DEVICE_POOL_MAX_DEVICES || store_size == 0)
+        return 0;
+    return POOL_ALIGN(max_devices * sizeof(uni_hid_device_t)) +
+           POOL_ALIGN(max_devices * sizeof(uni_hid_device_cold_t)) +
+           POOL_ALIGN(DEVICE_INDEX_COUNT * DEVICE_INDEX_SIZE(max_devices) * sizeof(device_index_entry_t)) + store_size;
+}
+
+bool uni_hid_device_set_pool(void* arena, size_t arena_size, int max_devices) {
+    device_index_t* indexes[DEVICE_INDEX_COUNT] = {&g_cid_index, &g_hids_cid_index, &g_handle_index, &g_addr_index};
+    uint8_t* ptr = arena;
+    int index_size;
+
+    if (arena != NULL) {
+        size_t size = uni_hid_device_get_pool_size(max_devices);
+        if (size == 0 || arena_size < size || ((uintptr_t)arena & 7) != 0) {
+            loge("Invalid device pool: %d devices, %u bytes\n", max_devices, (unsigned)arena_size);
+            return false;
+        }
+    }
+
+    // The devices point to each other, and to the indexes. They can't be moved.
+    for (int i = 0; i < g_max_devices; i++) {
+        if (bd_addr_cmp(g_devices[i].conn.btaddr, zero_addr) != 0) {
+            loge("Cannot change the device pool: device idx=%d in use\n", i);
+            return false;
+        }
+    }
+
+    // The HID descriptor store goes after the indexes. Set first, since it might have descriptors in use.
+    size_t store_offset =
+        uni_hid_device_get_pool_size(max_devices) - uni_hid_descriptor_store_get_arena_size(max_devices);
+    if (!uni_hid_descriptor_store_set_arena(arena ? ptr + store_offset : NULL, max_devices))
+        return false;
+
+    if (arena == NULL) {
+        g_devices = g_static_devices;
+        g_devices_cold = g_static_devices_cold;
+        g_max_devices = CONFIG_BLUEPAD32_MAX_DEVICES;
+        index_size = DEVICE_INDEX_SIZE(CONFIG_BLUEPAD32_MAX_DEVICES);
+        for (int i = 0; i < DEVICE_INDEX_COUNT; i++)
+            indexes[i]->entries = g_static_index_entries[i];
+        memset(g_static_index_entries, 0, sizeof(g_static_index_entries));
+    } else {
+        memset(arena, 0, store_offset);
+        g_devices = (uni_hid_device_t*)ptr;
+        ptr += POOL_ALIGN(max_devices * sizeof(uni_hid_device_t));
+        g_devices_cold = (uni_hid_device_cold_t*)ptr;
+        ptr += POOL_ALIGN(max_devices * sizeof(uni_hid_device_cold_t));
+        g_max_devices = max_devices;
+        index_size = DEVICE_INDEX_SIZE(max_devices);
+        for (int i = 0; i < DEVICE_INDEX_COUNT; i++) {
+            indexes[i]->entries = (device_index_entry_t*)ptr;
+            ptr += index_size * sizeof(device_index_entry_t);
+        }
+    }
+    g_index_mask = index_size - 1;
+
+    logi("Device pool: %d devices\n", g_max_devices);
+    uni_hid_device_setup();
+    return true;
+}
+
+int uni_hid_device_get_max_devices(void) {
+    return g_max_devices;
 }
 
 uni_hid_device_t* uni_hid_device_create(bd_addr_t address) {
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < g_max_devices; i++) {
         if (bd_addr_cmp(g_devices[i].conn.btaddr, zero_addr) == 0) {
             logi("Creating device: %s (idx=%d)\n", bd_addr_to_str(address), i);
 
-            memset(&g_devices[i], 0, sizeof(g_devices[i]));
+            device_clear(&g_devices[i]);
             bd_addr_copy(g_devices[i].conn.btaddr, address);
+            index_add(&g_addr_index, addr_key(address), &g_devices[i]);
 
             // Delete device if it doesn't have a connection
-            start_connection_timeout(&g_devices[i]);
+            uni_hid_device_set_connection_timeout(&g_devices[i], HID_DEVICE_CONNECTION_TIMEOUT_MS);
             return &g_devices[i];
         }
     }
@@ -86,7 +296,7 @@ uni_hid_device_t* uni_hid_device_create_virtual(uni_hid_device_t* parent) {
     if (!uni_virtual_device_is_enabled())
         return NULL;
 
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < g_max_devices; i++) {
         if (bd_addr_cmp(g_devices[i].conn.btaddr, zero_addr) == 0) {
             logi("Creating virtual device (idx=%d)\n", i);
 
@@ -110,7 +320,7 @@ uni_hid_device_t* uni_hid_device_create_virtual(uni_hid_device_t* parent) {
             // All virtual devices have a "controller type", which is known by the parent.
             g_devices[i].flags |= FLAGS_HAS_CONTROLLER_TYPE;
 
-            snprintf(g_devices[i].name, sizeof(g_devices[i].name), "virtual-%d", i);
+            snprintf(g_devices[i].cold->name, sizeof(g_devices[i].cold->name), "virtual-%d", i);
 
             return &g_devices[i];
         }
@@ -123,18 +333,36 @@ void uni_hid_device_init(uni_hid_device_t* d) {
         loge("Invalid device\n");
         return;
     }
-    memset(d, 0, sizeof(*d));
-    d->hids_cid = 0xffff;
 
-    uni_bt_conn_init(&d->conn);
+    // Remove it from the indexes before clearing the keys.
+    uni_hid_device_set_connection_handle(d, UNI_BT_CONN_HANDLE_INVALID);
+    uni_hid_device_set_control_cid(d, 0);
+    uni_hid_device_set_interrupt_cid(d, 0);
+    uni_hid_device_set_hids_cid(d, 0xffff);
+    if (!uni_hid_device_is_virtual_device(d))
+        index_remove(&g_addr_index, addr_key(d->conn.btaddr), d);
+
+    // Discard pending effects, so that they don't get played on the next device that uses this entry.
+    uni_haptics_cancel(d);
+
+    if (d->hid_descriptor != UNI_HID_DESCRIPTOR_HANDLE_INVALID)
+        uni_hid_descriptor_store_release(d->hid_descriptor);
+
+    device_clear(d);
 }
 
 uni_hid_device_t* uni_hid_device_get_instance_for_address(bd_addr_t addr) {
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        // Ignore virtual devices since they share the same address with their parents
-        if (!uni_hid_device_is_virtual_device(&g_devices[i]) && bd_addr_cmp(addr, g_devices[i].conn.btaddr) == 0) {
-            return &g_devices[i];
+    uint16_t key = addr_key(addr);
+    uint16_t i = index_hash(key);
+
+    // Different addresses might have the same key, so compare the whole address.
+    while (g_addr_index.entries[i].slot != 0) {
+        if (g_addr_index.entries[i].key == key) {
+            uni_hid_device_t* d = &g_devices[g_addr_index.entries[i].slot - 1];
+            if (bd_addr_cmp(addr, d->conn.btaddr) == 0)
+                return d;
         }
+        i = (i + 1) & g_index_mask;
     }
     return NULL;
 }
@@ -142,36 +370,23 @@ uni_hid_device_t* uni_hid_device_get_instance_for_address(bd_addr_t addr) {
 uni_hid_device_t* uni_hid_device_get_instance_for_cid(uint16_t cid) {
     if (cid == 0)
         return NULL;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        if (g_devices[i].conn.interrupt_cid == cid || g_devices[i].conn.control_cid == cid)
-            return &g_devices[i];
-    }
-    return NULL;
+    return index_find(&g_cid_index, cid);
 }
 
 uni_hid_device_t* uni_hid_device_get_instance_for_hids_cid(uint16_t cid) {
-    if (cid == 0)
+    if (cid == 0 || cid == 0xffff)
         return NULL;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        if (g_devices[i].hids_cid == cid)
-            return &g_devices[i];
-    }
-    return NULL;
+    return index_find(&g_hids_cid_index, cid);
 }
 
 uni_hid_device_t* uni_hid_device_get_instance_for_connection_handle(hci_con_handle_t handle) {
     if (handle == UNI_BT_CONN_HANDLE_INVALID)
         return NULL;
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
-        if (g_devices[i].conn.handle == handle) {
-            return &g_devices[i];
-        }
-    }
-    return NULL;
+    return index_find(&g_handle_index, handle);
 }
 
 uni_hid_device_t* uni_hid_device_get_instance_with_predicate(uni_hid_device_predicate_t predicate, void* data) {
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < g_max_devices; i++) {
         // Only "ready" devices are propagated
         if (uni_bt_conn_get_state(&g_devices[i].conn) != UNI_BT_CONN_STATE_DEVICE_READY)
             continue;
@@ -182,7 +397,7 @@ uni_hid_device_t* uni_hid_device_get_instance_with_predicate(uni_hid_device_pred
 }
 
 uni_hid_device_t* uni_hid_device_get_instance_for_idx(int idx) {
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES)
+    if (idx < 0 || idx >= g_max_devices)
         return NULL;
     return &g_devices[idx];
 }
@@ -190,13 +405,13 @@ uni_hid_device_t* uni_hid_device_get_instance_for_idx(int idx) {
 int uni_hid_device_get_idx_for_instance(const uni_hid_device_t* d) {
     int idx = d - &g_devices[0];
 
-    if (idx < 0 || idx >= CONFIG_BLUEPAD32_MAX_DEVICES)
+    if (idx < 0 || idx >= g_max_devices)
         return -1;
     return idx;
 }
 
 uni_hid_device_t* uni_hid_device_get_first_device_with_state(uni_bt_conn_state_t state) {
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < g_max_devices; i++) {
         if ((bd_addr_cmp(g_devices[i].conn.btaddr, zero_addr) != 0) &&
             uni_bt_conn_get_state(&g_devices[i].conn) == state)
             return &g_devices[i];
@@ -242,7 +457,7 @@ bool uni_hid_device_set_ready_complete(uni_hid_device_t* d) {
     logi("Device setup (%s) is complete\n", bd_addr_to_str(d->conn.btaddr));
 
     // Remove the timer once the connection was established.
-    btstack_run_loop_remove_timer(&d->connection_timer);
+    btstack_run_loop_remove_timer(&d->cold->connection_timer);
 
     // Platform can reject the connection.
     if (uni_get_platform()->on_device_ready(d) != UNI_ERROR_SUCCESS) {
@@ -254,13 +469,14 @@ bool uni_hid_device_set_ready_complete(uni_hid_device_t* d) {
     }
 
     uni_bt_service_on_device_ready(d);
+    uni_bt_pipeline_on_ready(d);
 
     uni_bt_conn_set_state(&d->conn, UNI_BT_CONN_STATE_DEVICE_READY);
     return true;
 }
 
 void uni_hid_device_request_inquire(void) {
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < g_max_devices; i++) {
         // retry remote name request
         if (uni_bt_conn_get_state(&g_devices[i].conn) == UNI_BT_CONN_STATE_REMOTE_NAME_INQUIRED)
             uni_bt_conn_set_state(&g_devices[i].conn, UNI_BT_CONN_STATE_REMOTE_NAME_REQUEST);
@@ -365,8 +581,8 @@ void uni_hid_device_set_name(uni_hid_device_t* d, const char* name) {
         return;
     }
 
-    strncpy(d->name, name, sizeof(d->name) - 1);
-    d->name[sizeof(d->name) - 1] = 0;
+    strncpy(d->cold->name, name, sizeof(d->cold->name) - 1);
+    d->cold->name[sizeof(d->cold->name) - 1] = 0;
 
     d->flags |= FLAGS_HAS_NAME;
 }
@@ -380,18 +596,37 @@ bool uni_hid_device_has_name(uni_hid_device_t* d) {
     return (d->flags & FLAGS_HAS_NAME) != 0;
 }
 
-void uni_hid_device_set_hid_descriptor(uni_hid_device_t* d, const uint8_t* descriptor, int len) {
+bool uni_hid_device_set_hid_descriptor(uni_hid_device_t* d, const uint8_t* descriptor, int len) {
     if (d == NULL) {
         loge("ERROR: Invalid device\n");
-        return;
+        return false;
     }
 
     int min = btstack_min(HID_MAX_DESCRIPTOR_LEN, len);
-    memcpy(d->hid_descriptor, descriptor, len);
-    d->hid_descriptor_len = min;
+
+    // Acquired before releasing the old one: if it is the same, it is not compiled again.
+    uni_hid_descriptor_handle_t handle = uni_hid_descriptor_store_acquire(descriptor, min);
+    if (d->hid_descriptor != UNI_HID_DESCRIPTOR_HANDLE_INVALID) {
+        uni_hid_descriptor_store_release(d->hid_descriptor);
+        // No room for both. Try again, now that the old one is gone.
+        if (handle == UNI_HID_DESCRIPTOR_HANDLE_INVALID)
+            handle = uni_hid_descriptor_store_acquire(descriptor, min);
+    }
+    d->hid_descriptor = handle;
+
+    if (handle == UNI_HID_DESCRIPTOR_HANDLE_INVALID) {
+        loge("Device %s: no room for its %d-byte HID descriptor\n", bd_addr_to_str(d->conn.btaddr), min);
+        d->flags &= ~FLAGS_HAS_HID_DESCRIPTOR;
+        return false;
+    }
     d->flags |= FLAGS_HAS_HID_DESCRIPTOR;
 
     //    printf_hexdump(descriptor, len);
+    return true;
+}
+
+const uint8_t* uni_hid_device_get_hid_descriptor(uni_hid_device_t* d, uint16_t* len) {
+    return uni_hid_descriptor_store_get_data(d->hid_descriptor, len);
 }
 
 bool uni_hid_device_has_hid_descriptor(uni_hid_device_t* d) {
@@ -477,8 +712,8 @@ void uni_hid_device_disconnect(uni_hid_device_t* d) {
     uni_bt_conn_disconnect(&d->conn);
 
     // Disconnected, so no longer needs the timers
-    btstack_run_loop_remove_timer(&d->connection_timer);
-    btstack_run_loop_remove_timer(&d->inquiry_remote_name_timer);
+    btstack_run_loop_remove_timer(&d->cold->connection_timer);
+    btstack_run_loop_remove_timer(&d->cold->inquiry_remote_name_timer);
 
     // If it was already connected, tell platforms
     if (connected)
@@ -501,7 +736,7 @@ void uni_hid_device_delete(uni_hid_device_t* d) {
         logi("Deleting device: %s\n", bd_addr_to_str(d->conn.btaddr));
 
     // Remove the timer. If it was still running, it will crash if the handler gets called.
-    btstack_run_loop_remove_timer(&d->connection_timer);
+    btstack_run_loop_remove_timer(&d->cold->connection_timer);
 
     uni_hid_device_init(d);
 }
@@ -537,13 +772,22 @@ void uni_hid_device_dump_device(uni_hid_device_t* d) {
         d->conn.handle, conn_type, d->hids_cid, d->conn.control_cid, d->conn.interrupt_cid, d->cod, d->flags,
         d->conn.incoming);
     logi("\tmodel: vid=0x%04x, pid=0x%04x, model='%s', name='%s'\n", d->vendor_id, d->product_id,
-         uni_gamepad_get_model_name(d->controller_type), d->name);
+         uni_gamepad_get_model_name(d->controller_type), d->cold->name);
     logi("\tbattery: %d / 255, type=%s\n", d->controller.battery,
          (d->controller.klass == UNI_CONTROLLER_CLASS_GAMEPAD)         ? "gamepad"
          : (d->controller.klass == UNI_CONTROLLER_CLASS_MOUSE)         ? "mouse"
          : (d->controller.klass == UNI_CONTROLLER_CLASS_BALANCE_BOARD) ? "balance board"
          : (d->controller.klass == UNI_CONTROLLER_CLASS_KEYBOARD)      ? "keyboard"
                                                                        : "unknown");
+    logi("\toutgoing queue: merged=%u, dropped=%u\n", (unsigned)d->cold->outgoing_buffer.merged_count,
+         (unsigned)d->cold->outgoing_buffer.dropped_count);
+    if (uni_hid_device_has_hid_descriptor(d)) {
+        const uni_hid_plan_t* plan = uni_hid_descriptor_store_get_plan(d->hid_descriptor);
+        if (plan)
+            uni_hid_plan_dump(plan);
+        else
+            logi("\tHID plan: not compiled\n");
+    }
     if (uni_get_platform()->device_dump)
         uni_get_platform()->device_dump(d);
     if (d->report_parser.device_dump)
@@ -552,7 +796,7 @@ void uni_hid_device_dump_device(uni_hid_device_t* d) {
 
 void uni_hid_device_dump_all(void) {
     logi("Connected devices:\n");
-    for (int i = 0; i < CONFIG_BLUEPAD32_MAX_DEVICES; i++) {
+    for (int i = 0; i < g_max_devices; i++) {
         if (bd_addr_cmp(g_devices[i].conn.btaddr, zero_addr) == 0)
             continue;
         logi("idx=%d:\n", i);
@@ -561,6 +805,27 @@ void uni_hid_device_dump_all(void) {
     }
 }
 
+void uni_hid_device_dump_latency_all(void) {
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+    logi("Latency:\n");
+    for (int i = 0; i < g_max_devices; i++) {
+        if (bd_addr_cmp(g_devices[i].conn.btaddr, zero_addr) == 0)
+            continue;
+        logi("idx=%d: %s\n", i, bd_addr_to_str(g_devices[i].conn.btaddr));
+        uni_latency_dump(&g_devices[i].cold->latency);
+    }
+#else
+    logi("Latency: not collected, enable CONFIG_BLUEPAD32_LATENCY_STATS\n");
+#endif  // CONFIG_BLUEPAD32_LATENCY_STATS
+}
+
+void uni_hid_device_reset_latency_all(void) {
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+    for (int i = 0; i < g_max_devices; i++)
+        uni_latency_reset(&g_devices[i].cold->latency);
+#endif
+}
+
 bool uni_hid_device_guess_controller_type_from_name(uni_hid_device_t* d, const char* name) {
     if (!name)
         return false;
@@ -593,7 +858,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             type = CONTROLLER_TYPE_GenericMouse;
         } else if (uni_hid_device_is_keyboard(d)) {
             type = CONTROLLER_TYPE_GenericKeyboard;
-        } else if (uni_hid_parser_xboxone_does_name_match(d, d->name)) {
+        } else if (uni_hid_parser_xboxone_does_name_match(d, d->cold->name)) {
             // Needed for some Xbox Controllers clones, like the GameSir T3s, that returns empty
             // answers for SDP queries.
             type = CONTROLLER_TYPE_XBoxOneController;
@@ -603,6 +868,10 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
         }
     }
 
+    uni_hid_device_set_controller_type(d, type);
+}
+
+void uni_hid_device_set_controller_type(uni_hid_device_t* d, uni_controller_type_t type) {
     // Subtype is still unknown, it will be set by the relevant parse_input_report() func
     d->controller_subtype = CONTROLLER_SUBTYPE_NONE;
 
@@ -624,7 +893,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.setup = uni_hid_parser_xboxone_setup;
             d->report_parser.init_report = uni_hid_parser_xboxone_init_report;
             d->report_parser.parse_usage = uni_hid_parser_xboxone_parse_usage;
-            d->report_parser.play_dual_rumble = uni_hid_parser_xboxone_play_dual_rumble;
+            d->report_parser.set_rumble = uni_hid_parser_xboxone_set_rumble;
             d->report_parser.device_dump = uni_hid_parser_xboxone_device_dump;
             logi("Device detected as Xbox Wireless: 0x%02x\n", type);
             break;
@@ -634,7 +903,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.set_player_leds = uni_hid_parser_android_set_player_leds;
             if (d->vendor_id == UNI_HID_PARSER_STADIA_VID && d->product_id == UNI_HID_PARSER_STADIA_PID) {
                 d->report_parser.setup = uni_hid_parser_stadia_setup;
-                d->report_parser.play_dual_rumble = uni_hid_parser_stadia_play_dual_rumble;
+                d->report_parser.set_rumble = uni_hid_parser_stadia_set_rumble;
                 logi("Device detected as Stadia: 0x%02x\n", type);
             } else {
                 logi("Device detected as Android: 0x%02x\n", type);
@@ -656,7 +925,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.init_report = uni_hid_parser_psmove_init_report;
             d->report_parser.parse_input_report = uni_hid_parser_psmove_parse_input_report;
             d->report_parser.set_lightbar_color = uni_hid_parser_psmove_set_lightbar_color;
-            d->report_parser.play_dual_rumble = uni_hid_parser_psmove_play_dual_rumble;
+            d->report_parser.set_rumble = uni_hid_parser_psmove_set_rumble;
             logi("Device detected as PS Move: 0x%02x\n", type);
             break;
         case CONTROLLER_TYPE_PS3Controller:
@@ -664,7 +933,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.init_report = uni_hid_parser_ds3_init_report;
             d->report_parser.parse_input_report = uni_hid_parser_ds3_parse_input_report;
             d->report_parser.set_player_leds = uni_hid_parser_ds3_set_player_leds;
-            d->report_parser.play_dual_rumble = uni_hid_parser_ds3_play_dual_rumble;
+            d->report_parser.set_rumble = uni_hid_parser_ds3_set_rumble;
             logi("Device detected as DualShock 3: 0x%02x\n", type);
             break;
         case CONTROLLER_TYPE_PS4Controller:
@@ -673,7 +942,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.parse_input_report = uni_hid_parser_ds4_parse_input_report;
             d->report_parser.parse_feature_report = uni_hid_parser_ds4_parse_feature_report;
             d->report_parser.set_lightbar_color = uni_hid_parser_ds4_set_lightbar_color;
-            d->report_parser.play_dual_rumble = uni_hid_parser_ds4_play_dual_rumble;
+            d->report_parser.set_rumble = uni_hid_parser_ds4_set_rumble;
             d->report_parser.device_dump = uni_hid_parser_ds4_device_dump;
             logi("Device detected as DualShock 4: 0x%02x\n", type);
             break;
@@ -684,7 +953,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.parse_feature_report = uni_hid_parser_ds5_parse_feature_report;
             d->report_parser.set_player_leds = uni_hid_parser_ds5_set_player_leds;
             d->report_parser.set_lightbar_color = uni_hid_parser_ds5_set_lightbar_color;
-            d->report_parser.play_dual_rumble = uni_hid_parser_ds5_play_dual_rumble;
+            d->report_parser.set_rumble = uni_hid_parser_ds5_set_rumble;
             d->report_parser.device_dump = uni_hid_parser_ds5_device_dump;
             logi("Device detected as DualSense: 0x%02x\n", type);
             break;
@@ -703,6 +972,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.init_report = uni_hid_parser_wii_init_report;
             d->report_parser.parse_input_report = uni_hid_parser_wii_parse_input_report;
             d->report_parser.set_player_leds = uni_hid_parser_wii_set_player_leds;
+            d->report_parser.set_rumble = uni_hid_parser_wii_set_rumble;
             d->report_parser.play_dual_rumble = uni_hid_parser_wii_play_dual_rumble;
             d->report_parser.device_dump = uni_hid_parser_wii_device_dump;
             logi("Device detected as Wii controller: 0x%02x\n", type);
@@ -714,7 +984,7 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             d->report_parser.init_report = uni_hid_parser_switch_init_report;
             d->report_parser.parse_input_report = uni_hid_parser_switch_parse_input_report;
             d->report_parser.set_player_leds = uni_hid_parser_switch_set_player_leds;
-            d->report_parser.play_dual_rumble = uni_hid_parser_switch_play_dual_rumble;
+            d->report_parser.set_rumble = uni_hid_parser_switch_set_rumble;
             d->report_parser.device_dump = uni_hid_parser_switch_device_dump;
             logi("Device detected as Nintendo Switch Pro controller: 0x%02x\n", type);
             break;
@@ -753,6 +1023,10 @@ void uni_hid_device_guess_controller_type_from_pid_vid(uni_hid_device_t* d) {
             break;
     }
 
+    // Parsers only set the motors. Timing is handled by the haptics engine.
+    if (d->report_parser.set_rumble != NULL && d->report_parser.play_dual_rumble == NULL)
+        d->report_parser.play_dual_rumble = uni_haptics_play_dual_rumble;
+
     d->controller_type = type;
     d->flags |= FLAGS_HAS_CONTROLLER_TYPE;
 }
@@ -767,7 +1041,31 @@ bool uni_hid_device_has_controller_type(uni_hid_device_t* d) {
 }
 
 void uni_hid_device_set_connection_handle(uni_hid_device_t* d, hci_con_handle_t handle) {
+    if (d->conn.handle == handle)
+        return;
+    if (d->conn.handle != UNI_BT_CONN_HANDLE_INVALID)
+        index_remove(&g_handle_index, d->conn.handle, d);
     d->conn.handle = handle;
+    if (handle != UNI_BT_CONN_HANDLE_INVALID)
+        index_add(&g_handle_index, handle, d);
+}
+
+void uni_hid_device_set_control_cid(uni_hid_device_t* d, uint16_t cid) {
+    index_set_cid(&d->conn.control_cid, cid, d);
+}
+
+void uni_hid_device_set_interrupt_cid(uni_hid_device_t* d, uint16_t cid) {
+    index_set_cid(&d->conn.interrupt_cid, cid, d);
+}
+
+void uni_hid_device_set_hids_cid(uni_hid_device_t* d, uint16_t cid) {
+    if (d->hids_cid == cid)
+        return;
+    if (d->hids_cid != 0 && d->hids_cid != 0xffff)
+        index_remove(&g_hids_cid_index, d->hids_cid, d);
+    d->hids_cid = cid;
+    if (cid != 0 && cid != 0xffff)
+        index_add(&g_hids_cid_index, cid, d);
 }
 
 void uni_hid_device_process_controller(uni_hid_device_t* d) {
@@ -781,20 +1079,52 @@ void uni_hid_device_process_controller(uni_hid_device_t* d) {
         d->controller.gamepad = gp;
     }
 
-    if (uni_get_platform()->on_controller_data != NULL)
-        uni_get_platform()->on_controller_data(d, &d->controller);
-    else if (uni_get_platform()->on_gamepad_data != NULL)
-        // Deprecated: should implement only on_controller_data
-        uni_get_platform()->on_gamepad_data(d, &d->controller.gamepad);
+    // Virtual devices don't receive reports: their data comes from the parent's reports.
+    d->controller.timestamp_us = d->parent ? d->parent->last_report_us : d->last_report_us;
+
+    const uni_controller_change_filter_t* filter = uni_controller_get_change_filter();
+    uint32_t changes = uni_controller_get_changes(&d->controller_delivered, &d->controller, filter);
+
+    if (changes != 0 || !filter->only_on_change) {
+        // Published before calling the platform, so that other tasks get it as soon as possible.
+        // Small changes below the thresholds are not published: they add up until they are reported.
+        uni_snapshot_publish(&d->controller_snapshot, &d->controller_delivered, &d->controller,
+                             sizeof(d->controller_delivered));
+
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+        uint64_t start_us = uni_system_get_time_us();
+#endif
+
+        if (uni_get_platform()->on_controller_data_changed != NULL)
+            uni_get_platform()->on_controller_data_changed(d, &d->controller, changes);
+        else if (uni_get_platform()->on_controller_data != NULL)
+            uni_get_platform()->on_controller_data(d, &d->controller);
+        else if (uni_get_platform()->on_gamepad_data != NULL)
+            // Deprecated: should implement only on_controller_data
+            uni_get_platform()->on_gamepad_data(d, &d->controller.gamepad);
+
+#ifdef CONFIG_BLUEPAD32_LATENCY_STATS
+        uint64_t end_us = uni_system_get_time_us();
+        uni_latency_histogram_add(&d->cold->latency.callback, end_us - start_us);
+        if (d->controller.timestamp_us != 0)
+            uni_latency_histogram_add(&d->cold->latency.total, end_us - d->controller.timestamp_us);
+#endif
+    }
 
     // FIXME: each backend should decide what to do with misc buttons
     process_misc_button_system(d);
     process_misc_button_home(d);
 }
 
+uint32_t uni_hid_device_get_controller_snapshot(uni_hid_device_t* d, uni_controller_t* out) {
+    return uni_snapshot_read(&d->controller_snapshot, out, &d->controller_delivered, sizeof(*out));
+}
+
 // Try to send the report now. If it can't, queue it and send it in the next
 // event loop.
-void uni_hid_device_send_report(uni_hid_device_t* d, uint16_t cid, const uint8_t* report, uint16_t len) {
+// When "coalesce" is true, and a report with the same key is already queued, it gets replaced
+// by the new one instead of queuing both.
+static void send_report(uni_hid_device_t* d, uint16_t cid, const uint8_t* report, uint16_t len, bool coalesce) {
     if (d == NULL) {
         loge("Send report: Invalid device\n");
         return;
@@ -809,16 +1139,26 @@ void uni_hid_device_send_report(uni_hid_device_t* d, uint16_t cid, const uint8_t
         return;
     }
 
-    int err = l2cap_send(cid, (uint8_t*)report, len);
-    if (err != 0) {
-        logd("Could not send report (error=0x%04x). Adding it to queue\n", err);
-        if (uni_circular_buffer_put(&d->outgoing_buffer, cid, report, len) != 0) {
-            loge("ERROR: circular buffer full. Cannot queue report\n");
+    if (coalesce && uni_circular_buffer_replace(&d->cold->outgoing_buffer, cid, report, len, OUTGOING_REPORT_KEY_LEN) ==
+                        UNI_CIRCULAR_BUFFER_ERROR_OK) {
+        // The queued one was stale. The new one will be sent in its place.
+        logd("Report merged with a queued one\n");
+    } else {
+        int err = l2cap_send(cid, (uint8_t*)report, len);
+        if (err != 0) {
+            logd("Could not send report (error=0x%04x). Adding it to queue\n", err);
+            if (uni_circular_buffer_put(&d->cold->outgoing_buffer, cid, report, len) != 0) {
+                loge("ERROR: circular buffer full. Cannot queue report\n");
+            }
         }
     }
-    // Even, if it can send the report, trigger a "can send now event" in case a report was queued.
-    // TODO: Is this really needed?
-    l2cap_request_can_send_now_event(cid);
+    // Only needed if there are queued reports. Either this one, or older ones.
+    if (!uni_circular_buffer_is_empty(&d->cold->outgoing_buffer))
+        l2cap_request_can_send_now_event(cid);
+}
+
+void uni_hid_device_send_report(uni_hid_device_t* d, uint16_t cid, const uint8_t* report, uint16_t len) {
+    send_report(d, cid, report, len, false);
 }
 
 // Sends an interrupt-report. If it can't, it will queue it and try again later.
@@ -840,26 +1180,55 @@ void uni_hid_device_send_ctrl_report(uni_hid_device_t* d, const uint8_t* report,
     uni_hid_device_send_report(d, d->conn.control_cid, report, len);
 }
 
-// Send the reports that are already queued. Uses the "intr" channel.
-void uni_hid_device_send_queued_reports(uni_hid_device_t* d) {
+// Like send_intr_report, but if a report with the same Report ID is still queued, it gets replaced
+// by this one. Only the latest state is sent. Use it for reports that contain the whole
+// state, like rumble or LEDs, and not for commands.
+void uni_hid_device_send_intr_report_coalesced(uni_hid_device_t* d, const uint8_t* report, uint16_t len) {
     if (d == NULL) {
         loge("Invalid device\n");
         return;
     }
+    send_report(d, d->conn.interrupt_cid, report, len, true);
+}
 
-    if (uni_circular_buffer_is_empty(&d->outgoing_buffer)) {
-        logd("circular buffer empty?\n");
+// Same as send_intr_report_coalesced, but uses the "control" channel.
+void uni_hid_device_send_ctrl_report_coalesced(uni_hid_device_t* d, const uint8_t* report, uint16_t len) {
+    if (d == NULL) {
+        loge("Invalid device\n");
         return;
     }
+    send_report(d, d->conn.control_cid, report, len, true);
+}
 
+// Send the reports that are already queued.
+// Called from the "can send now" event: sends as many reports as the channels accept,
+// and only asks for another event if there are reports left.
+void uni_hid_device_send_queued_reports(uni_hid_device_t* d) {
     void* data;
     int data_len;
     int16_t cid;
-    if (uni_circular_buffer_get(&d->outgoing_buffer, &cid, &data, &data_len) != UNI_CIRCULAR_BUFFER_ERROR_OK) {
-        loge("ERROR: could not get buffer from circular buffer.\n");
+
+    if (d == NULL) {
+        loge("Invalid device\n");
         return;
     }
-    uni_hid_device_send_report(d, cid, data, data_len);
+
+    uni_circular_buffer_t* buffer = &d->cold->outgoing_buffer;
+    while (uni_circular_buffer_peek(buffer, &cid, &data, &data_len) == UNI_CIRCULAR_BUFFER_ERROR_OK) {
+        if (!l2cap_can_send_packet_now(cid))
+            break;
+        int err = l2cap_send(cid, data, data_len);
+        if (err != 0) {
+            logd("Could not send queued report (error=0x%04x)\n", err);
+            break;
+        }
+        // Sent, remove it from the queue.
+        uni_circular_buffer_get(buffer, &cid, &data, &data_len);
+    }
+
+    // The oldest report is the one that must go next.
+    if (uni_circular_buffer_peek(buffer, &cid, &data, &data_len) == UNI_CIRCULAR_BUFFER_ERROR_OK)
+        l2cap_request_can_send_now_event(cid);
 }
 
 bool uni_hid_device_does_require_hid_descriptor(uni_hid_device_t* d) {
@@ -942,10 +1311,10 @@ static void process_misc_button_system(uni_hid_device_t* d) {
 
     if (requires_delay) {
         d->misc_button_wait_delay |= MISC_BUTTON_SYSTEM;
-        btstack_run_loop_set_timer_context(&d->misc_button_delay_timer, d);
-        btstack_run_loop_set_timer_handler(&d->misc_button_delay_timer, &misc_button_enable_callback);
-        btstack_run_loop_set_timer(&d->misc_button_delay_timer, MISC_BUTTON_DELAY_MS);
-        btstack_run_loop_add_timer(&d->misc_button_delay_timer);
+        btstack_run_loop_set_timer_context(&d->cold->misc_button_delay_timer, d);
+        btstack_run_loop_set_timer_handler(&d->cold->misc_button_delay_timer, &misc_button_enable_callback);
+        btstack_run_loop_set_timer(&d->cold->misc_button_delay_timer, MISC_BUTTON_DELAY_MS);
+        btstack_run_loop_add_timer(&d->cold->misc_button_delay_timer);
     }
 }
 
@@ -975,6 +1344,7 @@ static void device_connection_timeout(btstack_timer_source_t* ts) {
         return;
     }
     logi("Device cannot connect in time, deleting:\n");
+    uni_bt_pipeline_on_timeout(d);
     uni_hid_device_dump_device(d);
 
     uni_hid_device_disconnect(d);
@@ -982,9 +1352,12 @@ static void device_connection_timeout(btstack_timer_source_t* ts) {
     /* 'd'' is destroyed after this call, don't use it */
 }
 
-static void start_connection_timeout(uni_hid_device_t* d) {
-    btstack_run_loop_set_timer_context(&d->connection_timer, d);
-    btstack_run_loop_set_timer_handler(&d->connection_timer, &device_connection_timeout);
-    btstack_run_loop_set_timer(&d->connection_timer, HID_DEVICE_CONNECTION_TIMEOUT_MS);
-    btstack_run_loop_add_timer(&d->connection_timer);
+void uni_hid_device_set_connection_timeout(uni_hid_device_t* d, uint32_t timeout_ms) {
+    btstack_run_loop_remove_timer(&d->cold->connection_timer);
+    if (timeout_ms == 0)
+        return;
+    btstack_run_loop_set_timer_context(&d->cold->connection_timer, d);
+    btstack_run_loop_set_timer_handler(&d->cold->connection_timer, &device_connection_timeout);
+    btstack_run_loop_set_timer(&d->cold->connection_timer, timeout_ms);
+    btstack_run_loop_add_timer(&d->cold->connection_timer);
 }
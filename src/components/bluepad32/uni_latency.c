@@ -0,0 +1,107 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "uni_latency.h"
+
+#include <btstack_util.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "uni_common.h"
+#include "uni_log.h"
+
+static int get_bucket(uint32_t value) {
+    int bucket = 0;
+
+    // Number of significant bits.
+    while (value != 0 && bucket < UNI_LATENCY_HISTOGRAM_BUCKETS - 1) {
+        value >>= 1;
+        bucket++;
+    }
+    return bucket;
+}
+
+// The max is a tighter bound for the bucket that contains it, and the only one for the last bucket.
+static uint32_t get_bucket_upper_bound(const uni_latency_histogram_t* h, int bucket) {
+    if (bucket == UNI_LATENCY_HISTOGRAM_BUCKETS - 1)
+        return h->max;
+    return btstack_min(1u << bucket, h->max);
+}
+
+static void dump_histogram(const char* name, const uni_latency_histogram_t* h) {
+    if (h->count == 0) {
+        logi("\t%s: no samples\n", name);
+        return;
+    }
+
+    logi("\t%s: n=%" PRIu32 ", min=%" PRIu32 ", mean=%" PRIu32 ", p50<=%" PRIu32 ", p90<=%" PRIu32 ", p99<=%" PRIu32
+         ", max=%" PRIu32 " us\n",
+         name, h->count, h->min, uni_latency_histogram_get_mean(h), uni_latency_histogram_get_percentile(h, 50),
+         uni_latency_histogram_get_percentile(h, 90), uni_latency_histogram_get_percentile(h, 99), h->max);
+
+    // Only the non-empty buckets, with their upper bound.
+    logi("\t\t");
+    for (int i = 0; i < UNI_LATENCY_HISTOGRAM_BUCKETS; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        if (i == UNI_LATENCY_HISTOGRAM_BUCKETS - 1)
+            logi(">=%" PRIu32 ":%" PRIu32 " ", (uint32_t)1 << (i - 1), h->buckets[i]);
+        else
+            logi("<%" PRIu32 ":%" PRIu32 " ", (uint32_t)1 << i, h->buckets[i]);
+    }
+    logi("\n");
+}
+
+void uni_latency_histogram_add(uni_latency_histogram_t* h, uint64_t value) {
+    uint32_t v = (value > UINT32_MAX) ? UINT32_MAX : (uint32_t)value;
+
+    if (h->count == 0 || v < h->min)
+        h->min = v;
+    if (v > h->max)
+        h->max = v;
+
+    h->buckets[get_bucket(v)]++;
+    h->count++;
+    h->total += v;
+}
+
+uint32_t uni_latency_histogram_get_percentile(const uni_latency_histogram_t* h, int percentile) {
+    if (h->count == 0)
+        return 0;
+
+    // Rank of the sample, rounded up. At least the first one.
+    uint32_t rank = (uint32_t)(((uint64_t)h->count * percentile + 99) / 100);
+    if (rank == 0)
+        rank = 1;
+
+    uint32_t acc = 0;
+    for (int i = 0; i < UNI_LATENCY_HISTOGRAM_BUCKETS; i++) {
+        acc += h->buckets[i];
+        if (acc >= rank)
+            return get_bucket_upper_bound(h, i);
+    }
+    return h->max;
+}
+
+uint32_t uni_latency_histogram_get_mean(const uni_latency_histogram_t* h) {
+    if (h->count == 0)
+        return 0;
+    return (uint32_t)(h->total / h->count);
+}
+
+void uni_latency_on_input_report(uni_latency_t* l, uint64_t last_us, uint64_t now_us) {
+    if (last_us != 0)
+        uni_latency_histogram_add(&l->inter_arrival, now_us - last_us);
+}
+
+void uni_latency_reset(uni_latency_t* l) {
+    memset(l, 0, sizeof(*l));
+}
+
+void uni_latency_dump(const uni_latency_t* l) {
+    dump_histogram("inter-arrival", &l->inter_arrival);
+    dump_histogram("parse", &l->parse);
+    dump_histogram("callback", &l->callback);
+    dump_histogram("total", &l->total);
+}
@@ -0,0 +1,64 @@
+// SPDX-License-Identifier: Apache-2.0
+// Copyright 2024 Ricardo Quesada
+// http://retro.moe/unijoysticle2
+
+#include "uni_snapshot.h"
+
+#include <string.h>
+
+// Only loads, stores and fences: Cortex-M0+ (Pico W) doesn't have atomic read-modify-write instructions.
+// The data itself is copied with memcpy(). A torn copy is possible, but it is detected with the sequence
+// number, and discarded.
+
+void uni_snapshot_init(uni_snapshot_t* s) {
+    __atomic_store_n(&s->seq, 0, __ATOMIC_RELAXED);
+}
+
+void uni_snapshot_write_begin(uni_snapshot_t* s) {
+    // Only one producer: no need for a read-modify-write.
+    uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELAXED);
+    // The odd sequence must be visible before any write to the data.
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void uni_snapshot_write_end(uni_snapshot_t* s) {
+    uint32_t seq = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    // The writes to the data must be visible before the even sequence.
+    __atomic_store_n(&s->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+void uni_snapshot_publish(uni_snapshot_t* s, void* shared, const void* src, size_t size) {
+    uni_snapshot_write_begin(s);
+    memcpy(shared, src, size);
+    uni_snapshot_write_end(s);
+}
+
+static bool try_read(uni_snapshot_t* s, void* dst, const void* shared, size_t size, uint32_t* seq) {
+    uint32_t begin = __atomic_load_n(&s->seq, __ATOMIC_ACQUIRE);
+    if (begin & 1)
+        return false;
+
+    memcpy(dst, shared, size);
+
+    // The reads of the data must complete before reading the sequence again.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    uint32_t end = __atomic_load_n(&s->seq, __ATOMIC_RELAXED);
+    *seq = begin;
+    return begin == end;
+}
+
+uint32_t uni_snapshot_read(uni_snapshot_t* s, void* dst, const void* shared, size_t size) {
+    uint32_t seq;
+
+    while (!try_read(s, dst, shared, size, &seq)) {
+        // The producer is writing. It only takes a few hundred cycles: spin.
+    }
+    // The sequence is incremented twice per write.
+    return seq / 2;
+}
+
+bool uni_snapshot_try_read(uni_snapshot_t* s, void* dst, const void* shared, size_t size) {
+    uint32_t seq;
+    return try_read(s, dst, shared, size, &seq);
+}
@@ -0,0 +1,159 @@
+#!/usr/bin/python3
+
+# Generates a sorted version of uni_controller_list.h, so that the controller type
+# can be found using a binary search instead of a linear search.
+#
+# Call this script everytime that uni_controller_list.h is modified:
+#   python3 gen_controller_list.py
+#
+# It fails if there are duplicate entries.
+# Use "--check" to verify that the generated file is up-to-date, without modifying it.
+
+import argparse
+import os
+import re
+import sys
+
+COMPONENT_DIR = os.path.join(os.path.dirname(os.path.abspath(__file__)), "..", "src", "components", "bluepad32")
+DEFAULT_INPUT = os.path.join(COMPONENT_DIR, "include", "controller", "uni_controller_list.h")
+DEFAULT_OUTPUT = os.path.join(COMPONENT_DIR, "include", "controller", "uni_controller_list_sorted.h")
+
+ENTRY_RE = re.compile(
+    r"^\s*\{\s*MAKE_CONTROLLER_ID\s*\(\s*(0[xX][0-9a-fA-F]+)\s*,\s*(0[xX][0-9a-fA-F]+)\s*\)\s*,"
+    r"\s*(\w+)\s*,\s*(NULL|\"[^\"]*\")\s*\}\s*,?\s*(//.*)?$"
+)
+
+HEADER = """\
+/*
+  Copyright (C) Valve Corporation
+
+  This software is provided 'as-is', without any express or implied
+  warranty.  In no event will the authors be held liable for any damages
+  arising from the use of this software.
+
+  Permission is granted to anyone to use this software for any purpose,
+  including commercial applications, and to alter it and redistribute it
+  freely, subject to the following restrictions:
+
+  1. The origin of this software must not be misrepresented; you must not
+     claim that you wrote the original software. If you use this software
+     in a product, an acknowledgment in the product documentation would be
+     appreciated but is not required.
+  2. Altered source versions must be plainly marked as such, and must not be
+     misrepresented as being the original software.
+  3. This notice may not be removed or altered from any source distribution.
+*/
+
+// Generated by tools/gen_controller_list.py from uni_controller_list.h. DO NOT EDIT.
+// Entries are sorted by device_id, and there are no duplicates.
+
+// DO NOT INCLUDE.
+// CAN ONLY BE INCLUDED FROM uni_controller_type.c
+
+#define MAKE_CONTROLLER_ID(nVID, nPID) (uint32_t)((uint16_t)nVID << 16 | (uint16_t)nPID)
+
+// clang-format off
+
+static const uni_controller_description_t arrControllers[] = {
+"""
+
+FOOTER = """\
+};
+
+// clang-format on
+"""
+
+
+def parse(path: str) -> list:
+    entries = []
+    with open(path) as f:
+        for lineno, line in enumerate(f, start=1):
+            stripped = line.strip()
+            if "MAKE_CONTROLLER_ID" not in stripped or stripped.startswith(("//", "#", "/*")):
+                continue
+            m = ENTRY_RE.match(line)
+            if not m:
+                raise ValueError(f"{path}:{lineno}: could not parse controller entry")
+            vid, pid, controller_type, name, comment = m.groups()
+            entries.append(
+                {
+                    "vid": int(vid, 16),
+                    "pid": int(pid, 16),
+                    "type": controller_type,
+                    "name": name,
+                    "comment": comment or "",
+                    "lineno": lineno,
+                }
+            )
+    return entries
+
+
+def find_duplicates(entries: list) -> list:
+    seen = {}
+    duplicates = []
+    for e in entries:
+        key = (e["vid"], e["pid"])
+        if key in seen:
+            duplicates.append((seen[key], e))
+        else:
+            seen[key] = e
+    return duplicates
+
+
+def generate(entries: list) -> str:
+    lines = [HEADER]
+    for e in sorted(entries, key=lambda e: (e["vid"] << 16) | e["pid"]):
+        entry = f"\t{{ MAKE_CONTROLLER_ID( 0x{e['vid']:04x}, 0x{e['pid']:04x} ), {e['type']}, {e['name']} }},"
+        if e["comment"]:
+            entry += f"\t{e['comment']}"
+        lines.append(entry.rstrip() + "\n")
+    lines.append(FOOTER)
+    return "".join(lines)
+
+
+def main() -> int:
+    parser = argparse.ArgumentParser(description="Generates the sorted controller list")
+    parser.add_argument("--input", default=DEFAULT_INPUT, help="uni_controller_list.h file")
+    parser.add_argument("--output", default=DEFAULT_OUTPUT, help="generated file")
+    parser.add_argument("--check", action="store_true", help="fail if the generated file is not up-to-date")
+    args = parser.parse_args()
+
+    try:
+        entries = parse(args.input)
+    except ValueError as e:
+        print(e, file=sys.stderr)
+        return 1
+    if not entries:
+        print(f"{args.input}: no controllers found", file=sys.stderr)
+        return 1
+
+    duplicates = find_duplicates(entries)
+    for first, second in duplicates:
+        print(
+            f"{args.input}:{second['lineno']}: duplicate controller entry for "
+            f"VID 0x{second['vid']:04x} PID 0x{second['pid']:04x} (first defined at line {first['lineno']})",
+            file=sys.stderr,
+        )
+    if duplicates:
+        return 1
+
+    content = generate(entries)
+
+    if args.check:
+        current = ""
+        if os.path.exists(args.output):
+            with open(args.output) as f:
+                current = f.read()
+        if current != content:
+            print(f"{args.output} is not up-to-date. Run tools/gen_controller_list.py", file=sys.stderr)
+            return 1
+        return 0
+
+    with open(args.output, "w") as f:
+        f.write(content)
+    print(f"{args.output}: {len(entries)} controllers")
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())